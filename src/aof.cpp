@@ -0,0 +1,74 @@
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "aof.h"
+
+static const char* const k_policies[] = {"no", "everysec", "always"};
+
+int aof_fsync_policy (const char* s) {
+	for (int i = 0; i < 3; ++i) {
+		if (!strcasecmp(s, k_policies[i])) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const char* aof_fsync_name (int policy) {
+	return k_policies[policy];
+}
+
+// prefix, decimal n, CRLF. returns the bytes written to out
+static size_t put_header (uint8_t* out, char prefix, size_t n) {
+	char digits[24];
+	size_t len = 0;
+	do {
+		digits[len++] = (char)('0' + n % 10);
+		n /= 10;
+	} while (n);
+	out[0] = (uint8_t)prefix;
+	for (size_t i = 0; i < len; ++i) {
+		out[1 + i] = (uint8_t)digits[len - 1 - i];
+	}
+	out[1 + len] = '\r';
+	out[2 + len] = '\n';
+	return 3 + len;
+}
+
+void aof_encode (Buffer* b, const std::string_view* args, size_t n) {
+	//headers take at most 23 bytes, so one reserve covers the command
+	size_t total = 23;
+	for (size_t i = 0; i < n; ++i) {
+		total += 23 + args[i].size() + 2;
+	}
+	buf_reserve(b, total);
+	uint8_t* out = buf_tail(b);
+	uint8_t* p = out;
+	p += put_header(p, '*', n);
+	for (size_t i = 0; i < n; ++i) {
+		p += put_header(p, '$', args[i].size());
+		memcpy(p, args[i].data(), args[i].size());
+		p += args[i].size();
+		*p++ = '\r';
+		*p++ = '\n';
+	}
+	buf_commit(b, (size_t)(p - out));
+}
+
+bool aof_write (int fd, Buffer* b) {
+	while (buf_size(b)) {
+		ssize_t rv = write(fd, buf_head(b), buf_size(b));
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rv <= 0) {
+			if (rv == 0) {
+				errno = EIO;
+			}
+			return false;
+		}
+		buf_consume(b, (size_t)rv);
+	}
+	return true;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include "buffer.h"
+
+// append-only file: every command that changed the keyspace, as a RESP
+// array, in the order the commands were applied. a restart replays it.
+// commands are appended to a buffer in memory and the event loop writes
+// the buffer out once per iteration, so a single write() carries every
+// command of the iteration (group commit). when the data reaches the
+// disk is up to the fsync policy
+
+enum {
+	AOF_FSYNC_NO = 0, //whenever the kernel writes back its dirty pages
+	AOF_FSYNC_EVERYSEC = 1, //by a background thread, once a second
+	AOF_FSYNC_ALWAYS = 2, //after every write, before the replies go out
+};
+
+// the policy named by s, -1 if there is none
+int aof_fsync_policy (const char* s);
+const char* aof_fsync_name (int policy);
+
+// append one command to b as a RESP array of bulk strings
+void aof_encode (Buffer* b, const std::string_view* args, size_t n);
+
+// write all of b to fd and consume it. on error returns false with errno
+// set, and the part not written is left in b
+bool aof_write (int fd, Buffer* b);
@@ -0,0 +1,51 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "backlog.h"
+
+void backlog_init (Backlog* b, size_t size, uint64_t offset) {
+	b->data = (uint8_t*)malloc(size);
+	if (!b->data) {
+		abort();
+	}
+	b->size = size;
+	b->start = offset;
+	b->end = offset;
+}
+
+void backlog_free (Backlog* b) {
+	free(b->data);
+	b->data = NULL;
+	b->size = 0;
+	b->start = b->end;
+}
+
+void backlog_append (Backlog* b, const void* p, size_t n) {
+	const uint8_t* src = (const uint8_t*)p;
+	//only the last size bytes survive
+	if (n > b->size) {
+		src += n - b->size;
+		b->end += n - b->size;
+		n = b->size;
+	}
+	size_t pos = (size_t)(b->end % b->size);
+	size_t first = b->size - pos < n ? b->size - pos : n;
+	memcpy(b->data + pos, src, first);
+	memcpy(b->data, src + first, n - first);
+	b->end += n;
+	if (b->end - b->start > b->size) {
+		b->start = b->end - b->size;
+	}
+}
+
+size_t backlog_read (const Backlog* b, uint64_t off, void* out, size_t n) {
+	assert(off >= b->start && off <= b->end);
+	if (n > b->end - off) {
+		n = (size_t)(b->end - off);
+	}
+	size_t pos = (size_t)(off % b->size);
+	size_t first = b->size - pos < n ? b->size - pos : n;
+	memcpy(out, b->data + pos, first);
+	memcpy((uint8_t*)out + first, b->data, n - first);
+	return n;
+}
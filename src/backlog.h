@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// replication backlog: the newest bytes of the command stream in a ring
+// of fixed size, addressed by stream offset. a replica that reconnects
+// with an offset still in the ring continues from there, and every
+// replica connection reads the bytes it is missing straight from the ring
+// rather than holding its own copy of the stream
+
+struct Backlog {
+	uint8_t* data = NULL;
+	size_t size = 0;
+	uint64_t start = 0; //stream offset of the oldest byte held
+	uint64_t end = 0; //stream offset after the newest byte
+};
+
+// an empty ring of size bytes whose stream continues at offset
+void backlog_init (Backlog* b, size_t size, uint64_t offset);
+void backlog_free (Backlog* b);
+// append to the stream, dropping the oldest bytes once the ring is full
+void backlog_append (Backlog* b, const void* p, size_t n);
+// copy up to n bytes from stream offset off, which must be between start
+// and end. returns the bytes copied
+size_t backlog_read (const Backlog* b, uint64_t off, void* out, size_t n);
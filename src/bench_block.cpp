@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "histogram.h"
+#include "protocol.h"
+
+// blocking pop benchmark.
+// parks N connections in BLPOP, spread over k queues, and measures the
+// server's cpu time while they wait, then pushes values one at a time and
+// times each from the RPUSH to the moment the waiter it woke has it. a
+// served waiter blocks again right away, so N stay parked throughout.
+// every value should go to the waiter that has waited longest on its
+// queue, deliveries to any other are counted as out of order. that holds
+// for a server with one worker: several take the BLPOPs of connections on
+// different workers in no particular order.
+//
+// usage: ./bench_block [-p port] [-c server_pid] [-m messages] [-k queues] [-t timeout] [n1 n2 ...]
+// defaults to 1000 and 10000 waiters on one queue, 10000 messages.
+// -c reports the server's cpu time over 2 s with the waiters parked
+// (same host). -t is the BLPOP timeout in seconds, 0 for none: with one,
+// every waiter also holds a timer.
+
+const size_t k_max_msg = 32 << 20;
+const uint64_t k_idle_sec = 2;
+
+static int g_port = 6379;
+
+static void die (const char* msg) {
+	fprintf(stderr, "[%d] %s ... %s\n", errno, strerror(errno), msg);
+	exit(1);
+}
+
+static uint64_t now_ns () {
+	struct timespec ts = {};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int32_t read_full (int fd, char* buf, size_t n) {
+	while (n > 0) {
+		ssize_t rv = read(fd, buf, n);
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rv <= 0) {
+			return -1;
+		}
+		n -= (size_t)rv;
+		buf += rv;
+	}
+	return 0;
+}
+
+static int32_t write_all (int fd, const char* buf, size_t n) {
+	while (n > 0) {
+		ssize_t rv = write(fd, buf, n);
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rv <= 0) {
+			return -1;
+		}
+		n -= (size_t)rv;
+		buf += rv;
+	}
+	return 0;
+}
+
+// the loopback source port range caps one source address at ~28k
+// connections, so spread the clients over 127.0.0.x
+static int connect_one (size_t i) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	struct sockaddr_in local = {};
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(0x7f000001 + (uint32_t)(i / 20000));
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)g_port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr*)&local, sizeof(local)) != 0
+		|| connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// append a request frame: len(4) + nstr(4) + nstr x (len(4) + bytes)
+static void append_req (std::string &out, const std::vector<std::string> &cmd) {
+	uint32_t len = 4;
+	for (const std::string &s: cmd) {
+		len += 4 + (uint32_t)s.size();
+	}
+	uint32_t n = (uint32_t)cmd.size();
+	out.append((const char*)&len, 4);
+	out.append((const char*)&n, 4);
+	for (const std::string &s: cmd) {
+		uint32_t sz = (uint32_t)s.size();
+		out.append((const char*)&sz, 4);
+		out.append(s);
+	}
+}
+
+// one reply frame, the body without the length
+static int32_t read_reply (int fd, std::string* body) {
+	uint32_t len = 0;
+	if (read_full(fd, (char*)&len, 4) || len > k_max_msg) {
+		return -1;
+	}
+	body->resize(len);
+	return read_full(fd, &(*body)[0], len);
+}
+
+static void raise_fd_limit () {
+	struct rlimit rl = {};
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		(void)setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+// user + system cpu time of a process in ms, from /proc (linux only)
+static long cpu_ms (int pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		return -1;
+	}
+	char line[1024];
+	size_t n = fread(line, 1, sizeof(line) - 1, f);
+	fclose(f);
+	line[n] = 0;
+	//the command name may hold spaces, the fields after it do not
+	const char* p = strrchr(line, ')');
+	unsigned long utime = 0;
+	unsigned long stime = 0;
+	if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+		return -1;
+	}
+	return (long)((utime + stime) * 1000 / (unsigned long)sysconf(_SC_CLK_TCK));
+}
+
+static std::string queue_name (size_t q) {
+	return "bq:" + std::to_string(q);
+}
+
+int main (int argc, char* argv[]) {
+	setbuf(stdout, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	raise_fd_limit();
+
+	int pid = 0;
+	size_t messages = 10000;
+	size_t queues = 1;
+	std::string timeout = "0";
+	int i = 1;
+	for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+		if (!strcmp(argv[i], "-p")) {
+			g_port = atoi(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-c")) {
+			pid = atoi(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-m")) {
+			messages = (size_t)atol(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-k")) {
+			queues = (size_t)atol(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-t")) {
+			timeout = argv[i + 1];
+		} else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	std::vector<size_t> counts;
+	for (; i < argc; ++i) {
+		counts.push_back((size_t)atol(argv[i]));
+	}
+	if (counts.empty()) {
+		counts = {1000, 10000};
+	}
+	queues = queues ? queues : 1;
+
+	int pusher = connect_one(0);
+	if (pusher < 0) {
+		die("connect pusher");
+	}
+	int ep = epoll_create1(0);
+	if (ep < 0) {
+		die("epoll_create1");
+	}
+	std::vector<int> waiters;
+	//the waiters of each queue in the order they blocked
+	std::vector<std::deque<size_t>> order(queues);
+	std::vector<std::string> blpop(queues);
+	for (size_t q = 0; q < queues; ++q) {
+		append_req(blpop[q], {"blpop", queue_name(q), timeout});
+	}
+
+	printf("%8s %8s %12s %10s %10s %10s %12s %12s\n", "waiters", "msgs", "msgs/s", "p50_us", "p99_us",
+		"max_us", "out_of_order", "idle_cpu_ms");
+	for (size_t target: counts) {
+		while (waiters.size() < target) {
+			size_t k = waiters.size();
+			int fd = connect_one(k + 1);
+			if (fd < 0) {
+				die("connect waiter");
+			}
+			size_t q = k % queues;
+			if (write_all(fd, blpop[q].data(), blpop[q].size())) {
+				die("blpop");
+			}
+			struct epoll_event ev = {};
+			ev.events = EPOLLIN;
+			ev.data.u64 = k;
+			if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+				die("epoll_ctl");
+			}
+			waiters.push_back(fd);
+			order[q].push_back(k);
+		}
+		//give the server time to park the last ones, then watch it idle
+		usleep(500 * 1000);
+		long idle = -1;
+		if (pid) {
+			long before = cpu_ms(pid);
+			sleep((unsigned)k_idle_sec);
+			idle = cpu_ms(pid) - before;
+		}
+
+		Histogram lat;
+		size_t misses = 0;
+		std::string push;
+		std::string body;
+		std::vector<struct epoll_event> events(16);
+		uint64_t start = now_ns();
+		for (size_t m = 0; m < messages; ++m) {
+			size_t q = m % queues;
+			push.clear();
+			append_req(push, {"rpush", queue_name(q), std::to_string(m)});
+			uint64_t t0 = now_ns();
+			if (write_all(pusher, push.data(), push.size())) {
+				die("rpush");
+			}
+			int rv = epoll_wait(ep, events.data(), (int)events.size(), 5000);
+			if (rv <= 0) {
+				fprintf(stderr, "message %zu was not delivered\n", m);
+				return 1;
+			}
+			if (rv > 1) {
+				fprintf(stderr, "message %zu woke %d waiters\n", m, rv);
+				return 1;
+			}
+			uint64_t t1 = now_ns();
+			size_t k = events[0].data.u64;
+			if (read_reply(waiters[k], &body) || body.size() < 5 || body[0] != SER_ARR) {
+				die("blpop reply");
+			}
+			hist_add(&lat, (t1 - t0) / 1000);
+			if (order[q].front() != k) {
+				misses++;
+				for (auto it = order[q].begin(); it != order[q].end(); ++it) {
+					if (*it == k) {
+						order[q].erase(it);
+						break;
+					}
+				}
+			} else {
+				order[q].pop_front();
+			}
+			order[q].push_back(k);
+			if (write_all(waiters[k], blpop[q].data(), blpop[q].size())
+				|| read_reply(pusher, &body))
+			{
+				die("blpop again");
+			}
+		}
+		double secs = (now_ns() - start) / 1e9;
+		printf("%8zu %8zu %12.0f %10llu %10llu %10llu %12zu %12ld\n", waiters.size(), messages,
+			(double)messages / secs, (unsigned long long)hist_percentile(&lat, 50),
+			(unsigned long long)hist_percentile(&lat, 99), (unsigned long long)lat.max, misses, idle);
+	}
+	//a reset, so runs one after another do not run out of ports to
+	//TIME_WAIT
+	struct linger lin = {};
+	lin.l_onoff = 1;
+	for (int fd: waiters) {
+		(void)setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+		close(fd);
+	}
+	return 0;
+}
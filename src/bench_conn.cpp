@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// connection-scaling benchmark.
+// opens N idle keep-alive connections, then measures request latency on
+// one active connection. with an O(ready) event loop the latency should
+// stay flat as N grows.
+//
+// usage: ./bench_conn [-p server_pid] [-P depth -s size] [-C cycles] [requests] [n1 n2 ...]
+// defaults to 100 1000 10000 50000 idle connections.
+// -p reports the server's resident memory per idle connection (same host).
+// -P runs a pipelined throughput test: depth requests of size bytes are
+// written at once and all replies read back, repeated requests times.
+// -C runs a churn test instead: connect, ping, disconnect, cycles times,
+// reporting the rate and the server's resident memory along the way.
+
+const size_t k_max_msg = 32 << 20;
+
+static void errmsg (const char* msg) {
+	fprintf(stderr, "[%d] %s ... %s\n", errno, strerror(errno), msg);
+}
+
+static int32_t read_full (int fd, char* buf, size_t n) {
+	while (n > 0) {
+		ssize_t rv = read(fd, buf, n);
+		if (rv <= 0) {
+			return -1;
+		}
+		assert((size_t)rv <= n);
+		n -= (size_t)rv;
+		buf += rv;
+	}
+	return 0;
+}
+
+static int32_t write_all (int fd, const char* buf, size_t n) {
+	while (n > 0) {
+		ssize_t rv = write(fd, buf, n);
+		if (rv <= 0) {
+			return -1;
+		}
+		assert((size_t)rv <= n);
+		n -= (size_t)rv;
+		buf += rv;
+	}
+	return 0;
+}
+
+static uint64_t now_ns () {
+	struct timespec ts = {};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// the loopback source port range caps one source address at ~28k
+// connections, so spread the idle clients over 127.0.0.x
+static int connect_one (size_t i) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	struct sockaddr_in local = {};
+	local.sin_family = AF_INET;
+	local.sin_port = 0;
+	local.sin_addr.s_addr = htonl(0x7f000001 + (uint32_t)(i / 20000));
+	if (bind(fd, (struct sockaddr*)&local, sizeof(local)) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	struct sockaddr_in serv_addr = {};
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_port = htons(6379);
+	serv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (const struct sockaddr*)&serv_addr, sizeof(serv_addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int32_t read_reply (int fd, std::vector<char> &rbuf) {
+	uint32_t len = 0;
+	if (read_full(fd, (char*)&len, 4)) {
+		return -1;
+	}
+	if (len > k_max_msg) {
+		return -1;
+	}
+	rbuf.resize(len);
+	return read_full(fd, rbuf.data(), len);
+}
+
+// append a request frame: len(4) + nstr(4) + nstr x (len(4) + bytes)
+static void append_req (std::vector<char> &out, const std::vector<std::string> &cmd) {
+	uint32_t len = 4;
+	for (const std::string &s: cmd) {
+		len += 4 + (uint32_t)s.size();
+	}
+	uint32_t n = (uint32_t)cmd.size();
+	out.insert(out.end(), (char*)&len, (char*)&len + 4);
+	out.insert(out.end(), (char*)&n, (char*)&n + 4);
+	for (const std::string &s: cmd) {
+		uint32_t sz = (uint32_t)s.size();
+		out.insert(out.end(), (char*)&sz, (char*)&sz + 4);
+		out.insert(out.end(), s.begin(), s.end());
+	}
+}
+
+static int32_t round_trip (int fd, const std::vector<char> &req) {
+	if (write_all(fd, req.data(), req.size())) {
+		return -1;
+	}
+	std::vector<char> rbuf;
+	return read_reply(fd, rbuf);
+}
+
+// resident set size of a process in KiB, from /proc (linux only)
+static long rss_kb (int pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		return -1;
+	}
+	char line[256];
+	long kb = -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "VmRSS:", 6)) {
+			kb = atol(line + 6);
+			break;
+		}
+	}
+	fclose(f);
+	return kb;
+}
+
+// the whole batch is written before any reply is read, so depth * size must
+// fit in the socket buffers or both sides block
+static int32_t pipeline_bench (size_t depth, size_t size, size_t rounds) {
+	int fd = connect_one(0);
+	if (fd < 0) {
+		errmsg("connect pipeline client");
+		return -1;
+	}
+	//echo comes back as tag(1) + len(4) + payload
+	std::vector<char> batch;
+	std::vector<std::string> cmd = {"echo", std::string(size, 'x')};
+	for (size_t i = 0; i < depth; ++i) {
+		append_req(batch, cmd);
+	}
+
+	std::vector<char> rbuf;
+	uint64_t start = now_ns();
+	for (size_t r = 0; r < rounds; ++r) {
+		if (write_all(fd, batch.data(), batch.size())) {
+			errmsg("pipeline write");
+			return -1;
+		}
+		for (size_t i = 0; i < depth; ++i) {
+			if (read_reply(fd, rbuf) || rbuf.size() != 5 + size) {
+				errmsg("pipeline read");
+				return -1;
+			}
+		}
+	}
+	double secs = (now_ns() - start) / 1e9;
+	close(fd);
+
+	double reqs = (double)depth * rounds;
+	printf("pipeline depth=%zu size=%zu: %.0f req/s, %.1f MB/s\n",
+		depth, size, reqs / secs, reqs * (20 + size) / secs / 1e6);
+	return 0;
+}
+
+// short-lived clients. the close is a reset (SO_LINGER 0) so millions of
+// cycles do not pile up sockets in TIME_WAIT
+static int32_t churn_bench (size_t cycles, int server_pid) {
+	std::vector<char> ping;
+	append_req(ping, {"ping"});
+	struct linger lin = {};
+	lin.l_onoff = 1;
+	lin.l_linger = 0;
+	size_t step = cycles >= 10 ? cycles / 10 : 1;
+
+	printf("%12s %12s %10s\n", "cycles", "conns/s", "rss_kb");
+	uint64_t start = now_ns();
+	for (size_t i = 1; i <= cycles; ++i) {
+		int fd = connect_one(i % 200000);
+		if (fd < 0) {
+			errmsg("connect churn client");
+			return -1;
+		}
+		if (round_trip(fd, ping)) {
+			errmsg("churn round trip");
+			return -1;
+		}
+		(void)setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+		close(fd);
+		if (i % step == 0) {
+			double secs = (now_ns() - start) / 1e9;
+			printf("%12zu %12.0f %10ld\n", i, step / secs,
+				server_pid ? rss_kb(server_pid) : -1);
+			start = now_ns();
+		}
+	}
+	return 0;
+}
+
+static void raise_fd_limit () {
+	struct rlimit rl = {};
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		(void)setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+int main (int argc, char* argv[]) {
+	setbuf(stdout, NULL);
+	raise_fd_limit();
+
+	int server_pid = 0;
+	size_t depth = 0;
+	size_t size = 16;
+	size_t cycles = 0;
+	int i = 1;
+	for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+		if (!strcmp(argv[i], "-p")) {
+			server_pid = atoi(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-P")) {
+			depth = (size_t)atol(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-s")) {
+			size = (size_t)atol(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-C")) {
+			cycles = (size_t)atol(argv[i + 1]);
+		} else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	size_t requests = 10000;
+	std::vector<size_t> counts;
+	if (i < argc) {
+		requests = (size_t)atol(argv[i++]);
+	}
+	for (; i < argc; ++i) {
+		counts.push_back((size_t)atol(argv[i]));
+	}
+	if (depth) {
+		return pipeline_bench(depth, size, requests) ? 1 : 0;
+	}
+	if (cycles) {
+		return churn_bench(cycles, server_pid) ? 1 : 0;
+	}
+	if (counts.empty()) {
+		counts = {100, 1000, 10000, 50000};
+	}
+
+	std::vector<int> idle;
+	long base_kb = server_pid ? rss_kb(server_pid) : -1;
+	printf("%10s %10s %10s %10s %10s %14s\n", "idle_conns", "avg_us", "p50_us", "p99_us", "max_us", "bytes_per_conn");
+	for (size_t target: counts) {
+		while (idle.size() < target) {
+			int fd = connect_one(idle.size());
+			if (fd < 0) {
+				errmsg("connect idle client");
+				break;
+			}
+			idle.push_back(fd);
+		}
+
+		int fd = connect_one(0);
+		if (fd < 0) {
+			errmsg("connect active client");
+			return 1;
+		}
+
+		std::vector<char> ping;
+		append_req(ping, {"ping"});
+		std::vector<uint64_t> lat;
+		lat.reserve(requests);
+		for (size_t i = 0; i < requests; ++i) {
+			uint64_t start = now_ns();
+			if (round_trip(fd, ping)) {
+				errmsg("round trip");
+				return 1;
+			}
+			lat.push_back(now_ns() - start);
+		}
+		close(fd);
+
+		std::sort(lat.begin(), lat.end());
+		uint64_t sum = 0;
+		for (uint64_t v: lat) {
+			sum += v;
+		}
+		//socket buffers live in the kernel, so this is the server's own cost
+		double per_conn = -1;
+		if (base_kb >= 0 && !idle.empty()) {
+			per_conn = (rss_kb(server_pid) - base_kb) * 1024.0 / idle.size();
+		}
+		printf("%10zu %10.2f %10.2f %10.2f %10.2f %14.0f\n", idle.size(),
+			sum / 1e3 / lat.size(),
+			lat[lat.size() / 2] / 1e3,
+			lat[lat.size() * 99 / 100] / 1e3,
+			lat.back() / 1e3,
+			per_conn);
+	}
+
+	for (int fd: idle) {
+		close(fd);
+	}
+	return 0;
+}
@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "histogram.h"
+
+// pub/sub fan-out benchmark.
+// opens N subscriber connections on one channel, then publishes messages
+// from another connection, a burst at a time, and waits until every
+// subscriber has read the burst before sending the next. each message
+// carries the time it was published, so every delivery is timed, and the
+// time until the last subscriber has it is the fan-out latency.
+//
+// usage: ./bench_pubsub [-p port] [-s size] [-m messages] [-b burst] [-S slow] [n1 n2 ...]
+// defaults to 1000 and 10000 subscribers, 1000 messages of 64 bytes.
+// -S adds subscribers that never read, which the server should cut off
+// once their output limit is reached (see --pubsub-limit).
+// the subscribers use the binary protocol and are read by this one
+// thread, so on a shared machine their reads compete with the server.
+
+const size_t k_max_msg = 32 << 20;
+const char k_channel[] = "bench";
+
+static int g_port = 6379;
+
+static void die (const char* msg) {
+	fprintf(stderr, "[%d] %s ... %s\n", errno, strerror(errno), msg);
+	exit(1);
+}
+
+static uint64_t now_ns () {
+	struct timespec ts = {};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int32_t read_full (int fd, char* buf, size_t n) {
+	while (n > 0) {
+		ssize_t rv = read(fd, buf, n);
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rv <= 0) {
+			return -1;
+		}
+		n -= (size_t)rv;
+		buf += rv;
+	}
+	return 0;
+}
+
+static int32_t write_all (int fd, const char* buf, size_t n) {
+	while (n > 0) {
+		ssize_t rv = write(fd, buf, n);
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rv <= 0) {
+			return -1;
+		}
+		n -= (size_t)rv;
+		buf += rv;
+	}
+	return 0;
+}
+
+// the loopback source port range caps one source address at ~28k
+// connections, so spread the clients over 127.0.0.x
+static int connect_one (size_t i) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	struct sockaddr_in local = {};
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(0x7f000001 + (uint32_t)(i / 20000));
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)g_port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr*)&local, sizeof(local)) != 0
+		|| connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// append a request frame: len(4) + nstr(4) + nstr x (len(4) + bytes)
+static void append_req (std::string &out, const std::vector<std::string> &cmd) {
+	uint32_t len = 4;
+	for (const std::string &s: cmd) {
+		len += 4 + (uint32_t)s.size();
+	}
+	uint32_t n = (uint32_t)cmd.size();
+	out.append((const char*)&len, 4);
+	out.append((const char*)&n, 4);
+	for (const std::string &s: cmd) {
+		uint32_t sz = (uint32_t)s.size();
+		out.append((const char*)&sz, 4);
+		out.append(s);
+	}
+}
+
+// one reply frame, the body without the length
+static int32_t read_reply (int fd, std::string* body) {
+	uint32_t len = 0;
+	if (read_full(fd, (char*)&len, 4) || len > k_max_msg) {
+		return -1;
+	}
+	body->resize(len);
+	return read_full(fd, &(*body)[0], len);
+}
+
+// subscribers left on the channel. the reply is an array of the channel
+// and the count, and ends with the count's int64(8)
+static int64_t numsub (int fd) {
+	std::string req;
+	append_req(req, {"pubsub", "numsub", k_channel});
+	std::string body;
+	if (write_all(fd, req.data(), req.size()) || read_reply(fd, &body) || body.size() < 9) {
+		die("pubsub numsub");
+	}
+	int64_t v = 0;
+	memcpy(&v, &body[body.size() - 8], 8);
+	return v;
+}
+
+struct Sub {
+	int fd = -1;
+	std::string in;
+	uint64_t next = 0; //sequence number of the next message
+};
+
+// the complete frames in sub->in. a message ends with the payload, which
+// starts with the publish time and the sequence number
+static int32_t sub_parse (Sub* sub, size_t size, uint64_t now, Histogram* lat, size_t* got) {
+	size_t pos = 0;
+	while (sub->in.size() - pos >= 4) {
+		uint32_t len = 0;
+		memcpy(&len, sub->in.data() + pos, 4);
+		if (sub->in.size() - pos - 4 < len) {
+			break;
+		}
+		if (len < size) {
+			return -1;
+		}
+		const char* payload = sub->in.data() + pos + 4 + len - size;
+		uint64_t sent = 0;
+		uint64_t seq = 0;
+		memcpy(&sent, payload, 8);
+		memcpy(&seq, payload + 8, 8);
+		if (seq != sub->next) {
+			fprintf(stderr, "message %llu arrived, expected %llu\n", (unsigned long long)seq,
+				(unsigned long long)sub->next);
+			return -1;
+		}
+		sub->next++;
+		hist_add(lat, (now - sent) / 1000);
+		(*got)++;
+		pos += 4 + len;
+	}
+	sub->in.erase(0, pos);
+	return 0;
+}
+
+static void raise_fd_limit () {
+	struct rlimit rl = {};
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		(void)setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+static int subscribe (size_t i) {
+	int fd = connect_one(i);
+	if (fd < 0) {
+		die("connect subscriber");
+	}
+	std::string req;
+	append_req(req, {"subscribe", k_channel});
+	std::string body;
+	if (write_all(fd, req.data(), req.size()) || read_reply(fd, &body)) {
+		die("subscribe");
+	}
+	return fd;
+}
+
+int main (int argc, char* argv[]) {
+	setbuf(stdout, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	raise_fd_limit();
+
+	size_t size = 64;
+	size_t messages = 1000;
+	size_t burst = 1;
+	size_t slow = 0;
+	int i = 1;
+	for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+		if (!strcmp(argv[i], "-p")) {
+			g_port = atoi(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-s")) {
+			size = (size_t)atol(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-m")) {
+			messages = (size_t)atol(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-b")) {
+			burst = (size_t)atol(argv[i + 1]);
+		} else if (!strcmp(argv[i], "-S")) {
+			slow = (size_t)atol(argv[i + 1]);
+		} else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	std::vector<size_t> counts;
+	for (; i < argc; ++i) {
+		counts.push_back((size_t)atol(argv[i]));
+	}
+	if (counts.empty()) {
+		counts = {1000, 10000};
+	}
+	size = size < 16 ? 16 : size;
+	burst = burst ? burst : 1;
+
+	int pub = connect_one(0);
+	if (pub < 0) {
+		die("connect publisher");
+	}
+	int ep = epoll_create1(0);
+	if (ep < 0) {
+		die("epoll_create1");
+	}
+	std::vector<Sub> subs;
+	std::vector<int> slow_fds;
+	for (size_t k = 0; k < slow; ++k) {
+		slow_fds.push_back(subscribe(k));
+	}
+
+	printf("%8s %8s %12s %10s %10s %10s %12s %12s %12s\n", "subs", "msgs", "deliveries/s",
+		"p50_us", "p99_us", "max_us", "fanout_p50", "fanout_p99", "fanout_max");
+	for (size_t target: counts) {
+		while (subs.size() < target) {
+			Sub sub;
+			sub.fd = subscribe(slow + subs.size());
+			sub.next = subs.empty() ? 0 : subs[0].next;
+			(void)fcntl(sub.fd, F_SETFL, fcntl(sub.fd, F_GETFL, 0) | O_NONBLOCK);
+			subs.push_back(sub);
+		}
+		//registered by index, the vector is complete for this round
+		for (size_t k = 0; k < subs.size(); ++k) {
+			struct epoll_event ev = {};
+			ev.events = EPOLLIN;
+			ev.data.u64 = k;
+			if (epoll_ctl(ep, EPOLL_CTL_ADD, subs[k].fd, &ev) < 0 && errno != EEXIST) {
+				die("epoll_ctl");
+			}
+		}
+
+		Histogram lat;
+		Histogram fanout;
+		std::string payload(size, 'x');
+		std::string req;
+		std::string body;
+		std::vector<struct epoll_event> events(1024);
+		uint64_t start = now_ns();
+		for (size_t sent = 0; sent < messages; sent += burst) {
+			size_t n = messages - sent < burst ? messages - sent : burst;
+			req.clear();
+			uint64_t t0 = now_ns();
+			for (size_t k = 0; k < n; ++k) {
+				uint64_t seq = subs[0].next + k;
+				memcpy(&payload[0], &t0, 8);
+				memcpy(&payload[8], &seq, 8);
+				append_req(req, {"publish", k_channel, payload});
+			}
+			if (write_all(pub, req.data(), req.size())) {
+				die("publish");
+			}
+			size_t want = n * subs.size();
+			size_t got = 0;
+			while (got < want) {
+				int rv = epoll_wait(ep, events.data(), (int)events.size(), 5000);
+				if (rv <= 0) {
+					fprintf(stderr, "%zu of %zu deliveries missing\n", want - got, want);
+					return 1;
+				}
+				uint64_t now = now_ns();
+				for (int e = 0; e < rv; ++e) {
+					Sub* sub = &subs[events[e].data.u64];
+					char buf[64 << 10];
+					ssize_t r = 0;
+					while ((r = read(sub->fd, buf, sizeof(buf))) > 0) {
+						sub->in.append(buf, (size_t)r);
+					}
+					if (r == 0 || sub_parse(sub, size, now, &lat, &got) < 0) {
+						die("subscriber read");
+					}
+				}
+			}
+			hist_add(&fanout, (now_ns() - t0) / 1000);
+			for (size_t k = 0; k < n; ++k) {
+				int64_t receivers = 0;
+				if (read_reply(pub, &body) || body.size() != 9) {
+					die("publish reply");
+				}
+				memcpy(&receivers, &body[1], 8);
+				if ((size_t)receivers < subs.size()) {
+					fprintf(stderr, "published to %lld subscribers\n", (long long)receivers);
+				}
+			}
+		}
+		double secs = (now_ns() - start) / 1e9;
+		printf("%8zu %8zu %12.0f %10llu %10llu %10llu %12llu %12llu %12llu\n", subs.size(), messages,
+			(double)lat.total / secs, (unsigned long long)hist_percentile(&lat, 50),
+			(unsigned long long)hist_percentile(&lat, 99), (unsigned long long)lat.max,
+			(unsigned long long)hist_percentile(&fanout, 50), (unsigned long long)hist_percentile(&fanout, 99),
+			(unsigned long long)fanout.max);
+	}
+	if (slow) {
+		int64_t left = numsub(pub) - (int64_t)subs.size();
+		printf("slow subscribers cut off: %lld of %zu\n", (long long)(slow - left), slow);
+	}
+	//a reset, so runs one after another do not run out of ports to
+	//TIME_WAIT
+	struct linger lin = {};
+	lin.l_onoff = 1;
+	for (Sub &sub: subs) {
+		slow_fds.push_back(sub.fd);
+	}
+	for (int fd: slow_fds) {
+		(void)setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+		close(fd);
+	}
+	return 0;
+}
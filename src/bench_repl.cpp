@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "histogram.h"
+
+// replication lag benchmark.
+// starts a primary and a replica of it on localhost, fills the primary
+// and times the replica's full resync, then writes to the primary from
+// load connections while a probe measures how long a write acknowledged
+// by the primary takes to show up on the replica. the stream offsets of
+// both are sampled for the lag in bytes. with --reconnect the replica is
+// told to reconnect halfway, which should be a partial resync.
+//
+// usage: ./bench_repl [-s server] [-p port] [-n prefill] [-c conns] [-P depth]
+//                     [-d size] [-r keys] [-T secs] [--reconnect] [-- server args]
+// the primary listens on port (6379), the replica on port + 1. arguments
+// after -- go to both servers, e.g. -- --threads 2 --io-uring
+
+struct Cfg {
+	std::string server = "./bin/server";
+	int port = 6379;
+	size_t prefill = 0;
+	size_t conns = 8;
+	size_t depth = 16;
+	size_t size = 100;
+	size_t keys = 100000;
+	double secs = 10;
+	bool reconnect = false;
+	std::vector<std::string> args;
+};
+
+static Cfg g_cfg;
+
+static void die (const char* msg) {
+	fprintf(stderr, "[%d] %s ... %s\n", errno, strerror(errno), msg);
+	exit(1);
+}
+
+static uint64_t now_ns () {
+	struct timespec ts = {};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int connect_port (int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	int on = 1;
+	(void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	return fd;
+}
+
+static void write_all (int fd, const std::string &s) {
+	size_t pos = 0;
+	while (pos < s.size()) {
+		ssize_t rv = write(fd, s.data() + pos, s.size() - pos);
+		if (rv <= 0) {
+			die("write()");
+		}
+		pos += (size_t)rv;
+	}
+}
+
+static void append_cmd (std::string* out, const std::vector<std::string> &args) {
+	*out += "*" + std::to_string(args.size()) + "\r\n";
+	for (const std::string &a: args) {
+		*out += "$" + std::to_string(a.size()) + "\r\n" + a + "\r\n";
+	}
+}
+
+// a blocking RESP connection that reads replies of the simple kinds the
+// server sends: status, error, integer and bulk strings
+struct Client {
+	int fd = -1;
+	std::string in;
+	size_t pos = 0;
+};
+
+static bool client_fill (Client* c) {
+	if (c->pos == c->in.size()) {
+		c->in.clear();
+		c->pos = 0;
+	}
+	char buf[64 << 10];
+	ssize_t rv = read(c->fd, buf, sizeof(buf));
+	if (rv <= 0) {
+		return false;
+	}
+	c->in.append(buf, (size_t)rv);
+	return true;
+}
+
+static std::string client_line (Client* c) {
+	while (1) {
+		size_t lf = c->in.find("\r\n", c->pos);
+		if (lf != std::string::npos) {
+			std::string line = c->in.substr(c->pos, lf - c->pos);
+			c->pos = lf + 2;
+			return line;
+		}
+		if (!client_fill(c)) {
+			die("read()");
+		}
+	}
+}
+
+// one reply. a bulk string comes back without its header, nil as "(nil)"
+static std::string client_reply (Client* c) {
+	std::string line = client_line(c);
+	if (line.empty() || line[0] != '$') {
+		return line;
+	}
+	long n = atol(line.c_str() + 1);
+	if (n < 0) {
+		return "(nil)";
+	}
+	while (c->in.size() - c->pos < (size_t)n + 2) {
+		if (!client_fill(c)) {
+			die("read()");
+		}
+	}
+	std::string val = c->in.substr(c->pos, (size_t)n);
+	c->pos += (size_t)n + 2;
+	return val;
+}
+
+static std::string client_cmd (Client* c, const std::vector<std::string> &args) {
+	std::string req;
+	append_cmd(&req, args);
+	write_all(c->fd, req);
+	return client_reply(c);
+}
+
+// a field of an INFO reply, 0 if missing
+static uint64_t info_u64 (Client* c, const char* field) {
+	std::string info = client_cmd(c, {"info", "replication"});
+	std::string key = std::string(field) + ":";
+	size_t at = info.find(key);
+	return at == std::string::npos ? 0 : strtoull(info.c_str() + at + key.size(), NULL, 10);
+}
+
+static bool link_up (Client* c) {
+	return client_cmd(c, {"info", "replication"}).find("master_link_status:up") != std::string::npos;
+}
+
+static pid_t start_server (int port, const char* primary) {
+	std::vector<std::string> argv = {g_cfg.server, "--port", std::to_string(port),
+		"--snapshot", "/tmp/bench_repl_" + std::to_string(port) + ".rdb"};
+	if (primary) {
+		argv.insert(argv.end(), {"--replicaof", "127.0.0.1", primary});
+	}
+	argv.insert(argv.end(), g_cfg.args.begin(), g_cfg.args.end());
+	pid_t pid = fork();
+	if (pid == 0) {
+		std::vector<char*> cargv;
+		for (std::string &a: argv) {
+			cargv.push_back(a.data());
+		}
+		cargv.push_back(NULL);
+		//keep the servers quiet, the benchmark reports
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, 1);
+		dup2(null, 2);
+		execv(cargv[0], cargv.data());
+		_exit(127);
+	}
+	if (pid < 0) {
+		die("fork()");
+	}
+	return pid;
+}
+
+static Client connect_client (int port) {
+	Client c;
+	for (int i = 0; i < 500 && c.fd < 0; ++i) {
+		c.fd = connect_port(port);
+		if (c.fd < 0) {
+			usleep(10 * 1000);
+		}
+	}
+	if (c.fd < 0) {
+		die("connect()");
+	}
+	return c;
+}
+
+// pipelined SETs of random keys until stop is set
+static void load_run (std::atomic<bool>* stop, std::atomic<uint64_t>* ops, uint64_t seed) {
+	Client c = connect_client(g_cfg.port);
+	std::string val(g_cfg.size, 'x');
+	uint64_t x = seed * 0x9e3779b97f4a7c15ull + 1;
+	while (!*stop) {
+		std::string batch;
+		for (size_t i = 0; i < g_cfg.depth; ++i) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			append_cmd(&batch, {"set", "key:" + std::to_string(x % g_cfg.keys), val});
+		}
+		write_all(c.fd, batch);
+		for (size_t i = 0; i < g_cfg.depth; ++i) {
+			client_reply(&c);
+		}
+		*ops += g_cfg.depth;
+	}
+	close(c.fd);
+}
+
+static void prefill (Client* c) {
+	std::string val(g_cfg.size, 'x');
+	const size_t k_batch = 1000;
+	for (size_t i = 0; i < g_cfg.prefill; i += k_batch) {
+		std::string batch;
+		size_t n = g_cfg.prefill - i < k_batch ? g_cfg.prefill - i : k_batch;
+		for (size_t j = 0; j < n; ++j) {
+			append_cmd(&batch, {"set", "key:" + std::to_string(i + j), val});
+		}
+		write_all(c->fd, batch);
+		for (size_t j = 0; j < n; ++j) {
+			client_reply(c);
+		}
+	}
+}
+
+static void usage (const char* prog) {
+	fprintf(stderr, "usage: %s [-s server] [-p port] [-n prefill] [-c conns] [-P depth] [-d size]\n"
+		"       [-r keys] [-T secs] [--reconnect] [-- server args]\n", prog);
+	exit(1);
+}
+
+int main (int argc, char* argv[]) {
+	setbuf(stdout, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	for (int i = 1; i < argc; ++i) {
+		const char* opt = argv[i];
+		if (!strcmp(opt, "--")) {
+			g_cfg.args.assign(argv + i + 1, argv + argc);
+			break;
+		} else if (!strcmp(opt, "--reconnect")) {
+			g_cfg.reconnect = true;
+		} else if (i + 1 >= argc) {
+			usage(argv[0]);
+		} else if (!strcmp(opt, "-s")) {
+			g_cfg.server = argv[++i];
+		} else if (!strcmp(opt, "-p")) {
+			g_cfg.port = atoi(argv[++i]);
+		} else if (!strcmp(opt, "-n")) {
+			g_cfg.prefill = (size_t)atol(argv[++i]);
+		} else if (!strcmp(opt, "-c")) {
+			g_cfg.conns = (size_t)atol(argv[++i]);
+		} else if (!strcmp(opt, "-P")) {
+			g_cfg.depth = (size_t)atol(argv[++i]);
+		} else if (!strcmp(opt, "-d")) {
+			g_cfg.size = (size_t)atol(argv[++i]);
+		} else if (!strcmp(opt, "-r")) {
+			g_cfg.keys = (size_t)atol(argv[++i]);
+		} else if (!strcmp(opt, "-T")) {
+			g_cfg.secs = atof(argv[++i]);
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (!g_cfg.conns || !g_cfg.depth || !g_cfg.keys) {
+		usage(argv[0]);
+	}
+
+	int rport = g_cfg.port + 1;
+	std::string pport = std::to_string(g_cfg.port);
+	pid_t primary_pid = start_server(g_cfg.port, NULL);
+	Client primary = connect_client(g_cfg.port);
+	if (g_cfg.prefill) {
+		uint64_t start = now_ns();
+		prefill(&primary);
+		printf("prefilled %zu keys of %zu bytes in %.2f s\n", g_cfg.prefill, g_cfg.size,
+			(now_ns() - start) / 1e9);
+	}
+
+	uint64_t start = now_ns();
+	pid_t replica_pid = start_server(rport, pport.c_str());
+	Client replica = connect_client(rport);
+	while (!link_up(&replica)) {
+		usleep(1000);
+	}
+	printf("full resync: %.3f s\n", (now_ns() - start) / 1e9);
+
+	std::atomic<bool> stop{false};
+	std::atomic<uint64_t> ops{0};
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < g_cfg.conns; ++i) {
+		threads.emplace_back(load_run, &stop, &ops, i + 1);
+	}
+
+	//the probe: a SET on the primary, then GETs on the replica until the
+	//value shows up there. the lag is counted from the primary's reply
+	Histogram lag;
+	Histogram bytes;
+	uint64_t end = now_ns() + (uint64_t)(g_cfg.secs * 1e9);
+	uint64_t reconnect_at = g_cfg.reconnect ? now_ns() + (end - now_ns()) / 2 : UINT64_MAX;
+	uint64_t probes = 0;
+	while (now_ns() < end) {
+		if (now_ns() >= reconnect_at) {
+			reconnect_at = UINT64_MAX;
+			uint64_t partial = info_u64(&primary, "sync_partial_ok");
+			uint64_t full = info_u64(&primary, "sync_full");
+			uint64_t at = now_ns();
+			client_cmd(&replica, {"replicaof", "127.0.0.1", pport});
+			//done once the primary has served the new PSYNC and the
+			//replica applies the stream again
+			bool ok = false;
+			while (1) {
+				ok = info_u64(&primary, "sync_partial_ok") > partial;
+				if ((ok || info_u64(&primary, "sync_full") > full) && link_up(&replica)) {
+					break;
+				}
+				usleep(1000);
+			}
+			printf("reconnect: %s resync in %.3f s\n", ok ? "partial" : "full", (now_ns() - at) / 1e9);
+		}
+		std::string val = std::to_string(probes++);
+		client_cmd(&primary, {"set", "probe", val});
+		uint64_t at = now_ns();
+		while (client_cmd(&replica, {"get", "probe"}) != val) {}
+		hist_add(&lag, (now_ns() - at) / 1000);
+		//the offsets are read one after the other, so this is close to
+		//the bytes in flight, not exact
+		uint64_t produced = info_u64(&primary, "master_repl_offset");
+		uint64_t applied = info_u64(&replica, "slave_repl_offset");
+		hist_add(&bytes, produced > applied ? produced - applied : 0);
+		usleep(10 * 1000);
+	}
+	stop = true;
+	for (std::thread &t: threads) {
+		t.join();
+	}
+	uint64_t total = ops;
+	uint64_t target = info_u64(&primary, "master_repl_offset");
+	uint64_t at = now_ns();
+	while (info_u64(&replica, "slave_repl_offset") < target) {
+		usleep(100);
+	}
+	double catchup = (now_ns() - at) / 1e9;
+
+	printf("load: %zu conns, pipeline %zu, %zu byte values, %zu keys: %.0f SET/s\n",
+		g_cfg.conns, g_cfg.depth, g_cfg.size, g_cfg.keys, total / g_cfg.secs);
+	printf("%12s %10s %10s %10s %10s %10s\n", "", "samples", "p50", "p99", "p99.9", "max");
+	printf("%12s %10llu %10llu %10llu %10llu %10llu\n", "lag_us", (unsigned long long)lag.total,
+		(unsigned long long)hist_percentile(&lag, 50), (unsigned long long)hist_percentile(&lag, 99),
+		(unsigned long long)hist_percentile(&lag, 99.9), (unsigned long long)lag.max);
+	printf("%12s %10llu %10llu %10llu %10llu %10llu\n", "lag_bytes", (unsigned long long)bytes.total,
+		(unsigned long long)hist_percentile(&bytes, 50), (unsigned long long)hist_percentile(&bytes, 99),
+		(unsigned long long)hist_percentile(&bytes, 99.9), (unsigned long long)bytes.max);
+	printf("caught up %.3f s after the load stopped\n", catchup);
+
+	kill(replica_pid, SIGTERM);
+	kill(primary_pid, SIGTERM);
+	waitpid(replica_pid, NULL, 0);
+	waitpid(primary_pid, NULL, 0);
+	unlink(("/tmp/bench_repl_" + std::to_string(g_cfg.port) + ".rdb.recv").c_str());
+	return 0;
+}
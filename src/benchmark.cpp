@@ -0,0 +1,609 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "buffer.h"
+#include "histogram.h"
+#include "protocol.h"
+#include "reactor.h"
+
+// closed-loop load generator for the binary protocol.
+// every connection keeps up to -P requests in flight and sends a new one as
+// soon as a reply comes back. latency is measured from queueing a request
+// to parsing its reply, so with -P > 1 it includes the pipeline wait.
+//
+// usage: ./benchmark [options]
+//   -h host          server address (127.0.0.1)
+//   -p port          server port (6379)
+//   -c conns         connections in total (50)
+//   -t threads       client threads, the connections are split evenly (1)
+//   -P depth         requests in flight per connection (1)
+//   -n requests      requests in total (100000)
+//   -T seconds       run for a fixed time instead of -n
+//   -d size          SET value size in bytes (16)
+//   -r keys          key space, keys are "key:0" .. "key:<keys-1>" (100000)
+//   --dist D         key distribution, uniform or zipf (uniform)
+//   --theta F        zipf skew in (0, 1), higher is hotter (0.99)
+//   --ratio S:G      SET to GET ratio (1:10)
+//   --prefill        SET every key once before the measured run
+//   --json           print the results as one JSON object
+
+enum {
+	DIST_UNIFORM = 0,
+	DIST_ZIPF = 1,
+	DIST_SEQ = 2, //every key once, only used by --prefill
+};
+
+enum {
+	OP_SET = 0,
+	OP_GET = 1,
+};
+
+struct Config {
+	std::string host = "127.0.0.1";
+	uint16_t port = 6379;
+	size_t conns = 50;
+	size_t threads = 1;
+	size_t depth = 1;
+	uint64_t requests = 100000;
+	double seconds = 0;
+	size_t size = 16;
+	uint64_t keys = 100000;
+	uint32_t dist = DIST_UNIFORM;
+	double theta = 0.99;
+	uint32_t ratio_set = 1;
+	uint32_t ratio_get = 10;
+	bool prefill = false;
+	bool json = false;
+};
+
+static Config g_cfg;
+
+static void errmsg (const char* msg) {
+	fprintf(stderr, "[%d] %s ... %s\n", errno, strerror(errno), msg);
+	exit(1);
+}
+
+static uint64_t now_ns () {
+	struct timespec ts = {};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// zipfian ranks in [0, n), rank 0 is the hottest key. the method from
+// "Quickly generating billion-record synthetic databases" (Gray et al.),
+// the same one YCSB uses: O(n) setup, O(1) per sample
+struct Zipf {
+	uint64_t n = 0;
+	double theta = 0;
+	double alpha = 0;
+	double zetan = 0;
+	double eta = 0;
+};
+
+static double zeta (uint64_t n, double theta) {
+	double sum = 0;
+	for (uint64_t i = 1; i <= n; ++i) {
+		sum += 1.0 / pow((double)i, theta);
+	}
+	return sum;
+}
+
+static void zipf_init (Zipf* z, uint64_t n, double theta) {
+	z->n = n;
+	z->theta = theta;
+	z->alpha = 1.0 / (1.0 - theta);
+	z->zetan = zeta(n, theta);
+	z->eta = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) / (1.0 - zeta(2, theta) / z->zetan);
+}
+
+// u uniform in [0, 1)
+static uint64_t zipf_next (const Zipf* z, double u) {
+	double uz = u * z->zetan;
+	if (uz < 1.0) {
+		return 0;
+	}
+	if (uz < 1.0 + pow(0.5, z->theta)) {
+		return 1;
+	}
+	uint64_t rank = (uint64_t)((double)z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+	return rank < z->n ? rank : z->n - 1;
+}
+
+static Zipf g_zipf;
+//next key for DIST_SEQ, shared by all threads
+static std::atomic<uint64_t> g_seq{0};
+
+struct Stats {
+	Histogram lat[2]; //per op, in ns
+	uint64_t errors = 0;
+	uint64_t bytes_out = 0;
+	uint64_t bytes_in = 0;
+};
+
+struct Client {
+	int fd = -1;
+	Buffer rbuf;
+	Buffer wbuf;
+	//queue time and op of the requests in flight, a ring of depth slots
+	std::vector<uint64_t> sent;
+	std::vector<uint8_t> ops;
+	size_t head = 0;
+	size_t inflight = 0;
+};
+
+struct Phase {
+	uint32_t dist = DIST_UNIFORM;
+	uint32_t ratio_set = 1;
+	uint32_t ratio_get = 0;
+	uint64_t requests = 0; //ignored when deadline is set
+	uint64_t deadline = 0;
+};
+
+struct Thread {
+	std::vector<Client*> clients;
+	std::vector<Client*> fd2client;
+	Reactor* reactor = NULL;
+	uint64_t rng = 0;
+	uint64_t budget = 0; //requests this thread may still send
+	Stats stats;
+};
+
+static uint64_t rng_next (uint64_t* s) {
+	//xorshift64*
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return *s * 0x2545f4914f6cdd1dull;
+}
+
+static double rng_unit (uint64_t* s) {
+	return (double)(rng_next(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t pick_key (Thread* t, const Phase* ph) {
+	switch (ph->dist) {
+	case DIST_ZIPF:
+		return zipf_next(&g_zipf, rng_unit(&t->rng));
+	case DIST_SEQ:
+		return g_seq.fetch_add(1, std::memory_order_relaxed) % g_cfg.keys;
+	default:
+		return rng_next(&t->rng) % g_cfg.keys;
+	}
+}
+
+static void fd_set_nb (int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		errmsg("fcntl error");
+	}
+}
+
+static int connect_one () {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		errmsg("socket()");
+	}
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(g_cfg.port);
+	if (inet_pton(AF_INET, g_cfg.host.c_str(), &addr.sin_addr) != 1) {
+		fprintf(stderr, "bad address %s\n", g_cfg.host.c_str());
+		exit(1);
+	}
+	if (connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		errmsg("connect()");
+	}
+	int val = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+	fd_set_nb(fd);
+	return fd;
+}
+
+static void buf_append_u32 (Buffer* b, uint32_t v) {
+	buf_append(b, &v, 4);
+}
+
+// queue one request frame: len(4) + nstr(4) + nstr x (len(4) + bytes)
+static void append_req (Buffer* out, const std::string* args, size_t n) {
+	uint32_t len = 4;
+	for (size_t i = 0; i < n; ++i) {
+		len += 4 + (uint32_t)args[i].size();
+	}
+	buf_append_u32(out, len);
+	buf_append_u32(out, (uint32_t)n);
+	for (size_t i = 0; i < n; ++i) {
+		buf_append_u32(out, (uint32_t)args[i].size());
+		buf_append(out, args[i].data(), args[i].size());
+	}
+}
+
+static bool can_send (Thread* t, const Phase* ph, uint64_t now) {
+	if (ph->deadline) {
+		return now < ph->deadline;
+	}
+	return t->budget > 0;
+}
+
+// top the connection's pipeline back up to depth requests
+static void fill_pipeline (Thread* t, Client* c, const Phase* ph) {
+	static const std::string k_set = "set";
+	static const std::string k_get = "get";
+	static thread_local std::string val(g_cfg.size, 'x');
+	uint32_t total = ph->ratio_set + ph->ratio_get;
+	std::string args[3];
+	char key[32];
+	uint64_t now = now_ns();
+	while (c->inflight < g_cfg.depth && can_send(t, ph, now)) {
+		int klen = snprintf(key, sizeof(key), "key:%lu", (unsigned long)pick_key(t, ph));
+		uint8_t op = (rng_next(&t->rng) % total < ph->ratio_set) ? OP_SET : OP_GET;
+		if (op == OP_SET) {
+			args[0] = k_set;
+			args[1].assign(key, (size_t)klen);
+			args[2] = val;
+			append_req(&c->wbuf, args, 3);
+		} else {
+			args[0] = k_get;
+			args[1].assign(key, (size_t)klen);
+			append_req(&c->wbuf, args, 2);
+		}
+		size_t slot = (c->head + c->inflight) % g_cfg.depth;
+		c->sent[slot] = now;
+		c->ops[slot] = op;
+		c->inflight++;
+		if (!ph->deadline) {
+			t->budget--;
+		}
+	}
+}
+
+static void flush_client (Thread* t, Client* c) {
+	while (buf_size(&c->wbuf) > 0) {
+		ssize_t rv = write(c->fd, buf_head(&c->wbuf), buf_size(&c->wbuf));
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rv < 0 && errno == EAGAIN) {
+			return; //the reactor reports when the socket drains
+		}
+		if (rv <= 0) {
+			errmsg("write()");
+		}
+		t->stats.bytes_out += (uint64_t)rv;
+		buf_consume(&c->wbuf, (size_t)rv);
+	}
+}
+
+// drain the socket and account every complete reply
+static void read_client (Thread* t, Client* c) {
+	while (1) {
+		buf_reserve(&c->rbuf, 4096);
+		ssize_t rv = read(c->fd, buf_tail(&c->rbuf), buf_avail(&c->rbuf));
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rv < 0 && errno == EAGAIN) {
+			break;
+		}
+		if (rv < 0) {
+			errmsg("read()");
+		}
+		if (rv == 0) {
+			fprintf(stderr, "server closed the connection\n");
+			exit(1);
+		}
+		t->stats.bytes_in += (uint64_t)rv;
+		buf_commit(&c->rbuf, (size_t)rv);
+	}
+
+	//replies that arrived together get the same timestamp
+	uint64_t now = now_ns();
+	while (buf_size(&c->rbuf) >= 4) {
+		uint32_t len = 0;
+		memcpy(&len, buf_head(&c->rbuf), 4);
+		if (buf_size(&c->rbuf) < 4 + (size_t)len) {
+			break;
+		}
+		if (c->inflight == 0 || len == 0) {
+			fprintf(stderr, "unexpected reply\n");
+			exit(1);
+		}
+		if (buf_head(&c->rbuf)[4] == SER_ERR) {
+			t->stats.errors++;
+		}
+		hist_add(&t->stats.lat[c->ops[c->head]], now - c->sent[c->head]);
+		c->head = (c->head + 1) % g_cfg.depth;
+		c->inflight--;
+		buf_consume(&c->rbuf, 4 + (size_t)len);
+	}
+}
+
+static bool thread_busy (Thread* t) {
+	for (Client* c: t->clients) {
+		if (c->inflight) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void run_phase (Thread* t, const Phase* ph, uint64_t budget) {
+	t->budget = budget;
+	for (Client* c: t->clients) {
+		fill_pipeline(t, c, ph);
+		flush_client(t, c);
+	}
+	const int k_max_events = 256;
+	ReactorEvent events[k_max_events];
+	while (thread_busy(t)) {
+		int n = reactor_wait(t->reactor, events, k_max_events, 1000);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			errmsg("reactor_wait");
+		}
+		for (int i = 0; i < n; ++i) {
+			Client* c = t->fd2client[(size_t)events[i].fd];
+			if (events[i].events & REACTOR_ERR) {
+				fprintf(stderr, "connection error\n");
+				exit(1);
+			}
+			if (events[i].events & REACTOR_READ) {
+				read_client(t, c);
+				fill_pipeline(t, c, ph);
+			}
+			flush_client(t, c);
+		}
+	}
+}
+
+static void thread_open (Thread* t, size_t conns, uint64_t seed) {
+	t->reactor = reactor_new();
+	if (!t->reactor) {
+		errmsg("reactor_new");
+	}
+	t->rng = seed * 0x9e3779b97f4a7c15ull + 1;
+	for (size_t i = 0; i < conns; ++i) {
+		Client* c = new Client();
+		c->fd = connect_one();
+		buf_init(&c->rbuf);
+		buf_init(&c->wbuf);
+		c->sent.resize(g_cfg.depth);
+		c->ops.resize(g_cfg.depth);
+		//both directions stay registered, edge-triggered wakeups are cheap
+		if (reactor_add(t->reactor, c->fd, REACTOR_READ | REACTOR_WRITE)) {
+			errmsg("reactor_add");
+		}
+		if (t->fd2client.size() <= (size_t)c->fd) {
+			t->fd2client.resize((size_t)c->fd + 1);
+		}
+		t->fd2client[(size_t)c->fd] = c;
+		t->clients.push_back(c);
+	}
+}
+
+static void thread_close (Thread* t) {
+	for (Client* c: t->clients) {
+		close(c->fd);
+		buf_release(&c->rbuf);
+		buf_release(&c->wbuf);
+		delete c;
+	}
+	reactor_free(t->reactor);
+}
+
+// run a phase on every thread, requests are split between them. returns
+// the wall time in seconds
+static double run_threads (std::vector<Thread*> &threads, const Phase* ph) {
+	std::vector<std::thread> running;
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < threads.size(); ++i) {
+		uint64_t budget = ph->requests / threads.size()
+			+ (i < ph->requests % threads.size() ? 1 : 0);
+		running.emplace_back(run_phase, threads[i], ph, budget);
+	}
+	for (std::thread &th: running) {
+		th.join();
+	}
+	return (now_ns() - start) / 1e9;
+}
+
+static void print_lat_text (const char* name, const Histogram* h, double secs) {
+	if (!h->total) {
+		return;
+	}
+	printf("%-6s %12lu %12.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+		(unsigned long)h->total, h->total / secs,
+		(double)h->sum / (double)h->total / 1e3,
+		hist_percentile(h, 50) / 1e3,
+		hist_percentile(h, 99) / 1e3,
+		hist_percentile(h, 99.9) / 1e3,
+		h->max / 1e3);
+}
+
+static void print_lat_json (const char* name, const Histogram* h, double secs, bool last) {
+	printf("\"%s\":{\"requests\":%lu,\"ops_per_sec\":%.1f,\"avg_us\":%.2f,"
+		"\"p50_us\":%.2f,\"p99_us\":%.2f,\"p99_9_us\":%.2f,\"max_us\":%.2f}%s",
+		name, (unsigned long)h->total, h->total / secs,
+		h->total ? (double)h->sum / (double)h->total / 1e3 : 0.0,
+		hist_percentile(h, 50) / 1e3,
+		hist_percentile(h, 99) / 1e3,
+		hist_percentile(h, 99.9) / 1e3,
+		h->max / 1e3, last ? "" : ",");
+}
+
+static void report (const Stats* s, double secs) {
+	Histogram all;
+	hist_merge(&all, &s->lat[OP_SET]);
+	hist_merge(&all, &s->lat[OP_GET]);
+	const char* dist = g_cfg.dist == DIST_ZIPF ? "zipf" : "uniform";
+	if (g_cfg.json) {
+		printf("{\"config\":{\"host\":\"%s\",\"port\":%u,\"conns\":%zu,\"threads\":%zu,"
+			"\"pipeline\":%zu,\"size\":%zu,\"keys\":%lu,\"dist\":\"%s\",\"theta\":%.3f,"
+			"\"ratio\":\"%u:%u\"},",
+			g_cfg.host.c_str(), (unsigned)g_cfg.port, g_cfg.conns, g_cfg.threads,
+			g_cfg.depth, g_cfg.size, (unsigned long)g_cfg.keys, dist, g_cfg.theta,
+			g_cfg.ratio_set, g_cfg.ratio_get);
+		printf("\"seconds\":%.3f,\"errors\":%lu,\"bytes_out\":%lu,\"bytes_in\":%lu,",
+			secs, (unsigned long)s->errors,
+			(unsigned long)s->bytes_out, (unsigned long)s->bytes_in);
+		print_lat_json("all", &all, secs, false);
+		print_lat_json("set", &s->lat[OP_SET], secs, false);
+		print_lat_json("get", &s->lat[OP_GET], secs, true);
+		printf("}\n");
+		return;
+	}
+	printf("%zu conns, %zu threads, pipeline %zu, %zu byte values, %lu %s keys, set:get %u:%u\n",
+		g_cfg.conns, g_cfg.threads, g_cfg.depth, g_cfg.size,
+		(unsigned long)g_cfg.keys, dist, g_cfg.ratio_set, g_cfg.ratio_get);
+	printf("%.2f s, %lu errors, %.1f MB/s out, %.1f MB/s in\n", secs,
+		(unsigned long)s->errors, s->bytes_out / secs / 1e6, s->bytes_in / secs / 1e6);
+	printf("%-6s %12s %12s %10s %10s %10s %10s %10s\n",
+		"op", "requests", "ops/s", "avg_us", "p50_us", "p99_us", "p99.9_us", "max_us");
+	print_lat_text("set", &s->lat[OP_SET], secs);
+	print_lat_text("get", &s->lat[OP_GET], secs);
+	print_lat_text("all", &all, secs);
+}
+
+static void usage (const char* prog) {
+	fprintf(stderr, "usage: %s [-h host] [-p port] [-c conns] [-t threads] [-P depth]\n"
+		"       [-n requests | -T seconds] [-d size] [-r keys] [--dist uniform|zipf]\n"
+		"       [--theta F] [--ratio set:get] [--prefill] [--json]\n", prog);
+	exit(1);
+}
+
+static void raise_fd_limit () {
+	struct rlimit rl = {};
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		(void)setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+int main (int argc, char* argv[]) {
+	setbuf(stdout, NULL);
+	raise_fd_limit();
+
+	for (int i = 1; i < argc; ++i) {
+		const char* opt = argv[i];
+		if (!strcmp(opt, "--prefill")) {
+			g_cfg.prefill = true;
+			continue;
+		}
+		if (!strcmp(opt, "--json")) {
+			g_cfg.json = true;
+			continue;
+		}
+		if (i + 1 >= argc) {
+			usage(argv[0]);
+		}
+		const char* val = argv[++i];
+		if (!strcmp(opt, "-h")) {
+			g_cfg.host = val;
+		} else if (!strcmp(opt, "-p")) {
+			g_cfg.port = (uint16_t)atoi(val);
+		} else if (!strcmp(opt, "-c")) {
+			g_cfg.conns = (size_t)atol(val);
+		} else if (!strcmp(opt, "-t")) {
+			g_cfg.threads = (size_t)atol(val);
+		} else if (!strcmp(opt, "-P")) {
+			g_cfg.depth = (size_t)atol(val);
+		} else if (!strcmp(opt, "-n")) {
+			g_cfg.requests = (uint64_t)atoll(val);
+		} else if (!strcmp(opt, "-T")) {
+			g_cfg.seconds = atof(val);
+		} else if (!strcmp(opt, "-d")) {
+			g_cfg.size = (size_t)atol(val);
+		} else if (!strcmp(opt, "-r")) {
+			g_cfg.keys = (uint64_t)atoll(val);
+		} else if (!strcmp(opt, "--dist")) {
+			if (!strcmp(val, "uniform")) {
+				g_cfg.dist = DIST_UNIFORM;
+			} else if (!strcmp(val, "zipf")) {
+				g_cfg.dist = DIST_ZIPF;
+			} else {
+				usage(argv[0]);
+			}
+		} else if (!strcmp(opt, "--theta")) {
+			g_cfg.theta = atof(val);
+		} else if (!strcmp(opt, "--ratio")) {
+			if (sscanf(val, "%u:%u", &g_cfg.ratio_set, &g_cfg.ratio_get) != 2) {
+				usage(argv[0]);
+			}
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (!g_cfg.conns || !g_cfg.threads || !g_cfg.depth || !g_cfg.keys
+		|| g_cfg.ratio_set + g_cfg.ratio_get == 0
+		|| !(g_cfg.theta > 0 && g_cfg.theta < 1))
+	{
+		usage(argv[0]);
+	}
+	if (g_cfg.threads > g_cfg.conns) {
+		g_cfg.threads = g_cfg.conns;
+	}
+	if (g_cfg.dist == DIST_ZIPF) {
+		zipf_init(&g_zipf, g_cfg.keys, g_cfg.theta);
+	}
+
+	std::vector<Thread*> threads;
+	for (size_t i = 0; i < g_cfg.threads; ++i) {
+		Thread* t = new Thread();
+		size_t conns = g_cfg.conns / g_cfg.threads + (i < g_cfg.conns % g_cfg.threads ? 1 : 0);
+		thread_open(t, conns, i + 1);
+		threads.push_back(t);
+	}
+
+	if (g_cfg.prefill) {
+		Phase fill;
+		fill.dist = DIST_SEQ;
+		fill.ratio_set = 1;
+		fill.ratio_get = 0;
+		fill.requests = g_cfg.keys;
+		double secs = run_threads(threads, &fill);
+		fprintf(stderr, "prefilled %lu keys in %.2f s\n", (unsigned long)g_cfg.keys, secs);
+		for (Thread* t: threads) {
+			t->stats = Stats{};
+		}
+	}
+
+	Phase ph;
+	ph.dist = g_cfg.dist;
+	ph.ratio_set = g_cfg.ratio_set;
+	ph.ratio_get = g_cfg.ratio_get;
+	ph.requests = g_cfg.requests;
+	if (g_cfg.seconds > 0) {
+		ph.deadline = now_ns() + (uint64_t)(g_cfg.seconds * 1e9);
+	}
+	double secs = run_threads(threads, &ph);
+
+	Stats total;
+	for (Thread* t: threads) {
+		hist_merge(&total.lat[OP_SET], &t->stats.lat[OP_SET]);
+		hist_merge(&total.lat[OP_GET], &t->stats.lat[OP_GET]);
+		total.errors += t->stats.errors;
+		total.bytes_out += t->stats.bytes_out;
+		total.bytes_in += t->stats.bytes_in;
+		thread_close(t);
+		delete t;
+	}
+	report(&total, secs);
+	return 0;
+}
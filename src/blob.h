@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "slab.h"
+
+// immutable, reference-counted byte string for stored values. a reply can
+// point at the value while it waits in an output queue, so the key may be
+// overwritten or deleted meanwhile without copying the value out first.
+// the count is atomic since replies are sent by other worker threads.
+
+struct Blob {
+	uint32_t refs;
+	uint32_t len;
+	char data[];
+};
+
+inline Blob* blob_new (const void* p, size_t len) {
+	Blob* b = (Blob*)slab_alloc(sizeof(Blob) + len);
+	b->refs = 1;
+	b->len = (uint32_t)len;
+	memcpy(b->data, p, len);
+	return b;
+}
+
+inline Blob* blob_ref (Blob* b) {
+	__atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+	return b;
+}
+
+inline void blob_unref (Blob* b) {
+	if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		slab_free(b, sizeof(Blob) + b->len);
+	}
+}
@@ -0,0 +1,71 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+
+const size_t k_buf_min = 512;
+
+void buf_init (Buffer* b) {
+	b->data = NULL;
+	b->cap = 0;
+	b->begin = 0;
+	b->end = 0;
+}
+
+void buf_release (Buffer* b) {
+	free(b->data);
+	buf_init(b);
+}
+
+void buf_trim (Buffer* b, size_t keep) {
+	if (b->begin == b->end && b->cap > keep) {
+		buf_release(b);
+	}
+}
+
+void buf_reserve (Buffer* b, size_t n) {
+	if (buf_avail(b) >= n) {
+		return;
+	}
+	size_t size = buf_size(b);
+	//reuse the consumed prefix when that is enough, this only happens
+	//when a partial request is left at the end of a full buffer
+	if (b->cap - size >= n && b->begin >= b->cap / 2) {
+		memmove(b->data, buf_head(b), size);
+		b->begin = 0;
+		b->end = size;
+		return;
+	}
+
+	size_t cap = b->cap ? b->cap : k_buf_min;
+	while (cap - size < n) {
+		cap *= 2;
+	}
+	uint8_t* data = (uint8_t*)malloc(cap);
+	if (!data) {
+		abort();
+	}
+	if (size) {
+		memcpy(data, buf_head(b), size);
+	}
+	free(b->data);
+	b->data = data;
+	b->cap = cap;
+	b->begin = 0;
+	b->end = size;
+}
+
+void buf_append (Buffer* b, const void* p, size_t n) {
+	buf_reserve(b, n);
+	memcpy(buf_tail(b), p, n);
+	b->end += n;
+}
+
+void buf_consume (Buffer* b, size_t n) {
+	assert(n <= buf_size(b));
+	b->begin += n;
+	if (b->begin == b->end) {
+		b->begin = 0;
+		b->end = 0;
+	}
+}
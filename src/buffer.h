@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// growable byte buffer for connection I/O.
+// data between begin and end is pending. consuming only advances begin, and
+// the offsets are reset once everything is consumed, so a pipeline of
+// requests is parsed without moving bytes around. the storage starts empty,
+// doubles as needed and is handed back with buf_release(), or with
+// buf_trim() once drained if it grew past what is worth keeping.
+struct Buffer {
+	uint8_t* data;
+	size_t cap;
+	size_t begin; //first pending byte
+	size_t end; //one past the last pending byte
+};
+
+void buf_init (Buffer* b);
+void buf_release (Buffer* b);
+// release the storage of an empty buffer above keep bytes, a smaller one
+// is kept for the next request
+void buf_trim (Buffer* b, size_t keep);
+
+// make room for at least n more bytes after end
+void buf_reserve (Buffer* b, size_t n);
+void buf_append (Buffer* b, const void* p, size_t n);
+void buf_consume (Buffer* b, size_t n);
+
+inline size_t buf_size (const Buffer* b) {
+	return b->end - b->begin;
+}
+
+inline uint8_t* buf_head (Buffer* b) {
+	return b->data + b->begin;
+}
+
+inline uint8_t* buf_tail (Buffer* b) {
+	return b->data + b->end;
+}
+
+inline size_t buf_avail (const Buffer* b) {
+	return b->cap - b->end;
+}
+
+// mark n bytes written at buf_tail() as pending
+inline void buf_commit (Buffer* b, size_t n) {
+	b->end += n;
+}
+
+// drop the pending bytes past the first n
+inline void buf_truncate (Buffer* b, size_t n) {
+	b->end = b->begin + n;
+}
@@ -1,213 +1,138 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netinet/ip.h>
 #include <string.h>
-#include <errno.h>
-#include <unistd.h>
-#include <signal.h>
-#include <assert.h>
-const size_t k_max_msg = 4096;
+#include <time.h>
+#include <string>
+#include <vector>
+#include "cluster_client.h"
 
 static void msg (const char* msg) {
 	fprintf(stderr, "%s\n", msg);
 }
 
-static void errmsg (const char* msg) {
-	fprintf(stderr, "[%d] %s ... %s\n", errno, strerror(errno) ,msg);
-}
-
-static int32_t read_full (int fd, char* buf, size_t n) {
-    while (n > 0) {
-		ssize_t rv = read(fd, buf, n);
-		if (rv <= 0) {
-			return -1;
+static void print_reply (const Reply &r) {
+	switch (r.type) {
+	case SER_NIL:
+		printf("(nil)\n");
+		break;
+	case SER_ERR:
+		printf("(err) %d %s\n", r.code, r.str.c_str());
+		break;
+	case SER_STR:
+		printf("(str) %s\n", r.str.c_str());
+		break;
+	case SER_INT:
+		printf("(int) %ld\n", (long)r.num);
+		break;
+	case SER_DBL:
+		printf("(dbl) %g\n", r.dbl);
+		break;
+	case SER_ARR:
+		printf("(arr) len=%zu\n", r.elems.size());
+		for (const Reply &e: r.elems) {
+			print_reply(e);
 		}
-		assert((size_t)rv <= n);
-		n -= (size_t)rv;
-		buf += rv;
+		printf("(arr) end\n");
+		break;
 	}
-	return 0;
 }
 
-static int32_t write_all (int fd, const char* buf, size_t n) {
-	while (n > 0) {
-		ssize_t rv = write(fd, buf, n);
-		if (rv <= 0) {
-			return -1;
+static double now_sec () {
+	struct timespec tv = {0, 0};
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	return (double)tv.tv_sec + (double)tv.tv_nsec / 1e9;
+}
+
+// sets n keys, reads them back and deletes them, in pipelined batches
+// spread over the cluster, and checks every reply
+static int check_keys (ClusterClient* cc, int n) {
+	const int k_batch = 1000;
+	const char* const k_steps[] = {"set", "get", "del"};
+	std::vector<Reply> replies;
+	for (const char* step: k_steps) {
+		double start = now_sec();
+		int bad = 0;
+		for (int base = 0; base < n; base += k_batch) {
+			int end = base + k_batch < n ? base + k_batch : n;
+			for (int i = base; i < end; ++i) {
+				std::string key = "key:" + std::to_string(i);
+				if (!strcmp(step, "set")) {
+					cc_queue(cc, {"set", key, "val:" + std::to_string(i)});
+				} else {
+					cc_queue(cc, {step, key});
+				}
+			}
+			if (cc_exec(cc, &replies) < 0) {
+				msg("cluster request failed");
+				return 1;
+			}
+			for (int i = base; i < end; ++i) {
+				const Reply &r = replies[i - base];
+				bool ok = !strcmp(step, "set") ? r.type == SER_NIL
+					: !strcmp(step, "get") ? r.type == SER_STR && r.str == "val:" + std::to_string(i)
+					: r.type == SER_INT && r.num == 1;
+				bad += ok ? 0 : 1;
+			}
+		}
+		printf("%-3s %d keys: %.0f ops/s, %d bad replies\n", step, n, n / (now_sec() - start), bad);
+		if (bad) {
+			return 1;
+		}
+	}
+	printf("redirects %llu, asks %llu, retries %llu, slot map fetches %llu\n", (unsigned long long)cc->redirects,
+		(unsigned long long)cc->asks, (unsigned long long)cc->retries, (unsigned long long)cc->refreshes);
+	for (size_t i = 0; i < cc->map.nodes.size(); ++i) {
+		uint32_t slots = 0;
+		for (uint16_t owner: cc->map.owner) {
+			slots += owner == i ? 1 : 0;
 		}
-		assert((size_t)rv <= n);
-		n -= (size_t)rv;
-		buf += rv;
+		printf("  %s:%d  %u slots, %llu commands\n", cc->map.nodes[i].host.c_str(), cc->map.nodes[i].port,
+			slots, (unsigned long long)(i < cc->conns.size() ? cc->conns[i].sent : 0));
 	}
 	return 0;
 }
 
-static int32_t send_req (int fd, const char* text) {
-    uint32_t len = (uint32_t)strlen(text);
-    if (len > k_max_msg) {
-        return -1;
-    }
-    // write
-    char wbuf[4+k_max_msg];
-    memcpy(wbuf, &len, 4);
-    memcpy(&wbuf[4], text, len);
-    int32_t err = write_all(fd, wbuf, 4 + len);
-    if (err) {
-        return err;
-    }
-    return 0;
-}
-
-static int32_t read_res (int fd) {
-    //read
-    //4 bytes header
-    char rbuf[4+k_max_msg+1];
-    errno = 0;
-    int32_t err = read_full(fd, rbuf, 4);
-    if (err) {
-        if (errno == 0) {
-            msg("EOF");
-        } else {
-            msg("read() error");
-        }
-        return err;
-    }    
-    uint32_t len = 0;
-	memcpy(&len, rbuf, 4); //assuming little endian
-	if (len > k_max_msg) {
-		msg("too long");
-		return -1;
+// ./client1 [-n N] [host port]. with -n, checks N keys spread over the
+// cluster
+int main (int argc, char* argv[]) {
+	setbuf(stdout, NULL);
+	const char* host = "127.0.0.1";
+	int port = 6379;
+	int n = 0;
+	int pos = 1;
+	if (pos + 1 < argc && !strcmp(argv[pos], "-n")) {
+		n = atoi(argv[pos + 1]);
+		pos += 2;
 	}
-
-    //reply body
-    err = read_full(fd, &rbuf[4], len);
-	if (err) {
-		msg("read() error");
-		return err;
+	if (pos + 1 < argc) {
+		host = argv[pos];
+		port = atoi(argv[pos + 1]);
 	}
-
-    //do something
-	rbuf[4 + len] = '\0';
-	printf("Server says: %s\n", &rbuf[4]);
-    return 0;
-}
-
-static int32_t query (int fd, const char* text) {
-    uint32_t len = (uint32_t)strlen(text);
-    if (len > k_max_msg) {
-        return -1;
-    }
-    // write
-    char wbuf[4+k_max_msg];
-    memcpy(wbuf, &len, 4);
-    memcpy(&wbuf[4], text, len);
-    // int header;
-    // memcpy(&header, wbuf, 4);
-    // printf("header %d\n", header);
-    int32_t err = write_all(fd, wbuf, 4 + len);
-    if (err) {
-        return err;
-    }
-
-    //read
-    //4 bytes header
-    char rbuf[4+k_max_msg+1];
-    errno = 0;
-    err = read_full(fd, rbuf, 4);
-    if (err) {
-        if (errno == 0) {
-            msg("EOF");
-        } else {
-            msg("read() error");
-        }
-        return err;
-    }    
-
-	memcpy(&len, rbuf, 4); //assuming little endian
-	if (len > k_max_msg) {
-		msg("too long");
-		return -1;
+	ClusterClient* cc = cc_new(host, port);
+	if (!cc) {
+		msg("Unable to connect to server");
+		return 1;
 	}
-
-    //reply body
-    err = read_full(fd, &rbuf[4], len);
-	if (err) {
-		msg("read() error");
-		return err;
+	printf("Connected to server, %s, %zu node(s). \n", cc->cluster ? "cluster" : "standalone",
+		cc->map.nodes.size());
+	if (n > 0) {
+		int rv = check_keys(cc, n);
+		cc_free(cc);
+		return rv;
 	}
 
-    //do something
-	rbuf[4 + len] = '\0';
-	printf("Server says: %s\n", &rbuf[4]);
-    return 0;
-}
-
-int talk (int connfd) {
-    char write_buffer[] = "+PING\r\n";
-	write(connfd, write_buffer, strlen(write_buffer));
-	char read_buffer[32] = {};
-	if(read(connfd, read_buffer, sizeof(read_buffer)-1) < 0) {
-        errmsg("read error");
-		return -1;
+	const std::vector<std::string> messages[3] = {{"set", "greeting", "hello my baby"}, {"get", "greeting"}, {"del", "greeting"}};
+	for (size_t i = 0; i < 3; ++i) {
+		cc_queue(cc, messages[i]);
+	}
+	std::vector<Reply> replies;
+	if (cc_exec(cc, &replies) == 0) {
+		for (const Reply &r: replies) {
+			printf("Server says: ");
+			print_reply(r);
+		}
 	}
-	printf("Server says: %s \n", read_buffer);
-    return 0;
+	cc_free(cc);
+	return 0;
 }
-
-int main() {
-    setbuf(stdout, NULL);
-    int client_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_fd == -1) {
-        //printf("Socket creation failed: %s...\n", strerror(errno));
-        errmsg("Socket creation failed");
-		return 1;
-    }
-
-	struct sockaddr_in serv_addr = { .sin_family = AF_INET ,
-									 .sin_port = htons(6379),
-									 .sin_addr = { htonl(INADDR_ANY) },
-									};
-    
-    int rv = connect(client_fd, (const struct sockaddr *) &serv_addr, sizeof(serv_addr));
-    if (rv) {
-        //printf("Unable to connect to server: %d %s...\n", errno, strerror(errno));
-        errmsg("Unable to connect to server");
-        return 1;
-    }
-    printf("Connected to server. \n");
-
-    //talk(client_fd);
-    // int32_t err = query(client_fd, "hello1");
-    // if (err) {
-    //     goto L_DONE;
-    // }
-    // err = query(client_fd, "hello2");
-    // if (err) {
-    //     goto L_DONE;
-    // }
-    // err = query(client_fd, "hello3");
-    // if (err) {
-    //     goto L_DONE;
-    // }
-
-    const char* messages[3] = {"hello my baby", "hello my honey", "hello my ragtime gal"};
-    for (size_t i = 0; i < 3; ++i) {
-        int32_t err = send_req(client_fd, messages[i]);
-        if (err) {
-            goto L_DONE;
-        }
-    }
-    for (int i = 0; i < 3; ++i) {
-        int32_t err = read_res(client_fd);
-        if (err) {
-            goto L_DONE;
-        }
-    }
-
-L_DONE:
-    close(client_fd);
-    return 0;
-}
\ No newline at end of file
@@ -9,6 +9,10 @@
 #include <unistd.h>
 #include <signal.h>
 #include <assert.h>
+#include <string>
+#include <vector>
+#include "protocol.h"
+
 const size_t k_max_msg = 4096;
 
 static void msg (const char* msg) {
@@ -45,15 +49,27 @@ static int32_t write_all (int fd, const char* buf, size_t n) {
 	return 0;
 }
 
-static int32_t send_req (int fd, const char* text) {
-    uint32_t len = (uint32_t)strlen(text);
+// request body: nstr(4) + nstr x (len(4) + bytes)
+static int32_t send_req (int fd, const std::vector<std::string> &cmd) {
+    uint32_t len = 4;
+    for (const std::string &s: cmd) {
+        len += 4 + (uint32_t)s.size();
+    }
     if (len > k_max_msg) {
         return -1;
     }
     // write
     char wbuf[4+k_max_msg];
     memcpy(wbuf, &len, 4);
-    memcpy(&wbuf[4], text, len);
+    uint32_t n = (uint32_t)cmd.size();
+    memcpy(&wbuf[4], &n, 4);
+    size_t cur = 8;
+    for (const std::string &s: cmd) {
+        uint32_t sz = (uint32_t)s.size();
+        memcpy(&wbuf[cur], &sz, 4);
+        memcpy(&wbuf[cur + 4], s.data(), s.size());
+        cur += 4 + s.size();
+    }
     int32_t err = write_all(fd, wbuf, 4 + len);
     if (err) {
         return err;
@@ -61,6 +77,91 @@ static int32_t send_req (int fd, const char* text) {
     return 0;
 }
 
+// print one serialized value, returns the bytes consumed or -1
+static int32_t print_response (const uint8_t* data, size_t size) {
+    if (size < 1) {
+        msg("bad response");
+        return -1;
+    }
+    switch (data[0]) {
+    case SER_NIL:
+        printf("(nil)\n");
+        return 1;
+    case SER_ERR: {
+        if (size < 1 + 8) {
+            msg("bad response");
+            return -1;
+        }
+        int32_t code = 0;
+        uint32_t len = 0;
+        memcpy(&code, &data[1], 4);
+        memcpy(&len, &data[1 + 4], 4);
+        if (size < 1 + 8 + len) {
+            msg("bad response");
+            return -1;
+        }
+        printf("(err) %d %.*s\n", code, len, &data[1 + 8]);
+        return 1 + 8 + len;
+    }
+    case SER_STR: {
+        if (size < 1 + 4) {
+            msg("bad response");
+            return -1;
+        }
+        uint32_t len = 0;
+        memcpy(&len, &data[1], 4);
+        if (size < 1 + 4 + len) {
+            msg("bad response");
+            return -1;
+        }
+        printf("(str) %.*s\n", len, &data[1 + 4]);
+        return 1 + 4 + len;
+    }
+    case SER_INT: {
+        if (size < 1 + 8) {
+            msg("bad response");
+            return -1;
+        }
+        int64_t val = 0;
+        memcpy(&val, &data[1], 8);
+        printf("(int) %ld\n", (long)val);
+        return 1 + 8;
+    }
+    case SER_DBL: {
+        if (size < 1 + 8) {
+            msg("bad response");
+            return -1;
+        }
+        double val = 0;
+        memcpy(&val, &data[1], 8);
+        printf("(dbl) %g\n", val);
+        return 1 + 8;
+    }
+    case SER_ARR: {
+        if (size < 1 + 4) {
+            msg("bad response");
+            return -1;
+        }
+        uint32_t len = 0;
+        memcpy(&len, &data[1], 4);
+        printf("(arr) len=%u\n", len);
+        size_t arr_bytes = 1 + 4;
+        for (uint32_t i = 0; i < len; ++i) {
+            int32_t rv = print_response(&data[arr_bytes], size - arr_bytes);
+            if (rv < 0) {
+                return rv;
+            }
+            arr_bytes += (size_t)rv;
+        }
+        printf("(arr) end\n");
+        return (int32_t)arr_bytes;
+    }
+    default:
+        msg("bad response");
+        return -1;
+    }
+}
+
 static int32_t read_res (int fd) {
     //read
     //4 bytes header
@@ -90,59 +191,21 @@ static int32_t read_res (int fd) {
 	}
 
     //do something
-	rbuf[4 + len] = '\0';
-	printf("Server says: %s\n", &rbuf[4]);
-    return 0;
+	printf("Server says: ");
+    int32_t rv = print_response((uint8_t*)&rbuf[4], len);
+    if (rv > 0 && (uint32_t)rv != len) {
+        msg("bad response");
+        rv = -1;
+    }
+    return rv < 0 ? rv : 0;
 }
 
-static int32_t query (int fd, const char* text) {
-    uint32_t len = (uint32_t)strlen(text);
-    if (len > k_max_msg) {
-        return -1;
-    }
-    // write
-    char wbuf[4+k_max_msg];
-    memcpy(wbuf, &len, 4);
-    memcpy(&wbuf[4], text, len);
-    // int header;
-    // memcpy(&header, wbuf, 4);
-    // printf("header %d\n", header);
-    int32_t err = write_all(fd, wbuf, 4 + len);
+static int32_t query (int fd, const std::vector<std::string> &cmd) {
+    int32_t err = send_req(fd, cmd);
     if (err) {
         return err;
     }
-
-    //read
-    //4 bytes header
-    char rbuf[4+k_max_msg+1];
-    errno = 0;
-    err = read_full(fd, rbuf, 4);
-    if (err) {
-        if (errno == 0) {
-            msg("EOF");
-        } else {
-            msg("read() error");
-        }
-        return err;
-    }    
-
-	memcpy(&len, rbuf, 4); //assuming little endian
-	if (len > k_max_msg) {
-		msg("too long");
-		return -1;
-	}
-
-    //reply body
-    err = read_full(fd, &rbuf[4], len);
-	if (err) {
-		msg("read() error");
-		return err;
-	}
-
-    //do something
-	rbuf[4 + len] = '\0';
-	printf("Server says: %s\n", &rbuf[4]);
-    return 0;
+    return read_res(fd);
 }
 
 int talk (int connfd) {
@@ -193,7 +256,7 @@ int main() {
     //     goto L_DONE;
     // }
 
-    const char* messages[3] = {"hello1", "hello2", "hello3"};
+    const std::vector<std::string> messages[3] = {{"mset", "hello1", "a", "hello2", "b"}, {"mget", "hello1", "hello2", "hello3"}, {"del", "hello1", "hello2"}};
     for (size_t i = 0; i < 3; ++i) {
         int32_t err = send_req(client_fd, messages[i]);
         if (err) {
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cluster.h"
+
+static uint16_t g_table[256];
+
+static bool init_table () {
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint16_t c = (uint16_t)(i << 8);
+		for (int k = 0; k < 8; ++k) {
+			c = (uint16_t)((c << 1) ^ ((c & 0x8000) ? 0x1021 : 0));
+		}
+		g_table[i] = c;
+	}
+	return true;
+}
+
+uint16_t crc16 (const void* data, size_t len) {
+	//built on the first call, thread-safe as a function-local static
+	static const bool ready = init_table();
+	(void)ready;
+	const uint8_t* p = (const uint8_t*)data;
+	uint16_t crc = 0;
+	while (len--) {
+		crc = (uint16_t)((crc << 8) ^ g_table[((crc >> 8) ^ *p++) & 0xff]);
+	}
+	return crc;
+}
+
+uint32_t key_slot (const char* key, size_t len) {
+	const char* open = (const char*)memchr(key, '{', len);
+	if (open) {
+		size_t from = (size_t)(open - key) + 1;
+		const char* close = (const char*)memchr(key + from, '}', len - from);
+		if (close && close > key + from) {
+			return crc16(key + from, (size_t)(close - key) - from) & (k_slots - 1);
+		}
+	}
+	return crc16(key, len) & (k_slots - 1);
+}
+
+uint16_t slot_map_node (SlotMap* map, const std::string &host, int port) {
+	for (size_t i = 0; i < map->nodes.size(); ++i) {
+		if (map->nodes[i].host == host && map->nodes[i].port == port) {
+			return (uint16_t)i;
+		}
+	}
+	map->nodes.push_back(ClusterNode{host, port});
+	return (uint16_t)(map->nodes.size() - 1);
+}
+
+bool slot_range_parse (const char* s, uint32_t* first, uint32_t* last) {
+	char* end = NULL;
+	unsigned long a = strtoul(s, &end, 10);
+	unsigned long b = a;
+	if (end == s) {
+		return false;
+	}
+	if (*end == '-') {
+		const char* from = end + 1;
+		b = strtoul(from, &end, 10);
+		if (end == from) {
+			return false;
+		}
+	}
+	if (*end || a > b || b >= k_slots) {
+		return false;
+	}
+	*first = (uint32_t)a;
+	*last = (uint32_t)b;
+	return true;
+}
+
+bool slot_map_parse (const std::string &text, SlotMap* map, std::string* err) {
+	size_t pos = 0;
+	int lineno = 0;
+	while (pos < text.size()) {
+		size_t eol = text.find('\n', pos);
+		eol = eol == std::string::npos ? text.size() : eol;
+		std::string line = text.substr(pos, eol - pos);
+		pos = eol + 1;
+		lineno++;
+		std::vector<std::string> words;
+		size_t i = 0;
+		while (i < line.size()) {
+			size_t j = line.find_first_of(" \t\r", i);
+			j = j == std::string::npos ? line.size() : j;
+			if (j > i) {
+				words.push_back(line.substr(i, j - i));
+			}
+			i = j + 1;
+		}
+		if (words.empty() || words[0][0] == '#') {
+			continue;
+		}
+		int port = atoi(words[1 < words.size() ? 1 : 0].c_str());
+		if (words.size() < 2 || port <= 0 || port > 65535) {
+			*err = "line " + std::to_string(lineno) + ": expected host port range...";
+			return false;
+		}
+		uint16_t node = slot_map_node(map, words[0], port);
+		for (size_t k = 2; k < words.size(); ++k) {
+			uint32_t first = 0;
+			uint32_t last = 0;
+			if (!slot_range_parse(words[k].c_str(), &first, &last)) {
+				*err = "line " + std::to_string(lineno) + ": bad slot range " + words[k];
+				return false;
+			}
+			for (uint32_t s = first; s <= last; ++s) {
+				if (map->owner[s] != k_no_node) {
+					*err = "line " + std::to_string(lineno) + ": slot " + std::to_string(s) + " given twice";
+					return false;
+				}
+				map->owner[s] = node;
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// hash slots: every key belongs to one of k_slots slots, CRC16 (XMODEM) of
+// the key modulo 16384 as in Redis Cluster, and each node of a cluster
+// serves some of the slots. a key holding a non-empty {tag} is hashed on
+// the tag alone, so keys sharing a tag share a slot and can be used in
+// one multi-key command
+
+const uint32_t k_slots = 16384;
+//owner of a slot no node serves
+const uint16_t k_no_node = 0xffff;
+
+uint16_t crc16 (const void* data, size_t len);
+uint32_t key_slot (const char* key, size_t len);
+
+struct ClusterNode {
+	std::string host;
+	int port = 0;
+};
+
+// which node serves each slot
+struct SlotMap {
+	std::vector<ClusterNode> nodes;
+	std::vector<uint16_t> owner = std::vector<uint16_t>(k_slots, k_no_node);
+};
+
+// the index of the node at host:port, added if it is new
+uint16_t slot_map_node (SlotMap* map, const std::string &host, int port);
+
+// "first-last" or a single slot
+bool slot_range_parse (const char* s, uint32_t* first, uint32_t* last);
+
+// a cluster layout, one node per line: "host port range...", where a
+// range is a slot or first-last. blank lines and lines starting with #
+// are skipped. returns false with *err set if a line is bad or a slot is
+// given twice
+bool slot_map_parse (const std::string &text, SlotMap* map, std::string* err);
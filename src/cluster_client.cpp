@@ -0,0 +1,467 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "cluster_client.h"
+
+const size_t k_max_msg = 32 << 20;
+//a command redirected this many times in one cc_exec() is given up on,
+//and one told to try again this many times
+const int k_max_redirects = 5;
+const int k_max_retries = 200;
+const int k_retry_us = 1000;
+//in CcConn::waiting, a reply no command waits for, the one to ASKING
+const size_t k_no_cmd = (size_t)-1;
+
+static void msg (const char* msg) {
+	fprintf(stderr, "%s\n", msg);
+}
+
+static int conn_open (const std::string &host, int port) {
+	struct addrinfo hints = {};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo* res = NULL;
+	std::string service = std::to_string(port);
+	if (getaddrinfo(host.c_str(), service.c_str(), &hints, &res) != 0) {
+		return -1;
+	}
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	return fd;
+}
+
+static void conn_close (CcConn* c) {
+	if (c->fd >= 0) {
+		close(c->fd);
+	}
+	c->fd = -1;
+	c->out.clear();
+	c->out_pos = 0;
+	c->in.clear();
+	c->in_pos = 0;
+	c->waiting.clear();
+	c->answered = 0;
+}
+
+// request body: nstr(4) + nstr x (len(4) + bytes)
+static int32_t encode_req (std::string* out, const std::vector<std::string> &cmd) {
+	size_t len = 4;
+	for (const std::string &s: cmd) {
+		len += 4 + s.size();
+	}
+	if (len > k_max_msg) {
+		return -1;
+	}
+	uint32_t head[2] = {(uint32_t)len, (uint32_t)cmd.size()};
+	out->append((const char*)head, 8);
+	for (const std::string &s: cmd) {
+		uint32_t sz = (uint32_t)s.size();
+		out->append((const char*)&sz, 4);
+		out->append(s);
+	}
+	return 0;
+}
+
+// one serialized value, returns the bytes consumed or -1
+static int32_t parse_reply (const uint8_t* data, size_t size, Reply* out) {
+	if (size < 1) {
+		return -1;
+	}
+	out->type = data[0];
+	switch (data[0]) {
+	case SER_NIL:
+		return 1;
+	case SER_ERR: {
+		uint32_t len = 0;
+		if (size < 1 + 8) {
+			return -1;
+		}
+		memcpy(&out->code, &data[1], 4);
+		memcpy(&len, &data[1 + 4], 4);
+		if (size < 1 + 8 + (size_t)len) {
+			return -1;
+		}
+		out->str.assign((const char*)&data[1 + 8], len);
+		return 1 + 8 + (int32_t)len;
+	}
+	case SER_STR: {
+		uint32_t len = 0;
+		if (size < 1 + 4) {
+			return -1;
+		}
+		memcpy(&len, &data[1], 4);
+		if (size < 1 + 4 + (size_t)len) {
+			return -1;
+		}
+		out->str.assign((const char*)&data[1 + 4], len);
+		return 1 + 4 + (int32_t)len;
+	}
+	case SER_INT:
+	case SER_DBL:
+		if (size < 1 + 8) {
+			return -1;
+		}
+		memcpy(data[0] == SER_INT ? (void*)&out->num : (void*)&out->dbl, &data[1], 8);
+		return 1 + 8;
+	case SER_ARR: {
+		uint32_t n = 0;
+		if (size < 1 + 4) {
+			return -1;
+		}
+		memcpy(&n, &data[1], 4);
+		size_t pos = 1 + 4;
+		//every element takes a byte at least
+		if (n > size - pos) {
+			return -1;
+		}
+		out->elems.resize(n);
+		for (uint32_t i = 0; i < n; ++i) {
+			int32_t rv = parse_reply(&data[pos], size - pos, &out->elems[i]);
+			if (rv < 0) {
+				return -1;
+			}
+			pos += (size_t)rv;
+		}
+		return (int32_t)pos;
+	}
+	default:
+		return -1;
+	}
+}
+
+// replies framed as len(4) + value, handed out in the order of waiting
+static int32_t conn_parse (CcConn* c, std::vector<Reply>* replies) {
+	while (c->in.size() - c->in_pos >= 4) {
+		uint32_t len = 0;
+		memcpy(&len, &c->in[c->in_pos], 4);
+		if (len > k_max_msg) {
+			msg("reply too long");
+			return -1;
+		}
+		if (c->in.size() - c->in_pos < 4 + (size_t)len) {
+			break;
+		}
+		if (c->answered == c->waiting.size()) {
+			msg("unexpected reply");
+			return -1;
+		}
+		size_t idx = c->waiting[c->answered++];
+		Reply ignored;
+		Reply* r = idx == k_no_cmd ? &ignored : &(*replies)[idx];
+		*r = Reply();
+		const uint8_t* body = (const uint8_t*)&c->in[c->in_pos + 4];
+		if (parse_reply(body, len, r) != (int32_t)len) {
+			msg("bad reply");
+			return -1;
+		}
+		c->in_pos += 4 + len;
+	}
+	if (c->in_pos == c->in.size()) {
+		c->in.clear();
+		c->in_pos = 0;
+	} else if (c->in_pos > c->in.size() / 2) {
+		c->in.erase(0, c->in_pos);
+		c->in_pos = 0;
+	}
+	return 0;
+}
+
+// sends every node its batch and reads all the replies, with the nodes
+// written and read at once so no node waits for another
+static int32_t run_batches (ClusterClient* cc, std::vector<Reply>* replies) {
+	std::vector<struct pollfd> pfds;
+	std::vector<CcConn*> busy;
+	while (true) {
+		pfds.clear();
+		busy.clear();
+		for (CcConn &c: cc->conns) {
+			bool sending = c.out_pos < c.out.size();
+			if (sending || c.answered < c.waiting.size()) {
+				pfds.push_back({c.fd, (short)(POLLIN | (sending ? POLLOUT : 0)), 0});
+				busy.push_back(&c);
+			}
+		}
+		if (busy.empty()) {
+			break;
+		}
+		if (poll(pfds.data(), pfds.size(), -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		for (size_t i = 0; i < busy.size(); ++i) {
+			CcConn* c = busy[i];
+			if (pfds[i].revents & POLLOUT) {
+				ssize_t rv = write(c->fd, c->out.data() + c->out_pos, c->out.size() - c->out_pos);
+				if (rv < 0 && errno != EAGAIN && errno != EINTR) {
+					return -1;
+				}
+				c->out_pos += rv > 0 ? (size_t)rv : 0;
+				if (c->out_pos == c->out.size()) {
+					c->out.clear();
+					c->out_pos = 0;
+				}
+			}
+			if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+				char chunk[64 << 10];
+				ssize_t rv = read(c->fd, chunk, sizeof(chunk));
+				if (rv == 0 || (rv < 0 && errno != EAGAIN && errno != EINTR)) {
+					msg(rv == 0 ? "EOF" : "read() error");
+					return -1;
+				}
+				if (rv > 0) {
+					c->in.append(chunk, (size_t)rv);
+					if (conn_parse(c, replies) < 0) {
+						return -1;
+					}
+				}
+			}
+		}
+	}
+	for (CcConn &c: cc->conns) {
+		c.waiting.clear();
+		c.answered = 0;
+	}
+	return 0;
+}
+
+static int32_t conn_ready (ClusterClient* cc, uint16_t node) {
+	if (cc->conns.size() < cc->map.nodes.size()) {
+		cc->conns.resize(cc->map.nodes.size());
+	}
+	CcConn* c = &cc->conns[node];
+	if (c->fd < 0) {
+		c->fd = conn_open(cc->map.nodes[node].host, cc->map.nodes[node].port);
+	}
+	return c->fd < 0 ? -1 : 0;
+}
+
+static int32_t conn_send (ClusterClient* cc, uint16_t node, size_t idx, bool asking) {
+	if (conn_ready(cc, node) < 0) {
+		return -1;
+	}
+	CcConn* c = &cc->conns[node];
+	if (asking) {
+		encode_req(&c->out, {"asking"});
+		c->waiting.push_back(k_no_cmd);
+	}
+	if (encode_req(&c->out, cc->queue[idx]) < 0) {
+		msg("request too long");
+		return -1;
+	}
+	c->waiting.push_back(idx);
+	c->sent++;
+	return 0;
+}
+
+// the node that should get a command: the owner of its first key's slot,
+// any node for a command without keys or a slot nobody serves
+static uint16_t cmd_node (ClusterClient* cc, const std::vector<std::string> &cmd) {
+	if (cmd.size() >= 2) {
+		uint16_t owner = cc->map.owner[key_slot(cmd[1].data(), cmd[1].size())];
+		if (owner != k_no_node) {
+			return owner;
+		}
+	}
+	for (size_t i = 0; i < cc->conns.size(); ++i) {
+		if (cc->conns[i].fd >= 0) {
+			return (uint16_t)i;
+		}
+	}
+	return 0;
+}
+
+// "slot host:port", the text of a MOVED or ASK error
+static bool parse_moved (const std::string &text, uint32_t* slot, std::string* host, int* port) {
+	size_t sp = text.find(' ');
+	size_t colon = text.rfind(':');
+	if (sp == std::string::npos || colon == std::string::npos || colon < sp) {
+		return false;
+	}
+	*slot = (uint32_t)strtoul(text.c_str(), NULL, 10);
+	*host = text.substr(sp + 1, colon - sp - 1);
+	*port = atoi(text.c_str() + colon + 1);
+	return *slot < k_slots && *port > 0;
+}
+
+int32_t cc_exec (ClusterClient* cc, std::vector<Reply>* replies) {
+	replies->assign(cc->queue.size(), Reply());
+	std::vector<size_t> todo(cc->queue.size());
+	for (size_t i = 0; i < todo.size(); ++i) {
+		todo[i] = i;
+	}
+	//the node an ASK sent a command to, for its next round only
+	std::vector<uint16_t> ask(cc->queue.size(), k_no_node);
+	bool moved = false;
+	int32_t err = 0;
+	int redirects = 0;
+	int retries = 0;
+	while (!todo.empty()) {
+		for (size_t idx: todo) {
+			uint16_t node = ask[idx] != k_no_node ? ask[idx] : cmd_node(cc, cc->queue[idx]);
+			err = err ? err : conn_send(cc, node, idx, ask[idx] != k_no_node);
+			ask[idx] = k_no_node;
+		}
+		err = err ? err : run_batches(cc, replies);
+		if (err) {
+			break;
+		}
+		std::vector<size_t> again;
+		bool redirected = false;
+		bool retry = false;
+		for (size_t idx: todo) {
+			Reply &r = (*replies)[idx];
+			uint32_t slot = 0;
+			std::string host;
+			int port = 0;
+			if (r.type != SER_ERR) {
+				continue;
+			}
+			if (r.code == ERR_TRYAGAIN) {
+				retry = true;
+				cc->retries++;
+				again.push_back(idx);
+			} else if ((r.code == ERR_MOVED || r.code == ERR_ASK) && parse_moved(r.str, &slot, &host, &port)) {
+				uint16_t node = slot_map_node(&cc->map, host, port);
+				if (r.code == ERR_MOVED) {
+					cc->map.owner[slot] = node;
+					cc->redirects++;
+					moved = true;
+				} else {
+					ask[idx] = node;
+					cc->asks++;
+				}
+				redirected = true;
+				again.push_back(idx);
+			}
+		}
+		redirects += redirected ? 1 : 0;
+		retries += retry ? 1 : 0;
+		if (redirects > k_max_redirects || retries > k_max_retries) {
+			msg(retries > k_max_retries ? "too many retries" : "too many redirects");
+			err = -1;
+			break;
+		}
+		if (retry) {
+			usleep(k_retry_us);
+		}
+		todo.swap(again);
+	}
+	if (err) {
+		//replies still in flight would be taken for the next batch's
+		for (CcConn &c: cc->conns) {
+			conn_close(&c);
+		}
+	}
+	cc->queue.clear();
+	if (!err && moved) {
+		err = cc_refresh(cc);
+	}
+	return err;
+}
+
+// [[first, last, [host, port]]...], the reply to CLUSTER SLOTS
+static bool map_from_reply (ClusterClient* cc, const Reply &r) {
+	std::vector<uint16_t> owner(k_slots, k_no_node);
+	for (const Reply &run: r.elems) {
+		if (run.type != SER_ARR || run.elems.size() < 3 || run.elems[2].type != SER_ARR
+			|| run.elems[2].elems.size() < 2)
+		{
+			return false;
+		}
+		int64_t first = run.elems[0].num;
+		int64_t last = run.elems[1].num;
+		const Reply &node = run.elems[2];
+		if (first < 0 || first > last || last >= (int64_t)k_slots) {
+			return false;
+		}
+		uint16_t idx = slot_map_node(&cc->map, node.elems[0].str, (int)node.elems[1].num);
+		for (int64_t s = first; s <= last; ++s) {
+			owner[s] = idx;
+		}
+	}
+	cc->map.owner.swap(owner);
+	return true;
+}
+
+int32_t cc_refresh (ClusterClient* cc) {
+	std::vector<std::vector<std::string>> queue;
+	queue.swap(cc->queue);
+	cc->queue.push_back({"cluster", "slots"});
+	int32_t err = -1;
+	std::vector<Reply> replies(1);
+	for (size_t i = 0; err && i < cc->map.nodes.size(); ++i) {
+		if (conn_send(cc, (uint16_t)i, 0, false) < 0) {
+			conn_close(&cc->conns[i]);
+			continue;
+		}
+		if (run_batches(cc, &replies) < 0) {
+			conn_close(&cc->conns[i]);
+			continue;
+		}
+		const Reply &r = replies[0];
+		if (r.type == SER_ERR) {
+			//no cluster support, the node has every key
+			cc->cluster = false;
+			cc->map.owner.assign(k_slots, (uint16_t)i);
+			err = 0;
+		} else if (r.type == SER_ARR && map_from_reply(cc, r)) {
+			cc->cluster = true;
+			err = 0;
+		}
+	}
+	cc->queue.swap(queue);
+	cc->refreshes += err ? 0 : 1;
+	return err;
+}
+
+ClusterClient* cc_new (const char* host, int port) {
+	ClusterClient* cc = new ClusterClient();
+	slot_map_node(&cc->map, host, port);
+	if (cc_refresh(cc) < 0) {
+		cc_free(cc);
+		return NULL;
+	}
+	return cc;
+}
+
+void cc_free (ClusterClient* cc) {
+	for (CcConn &c: cc->conns) {
+		conn_close(&c);
+	}
+	delete cc;
+}
+
+void cc_queue (ClusterClient* cc, std::vector<std::string> cmd) {
+	cc->queue.push_back(std::move(cmd));
+}
+
+int32_t cc_query (ClusterClient* cc, std::vector<std::string> cmd, Reply* reply) {
+	cc_queue(cc, std::move(cmd));
+	std::vector<Reply> replies;
+	int32_t err = cc_exec(cc, &replies);
+	if (!err) {
+		*reply = std::move(replies[0]);
+	}
+	return err;
+}
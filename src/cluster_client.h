@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "cluster.h"
+#include "protocol.h"
+
+// client for the binary protocol that spreads keys over a cluster. it
+// keeps a copy of the slot map, fetched with CLUSTER SLOTS, and one
+// connection per node. queued commands are sent to the node serving the
+// slot of their first key, each node's share as one pipelined batch, and
+// all nodes are written and read at once. a MOVED reply fixes the slot's
+// owner in the copy, the command is sent again there, and the whole map is
+// fetched again once the batch is done. while a slot moves, ASK sends one
+// command to the slot's new node, preceded by ASKING, and TRYAGAIN (the
+// keys are in transit) resends it after a moment. a server without
+// cluster support gets every slot
+
+struct Reply {
+	uint8_t type = SER_NIL;
+	int32_t code = 0; //for SER_ERR
+	std::string str; //the string, or the error text
+	int64_t num = 0;
+	double dbl = 0;
+	std::vector<Reply> elems;
+};
+
+struct CcConn {
+	int fd = -1;
+	std::string out; //encoded requests, sent from out_pos
+	size_t out_pos = 0;
+	std::string in; //replies read, parsed from in_pos
+	size_t in_pos = 0;
+	std::vector<size_t> waiting; //the command of each reply to come, or k_no_cmd
+	size_t answered = 0;
+	uint64_t sent = 0; //commands sent, for stats
+};
+
+struct ClusterClient {
+	SlotMap map;
+	std::vector<CcConn> conns; //one per map.nodes entry
+	std::vector<std::vector<std::string>> queue;
+	bool cluster = false; //false if the server has no cluster support
+	uint64_t redirects = 0;
+	uint64_t asks = 0;
+	uint64_t retries = 0; //after TRYAGAIN
+	uint64_t refreshes = 0;
+};
+
+// connects to one node and fetches the slot map through it, NULL if that
+// fails
+ClusterClient* cc_new (const char* host, int port);
+void cc_free (ClusterClient* cc);
+// fetches the slot map again, from the first node that answers
+int32_t cc_refresh (ClusterClient* cc);
+void cc_queue (ClusterClient* cc, std::vector<std::string> cmd);
+// runs the queued commands, replies[i] answers the i-th. -1 if a node
+// cannot be reached or a command keeps being redirected
+int32_t cc_exec (ClusterClient* cc, std::vector<Reply>* replies);
+// one command on its own
+int32_t cc_query (ClusterClient* cc, std::vector<std::string> cmd, Reply* reply);
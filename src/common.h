@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// pointer to the struct that embeds member
+#define container_of(ptr, T, member) \
+	((T*)((char*)(ptr) - offsetof(T, member)))
+
+// set once at startup, before anything is hashed. keys written out in
+// the order of one table, like a snapshot, and inserted into another table
+// in that order pile up into long probe chains in linear probing unless
+// the two processes hash differently
+inline uint64_t g_hash_seed = 0;
+
+// FNV-1a with a murmur finalizer, the table uses the low bits as the index
+inline uint64_t str_hash (const uint8_t* data, size_t len) {
+	uint64_t h = 0xcbf29ce484222325ull ^ g_hash_seed;
+	for (size_t i = 0; i < len; ++i) {
+		h = (h ^ data[i]) * 0x100000001b3ull;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return h;
+}
@@ -0,0 +1,79 @@
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC_X86 1
+#endif
+
+static uint32_t g_table[8][256];
+
+static void init_tables () {
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; ++k) {
+			c = (c >> 1) ^ (0x82f63b78 & (0 - (c & 1)));
+		}
+		g_table[0][i] = c;
+	}
+	for (uint32_t i = 0; i < 256; ++i) {
+		for (int t = 1; t < 8; ++t) {
+			g_table[t][i] = (g_table[t - 1][i] >> 8) ^ g_table[0][g_table[t - 1][i] & 0xff];
+		}
+	}
+}
+
+static uint32_t crc_sw (uint32_t crc, const uint8_t* p, size_t len) {
+	while (len >= 8) {
+		uint64_t v = 0;
+		memcpy(&v, p, 8);
+		v ^= crc;
+		crc = g_table[7][v & 0xff] ^ g_table[6][(v >> 8) & 0xff]
+			^ g_table[5][(v >> 16) & 0xff] ^ g_table[4][(v >> 24) & 0xff]
+			^ g_table[3][(v >> 32) & 0xff] ^ g_table[2][(v >> 40) & 0xff]
+			^ g_table[1][(v >> 48) & 0xff] ^ g_table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--) {
+		crc = (crc >> 8) ^ g_table[0][(crc ^ *p++) & 0xff];
+	}
+	return crc;
+}
+
+#ifdef CRC_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw (uint32_t crc, const uint8_t* p, size_t len) {
+	uint64_t c = crc;
+	while (len >= 8) {
+		uint64_t v = 0;
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--) {
+		c = _mm_crc32_u8((uint32_t)c, *p++);
+	}
+	return (uint32_t)c;
+}
+#endif
+
+typedef uint32_t (*crc_fn)(uint32_t, const uint8_t*, size_t);
+
+static crc_fn pick () {
+#ifdef CRC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		return crc_hw;
+	}
+#endif
+	init_tables();
+	return crc_sw;
+}
+
+uint32_t crc32c (uint32_t crc, const void* data, size_t len) {
+	//picked on the first call, thread-safe as a function-local static
+	static const crc_fn fn = pick();
+	return ~fn(~crc, (const uint8_t*)data, len);
+}
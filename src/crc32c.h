@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// crc32c (castagnoli), with the sse4.2 crc32 instruction when the cpu has
+// it and slicing-by-8 tables otherwise. chained by passing the previous
+// result as crc, starting from 0
+uint32_t crc32c (uint32_t crc, const void* data, size_t len);
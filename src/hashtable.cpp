@@ -0,0 +1,185 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "hashtable.h"
+
+const size_t k_init_size = 8;
+//slots moved out of the old table per operation. anything above 2 finishes
+//the migration before the new table fills up under inserts alone
+const size_t k_rehash_work = 16;
+
+static void h_init (HTab* htab, size_t n) {
+	assert(n > 0 && ((n - 1) & n) == 0);
+	htab->slots = (HSlot*)calloc(n, sizeof(HSlot));
+	if (!htab->slots) {
+		abort();
+	}
+	htab->mask = n - 1;
+	htab->size = 0;
+}
+
+// grow at 3/4 load, linear probing degrades quickly past that
+static bool h_full (HTab* htab) {
+	return htab->size + 1 > (htab->mask + 1) / 4 * 3;
+}
+
+static void h_insert (HTab* htab, HNode* node) {
+	size_t pos = node->hcode & htab->mask;
+	while (htab->slots[pos].node) {
+		pos = (pos + 1) & htab->mask;
+	}
+	htab->slots[pos].hcode = node->hcode;
+	htab->slots[pos].node = node;
+	htab->size++;
+}
+
+// tombstones only exist in the old table, they keep probe chains intact
+// while its entries are moved out
+static HSlot* h_lookup (HTab* htab, HNode* key, bool (*eq)(HNode*, HNode*)) {
+	if (!htab->slots) {
+		return NULL;
+	}
+	size_t pos = key->hcode & htab->mask;
+	while (1) {
+		HSlot* slot = &htab->slots[pos];
+		if (!slot->node) {
+			if (slot->hcode == 0) {
+				return NULL;
+			}
+		} else if (slot->hcode == key->hcode && eq(slot->node, key)) {
+			return slot;
+		}
+		pos = (pos + 1) & htab->mask;
+	}
+}
+
+// backward-shift deletion, keeps the new table free of tombstones
+static void h_remove (HTab* htab, HSlot* slot) {
+	size_t mask = htab->mask;
+	size_t i = (size_t)(slot - htab->slots);
+	size_t j = i;
+	while (1) {
+		j = (j + 1) & mask;
+		if (!htab->slots[j].node) {
+			break;
+		}
+		size_t home = htab->slots[j].hcode & mask;
+		//leave entries whose home lies cyclically in (i, j]
+		bool stay = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+		if (stay) {
+			continue;
+		}
+		htab->slots[i] = htab->slots[j];
+		i = j;
+	}
+	htab->slots[i].hcode = 0;
+	htab->slots[i].node = NULL;
+	htab->size--;
+}
+
+static void h_tombstone (HTab* htab, HSlot* slot) {
+	slot->hcode = 1;
+	slot->node = NULL;
+	htab->size--;
+}
+
+static void hm_help_rehashing (HMap* hmap, size_t work) {
+	HTab* older = &hmap->older;
+	size_t nwork = 0;
+	while (nwork < work && older->size > 0) {
+		HSlot* slot = &older->slots[hmap->migrate_pos];
+		if (slot->node) {
+			h_insert(&hmap->newer, slot->node);
+			h_tombstone(older, slot);
+		}
+		hmap->migrate_pos++;
+		nwork++;
+	}
+	if (older->slots && older->size == 0) {
+		free(older->slots);
+		*older = HTab{};
+	}
+}
+
+static void hm_start_resizing (HMap* hmap) {
+	assert(hmap->older.slots == NULL);
+	hmap->older = hmap->newer;
+	h_init(&hmap->newer, (hmap->older.mask + 1) * 2);
+	hmap->migrate_pos = 0;
+}
+
+HNode* hm_lookup (HMap* hmap, HNode* key, bool (*eq)(HNode*, HNode*)) {
+	hm_help_rehashing(hmap, k_rehash_work);
+	HSlot* slot = h_lookup(&hmap->newer, key, eq);
+	if (!slot) {
+		slot = h_lookup(&hmap->older, key, eq);
+	}
+	return slot ? slot->node : NULL;
+}
+
+void hm_insert (HMap* hmap, HNode* node) {
+	if (!hmap->newer.slots) {
+		h_init(&hmap->newer, k_init_size);
+	}
+	if (h_full(&hmap->newer)) {
+		//the new table is twice the old one and drains faster than it
+		//fills, so this only finishes a migration in degenerate cases
+		if (hmap->older.slots) {
+			hm_help_rehashing(hmap, (size_t)-1);
+		}
+		hm_start_resizing(hmap);
+	}
+	h_insert(&hmap->newer, node);
+	hm_help_rehashing(hmap, k_rehash_work);
+}
+
+void hm_reserve (HMap* hmap, size_t n) {
+	assert(hm_size(hmap) == 0);
+	size_t cap = k_init_size;
+	while (cap / 4 * 3 < n + 1) {
+		cap *= 2;
+	}
+	hm_clear(hmap);
+	h_init(&hmap->newer, cap);
+}
+
+HNode* hm_delete (HMap* hmap, HNode* key, bool (*eq)(HNode*, HNode*)) {
+	hm_help_rehashing(hmap, k_rehash_work);
+	HSlot* slot = h_lookup(&hmap->newer, key, eq);
+	if (slot) {
+		HNode* node = slot->node;
+		h_remove(&hmap->newer, slot);
+		return node;
+	}
+	slot = h_lookup(&hmap->older, key, eq);
+	if (slot) {
+		HNode* node = slot->node;
+		h_tombstone(&hmap->older, slot);
+		return node;
+	}
+	return NULL;
+}
+
+void hm_clear (HMap* hmap) {
+	free(hmap->newer.slots);
+	free(hmap->older.slots);
+	*hmap = HMap{};
+}
+
+size_t hm_size (HMap* hmap) {
+	return hmap->newer.size + hmap->older.size;
+}
+
+static bool h_foreach (HTab* htab, bool (*f)(HNode*, void*), void* arg) {
+	for (size_t i = 0; htab->slots && i <= htab->mask; ++i) {
+		if (htab->slots[i].node && !f(htab->slots[i].node, arg)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void hm_foreach (HMap* hmap, bool (*f)(HNode*, void*), void* arg) {
+	if (h_foreach(&hmap->newer, f, arg)) {
+		(void)h_foreach(&hmap->older, f, arg);
+	}
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// intrusive hash map with open addressing and linear probing.
+// the slot array holds the hash next to the node pointer, so a probe only
+// touches the node on a hash match.
+// growing is incremental: a new table twice the size takes the inserts
+// while every operation moves a bounded number of slots out of the old one.
+
+struct HNode {
+	uint64_t hcode = 0;
+};
+
+struct HSlot {
+	uint64_t hcode; //for an empty slot: 0 = never used, 1 = tombstone
+	HNode* node;
+};
+
+struct HTab {
+	HSlot* slots = NULL;
+	size_t mask = 0;
+	size_t size = 0;
+};
+
+struct HMap {
+	HTab newer;
+	HTab older; //being drained into newer
+	size_t migrate_pos = 0;
+};
+
+HNode* hm_lookup (HMap* hmap, HNode* key, bool (*eq)(HNode*, HNode*));
+void hm_insert (HMap* hmap, HNode* node);
+// size an empty map for n nodes, so inserting them never grows it
+void hm_reserve (HMap* hmap, size_t n);
+// unlink and return the node, or NULL
+HNode* hm_delete (HMap* hmap, HNode* key, bool (*eq)(HNode*, HNode*));
+void hm_clear (HMap* hmap);
+size_t hm_size (HMap* hmap);
+// call f on every node until it returns false. the map must not change
+// meanwhile
+void hm_foreach (HMap* hmap, bool (*f)(HNode*, void*), void* arg);
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// latency histogram with log-linear buckets. values are grouped by their
+// highest set bit and every power of two is split into 16 sub-buckets, so a
+// reported percentile is within ~6% of the recorded value.
+
+const size_t k_hist_sub = 16;
+const size_t k_hist_buckets = 64 * k_hist_sub;
+
+struct Histogram {
+	uint64_t counts[k_hist_buckets] = {};
+	uint64_t total = 0;
+	uint64_t max = 0;
+	uint64_t sum = 0;
+};
+
+inline size_t hist_bucket (uint64_t v) {
+	if (v < k_hist_sub) {
+		return (size_t)v;
+	}
+	size_t bit = 63 - (size_t)__builtin_clzll(v);
+	size_t sub = (size_t)(v >> (bit - 4)) & (k_hist_sub - 1);
+	return (bit - 3) * k_hist_sub + sub;
+}
+
+// largest value that falls into the bucket
+inline uint64_t hist_bucket_max (size_t idx) {
+	if (idx < k_hist_sub) {
+		return idx;
+	}
+	size_t bit = idx / k_hist_sub + 3;
+	uint64_t sub = idx % k_hist_sub;
+	return ((k_hist_sub + sub + 1) << (bit - 4)) - 1;
+}
+
+inline void hist_add (Histogram* h, uint64_t v) {
+	h->counts[hist_bucket(v)]++;
+	h->total++;
+	h->sum += v;
+	if (v > h->max) {
+		h->max = v;
+	}
+}
+
+inline void hist_merge (Histogram* dst, const Histogram* src) {
+	for (size_t i = 0; i < k_hist_buckets; ++i) {
+		dst->counts[i] += src->counts[i];
+	}
+	dst->total += src->total;
+	dst->sum += src->sum;
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+}
+
+// p in [0, 100]
+inline uint64_t hist_percentile (const Histogram* h, double p) {
+	if (!h->total) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t)(p / 100.0 * (double)h->total);
+	if (rank >= h->total) {
+		rank = h->total - 1;
+	}
+	uint64_t seen = 0;
+	for (size_t i = 0; i < k_hist_buckets; ++i) {
+		seen += h->counts[i];
+		if (seen > rank) {
+			uint64_t v = hist_bucket_max(i);
+			return v < h->max ? v : h->max;
+		}
+	}
+	return h->max;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+// intrusive circular doubly linked list. a list is a sentinel node, and a
+// node that is in no list links to itself, so detaching it again is a no-op
+
+struct DList {
+	DList* prev = this;
+	DList* next = this;
+};
+
+inline bool dlist_empty (const DList* node) {
+	return node->next == node;
+}
+
+inline void dlist_detach (DList* node) {
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->prev = node;
+	node->next = node;
+}
+
+inline void dlist_push_back (DList* head, DList* node) {
+	node->prev = head->prev;
+	node->next = head;
+	head->prev->next = node;
+	head->prev = node;
+}
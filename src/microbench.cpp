@@ -0,0 +1,690 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <set>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <vector>
+#include "common.h"
+#include "histogram.h"
+#include "hashtable.h"
+#include "resp.h"
+#include "timer.h"
+#include "zset.h"
+
+// in-process microbenchmarks for the server's data structures.
+//
+// usage: ./microbench hashtable [n1 n2 ...]
+//   per-operation insert and lookup latency percentiles at each key count,
+//   defaults to 1M and 10M keys. 100M keys needs ~10 GB of memory.
+// usage: ./microbench check [ops]
+//   self-check of the hash table and the timing wheel: runs ops random
+//   operations (default 1M) per round against a reference container and
+//   exits 1 on the first difference.
+// usage: ./microbench resp [n | capture_file]
+//   RESP parser throughput for every delimiter kernel this cpu supports,
+//   over a pipeline of n small SET/GET commands (default 1M) or over raw
+//   bytes captured from a client, e.g. with tcpdump or socat.
+// usage: ./microbench timer [n1 n2 ...]
+//   timing wheel add and delete latency, then time stepped 1 ms at a time
+//   until every timer fired, with the cost of each step and of each batch
+//   of 128 expiries. timers are spread over 10 minutes, and in a second
+//   round all due in the same ms. defaults to 1M and 10M timers.
+// usage: ./microbench zset [n1 n2 ...]
+//   sorted set ZADD latency and throughput, ZRANK, and ZRANGE of 10
+//   members by rank and by score, at each member count, plus the memory
+//   per member. defaults to 1M and 10M members.
+// usage: ./microbench zsmall [keys [fields]]
+//   memory per field of many small sorted sets, as listpacks and as
+//   skiplists, with ZADD and ZSCORE cost. defaults to 10M keys of 8 fields,
+//   the skiplist run uses at most 1M keys since it needs ~10x the memory.
+
+static uint64_t now_ns () {
+	struct timespec ts = {};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void print_hist (const char* name, size_t n, const Histogram* h) {
+	printf("%-10s %12zu %8.0f %8lu %8lu %8lu %10lu\n", name, n,
+		(double)h->sum / (double)h->total,
+		(unsigned long)hist_percentile(h, 50),
+		(unsigned long)hist_percentile(h, 99),
+		(unsigned long)hist_percentile(h, 99.9),
+		(unsigned long)h->max);
+}
+
+static void print_header () {
+	printf("%-10s %12s %8s %8s %8s %8s %10s\n", "op", "keys", "avg_ns", "p50", "p99", "p99.9", "max");
+}
+
+// keys are short byte strings like the ones clients send
+struct BenchKey {
+	HNode node;
+	uint32_t len;
+	char key[20];
+};
+
+static bool bench_key_eq (HNode* lhs, HNode* rhs) {
+	BenchKey* l = container_of(lhs, BenchKey, node);
+	BenchKey* r = container_of(rhs, BenchKey, node);
+	return l->len == r->len && !memcmp(l->key, r->key, l->len);
+}
+
+static void bench_key_init (BenchKey* k, uint64_t i) {
+	k->len = (uint32_t)snprintf(k->key, sizeof(k->key), "key:%lu", (unsigned long)i);
+	k->node.hcode = str_hash((const uint8_t*)k->key, k->len);
+}
+
+static void bench_hashtable (size_t n) {
+	std::vector<BenchKey> keys(n);
+	HMap map;
+
+	//every insert is timed, so a resize that blocked would show up in max
+	Histogram ins;
+	for (size_t i = 0; i < n; ++i) {
+		bench_key_init(&keys[i], i);
+		uint64_t start = now_ns();
+		hm_insert(&map, &keys[i].node);
+		hist_add(&ins, now_ns() - start);
+	}
+	print_hist("insert", n, &ins);
+
+	//random order so lookups are not served from a warm cache line
+	Histogram hit;
+	uint64_t x = 88172645463325252ull;
+	BenchKey probe;
+	for (size_t i = 0; i < n; ++i) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		bench_key_init(&probe, x % n);
+		uint64_t start = now_ns();
+		HNode* node = hm_lookup(&map, &probe.node, &bench_key_eq);
+		hist_add(&hit, now_ns() - start);
+		if (!node) {
+			fprintf(stderr, "lookup miss\n");
+			exit(1);
+		}
+	}
+	print_hist("lookup", n, &hit);
+
+	Histogram miss;
+	for (size_t i = 0; i < n; ++i) {
+		bench_key_init(&probe, n + i);
+		uint64_t start = now_ns();
+		HNode* node = hm_lookup(&map, &probe.node, &bench_key_eq);
+		hist_add(&miss, now_ns() - start);
+		if (node) {
+			fprintf(stderr, "unexpected hit\n");
+			exit(1);
+		}
+	}
+	print_hist("miss", n, &miss);
+
+	Histogram del;
+	for (size_t i = 0; i < n; ++i) {
+		uint64_t start = now_ns();
+		HNode* node = hm_delete(&map, &keys[i].node, &bench_key_eq);
+		hist_add(&del, now_ns() - start);
+		if (node != &keys[i].node) {
+			fprintf(stderr, "delete failed\n");
+			exit(1);
+		}
+	}
+	print_hist("delete", n, &del);
+	hm_clear(&map);
+}
+
+static uint64_t xorshift (uint64_t* x) {
+	*x ^= *x << 13;
+	*x ^= *x >> 7;
+	*x ^= *x << 17;
+	return *x;
+}
+
+static void check_fail (const char* what, uint64_t op) {
+	fprintf(stderr, "check failed: %s at op %lu\n", what, (unsigned long)op);
+	exit(1);
+}
+
+struct CheckKey {
+	HNode node;
+	uint64_t id = 0;
+};
+
+static bool check_key_eq (HNode* lhs, HNode* rhs) {
+	return container_of(lhs, CheckKey, node)->id == container_of(rhs, CheckKey, node)->id;
+}
+
+// random insert, delete and lookup of ids below range, compared with an
+// unordered_map after every operation. with nhash > 0 the ids only get
+// nhash distinct hashes, so probe chains are long, run into each other
+// and wrap around the end of the table, which is what backward-shift
+// deletion and the old table's tombstones have to get right
+static size_t check_hashtable_round (size_t ops, uint64_t range, uint64_t nhash, uint64_t* seed) {
+	HMap map;
+	std::unordered_map<uint64_t, CheckKey*> ref;
+	size_t resizing = 0;
+	auto make_key = [&](CheckKey* k, uint64_t id) {
+		uint64_t h = nhash ? id % nhash : id;
+		k->id = id;
+		k->node.hcode = str_hash((const uint8_t*)&h, sizeof(h));
+	};
+	for (size_t op = 0; op < ops; ++op) {
+		uint64_t id = xorshift(seed) % range;
+		uint64_t r = xorshift(seed) % 100;
+		CheckKey probe;
+		make_key(&probe, id);
+		auto it = ref.find(id);
+		if (r < 45) {
+			if (it == ref.end()) {
+				CheckKey* k = new CheckKey();
+				make_key(k, id);
+				hm_insert(&map, &k->node);
+				ref[id] = k;
+			} else if (hm_lookup(&map, &probe.node, &check_key_eq) != &it->second->node) {
+				check_fail("lookup before insert", op);
+			}
+		} else if (r < 80) {
+			HNode* node = hm_delete(&map, &probe.node, &check_key_eq);
+			if (node != (it == ref.end() ? NULL : &it->second->node)) {
+				check_fail("delete", op);
+			}
+			if (it != ref.end()) {
+				delete it->second;
+				ref.erase(it);
+			}
+		} else {
+			HNode* node = hm_lookup(&map, &probe.node, &check_key_eq);
+			if (node != (it == ref.end() ? NULL : &it->second->node)) {
+				check_fail("lookup", op);
+			}
+		}
+		if (hm_size(&map) != ref.size()) {
+			check_fail("size", op);
+		}
+		resizing += map.older.slots ? 1 : 0;
+	}
+	//every id, present or not, once more
+	for (uint64_t id = 0; id < range; ++id) {
+		CheckKey probe;
+		make_key(&probe, id);
+		auto it = ref.find(id);
+		if (hm_lookup(&map, &probe.node, &check_key_eq) != (it == ref.end() ? NULL : &it->second->node)) {
+			check_fail("final lookup", ops);
+		}
+	}
+	for (auto &[id, k]: ref) {
+		delete k;
+	}
+	hm_clear(&map);
+	return resizing;
+}
+
+// each round starts from an empty map, so small rounds go through
+// several resizes each
+static void check_hashtable (size_t ops) {
+	struct {
+		uint64_t range;
+		uint64_t nhash;
+		size_t round_ops;
+	} runs[] = {{300, 0, 2000}, {100000, 0, ops}, {300, 16, 2000}, {3000, 4, 20000}};
+	uint64_t seed = 88172645463325252ull;
+	for (auto &run: runs) {
+		size_t resizing = 0;
+		size_t rounds = ops / run.round_ops;
+		for (size_t i = 0; i < rounds; ++i) {
+			resizing += check_hashtable_round(run.round_ops, run.range, run.nhash, &seed);
+		}
+		printf("hashtable  keys < %6lu, %6lu hashes: %zu rounds of %zu ops, %zu during a resize\n",
+			(unsigned long)run.range, (unsigned long)(run.nhash ? run.nhash : run.range),
+			rounds, run.round_ops, resizing);
+	}
+}
+
+struct CheckTimer {
+	TNode node;
+	size_t id = 0;
+};
+
+// random add, re-add, delete and advance on a wheel, compared with a
+// sorted set of (expire, id) after every operation. advancing gets a
+// small work limit, so it stops halfway through slots and resumes. a
+// timer must fire once time reaches its expiry, and never before.
+// returns the number of timers fired
+static size_t check_timer_round (size_t ops, size_t ntimers, uint64_t* seed) {
+	std::vector<CheckTimer> timers(ntimers);
+	std::set<std::pair<uint64_t, size_t>> ref;
+	TWheel* w = new TWheel();
+	uint64_t now = 1000 + xorshift(seed) % ((uint64_t)1 << 40);
+	tw_init(w, now);
+	for (size_t i = 0; i < ntimers; ++i) {
+		timers[i].id = i;
+	}
+	size_t fired = 0;
+	for (size_t op = 0; op < ops; ++op) {
+		CheckTimer* t = &timers[xorshift(seed) % ntimers];
+		uint64_t r = xorshift(seed) % 100;
+		if (r < 45) {
+			//already due, or up to past the reach of the top level
+			uint64_t reach = (uint64_t)1 << (6 * (xorshift(seed) % 8));
+			uint64_t expire = r < 3 ? now - xorshift(seed) % 1000 : now + xorshift(seed) % reach;
+			ref.erase({t->node.expire, t->id});
+			tw_add(w, &t->node, expire);
+			ref.insert({expire, t->id});
+		} else if (r < 65) {
+			ref.erase({t->node.expire, t->id});
+			tw_del(w, &t->node);
+		} else {
+			//mostly a few ms, sometimes far ahead
+			uint64_t far = (uint64_t)1 << (6 * (xorshift(seed) % 6 + 1));
+			now += r < 95 ? xorshift(seed) % 4 : xorshift(seed) % far;
+			size_t work = 1 + xorshift(seed) % 8;
+			//a timer moves at most once per level, and once more from
+			//its parking slot, so a wheel that keeps asking is stuck
+			size_t calls = (ref.size() + 1) * (k_tw_levels + 2);
+			while (1) {
+				if (calls-- == 0) {
+					check_fail("advance does not finish", op);
+				}
+				bool caught_up = tw_advance(w, now, work);
+				TNode* node = NULL;
+				while ((node = tw_pop_due(w))) {
+					size_t id = container_of(node, CheckTimer, node)->id;
+					if (node->expire > now || !ref.erase({node->expire, id})) {
+						check_fail("timer fired early or twice", op);
+					}
+					fired++;
+				}
+				if (caught_up) {
+					break;
+				}
+			}
+			if (!ref.empty() && ref.begin()->first <= now) {
+				check_fail("timer not fired", op);
+			}
+		}
+		if (w->size != ref.size()) {
+			check_fail("timer count", op);
+		}
+		//the wheel may report work early, at a slot boundary, but not late
+		uint64_t next = tw_next(w);
+		uint64_t first = ref.empty() ? UINT64_MAX : std::max(ref.begin()->first, now);
+		if (next > first) {
+			check_fail("next timer", op);
+		}
+	}
+	delete w;
+	return fired;
+}
+
+// few timers rescheduled over and over, then many spread over all levels
+static void check_timer (size_t ops) {
+	struct {
+		size_t ntimers;
+		size_t round_ops;
+	} runs[] = {{64, 2000}, {5000, ops}};
+	uint64_t seed = 2463534242ull;
+	for (auto &run: runs) {
+		size_t fired = 0;
+		size_t rounds = ops / run.round_ops;
+		for (size_t i = 0; i < rounds; ++i) {
+			fired += check_timer_round(run.round_ops, run.ntimers, &seed);
+		}
+		printf("timer      %6zu timers: %zu rounds of %zu ops, %zu fired\n",
+			run.ntimers, rounds, run.round_ops, fired);
+	}
+}
+
+// span is the range of expiry times in ms, 1 puts every timer in one slot
+static void bench_timer (size_t n, uint64_t span) {
+	const size_t k_batch = 128;
+	std::vector<TNode> nodes(n);
+	TWheel* w = new TWheel();
+	tw_init(w, 0);
+
+	Histogram add;
+	uint64_t x = 88172645463325252ull;
+	for (size_t i = 0; i < n; ++i) {
+		uint64_t expire = 1 + xorshift(&x) % span;
+		uint64_t start = now_ns();
+		tw_add(w, &nodes[i], expire);
+		hist_add(&add, now_ns() - start);
+	}
+	print_hist(span > 1 ? "add" : "add_same", n, &add);
+
+	Histogram del;
+	for (size_t i = 0; i < n; i += 4) {
+		uint64_t start = now_ns();
+		tw_del(w, &nodes[i]);
+		hist_add(&del, now_ns() - start);
+	}
+	print_hist("delete", n / 4, &del);
+
+	//what the server's active expiry does, minus the keyspace
+	Histogram tick;
+	Histogram batch;
+	size_t fired = 0;
+	for (uint64_t now = 1; now <= span; ++now) {
+		uint64_t tick_start = now_ns();
+		while (1) {
+			uint64_t start = now_ns();
+			bool caught_up = tw_advance(w, now, k_batch);
+			size_t got = 0;
+			TNode* node = NULL;
+			while (got < k_batch && (node = tw_pop_due(w))) {
+				if (node->expire > now) {
+					fprintf(stderr, "timer fired early\n");
+					exit(1);
+				}
+				got++;
+			}
+			hist_add(&batch, now_ns() - start);
+			fired += got;
+			if (caught_up && got < k_batch) {
+				break;
+			}
+		}
+		hist_add(&tick, now_ns() - tick_start);
+	}
+	if (fired != n - (n + 3) / 4 || w->size != 0) {
+		fprintf(stderr, "fired %zu of %zu timers\n", fired, n - (n + 3) / 4);
+		exit(1);
+	}
+	print_hist("tick", (size_t)tick.total, &tick);
+	print_hist("batch", (size_t)batch.total, &batch);
+	delete w;
+}
+
+static void bench_zset (size_t n) {
+	const size_t k_range = 10;
+	ZSet* z = zset_new();
+	uint64_t x = 88172645463325252ull;
+	char name[24];
+
+	Histogram add;
+	uint64_t begin = now_ns();
+	for (size_t i = 0; i < n; ++i) {
+		int len = snprintf(name, sizeof(name), "m:%lu", (unsigned long)i);
+		double score = (double)(xorshift(&x) % (n * 4));
+		uint64_t start = now_ns();
+		zset_add(z, name, (size_t)len, score);
+		hist_add(&add, now_ns() - start);
+	}
+	double secs = (double)(now_ns() - begin) / 1e9;
+	print_hist("zadd", n, &add);
+
+	Histogram rank;
+	for (size_t i = 0; i < n; ++i) {
+		int len = snprintf(name, sizeof(name), "m:%lu", (unsigned long)(xorshift(&x) % n));
+		uint64_t start = now_ns();
+		size_t r = 0;
+		bool found = zset_rank(z, name, (size_t)len, &r);
+		hist_add(&rank, now_ns() - start);
+		if (!found) {
+			fprintf(stderr, "member missing\n");
+			exit(1);
+		}
+	}
+	print_hist("zrank", n, &rank);
+
+	//what ZRANGE does before the reply is written
+	Histogram by_rank;
+	uint64_t sum = 0;
+	for (size_t i = 0; i < n; ++i) {
+		uint64_t start = now_ns();
+		ZIter it;
+		zset_seek_rank(z, xorshift(&x) % (n - k_range), &it);
+		for (size_t j = 0; j < k_range; ++j) {
+			const char* member = NULL;
+			size_t len = 0;
+			double score = 0;
+			zset_iter_get(&it, &member, &len, &score);
+			sum += len;
+			zset_iter_next(&it);
+		}
+		hist_add(&by_rank, now_ns() - start);
+	}
+	print_hist("zrange", n, &by_rank);
+
+	Histogram by_score;
+	for (size_t i = 0; i < n; ++i) {
+		double min = (double)(xorshift(&x) % (n * 4));
+		uint64_t start = now_ns();
+		ZIter it;
+		if (zset_seek_score(z, min, false, &it)) {
+			size_t count = zset_count_to(z, min + 40, false) - it.rank;
+			for (size_t j = 0; j < count && j < k_range; ++j) {
+				const char* member = NULL;
+				size_t len = 0;
+				double score = 0;
+				zset_iter_get(&it, &member, &len, &score);
+				sum += len;
+				zset_iter_next(&it);
+			}
+		}
+		hist_add(&by_score, now_ns() - start);
+	}
+	print_hist("zrangebysc", n, &by_score);
+	printf("zadd %.0f ops/s, %.1f bytes/member, checksum %lu\n",
+		(double)n / secs, (double)zset_mem(z) / (double)n, (unsigned long)sum);
+	zset_free(z);
+}
+
+static size_t rss_bytes () {
+	long pages = 0;
+	long resident = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(f);
+	}
+	return (size_t)resident * 4096;
+}
+
+// keys small sorted sets of fields members each, as listpacks or forced
+// to skiplists. runs in a child so the heap it leaves behind does not skew
+// the next run's memory
+static void bench_zset_small (size_t keys, size_t fields, bool listpack) {
+	pid_t pid = fork();
+	if (pid != 0) {
+		waitpid(pid, NULL, 0);
+		return;
+	}
+	g_zset_max_listpack_entries = listpack ? 128 : 0;
+	std::vector<ZSet*> sets(keys);
+	uint64_t x = 88172645463325252ull;
+	char name[24];
+	size_t rss = rss_bytes();
+	size_t mem = 0;
+
+	uint64_t start = now_ns();
+	for (size_t k = 0; k < keys; ++k) {
+		sets[k] = zset_new();
+		for (size_t i = 0; i < fields; ++i) {
+			int len = snprintf(name, sizeof(name), "f:%lu", (unsigned long)i);
+			zset_add(sets[k], name, (size_t)len, (double)(xorshift(&x) % 1000));
+		}
+	}
+	double add_ns = (double)(now_ns() - start) / (double)(keys * fields);
+	rss = rss_bytes() - rss;
+	for (size_t k = 0; k < keys; ++k) {
+		mem += zset_mem(sets[k]);
+	}
+
+	start = now_ns();
+	for (size_t i = 0; i < keys; ++i) {
+		int len = snprintf(name, sizeof(name), "f:%lu", (unsigned long)(xorshift(&x) % fields));
+		double score = 0;
+		zset_score(sets[xorshift(&x) % keys], name, (size_t)len, &score);
+	}
+	double score_ns = (double)(now_ns() - start) / (double)keys;
+
+	printf("%-10s %10zu %6zu %12.1f %12.1f %10.0f %10.0f\n", listpack ? "listpack" : "skiplist",
+		keys, fields, (double)rss / (double)(keys * fields), (double)mem / (double)(keys * fields),
+		add_ns, score_ns);
+	exit(0);
+}
+
+static void append_bulk (std::vector<uint8_t> &out, const char* s, size_t n) {
+	char hdr[32];
+	int len = snprintf(hdr, sizeof(hdr), "$%zu\r\n", n);
+	out.insert(out.end(), hdr, hdr + len);
+	out.insert(out.end(), s, s + n);
+	out.push_back('\r');
+	out.push_back('\n');
+}
+
+// what redis-benchmark -t set,get sends, small keys and values
+static void make_pipeline (std::vector<uint8_t> &out, size_t n) {
+	char key[32];
+	char val[32];
+	for (size_t i = 0; i < n; ++i) {
+		int klen = snprintf(key, sizeof(key), "key:%012zu", i % 100000);
+		if (i % 2 == 0) {
+			int vlen = snprintf(val, sizeof(val), "value-%zu", i);
+			const char* hdr = "*3\r\n";
+			out.insert(out.end(), hdr, hdr + 4);
+			append_bulk(out, "SET", 3);
+			append_bulk(out, key, (size_t)klen);
+			append_bulk(out, val, (size_t)vlen);
+		} else {
+			const char* hdr = "*2\r\n";
+			out.insert(out.end(), hdr, hdr + 4);
+			append_bulk(out, "GET", 3);
+			append_bulk(out, key, (size_t)klen);
+		}
+	}
+}
+
+static bool read_file (const char* path, std::vector<uint8_t> &out) {
+	FILE* f = fopen(path, "rb");
+	if (!f) {
+		return false;
+	}
+	uint8_t chunk[1 << 16];
+	size_t n = 0;
+	while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+		out.insert(out.end(), chunk, chunk + n);
+	}
+	fclose(f);
+	return true;
+}
+
+static void bench_resp (const std::vector<uint8_t> &data) {
+	const char* kernels[] = {"scalar", "sse2", "avx2"};
+	RespParser parser;
+	printf("%-8s %12s %10s %14s\n", "kernel", "bytes", "MB/s", "commands/s");
+	for (const char* kernel: kernels) {
+		if (!resp_set_kernel(kernel)) {
+			continue;
+		}
+		//best of a few rounds, the first one also warms the caches
+		double best = 0;
+		size_t commands = 0;
+		for (int round = 0; round < 5; ++round) {
+			commands = 0;
+			size_t off = 0;
+			uint64_t start = now_ns();
+			while (off < data.size()) {
+				resp_reset(&parser);
+				int64_t rv = resp_parse(&parser, data.data() + off, data.size() - off, 32 << 20, 200000);
+				if (rv <= 0) {
+					break; //truncated capture or garbage
+				}
+				off += (size_t)rv;
+				commands++;
+			}
+			double secs = (now_ns() - start) / 1e9;
+			if (best == 0 || secs < best) {
+				best = secs;
+			}
+		}
+		printf("%-8s %12zu %10.0f %14.0f\n", kernel, data.size(),
+			data.size() / best / 1e6, commands / best);
+	}
+}
+
+static void usage (const char* prog) {
+	fprintf(stderr, "usage: %s hashtable [n ...]\n", prog);
+	fprintf(stderr, "       %s check [ops]\n", prog);
+	fprintf(stderr, "       %s resp [n | capture_file]\n", prog);
+	fprintf(stderr, "       %s timer [n ...]\n", prog);
+	fprintf(stderr, "       %s zset [n ...]\n", prog);
+	fprintf(stderr, "       %s zsmall [keys [fields]]\n", prog);
+	exit(1);
+}
+
+int main (int argc, char* argv[]) {
+	setbuf(stdout, NULL);
+	if (argc < 2) {
+		usage(argv[0]);
+	}
+	if (!strcmp(argv[1], "resp")) {
+		std::vector<uint8_t> data;
+		if (argc > 2 && atol(argv[2]) == 0) {
+			if (!read_file(argv[2], data)) {
+				fprintf(stderr, "cannot read %s\n", argv[2]);
+				return 1;
+			}
+		} else {
+			make_pipeline(data, argc > 2 ? (size_t)atol(argv[2]) : 1000000);
+		}
+		resp_init();
+		bench_resp(data);
+		return 0;
+	}
+
+	std::vector<size_t> counts;
+	for (int i = 2; i < argc; ++i) {
+		counts.push_back((size_t)atol(argv[i]));
+	}
+
+	if (!strcmp(argv[1], "hashtable")) {
+		if (counts.empty()) {
+			counts = {1000000, 10000000};
+		}
+		print_header();
+		for (size_t n: counts) {
+			bench_hashtable(n);
+		}
+	} else if (!strcmp(argv[1], "check")) {
+		check_hashtable(counts.empty() ? 1000000 : counts[0]);
+		check_timer(counts.empty() ? 1000000 : counts[0]);
+		printf("check passed\n");
+	} else if (!strcmp(argv[1], "timer")) {
+		if (counts.empty()) {
+			counts = {1000000, 10000000};
+		}
+		print_header();
+		for (size_t n: counts) {
+			bench_timer(n, 10 * 60 * 1000);
+			bench_timer(n, 1);
+		}
+	} else if (!strcmp(argv[1], "zset")) {
+		if (counts.empty()) {
+			counts = {1000000, 10000000};
+		}
+		print_header();
+		for (size_t n: counts) {
+			bench_zset(n);
+		}
+	} else if (!strcmp(argv[1], "zsmall")) {
+		size_t keys = counts.size() > 0 ? counts[0] : 10000000;
+		size_t fields = counts.size() > 1 ? counts[1] : 8;
+		printf("%-10s %10s %6s %12s %12s %10s %10s\n", "encoding", "keys", "fields",
+			"rss_B/field", "used_B/field", "zadd_ns", "zscore_ns");
+		bench_zset_small(keys, fields, true);
+		bench_zset_small(keys < 1000000 ? keys : 1000000, fields, false);
+	} else {
+		usage(argv[0]);
+	}
+	return 0;
+}
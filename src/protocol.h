@@ -0,0 +1,29 @@
+#pragma once
+
+// the binary protocol, shared by the server, the clients and the benches.
+// every message is len(4) + body, little endian. a request body is
+// nstr(4) followed by nstr x (len(4) + bytes), a reply body is one value
+// below
+
+enum { //type tag in front of every serialized reply value
+	SER_NIL = 0, //tag only
+	SER_ERR = 1, //code(4) + len(4) + msg
+	SER_STR = 2, //len(4) + bytes
+	SER_INT = 3, //int64(8)
+	SER_DBL = 4, //double(8)
+	SER_ARR = 5, //n(4) + n values
+};
+
+enum { //error codes carried by SER_ERR
+	ERR_UNKNOWN = 1, //unknown command
+	ERR_BAD_ARG = 2, //wrong arguments for the command
+	ERR_TYPE = 3, //the key holds another type of value
+	ERR_BUSY = 4, //another operation is in progress
+	ERR_IO = 5, //the server failed to read or write a file
+	ERR_READONLY = 6, //a write sent to a replica
+	ERR_MOVED = 7, //the key's slot is on another node, "slot host:port"
+	ERR_CROSSSLOT = 8, //the keys of a command are in different slots
+	ERR_CLUSTERDOWN = 9, //no node serves the key's slot
+	ERR_ASK = 10, //the slot is moving and the key is on its target, "slot host:port"
+	ERR_TRYAGAIN = 11, //the key is being moved right now
+};
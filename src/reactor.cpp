@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <vector>
+#include "reactor.h"
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+
+struct Reactor {
+	int epfd = -1;
+	std::vector<struct epoll_event> events;
+};
+
+static uint32_t to_epoll (uint32_t events) {
+	uint32_t out = EPOLLET;
+	if (events & REACTOR_READ) {
+		out |= EPOLLIN;
+	}
+	if (events & REACTOR_WRITE) {
+		out |= EPOLLOUT;
+	}
+	return out;
+}
+
+const char* reactor_backend () {
+	return "epoll";
+}
+
+Reactor* reactor_new () {
+	int epfd = epoll_create1(0);
+	if (epfd < 0) {
+		return NULL;
+	}
+	Reactor* r = new Reactor();
+	r->epfd = epfd;
+	return r;
+}
+
+void reactor_free (Reactor* r) {
+	close(r->epfd);
+	delete r;
+}
+
+int32_t reactor_add (Reactor* r, int fd, uint32_t events) {
+	struct epoll_event ev = {};
+	ev.events = to_epoll(events);
+	ev.data.fd = fd;
+	return epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int32_t reactor_mod (Reactor* r, int fd, uint32_t old_events, uint32_t events) {
+	if (old_events == events) {
+		return 0;
+	}
+	struct epoll_event ev = {};
+	ev.events = to_epoll(events);
+	ev.data.fd = fd;
+	return epoll_ctl(r->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int32_t reactor_del (Reactor* r, int fd, uint32_t old_events) {
+	(void)old_events;
+	return epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int reactor_wait (Reactor* r, ReactorEvent* out, int max, int timeout_ms) {
+	if (r->events.size() < (size_t)max) {
+		r->events.resize(max);
+	}
+	int rv = epoll_wait(r->epfd, r->events.data(), max, timeout_ms);
+	if (rv < 0) {
+		return (errno == EINTR) ? 0 : -1;
+	}
+	for (int i = 0; i < rv; ++i) {
+		uint32_t ev = r->events[i].events;
+		out[i].fd = r->events[i].data.fd;
+		out[i].events = 0;
+		if (ev & EPOLLIN) {
+			out[i].events |= REACTOR_READ;
+		}
+		if (ev & EPOLLOUT) {
+			out[i].events |= REACTOR_WRITE;
+		}
+		if (ev & (EPOLLERR | EPOLLHUP)) {
+			out[i].events |= REACTOR_ERR;
+		}
+	}
+	return rv;
+}
+
+#else
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+
+struct Reactor {
+	int kq = -1;
+	std::vector<struct kevent> events;
+};
+
+const char* reactor_backend () {
+	return "kqueue";
+}
+
+Reactor* reactor_new () {
+	int kq = kqueue();
+	if (kq < 0) {
+		return NULL;
+	}
+	Reactor* r = new Reactor();
+	r->kq = kq;
+	return r;
+}
+
+void reactor_free (Reactor* r) {
+	close(r->kq);
+	delete r;
+}
+
+// read and write are separate filters in kqueue, so a change of interest
+// becomes up to two changelist entries. EV_CLEAR gives edge-triggered
+// semantics like EPOLLET
+int32_t reactor_mod (Reactor* r, int fd, uint32_t old_events, uint32_t events) {
+	struct kevent changes[2];
+	int n = 0;
+	if ((events & REACTOR_READ) && !(old_events & REACTOR_READ)) {
+		EV_SET(&changes[n++], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+	} else if (!(events & REACTOR_READ) && (old_events & REACTOR_READ)) {
+		EV_SET(&changes[n++], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	}
+	if ((events & REACTOR_WRITE) && !(old_events & REACTOR_WRITE)) {
+		EV_SET(&changes[n++], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, NULL);
+	} else if (!(events & REACTOR_WRITE) && (old_events & REACTOR_WRITE)) {
+		EV_SET(&changes[n++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+	}
+	if (n == 0) {
+		return 0;
+	}
+	return kevent(r->kq, changes, n, NULL, 0, NULL) < 0 ? -1 : 0;
+}
+
+int32_t reactor_add (Reactor* r, int fd, uint32_t events) {
+	return reactor_mod(r, fd, 0, events);
+}
+
+int32_t reactor_del (Reactor* r, int fd, uint32_t old_events) {
+	return reactor_mod(r, fd, old_events, 0);
+}
+
+int reactor_wait (Reactor* r, ReactorEvent* out, int max, int timeout_ms) {
+	if (r->events.size() < (size_t)max) {
+		r->events.resize(max);
+	}
+	struct timespec ts = {};
+	struct timespec* tsp = NULL;
+	if (timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+		tsp = &ts;
+	}
+	int rv = kevent(r->kq, NULL, 0, r->events.data(), max, tsp);
+	if (rv < 0) {
+		return (errno == EINTR) ? 0 : -1;
+	}
+	for (int i = 0; i < rv; ++i) {
+		struct kevent &ev = r->events[i];
+		out[i].fd = (int)ev.ident;
+		out[i].events = 0;
+		if (ev.filter == EVFILT_READ) {
+			out[i].events |= REACTOR_READ;
+		}
+		if (ev.filter == EVFILT_WRITE) {
+			out[i].events |= REACTOR_WRITE;
+		}
+		if (ev.flags & (EV_ERROR | EV_EOF)) {
+			out[i].events |= REACTOR_ERR;
+		}
+	}
+	return rv;
+}
+
+#endif
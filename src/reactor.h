@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+// small readiness reactor on top of epoll (linux) or kqueue (bsd/macos).
+// registrations are edge-triggered and persistent: the caller changes the
+// interest set only when a connection switches between reading and writing,
+// and must drain an fd until EAGAIN after each notification.
+
+enum {
+	REACTOR_READ = 1,
+	REACTOR_WRITE = 2,
+	REACTOR_ERR = 4, //only reported, never requested
+};
+
+struct ReactorEvent {
+	int fd;
+	uint32_t events;
+};
+
+struct Reactor;
+
+Reactor* reactor_new ();
+void reactor_free (Reactor* r);
+// name of the compiled-in backend
+const char* reactor_backend ();
+
+int32_t reactor_add (Reactor* r, int fd, uint32_t events);
+int32_t reactor_mod (Reactor* r, int fd, uint32_t old_events, uint32_t events);
+int32_t reactor_del (Reactor* r, int fd, uint32_t old_events);
+
+// returns the number of ready events written to out, or -1 on error.
+// timeout_ms < 0 blocks forever
+int reactor_wait (Reactor* r, ReactorEvent* out, int max, int timeout_ms);
@@ -0,0 +1,344 @@
+#include <string.h>
+#include "resp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RESP_X86 1
+#endif
+
+enum {
+	RESP_START = 0, //first byte decides multibulk or inline
+	RESP_ARRAY = 1, //waiting for the rest of "*<n>\r\n"
+	RESP_BULK_HDR = 2, //waiting for "$<len>\r\n"
+	RESP_BULK_DATA = 3, //waiting for <len> bytes + "\r\n"
+	RESP_INLINE = 4, //waiting for the end of an inline command line
+};
+
+//longest header or inline line accepted, like the upstream server
+const size_t k_max_line = 64 << 10;
+
+void resp_reset (RespParser* p) {
+	p->state = RESP_START;
+	p->pos = 0;
+	p->scan = 0;
+	p->nargs = 0;
+	p->bulk = 0;
+	p->args.clear();
+}
+
+static inline size_t find_lf_scalar (const uint8_t* data, size_t from, size_t size) {
+	for (size_t i = from; i < size; ++i) {
+		if (data[i] == '\n') {
+			return i;
+		}
+	}
+	return size;
+}
+
+#ifdef RESP_X86
+// bit i is set when data[i] == '\n', for 64 bytes at a time
+__attribute__((target("sse2")))
+static inline uint64_t lf_mask_sse2 (const uint8_t* data) {
+	const __m128i lf = _mm_set1_epi8('\n');
+	uint64_t mask = 0;
+	for (int i = 0; i < 4; ++i) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(data + 16 * i));
+		mask |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)) << (16 * i);
+	}
+	return mask;
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t lf_mask_avx2 (const uint8_t* data) {
+	const __m256i lf = _mm256_set1_epi8('\n');
+	__m256i lo = _mm256_loadu_si256((const __m256i*)data);
+	__m256i hi = _mm256_loadu_si256((const __m256i*)(data + 32));
+	uint64_t mlo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, lf));
+	uint64_t mhi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, lf));
+	return mlo | (mhi << 32);
+}
+#endif
+
+// the '\n' positions of the last 64-byte window looked at. small requests
+// have several short lines per window, so one vector compare serves all of
+// them. only valid for one call since the buffer may move in between
+struct LfIndex {
+	size_t base = 0;
+	size_t end = 0;
+	uint64_t mask = 0;
+};
+
+// index of the first '\n' in data[from, size), or size if there is none.
+// the parser is compiled once per kernel so this inlines into it, and
+// resp_set_kernel() picks one of the copies
+template <uint64_t (*lf_mask)(const uint8_t*)>
+static inline size_t find_lf (LfIndex* idx, const uint8_t* data, size_t from, size_t size) {
+	if constexpr (lf_mask == nullptr) {
+		(void)idx;
+		return find_lf_scalar(data, from, size);
+	} else {
+		while (from < size) {
+			if (from < idx->base || from >= idx->end) {
+				if (size - from < 64) {
+					return find_lf_scalar(data, from, size);
+				}
+				idx->base = from;
+				idx->end = from + 64;
+				idx->mask = lf_mask(data + from);
+			}
+			uint64_t m = idx->mask >> (from - idx->base);
+			if (m) {
+				return from + (size_t)__builtin_ctzll(m);
+			}
+			from = idx->end;
+		}
+		return size;
+	}
+}
+
+// the line starting at p->pos, searched from p->scan on. returns the index
+// of its '\n', or -1 with p->scan advanced past everything seen so far
+template <uint64_t (*lf_mask)(const uint8_t*)>
+static inline int64_t find_eol (RespParser* p, LfIndex* idx, const uint8_t* data, size_t size) {
+	if (p->scan < p->pos) {
+		p->scan = p->pos;
+	}
+	size_t lf = find_lf<lf_mask>(idx, data, p->scan, size);
+	if (lf == size) {
+		p->scan = size;
+		return -1;
+	}
+	return (int64_t)lf;
+}
+
+// the n <= 8 digits ending at data[end] without a branch per digit: they
+// are loaded right-aligned into a word padded with '0', checked in one go,
+// then combined pairwise (SWAR, 2 -> 4 -> 8 digits per lane)
+static inline bool parse_digits8 (const uint8_t* data, size_t end, size_t n, uint64_t* out) {
+	uint64_t v = 0x3030303030303030ull;
+	if (end >= 8) {
+		//one unaligned load, the bytes in front of the digits are masked
+		uint64_t pad = (~0ull >> (8 * n - 1)) >> 1;
+		memcpy(&v, data + end - 8, 8);
+		v = (v & ~pad) | (0x3030303030303030ull & pad);
+	} else {
+		memcpy((uint8_t*)&v + (8 - n), data + end - n, n);
+	}
+	//every byte must be in '0'..'9'
+	uint64_t hi = v & 0xf0f0f0f0f0f0f0f0ull;
+	uint64_t over = (v + 0x0606060606060606ull) & 0xf0f0f0f0f0f0f0f0ull;
+	if (hi != 0x3030303030303030ull || over != 0x3030303030303030ull) {
+		return false;
+	}
+	v -= 0x3030303030303030ull;
+	v = (v * 10 + (v >> 8)) & 0x00ff00ff00ff00ffull;
+	v = (v * 100 + (v >> 16)) & 0x0000ffff0000ffffull;
+	v = (v * 10000 + (v >> 32)) & 0x00000000ffffffffull;
+	*out = v;
+	return true;
+}
+
+// a decimal between begin and the "\r\n" that ends at eol
+static inline bool parse_int (const uint8_t* data, size_t begin, size_t eol, int64_t* out) {
+	if (eol < begin + 2 || data[eol - 1] != '\r') {
+		return false;
+	}
+	size_t end = eol - 1;
+	bool neg = false;
+	if (begin < end && data[begin] == '-') {
+		neg = true;
+		begin++;
+	}
+	size_t n = end - begin;
+	if (n == 0 || n > 16) {
+		return false;
+	}
+	uint64_t v = 0;
+	if (n <= 8) {
+		if (!parse_digits8(data, end, n, &v)) {
+			return false;
+		}
+	} else {
+		uint64_t high = 0;
+		uint64_t low = 0;
+		if (!parse_digits8(data, end - 8, n - 8, &high)
+			|| !parse_digits8(data, end, 8, &low))
+		{
+			return false;
+		}
+		v = high * 100000000ull + low;
+	}
+	*out = neg ? -(int64_t)v : (int64_t)v;
+	return true;
+}
+
+static int64_t parse_inline (RespParser* p, const uint8_t* data, size_t eol) {
+	size_t end = (eol > 0 && data[eol - 1] == '\r') ? eol - 1 : eol;
+	size_t i = 0;
+	while (i < end) {
+		while (i < end && (data[i] == ' ' || data[i] == '\t')) {
+			i++;
+		}
+		size_t start = i;
+		while (i < end && data[i] != ' ' && data[i] != '\t') {
+			i++;
+		}
+		if (i > start) {
+			p->args.push_back(RespArg{start, i - start});
+		}
+	}
+	return (int64_t)eol + 1;
+}
+
+template <uint64_t (*lf_mask)(const uint8_t*)>
+__attribute__((always_inline))
+static inline int64_t parse_impl (RespParser* p, const uint8_t* data, size_t size,
+	size_t max_bulk, size_t max_args)
+{
+	LfIndex idx;
+	while (1) {
+		switch (p->state) {
+		case RESP_START:
+			if (size == 0) {
+				return 0;
+			}
+			p->state = (data[0] == '*') ? RESP_ARRAY : RESP_INLINE;
+			p->pos = 0;
+			p->scan = 0;
+			break;
+
+		case RESP_INLINE:
+		case RESP_ARRAY: {
+			int64_t eol = find_eol<lf_mask>(p, &idx, data, size);
+			if (eol < 0) {
+				return (size - p->pos > k_max_line) ? -1 : 0;
+			}
+			if (p->state == RESP_INLINE) {
+				return parse_inline(p, data, (size_t)eol);
+			}
+			int64_t n = 0;
+			if (!parse_int(data, 1, (size_t)eol, &n) || n > (int64_t)max_args) {
+				return -1;
+			}
+			p->pos = (size_t)eol + 1;
+			if (n <= 0) {
+				return (int64_t)p->pos; //empty or null array, nothing to run
+			}
+			p->nargs = n;
+			p->state = RESP_BULK_HDR;
+			break;
+		}
+
+		case RESP_BULK_HDR: {
+			if (p->nargs == 0) {
+				return (int64_t)p->pos;
+			}
+			if (p->pos >= size) {
+				return 0;
+			}
+			if (data[p->pos] != '$') {
+				return -1;
+			}
+			int64_t eol = find_eol<lf_mask>(p, &idx, data, size);
+			if (eol < 0) {
+				return (size - p->pos > k_max_line) ? -1 : 0;
+			}
+			int64_t len = 0;
+			if (!parse_int(data, p->pos + 1, (size_t)eol, &len)
+				|| len < 0 || len > (int64_t)max_bulk)
+			{
+				return -1;
+			}
+			p->pos = (size_t)eol + 1;
+			p->bulk = len;
+			p->state = RESP_BULK_DATA;
+			break;
+		}
+
+		case RESP_BULK_DATA: {
+			size_t len = (size_t)p->bulk;
+			if (size - p->pos < len + 2) {
+				return 0;
+			}
+			if (data[p->pos + len] != '\r' || data[p->pos + len + 1] != '\n') {
+				return -1;
+			}
+			p->args.push_back(RespArg{p->pos, len});
+			p->pos += len + 2;
+			p->nargs--;
+			p->state = RESP_BULK_HDR;
+			break;
+		}
+
+		default:
+			return -1;
+		}
+	}
+}
+
+typedef int64_t (*parse_fn)(RespParser*, const uint8_t*, size_t, size_t, size_t);
+
+static int64_t parse_scalar (RespParser* p, const uint8_t* data, size_t size,
+	size_t max_bulk, size_t max_args)
+{
+	return parse_impl<nullptr>(p, data, size, max_bulk, max_args);
+}
+
+#ifdef RESP_X86
+__attribute__((target("sse2")))
+static int64_t parse_sse2 (RespParser* p, const uint8_t* data, size_t size,
+	size_t max_bulk, size_t max_args)
+{
+	return parse_impl<lf_mask_sse2>(p, data, size, max_bulk, max_args);
+}
+
+__attribute__((target("avx2")))
+static int64_t parse_avx2 (RespParser* p, const uint8_t* data, size_t size,
+	size_t max_bulk, size_t max_args)
+{
+	return parse_impl<lf_mask_avx2>(p, data, size, max_bulk, max_args);
+}
+#endif
+
+static parse_fn g_parse = parse_scalar;
+static const char* g_kernel = "scalar";
+
+bool resp_set_kernel (const char* name) {
+	if (!strcmp(name, "scalar")) {
+		g_parse = parse_scalar;
+#ifdef RESP_X86
+	} else if (!strcmp(name, "sse2") && __builtin_cpu_supports("sse2")) {
+		g_parse = parse_sse2;
+	} else if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+		g_parse = parse_avx2;
+#endif
+	} else {
+		return false;
+	}
+	g_kernel = name;
+	return true;
+}
+
+void resp_init () {
+#ifdef RESP_X86
+	__builtin_cpu_init();
+#endif
+}
+
+const char* resp_kernel () {
+	return g_kernel;
+}
+
+int64_t resp_parse (RespParser* p, const uint8_t* data, size_t size,
+	size_t max_bulk, size_t max_args)
+{
+	return g_parse(p, data, size, max_bulk, max_args);
+}
+
+size_t resp_want (const RespParser* p, size_t size) {
+	if (p->state != RESP_BULK_DATA) {
+		return 0;
+	}
+	size_t need = p->pos + (size_t)p->bulk + 2;
+	return need > size ? need - size : 0;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// incremental parser for RESP requests (multibulk arrays of bulk strings)
+// and inline commands. the parser remembers how far it got, so feeding it
+// the same request again after more bytes arrived resumes where it stopped
+// instead of re-scanning the bytes it has already seen.
+
+// reads the cpu features (cpuid). call once at startup, before
+// resp_set_kernel()
+void resp_init ();
+// pick the delimiter search: "scalar" (the default), "sse2" or "avx2".
+// false if not supported here. the vector ones only pay off for long
+// lines, RESP headers are a few bytes
+bool resp_set_kernel (const char* name);
+const char* resp_kernel ();
+
+struct RespArg {
+	size_t off; //relative to the start of the request
+	size_t len;
+};
+
+struct RespParser {
+	uint32_t state = 0;
+	size_t pos = 0; //bytes of the request already consumed by the parser
+	size_t scan = 0; //how far the current line was searched for '\n'
+	int64_t nargs = 0; //bulk strings still expected
+	int64_t bulk = 0; //length of the bulk string being read
+	std::vector<RespArg> args;
+};
+
+// parse the request starting at data[0]. returns its total length once it
+// is complete (args then holds every argument), 0 if more bytes are
+// needed, or -1 on a protocol error. call resp_reset() before the next one
+void resp_reset (RespParser* p);
+int64_t resp_parse (RespParser* p, const uint8_t* data, size_t size,
+	size_t max_bulk, size_t max_args);
+
+// bytes still missing for a bulk string being read, 0 when unknown
+size_t resp_want (const RespParser* p, size_t size);
@@ -2,18 +2,110 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <poll.h>
 #include <unistd.h>
 #include <sys/socket.h>
-#include <sys/event.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <signal.h>
+#include <new>
+#include <string>
+#include <string_view>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include "common.h"
+#include "protocol.h"
+#include "blob.h"
+#include "slab.h"
+#include "reactor.h"
+#include "buffer.h"
+#include "hashtable.h"
+#include "resp.h"
+#include "uring.h"
+#include "timer.h"
+#include "list.h"
+#include "zset.h"
+#include "snapshot.h"
+#include "aof.h"
+#include "backlog.h"
+#include "cluster.h"
 
-const size_t k_max_msg = 4096;
+//largest request accepted, the buffers only grow this far for large values
+const size_t k_max_msg = 32 << 20;
+//read size when no large request is pending
+const size_t k_read_chunk = 4096;
+//buffer capacity and queued value slots a drained connection keeps, so a
+//request/response client does not pay a malloc and free per request
+//while a connection that once took a large request does not hold on to it
+const size_t k_conn_buf_keep = 4096;
+const size_t k_conn_refs_keep = 16;
+//loop timeout while accepting waits for fds to be freed
+const int k_accept_retry_ms = 100;
+
+//an fd held in reserve by each worker thread. when accept() runs out of
+//fds it is closed to take one pending connection and close that, so the
+//backlog drains instead of stalling the edge-triggered listener. without
+//it accepting is retried from the loop
+static thread_local int t_spare_fd = -1;
+static thread_local bool t_accept_retry = false;
+
+//log every request, off by default since stdout is shared by all workers
+static bool g_verbose = false;
+//queued output at which a connection stops reading and parsing, so an
+//aggressively pipelining client cannot grow its queue without bound
+static size_t g_output_hwm = 256 << 10;
+//completion-based loop on io_uring instead of the readiness reactor
+static bool g_io_uring = false;
+//submission queue size and provided receive buffers per worker ring
+const uint32_t k_uring_entries = 1024;
+const uint32_t k_uring_bufs = 1024;
+//values at least this long are sent from the keyspace by writev() instead
+//of being copied into the output buffer
+const size_t k_ref_min = 1024;
+//iovecs gathered per writev()
+const int k_max_iov = 64;
+//time a loop iteration may spend deleting expired keys, the pause after
+//a backlog used it up, and the timers handled between checks of the clock.
+//a backlog of expired keys gets at most a fifth of the cpu
+const uint64_t k_expire_budget_us = 250;
+const uint64_t k_expire_rest_us = 1000;
+const size_t k_expire_batch = 128;
+//close connections without traffic for this long, and connections that
+//take longer than this to send one request, so a client trickling bytes
+//cannot hold a connection and its buffers forever. 0 disables
+static uint64_t g_idle_timeout_ms = 300 * 1000;
+static uint64_t g_read_timeout_ms = 30 * 1000;
+//snapshot written by SAVE and BGSAVE and loaded at startup, and the file
+//it is written to first
+static std::string g_snapshot_path = "dump.rdb";
+static std::string g_snapshot_tmp;
+//write buffer of a save, followed by room for the index of chunks. 1M
+//chunks of 1 MiB cover 1 TiB before the last chunk takes the rest, and
+//only the part of the index in use is ever touched
+const size_t k_snapshot_buf = 1 << 20;
+const size_t k_snapshot_index = 1 << 20;
+const size_t k_snapshot_mem = k_snapshot_buf + k_snapshot_index * sizeof(SnapChunk);
+//threads decoding the snapshot at startup, 0 for one per cpu, and the
+//chunks per thread read ahead of them
+static int g_load_threads = 0;
+const size_t k_snapshot_readahead = 2;
+//bytes of the replication stream kept for replicas to resume from. the
+//ring is allocated when the first replica connects
+static size_t g_repl_backlog_size = 64 << 20;
 
 static void msg (const char* msg) {
 	fprintf(stderr, "%s\n", msg);
@@ -24,22 +116,194 @@ static void errmsg (const char* msg) {
 	abort();
 }
 
+static uint64_t get_monotonic_us () {
+	struct timespec tv = {0, 0};
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_nsec / 1000;
+}
+
+static uint64_t get_monotonic_ms () {
+	return get_monotonic_us() / 1000;
+}
+
+// loop timeout in ms until a deadline on the ms clock, -1 if there is
+// none. now is truncated to the ms, so one more is waited for the
+// deadline to have passed. a far deadline is capped, which only means an
+// early wakeup, so the wait always fits in an int
+static int deadline_to_timeout (uint64_t next, uint64_t now) {
+	const uint64_t k_max_wait_ms = 1000 * 1000;
+	if (next == UINT64_MAX) {
+		return -1;
+	}
+	uint64_t wait = next > now ? next - now + 1 : 0;
+	return (int)(wait < k_max_wait_ms ? wait : k_max_wait_ms);
+}
+
+// unix time in ms, for expiries that outlive the process
+static int64_t get_wall_ms () {
+	struct timespec tv = {0, 0};
+	clock_gettime(CLOCK_REALTIME, &tv);
+	return (int64_t)tv.tv_sec * 1000 + tv.tv_nsec / 1000000;
+}
+
 enum { //state to define what to do with connection
-    STATE_REQ = 0, //reading requests
-    STATE_RES = 1, //sending responses
+    STATE_REQ = 0, //reading requests, queued output is flushed alongside
+    STATE_RES = 1, //output queue over g_output_hwm, reading is paused
     STATE_END = 2, //mark for deletion
+	STATE_BLOCKED = 3, //in BLPOP or BRPOP, requests are buffered but not run
+};
+
+enum { //how a blocked connection was woken
+	BLOCK_WAITING = 0,
+	BLOCK_SERVED = 1, //a push popped a value for it
+	BLOCK_MOVED = 2, //the slot of its keys went to another node
+};
+
+enum { //wire protocol, sniffed from the first bytes of a connection
+	PROTO_UNKNOWN = 0,
+	PROTO_BIN = 1, //length-prefixed frames with typed replies
+	PROTO_RESP2 = 2, //RESP or inline requests, RESP2 replies
+	PROTO_RESP3 = 3, //after HELLO 3
+};
+
+enum { //what a connection from a replica is being sent
+	REPL_NONE = 0, //not a replica
+	REPL_WAIT_SYNC = 1, //full resync, the snapshot is being written
+	REPL_SEND_SYNC = 2, //full resync, sending the snapshot
+	REPL_ONLINE = 3, //the stream, from the backlog
+};
+
+// a stored value queued for sending in place, between the wbuf bytes
+// before and after it
+struct OutRef {
+	uint64_t pos; //wbuf stream offset the value goes at, see wbuf_sent
+	Blob* val;
+	size_t sent;
+};
+
+struct Conn;
+struct BlockKey;
+
+// one of the keys a blocked connection waits on
+struct BlockWait {
+	DList link; //in bk->waiters, in the order the connections blocked
+	BlockKey* bk = NULL; //NULL once unlinked
+	Conn* conn = NULL;
 };
 
 struct Conn {
     int fd = -1;
     uint32_t state = 0;
+	uint32_t proto = PROTO_UNKNOWN;
+	//resumable parser state for a partially received RESP request
+	RespParser resp;
 	//buffer for reading
-    size_t rbuf_size = 0;
-    uint8_t rbuf[4 + k_max_msg];
-	//buffer for writing
-    size_t wbuf_size = 0;
-	size_t wbuf_sent = 0;
-    uint8_t wbuf[4 + k_max_msg];
+	Buffer rbuf;
+	//output queue, replies are appended and sent from the head. it can
+	//hold any number of pipelined replies, bounded by g_output_hwm
+	Buffer wbuf;
+	//large values in the output queue, in order, and the wbuf bytes sent
+	//so far which their positions are relative to
+	std::vector<OutRef> refs;
+	size_t ref_head = 0;
+	size_t ref_bytes = 0; //value bytes still to send
+	uint64_t wbuf_sent = 0;
+	//io_uring only: the part of the queue a send is in flight for. the
+	//kernel reads it asynchronously, so new replies go to wbuf meanwhile
+	Buffer sbuf;
+	bool sending = false;
+	bool recv_armed = false; //multishot recv still active
+	bool recv_stopping = false; //cancel submitted
+	//links into the worker's idle list, ordered by last_active, and while
+	//a request is partially read into its reading list, ordered by
+	//read_start. both in ms
+	DList idle;
+	DList reading;
+	uint64_t last_active = 0;
+	uint64_t read_start = 0;
+	//with the AOF on, replies wait in the queue until the commands they
+	//answer have been written, see aof_flush(). linked into the worker's
+	//aof_waiting list meanwhile
+	bool aof_wait = false;
+	DList aof_waiting;
+	//on a primary, a connection from a replica: the stream offset queued
+	//up to, the offset the replica acknowledged, and during a full resync
+	//the snapshot and how much of it is queued. linked into the worker's
+	//replicas list and into g_repl.replicas
+	uint32_t repl = REPL_NONE;
+	uint64_t repl_off = 0;
+	uint64_t repl_ack = 0;
+	uint64_t repl_ack_ms = 0;
+	struct ReplSync* repl_sync = NULL;
+	uint64_t sync_pos = 0;
+	DList repl_link;
+	DList repl_all;
+	//on a replica, the link applying the primary's stream. it may write
+	//while clients may not
+	bool primary = false;
+	//in cluster mode: ASKING was the last command, and the connection a
+	//slot migration sends keys over, see migrate_tick()
+	bool asking = false;
+	bool migrate = false;
+	//the worker that owns the connection, its channel and pattern
+	//subscriptions through Sub::conn_link, and while messages are queued
+	//for it in a loop iteration, the interest set before the first one.
+	//pub_soft_ms is when the queue went over the soft limit, 0 if it is
+	//under it
+	int worker = 0;
+	DList subs;
+	uint32_t nsubs = 0;
+	bool pub_touched = false;
+	uint32_t pub_events = 0;
+	uint64_t pub_soft_ms = 0;
+	//in BLPOP or BRPOP: the keys waited on, sized until the worker has
+	//replied, and the timeout in the worker's block_timers. a push on any
+	//worker sets the result under g_block.lock and links the connection
+	//into the unblocked list of its worker, see block_serve()
+	std::vector<BlockWait> waits;
+	bool block_left = false;
+	TNode block_timer;
+	uint32_t block_result = BLOCK_WAITING;
+	std::string block_key;
+	Blob* block_val = NULL;
+	DList unblock_link;
+};
+
+struct PubMsg;
+
+// each worker owns a listening socket, an event loop and its connections,
+// so a connection never crosses threads after accept
+struct Worker {
+	int id = 0;
+	int listen_fd = -1;
+	Reactor* reactor = NULL;
+	//map of all client connections, key: fd
+	std::vector<Conn*> fd2conn;
+	//connections in timeout order, see conn_expired()
+	DList idle_conns;
+	DList reading_conns;
+	//connections whose replies wait for the next aof_flush()
+	DList aof_waiting;
+	//connections from replicas, fed at the end of every iteration. other
+	//workers write to wake_fd[1] when the stream grew, unless woken is
+	//already set
+	DList replicas;
+	std::atomic<int> nreplicas{0};
+	int wake_fd[2] = {-1, -1};
+	std::atomic<bool> woken{false};
+	//loop iterations started, see migrate_tick()
+	std::atomic<uint64_t> ticks{0};
+	//messages published for this worker's subscribers, by any worker, and
+	//the connections they were queued on in this iteration
+	std::mutex inbox_lock;
+	std::vector<PubMsg*> inbox;
+	std::vector<Conn*> pub_touched;
+	//connections blocked in BLPOP or BRPOP with a timeout, and those a
+	//push has woken, under inbox_lock. both are replied to at the end of
+	//the iteration, a blocked connection costs the loop nothing until then
+	TWheel block_timers;
+	DList unblocked;
+	std::thread thread;
 };
 
 static void fd_set_nb (int fd) {
@@ -59,6 +323,13 @@ static void fd_set_nb (int fd) {
 
 }
 
+//kept out of the snapshot and resync children
+static void fd_set_cloexec (int fd) {
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+		errmsg("fcntl error");
+	}
+}
+
 static void conn_put (std::vector<Conn*> &fd2conn, struct Conn* conn) {
 	if(fd2conn.size() <= (size_t)conn->fd) {
 		fd2conn.resize(conn->fd + 1);
@@ -66,240 +337,5510 @@ static void conn_put (std::vector<Conn*> &fd2conn, struct Conn* conn) {
 	fd2conn[conn->fd] = conn;
 }
 
-static int32_t accept_new_conn (std::vector<Conn *> &fd2conn, int fd) {
+// replies not yet handed to the kernel
+static size_t conn_queued (Conn* conn) {
+	return buf_size(&conn->wbuf) + conn->ref_bytes + buf_size(&conn->sbuf);
+}
+
+// interest set for a connection, derived from its state.
+// edge-triggered, so every handler must drain until EAGAIN
+static uint32_t conn_events (Conn* conn) {
+	if (conn->state == STATE_RES) {
+		return REACTOR_WRITE;
+	}
+	return conn_queued(conn) ? (REACTOR_READ | REACTOR_WRITE) : REACTOR_READ;
+}
+
+// out of fds: takes one pending connection with the reserve fd and
+// closes it, so the client sees the connection close rather than wait in
+// the backlog. returns 0 if one was taken. if the reserve cannot be
+// opened again, accepting is retried later
+static int32_t accept_shed (int fd) {
+	int connfd = -1;
+	if (t_spare_fd >= 0) {
+		(void)close(t_spare_fd);
+		connfd = accept(fd, NULL, NULL);
+		if (connfd >= 0) {
+			msg("accept(): out of file descriptors, connection dropped");
+			(void)close(connfd);
+		}
+		t_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	}
+	if (t_spare_fd < 0) {
+		msg("accept(): out of file descriptors, retrying");
+		t_accept_retry = true;
+		return -1;
+	}
+	return connfd >= 0 ? 0 : -1;
+}
+
+static Conn* conn_new (Worker* w, int connfd) {
+	//replies are flushed per read batch, a partial batch must not wait
+	//for the client's delayed ACK
+	int nodelay = 1;
+	(void)setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	//connections come and go, so they are recycled through the slab
+	//allocator instead of fragmenting the heap
+	Conn* conn = new (slab_alloc(sizeof(Conn))) Conn();
+	conn->fd = connfd;
+	conn->worker = w->id;
+	conn->state = STATE_REQ;
+	buf_init(&conn->rbuf);
+	buf_init(&conn->wbuf);
+	buf_init(&conn->sbuf);
+	conn_put(w->fd2conn, conn);
+	if (g_idle_timeout_ms) {
+		conn->last_active = get_monotonic_ms();
+		dlist_push_back(&w->idle_conns, &conn->idle);
+	}
+	return conn;
+}
+
+static void repl_conn_gone (Conn* conn);
+static void migrate_conn_gone (Conn* conn);
+static void pubsub_conn_gone (Conn* conn);
+static void block_conn_gone (Worker* w, Conn* conn);
+
+static void conn_destroy (Worker* w, Conn* conn) {
+	w->fd2conn[conn->fd] = NULL;
+	if (!dlist_empty(&conn->repl_link)) {
+		dlist_detach(&conn->repl_link);
+		w->nreplicas--;
+	}
+	if (conn->repl) {
+		repl_conn_gone(conn);
+	}
+	if (conn->migrate) {
+		migrate_conn_gone(conn);
+	}
+	if (conn->nsubs) {
+		pubsub_conn_gone(conn);
+	}
+	block_conn_gone(w, conn);
+	dlist_detach(&conn->idle);
+	dlist_detach(&conn->reading);
+	dlist_detach(&conn->aof_waiting);
+	(void)close(conn->fd);
+	buf_release(&conn->rbuf);
+	buf_release(&conn->wbuf);
+	buf_release(&conn->sbuf);
+	for (size_t i = conn->ref_head; i < conn->refs.size(); ++i) {
+		blob_unref(conn->refs[i].val);
+	}
+	conn->~Conn();
+	slab_free(conn, sizeof(Conn));
+}
+
+// returns 0 while the backlog may hold more connections
+static int32_t accept_new_conn (Worker* w) {
 	// accept
 	struct sockaddr_in client_addr = {};
 	socklen_t socklen = sizeof(client_addr);
-	int connfd = accept(fd, (struct sockaddr*) &client_addr, &socklen);
+	int connfd = accept(w->listen_fd, (struct sockaddr*) &client_addr, &socklen);
 	if (connfd < 0) {
-		//msg("accept() error");
+		if (errno == EMFILE || errno == ENFILE) {
+			return accept_shed(w->listen_fd);
+		}
+		if (errno == EINTR || errno == ECONNABORTED) {
+			return 0;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			msg("accept() error");
+		}
 		return -1;
 	}
 
 	fd_set_nb(connfd);
-	struct Conn* conn = (struct Conn*)malloc(sizeof(struct Conn));
-	if (!conn) {
-		close(connfd);
+	Conn* conn = conn_new(w, connfd);
+
+	//register once, the registration persists until the fd is closed
+	if (reactor_add(w->reactor, connfd, conn_events(conn)) < 0) {
+		msg("reactor_add() error");
+		conn_destroy(w, conn);
 		return -1;
 	}
-	conn->fd = connfd;
-	conn->state = STATE_REQ;
-	conn->rbuf_size = 0;
-	conn->wbuf_size = 0;
-	conn->wbuf_sent = 0;
-	conn_put(fd2conn, conn);
 	return 0;
 }
-static void state_req(Conn* conn);
-static void state_res(Conn* conn);
 
-static bool try_one_request (Conn* conn) {
-	if (conn->rbuf_size < 4) {
-		return false;
+// record traffic on the connection. moving it to the tail keeps the idle
+// list in last_active order. it joins the reading list when a partial
+// request is left in rbuf, and stays there until that request completes
+static void conn_touch (Worker* w, Conn* conn, uint64_t now) {
+	if (conn->state == STATE_END) {
+		dlist_detach(&conn->idle);
+		dlist_detach(&conn->reading);
+		return;
 	}
-	uint32_t len = 0;
-	memcpy(&len, &conn->rbuf[0], 4);
-	if (len > k_max_msg) {
-		msg("too long");
-		conn->state = STATE_END;
-		return false;
+	if (g_idle_timeout_ms) {
+		conn->last_active = now;
+		dlist_detach(&conn->idle);
+		//a subscriber waits for messages however long they take, and a
+		//blocked connection for a push
+		if (!conn->nsubs && conn->state != STATE_BLOCKED) {
+			dlist_push_back(&w->idle_conns, &conn->idle);
+		}
+	}
+	bool partial = conn->state == STATE_REQ && buf_size(&conn->rbuf);
+	if (!partial) {
+		dlist_detach(&conn->reading);
+	} else if (g_read_timeout_ms && dlist_empty(&conn->reading)) {
+		conn->read_start = now;
+		dlist_push_back(&w->reading_conns, &conn->reading);
 	}
+}
 
-	if (4 + len > conn->rbuf_size) {
-		return false;
+// a connection past one of the timeouts, taken off both lists, or NULL.
+// only the list heads are looked at, so finding n expired connections
+// costs O(n) however many are open
+static Conn* conn_expired (Worker* w, uint64_t now) {
+	if (!dlist_empty(&w->idle_conns)) {
+		Conn* conn = container_of(w->idle_conns.next, Conn, idle);
+		if (conn->last_active + g_idle_timeout_ms <= now) {
+			msg("idle timeout");
+			dlist_detach(&conn->idle);
+			dlist_detach(&conn->reading);
+			return conn;
+		}
+	}
+	if (!dlist_empty(&w->reading_conns)) {
+		Conn* conn = container_of(w->reading_conns.next, Conn, reading);
+		if (conn->read_start + g_read_timeout_ms <= now) {
+			msg("request read timeout");
+			dlist_detach(&conn->idle);
+			dlist_detach(&conn->reading);
+			return conn;
+		}
+	}
+	return NULL;
+}
+
+// loop timeout in ms until the next connection times out, -1 if none can
+static int conn_timeout (Worker* w, uint64_t now) {
+	uint64_t next = UINT64_MAX;
+	if (!dlist_empty(&w->idle_conns)) {
+		Conn* conn = container_of(w->idle_conns.next, Conn, idle);
+		next = conn->last_active + g_idle_timeout_ms;
 	}
+	if (!dlist_empty(&w->reading_conns)) {
+		Conn* conn = container_of(w->reading_conns.next, Conn, reading);
+		uint64_t at = conn->read_start + g_read_timeout_ms;
+		next = at < next ? at : next;
+	}
+	return deadline_to_timeout(next, now);
+}
+static void state_req(Conn* conn);
+static void state_res(Conn* conn);
+
+enum { //type of the value a key holds
+	T_STR = 0,
+	T_ZSET = 1,
+	T_LIST = 2,
+};
 
-	printf("Client says %.*s \n", len, &conn->rbuf[4]);
+// a key-value pair in the keyspace
+struct Entry {
+	HNode node;
+	std::string key;
+	uint32_t type = T_STR;
+	//the key's slot, which picks its shard, and in cluster mode whether
+	//the key is on its way to another node, see migrate_batch()
+	uint16_t slot = 0;
+	bool moving = false;
+	union {
+		Blob* val = NULL;
+		ZSet* zset;
+		std::deque<Blob*>* list;
+	};
+	//linked into its shard's ttl wheel while the key has an expiry
+	TNode ttl;
+	//in cluster mode linked into the keys of its slot, or into the
+	//migration batch it is in
+	DList slot_link;
+};
 
-	memcpy(&conn->wbuf[0], &len, 4);
-	memcpy(&conn->wbuf[4], &conn->rbuf[4], len);
-	conn->wbuf_size = 4 + len;
+//the keyspace is split into shards, each with its own lock and table, so
+//workers only wait for each other on keys of the same shard
+const size_t k_shards = 64;
+static_assert(k_shards <= 64, "a set of shards is a 64-bit mask");
+const uint64_t k_all_shards = ~(uint64_t)0 >> (64 - k_shards);
 
-	size_t remain = conn->rbuf_size - 4 - len;
-	if (remain) {
-		memmove(conn->rbuf, &conn->rbuf[4+len], remain);
-	}
-	conn->rbuf_size = remain;
+struct Shard {
+	std::mutex lock;
+	HMap db;
+	//key expiries, ms on the monotonic clock
+	TWheel ttl;
+	//when the wheel next has work, UINT64_MAX if it is empty. read
+	//without the lock, so the active expiry only locks shards with work
+	std::atomic<uint64_t> expire_next{UINT64_MAX};
+};
 
-	//change state
-	conn->state = STATE_RES;
-	state_res(conn);
+static struct {
+	Shard shards[k_shards];
+	//the log, the forked child, the replication stream and the cluster
+	//nodes. locks are taken in this order: g_aof.write_lock,
+	//g_migrate.lock, shard locks by ascending index, g_block.lock, this
+	//one
+	std::mutex lock;
+} g_data;
 
-	return (conn->state == STATE_REQ);
+// the keys of the slots that are equal modulo k_shards. a slot's keys
+// share a shard, so a cluster command, whose keys share a slot, takes
+// one lock
+static Shard* slot_shard (uint32_t slot) {
+	return &g_data.shards[slot % k_shards];
 }
 
-static bool try_fill_buffer (Conn* conn) {
-	assert(conn->rbuf_size < sizeof(conn->rbuf));
-	ssize_t rv = 0;
-	do {
-		size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;
-		rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap);
-	} while (rv < 0 && errno == EINTR);
+static Shard* key_shard (std::string_view key) {
+	return slot_shard(key_slot(key.data(), key.size()));
+}
 
-	if (rv < 0 && errno == EAGAIN) {
-		// got EAGAIN, stop.
-		return false;
+static Shard* entry_shard (Entry* ent) {
+	return slot_shard(ent->slot);
+}
+
+// the shards of cmd[first], cmd[first + step] and so on before end, one
+// bit each
+static uint64_t shard_mask (std::vector<std::string_view> &cmd, size_t first, size_t end, size_t step) {
+	uint64_t mask = 0;
+	for (size_t i = first; i < end; i += step) {
+		mask |= (uint64_t)1 << (key_slot(cmd[i].data(), cmd[i].size()) % k_shards);
 	}
+	return mask;
+}
 
-	if (rv < 0) {
-		msg("read() error");
-		conn->state = STATE_END;
-		return false;
+// holds the locks of a set of shards for a command over several keys.
+// they are taken in ascending order, so two commands that share shards
+// cannot deadlock
+struct ShardLocks {
+	uint64_t mask = 0;
+
+	explicit ShardLocks (uint64_t m) : mask(m) {
+		for (size_t i = 0; i < k_shards; ++i) {
+			if (mask & (uint64_t)1 << i) {
+				g_data.shards[i].lock.lock();
+			}
+		}
 	}
-	
-	if (rv == 0) {
-		if (conn->rbuf_size > 0) {
-			msg("unexpected EOF");
-		} else {
-			msg("EOF");
+	~ShardLocks () {
+		for (size_t i = 0; i < k_shards; ++i) {
+			if (mask & (uint64_t)1 << i) {
+				g_data.shards[i].lock.unlock();
+			}
 		}
-		conn->state = STATE_END;
-		return false;
 	}
+};
 
-	conn->rbuf_size += (size_t)rv;
-	assert(conn->rbuf_size <= sizeof(conn->rbuf));
+// probe for the maps keyed by name: the hash and a view of the name, so
+// a lookup never copies the key. the eq functions get the node in the map
+// as lhs and the probe as rhs
+struct KeyProbe {
+	HNode node;
+	std::string_view key;
+};
 
-	while(try_one_request(conn)) {}
-	return (conn->state == STATE_REQ);
+static KeyProbe key_probe (std::string_view key) {
+	KeyProbe probe;
+	probe.node.hcode = str_hash((const uint8_t*)key.data(), key.size());
+	probe.key = key;
+	return probe;
 }
 
-static bool try_flush_buffer (Conn* conn) {
-	ssize_t rv = 0;
-	do {
-		size_t remain = conn->wbuf_size - conn->wbuf_sent;
-		rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], remain);
-	} while (rv < 0 && errno == EINTR);
+// a probe for a node already in its map, with the hash it was stored under
+static KeyProbe key_probe (std::string_view key, const HNode* node) {
+	KeyProbe probe;
+	probe.node.hcode = node->hcode;
+	probe.key = key;
+	return probe;
+}
 
-	if (rv < 0 && errno == EAGAIN) {
-		//got EAGAIN, stop
-	    return false;
-	}
+static struct {
+	//set once the log has been replayed, before the workers start
+	bool on = false;
+	int fsync = AOF_FSYNC_EVERYSEC;
+	std::string path = "appendonly.aof";
+	std::string tmp; //the next log while a rewrite finishes
+	std::string base; //snapshot the log starts from, written by a rewrite
+	std::string base_tmp;
+	int fd = -1;
+	//commands not written yet, appended under g_data.lock
+	Buffer buf;
+	//while a rewrite runs, the commands since its fork, for the new log.
+	//under g_data.lock
+	bool rewriting = false;
+	Buffer rewrite;
+	//one writer at a time, so batches reach the file in order. out is
+	//the batch being written, under write_lock
+	std::mutex write_lock;
+	Buffer out;
+	bool write_failed = false;
+	//bytes appended, written to the file and covered by an fsync, all
+	//counted from startup
+	std::atomic<uint64_t> appended{0};
+	std::atomic<uint64_t> written{0};
+	std::atomic<uint64_t> synced{0};
+	//held by whoever calls fsync on fd or replaces it
+	std::mutex sync_lock;
+} g_aof;
 
-	if (rv < 0) {
-		msg("write() error");
-		conn->state = STATE_END;
-		return false;
+enum { //state of a full resync snapshot
+	SYNC_WRITING = 0, //the child is writing it
+	SYNC_READY = 1,
+	SYNC_FAILED = 2,
+};
+
+// the snapshot a full resync sends, shared by the replicas that asked for
+// one while it was being written. the stream continues from offset, where
+// it was at the fork. the file is unlinked once written, fd keeps it
+struct ReplSync {
+	uint64_t offset = 0;
+	int fd = -1;
+	uint64_t size = 0;
+	std::atomic<int> state{SYNC_WRITING};
+	int refs = 0; //replicas sending it, under g_data.lock
+};
+
+static struct {
+	//on a primary. the stream is every propagated command, in order, and
+	//offset counts its bytes. the backlog holds the end of it, both under
+	//g_data.lock
+	char replid[41] = {};
+	std::atomic<uint64_t> offset{0};
+	Backlog backlog;
+	Buffer scratch; //encodes commands when the AOF is off
+	ReplSync* sync = NULL; //the full resync snapshot being written
+	std::string sync_path;
+	DList replicas; //every replica connection, through repl_all
+	uint64_t full_syncs = 0;
+	uint64_t partial_syncs = 0;
+	uint64_t partial_fails = 0;
+	//on a replica: where the primary is, under cfg_lock. cfg_gen changes
+	//with every REPLICAOF, which makes the link reconnect. on a replica
+	//offset is the stream offset applied
+	std::mutex cfg_lock;
+	std::string host;
+	int port = 0;
+	std::string primary_replid;
+	std::atomic<uint64_t> cfg_gen{0};
+	std::atomic<bool> replica{false};
+	std::atomic<bool> link_up{false};
+	bool thread_started = false;
+} g_repl;
+
+static std::vector<Worker*> g_workers;
+
+static struct {
+	//set from --cluster once the keyspace is loaded
+	bool on = false;
+	uint16_t self = k_no_node; //this node's index in nodes
+	//only ever added to, under g_data.lock
+	std::vector<ClusterNode> nodes;
+	//per slot, the node serving it, and while the slot moves the node it
+	//goes to (here on its source) or comes from (on its target). changed
+	//under g_migrate.lock, read without it by every command
+	std::atomic<uint16_t> owner[k_slots];
+	std::atomic<uint16_t> migrating[k_slots];
+	std::atomic<uint16_t> importing[k_slots];
+	//the keys of each slot, through Entry::slot_link, under the slot's
+	//shard lock. nkeys counts keys in a migration batch too
+	DList keys[k_slots];
+	uint32_t nkeys[k_slots] = {};
+	//the keys clients are blocked on, through BlockKey::slot_link, under
+	//g_block.lock
+	DList blocked[k_slots];
+} g_cluster;
+
+enum { //state of a slot migration
+	MIG_NONE = 0,
+	MIG_QUIESCE = 1, //waiting for every worker to see the slots migrating
+	MIG_MOVING = 2,
+	MIG_DONE = 3,
+	MIG_FAILED = 4,
+};
+
+static const char* const k_mig_states[] = {"none", "quiesce", "moving", "done", "failed"};
+
+// keys sent to the target together, deleted here once it has answered for
+// all of them. a batch without keys hands a drained slot over
+struct MigBatch {
+	DList keys; //the entries, through Entry::slot_link
+	uint32_t slot = 0;
+	uint32_t replies = 0; //still to come
+	bool handover = false;
+};
+
+// the slot migration, one at a time, driven by worker 0. commands on a
+// migrating slot hold lock from the key check until they have run, so the
+// keys they found cannot start moving in between. taken before the
+// shard locks
+static struct {
+	std::mutex lock;
+	std::atomic<bool> active{false};
+	uint32_t state = MIG_NONE;
+	uint16_t target = k_no_node;
+	std::vector<uint32_t> slots; //to move, in order
+	size_t next = 0; //the slot being drained
+	size_t handed = 0; //slots the target has taken over
+	std::vector<uint64_t> ticks; //every worker's ticks when it started
+	std::deque<MigBatch*> inflight;
+	std::deque<MigBatch*> answered; //for migrate_tick() to finish
+
+	uint64_t keys_moved = 0;
+	uint64_t start_us = 0;
+	uint64_t end_us = 0;
+	std::string err;
+	std::string target_addr; //host:port
+	//to the target, only touched by worker 0
+	Conn* conn = NULL;
+} g_migrate;
+
+//time a worker 0 loop iteration spends on migration, us
+static uint64_t g_migrate_budget_us = 1000;
+
+// a channel or pattern with subscribers. each worker links its own
+// subscribers into subs[id], and only that worker changes or walks that
+// list, so it delivers without holding g_pubsub.lock. the channel goes
+// with the last subscriber of any worker, so it outlives a walk by a
+// worker whose list is not empty
+struct PubChan {
+	HNode node;
+	std::string name;
+	bool pattern = false;
+	DList pattern_link; //in g_pubsub.patterns_all
+	//one per worker, sized once, the list heads must not move
+	std::vector<DList> subs;
+	std::vector<uint32_t> nsubs;
+	uint32_t total = 0;
+};
+
+// one connection's subscription to a channel or pattern
+struct Sub {
+	DList chan_link; //in chan->subs[conn->worker]
+	DList conn_link; //in conn->subs
+	PubChan* chan = NULL;
+	Conn* conn = NULL;
+};
+
+// a published message, shared by the workers delivering it. the frame
+// for a protocol is encoded by the first worker that needs it, and every
+// subscriber using that protocol is sent the same Blob
+struct PubMsg {
+	std::atomic<uint32_t> refs{0};
+	std::string channel;
+	std::string payload;
+	std::mutex lock;
+	Blob* frames[PROTO_RESP3 + 1] = {};
+};
+
+// the subscriptions of all workers. a PUBLISH holds lock only to find
+// the workers with subscribers for the message
+static struct {
+	std::mutex lock;
+	HMap channels;
+	HMap patterns;
+	DList patterns_all; //walked by every PUBLISH
+} g_pubsub;
+
+//output queued for a subscriber at which it is disconnected, right away
+//above hard, or after being above soft for soft_sec. 0 for no limit
+static size_t g_pubsub_hard = 32 << 20;
+static size_t g_pubsub_soft = 8 << 20;
+static uint64_t g_pubsub_soft_sec = 60;
+
+static bool entry_eq (HNode* lhs, HNode* rhs) {
+	return container_of(lhs, Entry, node)->key == container_of(rhs, KeyProbe, node)->key;
+}
+
+//most arguments accepted in one request
+const size_t k_max_args = 200 * 1000;
+
+// a request body is nstr(4) followed by nstr x (len(4) + bytes).
+// the arguments are views into rbuf, valid until the request is consumed
+static int32_t parse_req (const uint8_t* data, size_t len, std::vector<std::string_view> &out) {
+	if (len < 4) {
+		return -1;
+	}
+	uint32_t n = 0;
+	memcpy(&n, &data[0], 4);
+	if (n > k_max_args) {
+		return -1;
 	}
 
-	conn->wbuf_sent += (size_t)rv;
-	assert(conn->wbuf_sent <= conn->wbuf_size);
-	if (conn->wbuf_sent == conn->wbuf_size) {
-		//response was fully sent, change state
-		conn->state = STATE_REQ;
-		conn->wbuf_sent = 0;
-		conn->wbuf_size = 0;
-		return false;
+	size_t pos = 4;
+	while (n--) {
+		if (pos + 4 > len) {
+			return -1;
+		}
+		uint32_t sz = 0;
+		memcpy(&sz, &data[pos], 4);
+		if (pos + 4 + sz > len) {
+			return -1;
+		}
+		out.emplace_back((const char*)&data[pos + 4], sz);
+		pos += 4 + sz;
 	}
 
-	//still got data in wbuf, could try to write again
-	return true;
+	if (pos != len) {
+		return -1; //trailing garbage
+	}
+	return 0;
 }
-static void state_req (Conn* conn) {
-	while(try_fill_buffer(conn)) {}
+
+// "<prefix><n>\r\n", the RESP header for most types
+static void out_resp_num (Conn* conn, char prefix, int64_t n) {
+	char buf[32];
+	char* end = buf + sizeof(buf);
+	char* p = end;
+	*--p = '\n';
+	*--p = '\r';
+	uint64_t v = (n < 0) ? (uint64_t)0 - (uint64_t)n : (uint64_t)n;
+	do {
+		*--p = (char)('0' + v % 10);
+		v /= 10;
+	} while (v);
+	if (n < 0) {
+		*--p = '-';
+	}
+	*--p = prefix;
+	buf_append(&conn->wbuf, p, (size_t)(end - p));
 }
 
-static void state_res (Conn* conn) {
-	while (try_flush_buffer(conn)) {}
+static void out_nil (Conn* conn) {
+	if (conn->proto == PROTO_RESP2) {
+		buf_append(&conn->wbuf, "$-1\r\n", 5);
+		return;
+	}
+	if (conn->proto == PROTO_RESP3) {
+		buf_append(&conn->wbuf, "_\r\n", 3);
+		return;
+	}
+	uint8_t tag = SER_NIL;
+	buf_append(&conn->wbuf, &tag, 1);
 }
 
-static void connection_io (Conn* conn) {
-	if (conn->state == STATE_REQ) {
-		state_req(conn);
-	} else if (conn->state == STATE_RES) {
-		state_res(conn);
-	} else {
-		assert(0);
+// a missing array, which RESP2 tells apart from a missing string
+static void out_nil_arr (Conn* conn) {
+	if (conn->proto == PROTO_RESP2) {
+		buf_append(&conn->wbuf, "*-1\r\n", 5);
+		return;
 	}
+	out_nil(conn);
 }
 
-int main (int argc, char *argv[]) {
-	// Disable output buffering
-	setbuf(stdout, NULL);
+static void out_str (Conn* conn, const char* s, size_t size) {
+	if (conn->proto != PROTO_BIN) {
+		out_resp_num(conn, '$', (int64_t)size);
+		buf_append(&conn->wbuf, s, size);
+		buf_append(&conn->wbuf, "\r\n", 2);
+		return;
+	}
+	uint8_t tag = SER_STR;
+	uint32_t len = (uint32_t)size;
+	buf_append(&conn->wbuf, &tag, 1);
+	buf_append(&conn->wbuf, &len, 4);
+	buf_append(&conn->wbuf, s, len);
+}
 
-	// Get an fd for stream socket in the internet domain
-	// fd = file descriptor, refers to something in an unix kernel (e.g., TCP connection, file, listening port)
-	int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (server_fd == -1) {
-		errmsg("Socket creation failed");
-		return 1;
+// queue the whole blob by reference, after what wbuf holds so far
+static void out_ref (Conn* conn, Blob* val) {
+	if (conn->ref_head == conn->refs.size()) {
+		conn->refs.clear();
+		conn->ref_head = 0;
 	}
+	conn->refs.push_back(OutRef{conn->wbuf_sent + buf_size(&conn->wbuf), blob_ref(val), 0});
+	conn->ref_bytes += val->len;
+}
 
-	// Since the tester restarts your program quite often, setting REUSE_PORT
-	// ensures that we don't run into 'Address already in use' errors
-	int reuse = 1;
-	if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
-		errmsg("SO_REUSEPORT failed");
-		return 1;
+// a stored value. large ones are queued by reference and go out with
+// writev() straight from the keyspace. io_uring sends from one contiguous
+// buffer, so it still gets a copy
+static void out_val (Conn* conn, Blob* val) {
+	if (val->len < k_ref_min || g_io_uring) {
+		return out_str(conn, val->data, val->len);
 	}
-	
-	// Property of our server address
-	struct sockaddr_in serv_addr = { .sin_family = AF_INET,
-									 .sin_port = htons(6379),
-									 .sin_addr = { htonl(INADDR_ANY) },
-									};
-	
-	//bind
-	if (bind(server_fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) != 0) {
-		errmsg("Bind failed");
-		return 1;
+	if (conn->proto != PROTO_BIN) {
+		out_resp_num(conn, '$', (int64_t)val->len);
+	} else {
+		uint8_t tag = SER_STR;
+		buf_append(&conn->wbuf, &tag, 1);
+		buf_append(&conn->wbuf, &val->len, 4);
 	}
-
-    //listen
-	if (listen(server_fd, SOMAXCONN) != 0) {
-		errmsg("Listen failed");
-		return 1;
+	out_ref(conn, val);
+	if (conn->proto != PROTO_BIN) {
+		buf_append(&conn->wbuf, "\r\n", 2);
 	}
-	
-	printf("Waiting for a client to connect...\n");
+}
 
-	//map of all client connections, key: fd
-	std::vector<Conn*> fd2conn;
-	fd_set_nb(server_fd);
-	std::vector<struct pollfd> poll_args;
+// a short status like PONG, a RESP simple string
+static void out_status (Conn* conn, const char* text) {
+	if (conn->proto != PROTO_BIN) {
+		buf_append(&conn->wbuf, "+", 1);
+		buf_append(&conn->wbuf, text, strlen(text));
+		buf_append(&conn->wbuf, "\r\n", 2);
+		return;
+	}
+	out_str(conn, text, strlen(text));
+}
 
-	while (1) {
-		poll_args.clear();
-		struct pollfd pfd = {server_fd, POLLIN, 0};
-		poll_args.push_back(pfd);
+// success without a value: +OK for RESP, nil for the binary protocol
+static void out_ok (Conn* conn) {
+	if (conn->proto != PROTO_BIN) {
+		buf_append(&conn->wbuf, "+OK\r\n", 5);
+		return;
+	}
+	out_nil(conn);
+}
 
-		for (Conn* conn: fd2conn) {
-			if (!conn) {
-			 	continue;
-			}
-			struct pollfd pfd = {};
-			pfd.fd = conn->fd;
-			pfd.events = (conn->state == STATE_REQ) ? POLLIN: POLLOUT;
-			pfd.events = pfd.events | POLLERR;
-			poll_args.push_back(pfd);
+static void out_int (Conn* conn, int64_t val) {
+	if (conn->proto != PROTO_BIN) {
+		out_resp_num(conn, ':', val);
+		return;
+	}
+	uint8_t tag = SER_INT;
+	buf_append(&conn->wbuf, &tag, 1);
+	buf_append(&conn->wbuf, &val, 8);
+}
 
+// shortest of %.15g and %.17g that reads back as the same double
+static size_t dbl_fmt (char* buf, size_t cap, double val) {
+	int n = snprintf(buf, cap, "%.15g", val);
+	if (strtod(buf, NULL) != val) {
+		n = snprintf(buf, cap, "%.17g", val);
+	}
+	return (size_t)n;
+}
 
+// a double: RESP3 has a type for it, RESP2 gets it as a bulk string
+static void out_dbl (Conn* conn, double val) {
+	if (conn->proto != PROTO_BIN) {
+		char buf[40];
+		size_t n = dbl_fmt(buf, sizeof(buf), val);
+		if (conn->proto == PROTO_RESP2) {
+			return out_str(conn, buf, n);
 		}
+		buf_append(&conn->wbuf, ",", 1);
+		buf_append(&conn->wbuf, buf, n);
+		buf_append(&conn->wbuf, "\r\n", 2);
+		return;
+	}
+	uint8_t tag = SER_DBL;
+	buf_append(&conn->wbuf, &tag, 1);
+	buf_append(&conn->wbuf, &val, 8);
+}
 
-		int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), 1000);
-		if (rv < 0) {
-			errmsg("poll");
-		}
+// RESP clients tell some errors apart by their first word
+static const char* err_prefix (int32_t code) {
+	switch (code) {
+	case ERR_TYPE:
+		return "-WRONGTYPE ";
+	case ERR_READONLY:
+		return "-READONLY ";
+	case ERR_MOVED:
+		return "-MOVED ";
+	case ERR_CROSSSLOT:
+		return "-CROSSSLOT ";
+	case ERR_CLUSTERDOWN:
+		return "-CLUSTERDOWN ";
+	case ERR_ASK:
+		return "-ASK ";
+	case ERR_TRYAGAIN:
+		return "-TRYAGAIN ";
+	default:
+		return "-ERR ";
+	}
+}
 
-		for(size_t i = 1; i < poll_args.size(); ++i) {
-			if (poll_args[i].revents) {
-				Conn* conn = fd2conn[poll_args[i].fd];
-				
-				connection_io(conn);
-			
-			    if (conn->state == STATE_END) {
-			    	fd2conn[conn->fd] = NULL;
-			    	(void)close(conn->fd);
-			    	free(conn);
-			    }
-			}
-		}
+static void out_err (Conn* conn, int32_t code, const char* text) {
+	if (conn->proto != PROTO_BIN) {
+		const char* prefix = err_prefix(code);
+		buf_append(&conn->wbuf, prefix, strlen(prefix));
+		buf_append(&conn->wbuf, text, strlen(text));
+		buf_append(&conn->wbuf, "\r\n", 2);
+		return;
+	}
+	uint8_t tag = SER_ERR;
+	uint32_t len = (uint32_t)strlen(text);
+	buf_append(&conn->wbuf, &tag, 1);
+	buf_append(&conn->wbuf, &code, 4);
+	buf_append(&conn->wbuf, &len, 4);
+	buf_append(&conn->wbuf, text, len);
+}
 
-		if (poll_args[0].revents) {
-			(void)accept_new_conn(fd2conn, server_fd);
-		}
+static void out_arr (Conn* conn, uint32_t n) {
+	if (conn->proto != PROTO_BIN) {
+		out_resp_num(conn, '*', n);
+		return;
+	}
+	uint8_t tag = SER_ARR;
+	buf_append(&conn->wbuf, &tag, 1);
+	buf_append(&conn->wbuf, &n, 4);
+}
 
-		}
-	
+// n key-value pairs. RESP3 has a map type, the others get a flat array
+static void out_map (Conn* conn, uint32_t n) {
+	if (conn->proto == PROTO_RESP3) {
+		out_resp_num(conn, '%', n);
+		return;
+	}
+	out_arr(conn, 2 * n);
+}
+
+static bool cmd_is (std::string_view word, const char* cmd) {
+	return word.size() == strlen(cmd) && !strncasecmp(word.data(), cmd, word.size());
+}
+
+static void list_free (std::deque<Blob*>* list) {
+	for (Blob* val: *list) {
+		blob_unref(val);
+	}
+	delete list;
+}
+
+// the caller holds the entry's shard lock and has unlinked the entry from
+// the db
+static void entry_free (Entry* ent) {
+	tw_del(&entry_shard(ent)->ttl, &ent->ttl);
+	if (!dlist_empty(&ent->slot_link)) {
+		dlist_detach(&ent->slot_link);
+		g_cluster.nkeys[ent->slot]--;
+	}
+	if (ent->type == T_ZSET) {
+		zset_free(ent->zset);
+	} else if (ent->type == T_LIST) {
+		list_free(ent->list);
+	} else {
+		blob_unref(ent->val);
+	}
+	ent->~Entry();
+	slab_free(ent, sizeof(Entry));
+}
+
+// the caller holds the entry's shard lock
+static void entry_remove (Entry* ent) {
+	KeyProbe probe = key_probe(ent->key, &ent->node);
+	hm_delete(&entry_shard(ent)->db, &probe.node, &entry_eq);
+	entry_free(ent);
+}
+
+// the caller holds the key's shard lock. a key past its expiry is deleted
+// here rather than waiting for the active expiry to get to it
+static Entry* entry_lookup (std::string_view key) {
+	KeyProbe probe = key_probe(key);
+	HNode* node = hm_lookup(&key_shard(key)->db, &probe.node, &entry_eq);
+	if (!node) {
+		return NULL;
+	}
+	Entry* ent = container_of(node, Entry, node);
+	if (tw_linked(&ent->ttl) && ent->ttl.expire <= get_monotonic_ms()) {
+		entry_remove(ent);
+		return NULL;
+	}
+	return ent;
+}
+
+// an entry that is not in the db yet, the value is for the caller to
+// fill in
+static Entry* entry_make (std::string_view key, uint32_t type) {
+	Entry* ent = new (slab_alloc(sizeof(Entry))) Entry();
+	ent->key.assign(key.data(), key.size());
+	ent->node.hcode = str_hash((const uint8_t*)key.data(), key.size());
+	ent->slot = (uint16_t)key_slot(key.data(), key.size());
+	ent->type = type;
+	return ent;
+}
+
+// the caller holds the entry's shard lock. in cluster mode every key is
+// listed under its slot, which is how a migration finds the keys to move
+static void entry_index (Entry* ent) {
+	dlist_push_back(&g_cluster.keys[ent->slot], &ent->slot_link);
+	g_cluster.nkeys[ent->slot]++;
+}
+
+// the caller holds the key's shard lock and has checked the key does not
+// exist. the value is for the caller to fill in
+static Entry* entry_new (std::string_view key, uint32_t type) {
+	Entry* ent = entry_make(key, type);
+	hm_insert(&entry_shard(ent)->db, &ent->node);
+	if (g_cluster.on) {
+		entry_index(ent);
+	}
+	return ent;
+}
+
+// the caller holds the key's shard lock. setting a value clears the expiry and
+// replaces a value of any type
+static Entry* entry_set (std::string_view key, std::string_view val) {
+	Entry* ent = entry_lookup(key);
+	if (ent) {
+		if (ent->type == T_ZSET) {
+			zset_free(ent->zset);
+			ent->type = T_STR;
+		} else if (ent->type == T_LIST) {
+			list_free(ent->list);
+			ent->type = T_STR;
+		} else {
+			//replies still queued keep the old value alive
+			blob_unref(ent->val);
+		}
+		ent->val = blob_new(val.data(), val.size());
+		tw_del(&entry_shard(ent)->ttl, &ent->ttl);
+		return ent;
+	}
+	ent = entry_new(key, T_STR);
+	ent->val = blob_new(val.data(), val.size());
+	return ent;
+}
+
+// the caller holds the key's shard lock
+static bool entry_del (std::string_view key) {
+	Entry* ent = entry_lookup(key);
+	if (!ent) {
+		return false;
+	}
+	entry_remove(ent);
+	return true;
+}
+
+// the caller holds the entry's shard lock
+static void entry_ttl_add (Entry* ent, uint64_t expire) {
+	Shard* sh = entry_shard(ent);
+	tw_add(&sh->ttl, &ent->ttl, expire);
+	if (expire < sh->expire_next) {
+		sh->expire_next = expire;
+	}
+}
+
+// the caller holds the entry's shard lock. a ttl of 0 or less deletes the
+// key
+static void entry_expire (Entry* ent, int64_t ttl_ms) {
+	if (ttl_ms <= 0) {
+		return entry_remove(ent);
+	}
+	entry_ttl_add(ent, get_monotonic_ms() + (uint64_t)ttl_ms);
+}
+
+//longest ttl accepted, about 30000 years
+const int64_t k_max_ttl_ms = (int64_t)1 << 50;
+
+static bool str2int (std::string_view s, int64_t* out) {
+	if (s.empty() || s.size() > 20) {
+		return false;
+	}
+	char buf[24];
+	memcpy(buf, s.data(), s.size());
+	buf[s.size()] = 0;
+	char* end = NULL;
+	errno = 0;
+	long long v = strtoll(buf, &end, 10);
+	if (errno || *end) {
+		return false;
+	}
+	*out = v;
+	return true;
+}
+
+// a ttl argument in seconds or ms, converted to ms
+static bool parse_ttl (std::string_view s, bool in_ms, int64_t* out) {
+	int64_t v = 0;
+	if (!str2int(s, &v)) {
+		return false;
+	}
+	int64_t scale = in_ms ? 1 : 1000;
+	if (v > k_max_ttl_ms / scale || v < -k_max_ttl_ms / scale) {
+		return false;
+	}
+	*out = v * scale;
+	return true;
+}
+
+// the caller holds the shard locks of the command's keys, so the log and
+// the replication stream see the commands on a key in the order they
+// were applied. the backlog is only created or freed with every shard
+// lock held. only memory is touched, the worker writes the log and feeds
+// replicas at the end of its loop iteration
+static void propagate (const std::string_view* args, size_t n) {
+	bool repl = g_repl.backlog.data != NULL;
+	if (!g_aof.on && !repl) {
+		return;
+	}
+	std::lock_guard<std::mutex> guard(g_data.lock);
+	Buffer* b = g_aof.on ? &g_aof.buf : &g_repl.scratch;
+	size_t before = buf_size(b);
+	aof_encode(b, args, n);
+	size_t len = buf_size(b) - before;
+	const uint8_t* cmd = buf_tail(b) - len;
+	if (repl) {
+		backlog_append(&g_repl.backlog, cmd, len);
+		g_repl.offset = g_repl.backlog.end;
+	}
+	if (!g_aof.on) {
+		buf_consume(b, len);
+		return;
+	}
+	if (g_aof.rewriting) {
+		buf_append(&g_aof.rewrite, cmd, len);
+	}
+	g_aof.appended += len;
+}
+
+static void propagate (std::vector<std::string_view> &cmd) {
+	propagate(cmd.data(), cmd.size());
+}
+
+// the caller holds the key's shard lock. expiries are propagated as a
+// unix time, so replaying the log later does not extend them
+static void propagate_expire (std::string_view key, int64_t ttl_ms) {
+	if (!g_aof.on && !g_repl.backlog.data) {
+		return;
+	}
+	char at[24];
+	int n = snprintf(at, sizeof(at), "%lld", (long long)(get_wall_ms() + ttl_ms));
+	std::string_view args[3] = {"PEXPIREAT", key, std::string_view(at, (size_t)n)};
+	propagate(args, 3);
+}
+
+const char* k_wrong_type = "Operation against a key holding the wrong kind of value";
+
+static void do_get (Conn* conn, std::vector<std::string_view> &cmd) {
+	std::lock_guard<std::mutex> guard(key_shard(cmd[1])->lock);
+	Entry* ent = entry_lookup(cmd[1]);
+	if (!ent) {
+		return out_nil(conn);
+	}
+	if (ent->type != T_STR) {
+		return out_err(conn, ERR_TYPE, k_wrong_type);
+	}
+	out_val(conn, ent->val);
+}
+
+// set key val [EX seconds | PX ms]
+static void do_set (Conn* conn, std::vector<std::string_view> &cmd) {
+	int64_t ttl_ms = 0;
+	if (cmd.size() == 5) {
+		bool in_ms = cmd_is(cmd[3], "px");
+		if (!in_ms && !cmd_is(cmd[3], "ex")) {
+			return out_err(conn, ERR_BAD_ARG, "syntax error");
+		}
+		if (!parse_ttl(cmd[4], in_ms, &ttl_ms) || ttl_ms <= 0) {
+			return out_err(conn, ERR_BAD_ARG, "invalid expire time");
+		}
+	}
+	std::lock_guard<std::mutex> guard(key_shard(cmd[1])->lock);
+	Entry* ent = entry_set(cmd[1], cmd[2]);
+	propagate(cmd.data(), 3);
+	if (ttl_ms) {
+		entry_expire(ent, ttl_ms);
+		propagate_expire(cmd[1], ttl_ms);
+	}
+	out_ok(conn);
+}
+
+// expire key seconds, pexpire key ms. replies 1 if the key exists
+static void do_expire (Conn* conn, std::vector<std::string_view> &cmd, bool in_ms) {
+	int64_t ttl_ms = 0;
+	if (!parse_ttl(cmd[2], in_ms, &ttl_ms)) {
+		return out_err(conn, ERR_BAD_ARG, "value is not an integer or out of range");
+	}
+	std::lock_guard<std::mutex> guard(key_shard(cmd[1])->lock);
+	Entry* ent = entry_lookup(cmd[1]);
+	if (!ent) {
+		return out_int(conn, 0);
+	}
+	entry_expire(ent, ttl_ms);
+	propagate_expire(cmd[1], ttl_ms);
+	out_int(conn, 1);
+}
+
+// expireat key unix-seconds, pexpireat key unix-ms. replies 1 if the key
+// exists, a time in the past deletes it
+static void do_expireat (Conn* conn, std::vector<std::string_view> &cmd, bool in_ms) {
+	int64_t at_ms = 0;
+	if (!parse_ttl(cmd[2], in_ms, &at_ms)) {
+		return out_err(conn, ERR_BAD_ARG, "value is not an integer or out of range");
+	}
+	std::lock_guard<std::mutex> guard(key_shard(cmd[1])->lock);
+	Entry* ent = entry_lookup(cmd[1]);
+	if (!ent) {
+		return out_int(conn, 0);
+	}
+	int64_t ttl_ms = at_ms - get_wall_ms();
+	entry_expire(ent, ttl_ms);
+	propagate_expire(cmd[1], ttl_ms);
+	out_int(conn, 1);
+}
+
+// ttl key, pttl key. -2 if the key does not exist, -1 if it has no expiry
+static void do_ttl (Conn* conn, std::vector<std::string_view> &cmd, bool in_ms) {
+	std::lock_guard<std::mutex> guard(key_shard(cmd[1])->lock);
+	Entry* ent = entry_lookup(cmd[1]);
+	if (!ent) {
+		return out_int(conn, -2);
+	}
+	if (!tw_linked(&ent->ttl)) {
+		return out_int(conn, -1);
+	}
+	uint64_t now = get_monotonic_ms();
+	int64_t left = ent->ttl.expire > now ? (int64_t)(ent->ttl.expire - now) : 0;
+	out_int(conn, in_ms ? left : (left + 500) / 1000);
+}
+
+// persist key, replies 1 if an expiry was removed
+static void do_persist (Conn* conn, std::vector<std::string_view> &cmd) {
+	std::lock_guard<std::mutex> guard(key_shard(cmd[1])->lock);
+	Entry* ent = entry_lookup(cmd[1]);
+	if (!ent || !tw_linked(&ent->ttl)) {
+		return out_int(conn, 0);
+	}
+	tw_del(&entry_shard(ent)->ttl, &ent->ttl);
+	propagate(cmd);
+	out_int(conn, 1);
+}
+
+// del key [key ...], replies with the number of keys removed
+static void do_del (Conn* conn, std::vector<std::string_view> &cmd) {
+	int64_t n = 0;
+	ShardLocks shards(shard_mask(cmd, 1, cmd.size(), 1));
+	for (size_t i = 1; i < cmd.size(); ++i) {
+		n += entry_del(cmd[i]) ? 1 : 0;
+	}
+	if (n) {
+		propagate(cmd);
+	}
+	out_int(conn, n);
+}
+
+static void do_mget (Conn* conn, std::vector<std::string_view> &cmd) {
+	out_arr(conn, (uint32_t)(cmd.size() - 1));
+	ShardLocks shards(shard_mask(cmd, 1, cmd.size(), 1));
+	for (size_t i = 1; i < cmd.size(); ++i) {
+		Entry* ent = entry_lookup(cmd[i]);
+		if (ent && ent->type == T_STR) {
+			out_val(conn, ent->val);
+		} else {
+			out_nil(conn);
+		}
+	}
+}
+
+static void do_mset (Conn* conn, std::vector<std::string_view> &cmd) {
+	ShardLocks shards(shard_mask(cmd, 1, cmd.size(), 2));
+	for (size_t i = 1; i + 1 < cmd.size(); i += 2) {
+		entry_set(cmd[i], cmd[i + 1]);
+	}
+	propagate(cmd);
+	out_ok(conn);
+}
+
+// a score, or a score range bound when bound is set: "(" in front makes
+// it exclusive, and -inf/+inf are accepted either way
+static bool parse_score (std::string_view s, double* out, bool bound, bool* exclusive) {
+	if (bound) {
+		*exclusive = !s.empty() && s[0] == '(';
+		if (*exclusive) {
+			s.remove_prefix(1);
+		}
+	}
+	if (s.empty() || s.size() > 64) {
+		return false;
+	}
+	char buf[72];
+	memcpy(buf, s.data(), s.size());
+	buf[s.size()] = 0;
+	char* end = NULL;
+	double v = strtod(buf, &end);
+	if (*end || v != v) {
+		return false; //trailing garbage or NaN
+	}
+	*out = v;
+	return true;
+}
+
+// the caller holds the key's shard lock. false after replying with an error if
+// the key holds something other than a sorted set
+static bool zset_check (Conn* conn, Entry* ent) {
+	if (ent && ent->type != T_ZSET) {
+		out_err(conn, ERR_TYPE, k_wrong_type);
+		return false;
+	}
+	return true;
+}
+
+// zadd key score member [score member ...], replies with the number of
+// members added. existing members get the new score
+static void do_zadd (Conn* conn, std::vector<std::string_view> &cmd) {
+	std::vector<double> scores;
+	for (size_t i = 2; i + 1 < cmd.size(); i += 2) {
+		double score = 0;
+		if (!parse_score(cmd[i], &score, false, NULL)) {
+			return out_err(conn, ERR_BAD_ARG, "value is not a valid float");
+		}
+		scores.push_back(score);
+	}
+	std::lock_guard<std::mutex> guard(key_shard(cmd[1])->lock);
+	Entry* ent = entry_lookup(cmd[1]);
+	if (!zset_check(conn, ent)) {
+		return;
+	}
+	if (!ent) {
+		ent = entry_new(cmd[1], T_ZSET);
+		ent->zset = zset_new();
+	}
+	int64_t added = 0;
+	for (size_t i = 0; i < scores.size(); ++i) {
+		std::string_view member = cmd[3 + 2 * i];
+		added += zset_add(ent->zset, member.data(), member.size(), scores[i]) ? 1 : 0;
+	}
+	propagate(cmd);
+	out_int(conn, added);
+}
+
+// zrem key member [member ...], replies with the number removed. the key
+// goes with its last member
+static void do_zrem (Conn* conn, std::vector<std::string_view> &cmd) {
+	std::lock_guard<std::mutex> guard(key_shard(cmd[1])->lock);
+	Entry* ent = entry_lookup(cmd[1]);
+	if (!zset_check(conn, ent)) {
+		return;
+	}
+	int64_t n = 0;
+	for (size_t i = 2; ent && i < cmd.size(); ++i) {
+		n += zset_del(ent->zset, cmd[i].data(), cmd[i].size()) ? 1 : 0;
+	}
+	if (ent && ent->zset->len == 0) {
+		entry_remove(ent);
+	}
+	if (n) {
+		propagate(cmd);
+	}
+	out_int(conn, n);
+}
+
+static void do_zscore (Conn* conn, std::vector<std::string_view> &cmd) {
+	std::lock_guard<std::mutex> guard(key_shard(cmd[1])->lock);
+	Entry* ent = entry_lookup(cmd[1]);
+	if (!zset_check(conn, ent)) {
+		return;
+	}
+	double score = 0;
+	if (!ent || !zset_score(ent->zset, cmd[2].data(), cmd[2].size(), &score)) {
+		return out_nil(conn);
+	}
+	out_dbl(conn, score);
+}
+
+static void do_zcard (Conn* conn, std::vector<std::string_view> &cmd) {
+	std::lock_guard<std::mutex> guard(key_shard(cmd[1])->lock);
+	Entry* ent = entry_lookup(cmd[1]);
+	if (!zset_check(conn, ent)) {
+		return;
+	}
+	out_int(conn, ent ? (int64_t)ent->zset->len : 0);
+}
+
+// zrank key member, 0-based position by ascending score
+static void do_zrank (Conn* conn, std::vector<std::string_view> &cmd) {
+	std::lock_guard<std::mutex> guard(key_shard(cmd[1])->lock);
+	Entry* ent = entry_lookup(cmd[1]);
+	if (!zset_check(conn, ent)) {
+		return;
+	}
+	size_t rank = 0;
+	if (!ent || !zset_rank(ent->zset, cmd[2].data(), cmd[2].size(), &rank)) {
+		return out_nil(conn);
+	}
+	out_int(conn, (int64_t)rank);
+}
+
+// zrange key start stop [BYSCORE] [LIMIT offset count] [WITHSCORES]
+// by rank, negative ranks count from the end, or with BYSCORE between two
+// scores. on a skiplist the start is found in O(log n) and the rest is a
+// walk along the bottom level
+static void do_zrange (Conn* conn, std::vector<std::string_view> &cmd) {
+	bool byscore = false;
+	bool withscores = false;
+	bool limit = false;
+	int64_t offset = 0;
+	int64_t count = -1;
+	for (size_t i = 4; i < cmd.size(); ++i) {
+		if (cmd_is(cmd[i], "byscore")) {
+			byscore = true;
+		} else if (cmd_is(cmd[i], "withscores")) {
+			withscores = true;
+		} else if (cmd_is(cmd[i], "limit") && i + 2 < cmd.size()) {
+			if (!str2int(cmd[i + 1], &offset) || !str2int(cmd[i + 2], &count)) {
+				return out_err(conn, ERR_BAD_ARG, "value is not an integer or out of range");
+			}
+			limit = true;
+			i += 2;
+		} else {
+			return out_err(conn, ERR_BAD_ARG, "syntax error");
+		}
+	}
+	if (limit && !byscore) {
+		return out_err(conn, ERR_BAD_ARG, "LIMIT needs BYSCORE");
+	}
+	double min = 0;
+	double max = 0;
+	bool min_ex = false;
+	bool max_ex = false;
+	int64_t start = 0;
+	int64_t stop = 0;
+	if (byscore) {
+		if (!parse_score(cmd[2], &min, true, &min_ex) || !parse_score(cmd[3], &max, true, &max_ex)) {
+			return out_err(conn, ERR_BAD_ARG, "min or max is not a float");
+		}
+	} else if (!str2int(cmd[2], &start) || !str2int(cmd[3], &stop)) {
+		return out_err(conn, ERR_BAD_ARG, "value is not an integer or out of range");
+	}
+
+	std::lock_guard<std::mutex> guard(key_shard(cmd[1])->lock);
+	Entry* ent = entry_lookup(cmd[1]);
+	if (!zset_check(conn, ent)) {
+		return;
+	}
+	ZSet* z = ent ? ent->zset : NULL;
+	ZIter it;
+	int64_t n = 0;
+	if (z && byscore) {
+		//the count comes from the ranks of both ends, so the reply
+		//header is written before walking the range
+		if (offset >= 0 && zset_seek_score(z, min, min_ex, &it)) {
+			n = (int64_t)zset_count_to(z, max, max_ex) - (int64_t)it.rank - offset;
+			if (count >= 0 && count < n) {
+				n = count;
+			}
+			if (n > 0 && offset) {
+				zset_seek_rank(z, it.rank + (size_t)offset, &it);
+			}
+		}
+	} else if (z) {
+		int64_t len = (int64_t)z->len;
+		start = start < 0 ? start + len : start;
+		stop = stop < 0 ? stop + len : stop;
+		start = start < 0 ? 0 : start;
+		stop = stop >= len ? len - 1 : stop;
+		n = stop - start + 1;
+		if (n > 0) {
+			zset_seek_rank(z, (size_t)start, &it);
+		}
+	}
+	n = n > 0 ? n : 0;
+	out_arr(conn, (uint32_t)(withscores ? 2 * n : n));
+	for (int64_t i = 0; i < n; ++i) {
+		const char* name = NULL;
+		size_t len = 0;
+		double score = 0;
+		zset_iter_get(&it, &name, &len, &score);
+		out_str(conn, name, len);
+		if (withscores) {
+			out_dbl(conn, score);
+		}
+		zset_iter_next(&it);
+	}
+}
+
+// the caller holds the key's shard lock. false after replying with an
+// error if the key holds something other than a list
+static bool list_check (Conn* conn, Entry* ent) {
+	if (ent && ent->type != T_LIST) {
+		out_err(conn, ERR_TYPE, k_wrong_type);
+		return false;
+	}
+	return true;
+}
+
+// the caller holds the key's shard lock and removes the key once it is
+// empty. the value is the caller's to unref
+static Blob* list_take (Entry* ent, bool left) {
+	Blob* val = NULL;
+	if (left) {
+		val = ent->list->front();
+		ent->list->pop_front();
+	} else {
+		val = ent->list->back();
+		ent->list->pop_back();
+	}
+	return val;
+}
+
+// a key clients are blocked on, with its waiters in the order they
+// blocked. in the index while it has any
+struct BlockKey {
+	HNode node;
+	std::string key;
+	DList waiters; //BlockWait::link
+	DList slot_link; //in cluster mode, in g_cluster.blocked
+};
+
+// the keys of every blocked connection of any worker, under lock, which
+// is taken after the shard locks. a push finds the waiters of its key
+// with one lookup. nkeys is the size of keys for a push to check with
+// only its shard lock held: a pop blocking on the same key holds that
+// lock too while it adds the key
+static struct {
+	std::mutex lock;
+	HMap keys;
+	std::atomic<size_t> nkeys{0};
+} g_block;
+
+static bool blockkey_eq (HNode* lhs, HNode* rhs) {
+	return container_of(lhs, BlockKey, node)->key == container_of(rhs, KeyProbe, node)->key;
+}
+
+// the caller holds g_block.lock
+static BlockKey* blockkey_lookup (std::string_view key) {
+	KeyProbe probe = key_probe(key);
+	HNode* node = hm_lookup(&g_block.keys, &probe.node, &blockkey_eq);
+	return node ? container_of(node, BlockKey, node) : NULL;
+}
+
+// the caller holds g_block.lock. a key leaves the index with its last
+// waiter. a wait already unlinked is skipped
+static void block_unlink (Conn* conn) {
+	for (BlockWait &wait: conn->waits) {
+		BlockKey* bk = wait.bk;
+		if (!bk) {
+			continue;
+		}
+		dlist_detach(&wait.link);
+		wait.bk = NULL;
+		if (dlist_empty(&bk->waiters)) {
+			KeyProbe probe = key_probe(bk->key, &bk->node);
+			hm_delete(&g_block.keys, &probe.node, &blockkey_eq);
+			g_block.nkeys--;
+			dlist_detach(&bk->slot_link);
+			delete bk;
+		}
+	}
+}
+
+static void worker_wake (Worker* w);
+
+// the caller holds g_block.lock and has set the connection's result. it
+// stops waiting on all of its keys and goes to its worker for the reply.
+// by is the connection whose command woke it, if any: a worker replies
+// at the end of the iteration the command runs in, the others are woken
+static void block_wake (Conn* by, Conn* conn) {
+	block_unlink(conn);
+	Worker* w = g_workers[conn->worker];
+	{
+		std::lock_guard<std::mutex> guard(w->inbox_lock);
+		dlist_push_back(&w->unblocked, &conn->unblock_link);
+	}
+	if (!by || by->fd < 0 || by->worker != conn->worker) {
+		worker_wake(w);
+	}
+}
+
+// the caller holds the key's shard lock and has just pushed to ent. the
+// waiters on the key are served first come first served, each with a
+// value from the end it pops from, until the list runs out. the pops are
+// propagated as LPOP and RPOP, so the log and the replicas see the list
+// as it is here. the key goes once it is empty
+static void block_serve (Conn* by, Entry* ent) {
+	if (!g_block.nkeys) {
+		return;
+	}
+	std::lock_guard<std::mutex> guard(g_block.lock);
+	while (!ent->list->empty()) {
+		//the key leaves the index with its last waiter
+		BlockKey* bk = blockkey_lookup(ent->key);
+		if (!bk) {
+			break;
+		}
+		Conn* conn = container_of(bk->waiters.next, BlockWait, link)->conn;
+		std::string_view args[2] = {conn->block_left ? "LPOP" : "RPOP", ent->key};
+		propagate(args, 2);
+		conn->block_key = ent->key;
+		conn->block_val = list_take(ent, conn->block_left);
+		conn->block_result = BLOCK_SERVED;
+		block_wake(by, conn);
+	}
+	if (ent->list->empty()) {
+		entry_remove(ent);
+	}
+}
+
+// the caller holds g_block.lock. the slot is served by another node now,
+// whose pushes cannot reach the connections blocked here on its keys.
+// they are answered with MOVED and block again there
+static void block_slot_moved (uint32_t slot) {
+	DList* head = &g_cluster.blocked[slot];
+	while (!dlist_empty(head)) {
+		BlockKey* bk = container_of(head->next, BlockKey, slot_link);
+		Conn* conn = container_of(bk->waiters.next, BlockWait, link)->conn;
+		conn->block_key = bk->key;
+		conn->block_result = BLOCK_MOVED;
+		block_wake(NULL, conn);
+	}
+}
+
+// run by the connection's worker: the connection stops waiting and is
+// taken off the unblocked list. returns how it was woken, with the value
+// a push popped for it in *val, which the caller unrefs
+static uint32_t block_end (Worker* w, Conn* conn, Blob** val) {
+	tw_del(&w->block_timers, &conn->block_timer);
+	std::lock_guard<std::mutex> guard(g_block.lock);
+	block_unlink(conn);
+	{
+		std::lock_guard<std::mutex> inbox(w->inbox_lock);
+		dlist_detach(&conn->unblock_link);
+	}
+	uint32_t result = conn->block_result;
+	*val = conn->block_val;
+	conn->block_result = BLOCK_WAITING;
+	conn->block_val = NULL;
+	conn->waits.clear();
+	return result;
+}
+
+// a value a push popped for a connection that is gone by the time its
+// worker would reply is lost, like a reply still queued
+static void block_conn_gone (Worker* w, Conn* conn) {
+	if (conn->waits.empty()) {
+		return;
+	}
+	Blob* val = NULL;
+	block_end(w, conn, &val);
+	if (val) {
+		blob_unref(val);
+	}
+}
+
+// lpush key value [value ...], rpush likewise, replies with the length of
+// the list. the values go to the connections blocked on the key first,
+// see block_serve()
+static void do_push (Conn* conn, std::vector<std::string_view> &cmd, bool left) {
+	std::lock_guard<std::mutex> guard(key_shard(cmd[1])->lock);
+	Entry* ent = entry_lookup(cmd[1]);
+	if (!list_check(conn, ent)) {
+		return;
+	}
+	if (!ent) {
+		ent = entry_new(cmd[1], T_LIST);
+		ent->list = new std::deque<Blob*>();
+	}
+	for (size_t i = 2; i < cmd.size(); ++i) {
+		Blob* val = blob_new(cmd[i].data(), cmd[i].size());
+		if (left) {
+			ent->list->push_front(val);
+		} else {
+			ent->list->push_back(val);
+		}
+	}
+	int64_t len = (int64_t)ent->list->size();
+	propagate(cmd);
+	block_serve(conn, ent);
+	out_int(conn, len);
+}
+
+// lpop key [count], rpop likewise. one value, or with a count an array of
+// up to count values. the key goes with its last value
+static void do_pop (Conn* conn, std::vector<std::string_view> &cmd, bool left) {
+	int64_t count = 1;
+	if (cmd.size() == 3 && (!str2int(cmd[2], &count) || count < 0)) {
+		return out_err(conn, ERR_BAD_ARG, "value is out of range, must be positive");
+	}
+	std::lock_guard<std::mutex> guard(key_shard(cmd[1])->lock);
+	Entry* ent = entry_lookup(cmd[1]);
+	if (!list_check(conn, ent)) {
+		return;
+	}
+	if (!ent) {
+		return cmd.size() == 3 ? out_nil_arr(conn) : out_nil(conn);
+	}
+	size_t n = (size_t)count < ent->list->size() ? (size_t)count : ent->list->size();
+	if (cmd.size() == 3) {
+		out_arr(conn, (uint32_t)n);
+	}
+	for (size_t i = 0; i < n; ++i) {
+		Blob* val = list_take(ent, left);
+		out_val(conn, val);
+		blob_unref(val);
+	}
+	if (n) {
+		propagate(cmd);
+	}
+	if (ent->list->empty()) {
+		entry_remove(ent);
+	}
+}
+
+static void do_llen (Conn* conn, std::vector<std::string_view> &cmd) {
+	std::lock_guard<std::mutex> guard(key_shard(cmd[1])->lock);
+	Entry* ent = entry_lookup(cmd[1]);
+	if (!list_check(conn, ent)) {
+		return;
+	}
+	out_int(conn, ent ? (int64_t)ent->list->size() : 0);
+}
+
+// lrange key start stop, inclusive, negative indexes count from the end
+static void do_lrange (Conn* conn, std::vector<std::string_view> &cmd) {
+	int64_t start = 0;
+	int64_t stop = 0;
+	if (!str2int(cmd[2], &start) || !str2int(cmd[3], &stop)) {
+		return out_err(conn, ERR_BAD_ARG, "value is not an integer or out of range");
+	}
+	std::lock_guard<std::mutex> guard(key_shard(cmd[1])->lock);
+	Entry* ent = entry_lookup(cmd[1]);
+	if (!list_check(conn, ent)) {
+		return;
+	}
+	int64_t len = ent ? (int64_t)ent->list->size() : 0;
+	start = start < 0 ? start + len : start;
+	stop = stop < 0 ? stop + len : stop;
+	start = start < 0 ? 0 : start;
+	stop = stop >= len ? len - 1 : stop;
+	int64_t n = stop >= start ? stop - start + 1 : 0;
+	out_arr(conn, (uint32_t)n);
+	for (int64_t i = 0; i < n; ++i) {
+		out_val(conn, (*ent->list)[(size_t)(start + i)]);
+	}
+}
+
+// blpop key [key ...] timeout, brpop likewise: [key, value] from the first
+// key holding a list, or the connection blocks until a push to one of
+// them, for at most timeout seconds, 0 for no limit. a blocked connection
+// is on no list the loop walks: its waits are found through the key by
+// the push that serves it, and only a timeout puts it in the worker's
+// wheel. it is not read from the socket meanwhile beyond buffering, and
+// replied to with a nil array once the timeout passes
+static void do_bpop (Conn* conn, std::vector<std::string_view> &cmd, bool left) {
+	double secs = 0;
+	if (!parse_score(cmd.back(), &secs, false, NULL) || secs > (double)(k_max_ttl_ms / 1000)) {
+		return out_err(conn, ERR_BAD_ARG, "timeout is not a float or out of range");
+	}
+	if (secs < 0) {
+		return out_err(conn, ERR_BAD_ARG, "timeout is negative");
+	}
+	size_t nkeys = cmd.size() - 2;
+	ShardLocks shards(shard_mask(cmd, 1, cmd.size() - 1, 1));
+	for (size_t i = 1; i <= nkeys; ++i) {
+		Entry* ent = entry_lookup(cmd[i]);
+		if (!list_check(conn, ent)) {
+			return;
+		}
+		if (!ent) {
+			continue;
+		}
+		std::string_view args[2] = {left ? "LPOP" : "RPOP", cmd[i]};
+		propagate(args, 2);
+		Blob* val = list_take(ent, left);
+		out_arr(conn, 2);
+		out_str(conn, cmd[i].data(), cmd[i].size());
+		out_val(conn, val);
+		blob_unref(val);
+		if (ent->list->empty()) {
+			entry_remove(ent);
+		}
+		return;
+	}
+	//the log and the primary's stream never wait, they only hold the pops
+	//that ended a wait
+	if (conn->fd < 0) {
+		return out_nil_arr(conn);
+	}
+	conn->waits.resize(nkeys);
+	conn->block_left = left;
+	std::lock_guard<std::mutex> guard(g_block.lock);
+	for (size_t i = 0; i < nkeys; ++i) {
+		BlockKey* bk = blockkey_lookup(cmd[i + 1]);
+		if (!bk) {
+			bk = new BlockKey();
+			bk->key.assign(cmd[i + 1].data(), cmd[i + 1].size());
+			bk->node.hcode = str_hash((const uint8_t*)bk->key.data(), bk->key.size());
+			hm_insert(&g_block.keys, &bk->node);
+			g_block.nkeys++;
+			if (g_cluster.on) {
+				dlist_push_back(&g_cluster.blocked[key_slot(bk->key.data(), bk->key.size())], &bk->slot_link);
+			}
+		}
+		BlockWait* wait = &conn->waits[i];
+		wait->bk = bk;
+		wait->conn = conn;
+		dlist_push_back(&bk->waiters, &wait->link);
+	}
+	conn->state = STATE_BLOCKED;
+	if (secs > 0) {
+		uint64_t ms = (uint64_t)(secs * 1000);
+		Worker* w = g_workers[conn->worker];
+		tw_add(&w->block_timers, &conn->block_timer, get_monotonic_ms() + (ms ? ms : 1));
+	}
+}
+
+enum { //what a forked child is writing
+	CHILD_SAVE = 0, //BGSAVE
+	CHILD_REWRITE = 1, //BGREWRITEAOF
+	CHILD_SYNC = 2, //the snapshot for a full resync
+};
+
+static struct {
+	//pid of the forked child, 0 if none. set with every shard lock and
+	//g_data.lock held, only one runs at a time
+	std::atomic<int> child{0};
+	std::atomic<int> kind{CHILD_SAVE};
+	//unix time of the last successful save
+	std::atomic<int64_t> lastsave{0};
+} g_save;
+
+struct SnapCtx {
+	SnapWriter* w;
+	uint64_t now; //monotonic ms
+	int64_t wall; //unix ms at now
+};
+
+static bool snapshot_entry (HNode* node, void* arg) {
+	SnapCtx* ctx = (SnapCtx*)arg;
+	Entry* ent = container_of(node, Entry, node);
+	bool expires = tw_linked(&ent->ttl);
+	if (expires && ent->ttl.expire <= ctx->now) {
+		return true;
+	}
+	//the record length goes first, so sets and lists are walked twice
+	uint64_t len = 1 + 1 + (expires ? 8 : 0) + 4 + ent->key.size() + 4;
+	ZIter it;
+	if (ent->type == T_STR) {
+		len += ent->val->len;
+	} else if (ent->type == T_LIST) {
+		for (Blob* val: *ent->list) {
+			len += 4 + val->len;
+		}
+	} else {
+		for (zset_seek_rank(ent->zset, 0, &it); zset_iter_valid(&it); zset_iter_next(&it)) {
+			const char* name = NULL;
+			size_t mlen = 0;
+			double score = 0;
+			zset_iter_get(&it, &name, &mlen, &score);
+			len += 4 + mlen + 8;
+		}
+	}
+	SnapWriter* w = ctx->w;
+	if (len > UINT32_MAX) {
+		w->failed = true;
+		return false;
+	}
+	snap_put_u32(w, (uint32_t)len);
+	snap_put_u8(w, (uint8_t)ent->type);
+	snap_put_u8(w, expires ? SNAP_EXPIRE : 0);
+	if (expires) {
+		snap_put_u64(w, (uint64_t)(ctx->wall + (int64_t)(ent->ttl.expire - ctx->now)));
+	}
+	snap_put_u32(w, (uint32_t)ent->key.size());
+	snap_put(w, ent->key.data(), ent->key.size());
+	if (ent->type == T_STR) {
+		snap_put_u32(w, ent->val->len);
+		snap_put(w, ent->val->data, ent->val->len);
+		snap_next(w);
+		return !w->failed;
+	}
+	if (ent->type == T_LIST) {
+		snap_put_u32(w, (uint32_t)ent->list->size());
+		for (Blob* val: *ent->list) {
+			snap_put_u32(w, val->len);
+			snap_put(w, val->data, val->len);
+		}
+		snap_next(w);
+		return !w->failed;
+	}
+	snap_put_u32(w, (uint32_t)ent->zset->len);
+	for (zset_seek_rank(ent->zset, 0, &it); zset_iter_valid(&it); zset_iter_next(&it)) {
+		const char* name = NULL;
+		size_t mlen = 0;
+		double score = 0;
+		zset_iter_get(&it, &name, &mlen, &score);
+		snap_put_u32(w, (uint32_t)mlen);
+		snap_put(w, name, mlen);
+		snap_put(w, &score, 8);
+	}
+	snap_next(w);
+	return !w->failed;
+}
+
+// keys in all shards. the caller holds every shard lock
+static size_t db_size () {
+	size_t n = 0;
+	for (Shard &sh: g_data.shards) {
+		n += hm_size(&sh.db);
+	}
+	return n;
+}
+
+// writes the keyspace to a new file at path, which is removed again on
+// failure. runs in the forked child, or with every shard lock held. does
+// not allocate, the child may have been forked while another thread held
+// the allocator's locks
+static bool snapshot_write (const char* path, uint8_t* buf, uint64_t* bytes) {
+	SnapWriter w;
+	SnapChunk* index = (SnapChunk*)(buf + k_snapshot_buf);
+	if (!snap_open(&w, path, buf, k_snapshot_buf, index, k_snapshot_index, db_size())) {
+		return false;
+	}
+	SnapCtx ctx = {&w, get_monotonic_ms(), get_wall_ms()};
+	for (Shard &sh: g_data.shards) {
+		hm_foreach(&sh.db, &snapshot_entry, &ctx);
+	}
+	bool ok = snap_close(&w);
+	if (!ok) {
+		(void)unlink(path);
+	}
+	*bytes = w.bytes;
+	return ok;
+}
+
+// writes the temporary file and renames it over the snapshot, so a
+// failed save leaves the previous one
+static bool snapshot_save (uint8_t* buf, uint64_t* bytes) {
+	if (!snapshot_write(g_snapshot_tmp.c_str(), buf, bytes)) {
+		return false;
+	}
+	if (rename(g_snapshot_tmp.c_str(), g_snapshot_path.c_str()) != 0) {
+		(void)unlink(g_snapshot_tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+//why a fork cannot start, by the kind of child already running
+const char* const k_busy[] = {
+	"background save already in progress",
+	"background AOF rewrite already in progress",
+	"full resync snapshot in progress, try again later",
+};
+
+// one line to stderr with write(), which is safe in the child
+static void snapshot_report (const char* what, uint64_t bytes, uint64_t us) {
+	char line[128];
+	double secs = (double)us / 1e6;
+	int n = snprintf(line, sizeof(line), "%s: %llu bytes in %.3f s, %.2f GB/s\n", what,
+		(unsigned long long)bytes, secs, secs > 0 ? (double)bytes / secs / 1e9 : 0.0);
+	(void)!write(2, line, (size_t)n);
+}
+
+// save, writes the snapshot while every worker waits
+static void do_save (Conn* conn) {
+	ShardLocks shards(k_all_shards);
+	std::lock_guard<std::mutex> guard(g_data.lock);
+	if (g_save.child) {
+		return out_err(conn, ERR_BUSY, k_busy[g_save.kind]);
+	}
+	uint8_t* buf = (uint8_t*)malloc(k_snapshot_mem);
+	uint64_t start = get_monotonic_us();
+	uint64_t bytes = 0;
+	bool ok = snapshot_save(buf, &bytes);
+	free(buf);
+	if (!ok) {
+		return out_err(conn, ERR_IO, "snapshot write failed");
+	}
+	snapshot_report("save", bytes, get_monotonic_us() - start);
+	g_save.lastsave = time(NULL);
+	out_ok(conn);
+}
+
+// bgsave, writes the snapshot from a forked child. the child sees the
+// keyspace as of the fork, the kernel copies a page only when the workers
+// write to it, and they keep serving meanwhile. the workers only wait for
+// fork() itself, which copies the page tables
+static void do_bgsave (Conn* conn) {
+	ShardLocks shards(k_all_shards);
+	std::lock_guard<std::mutex> guard(g_data.lock);
+	if (g_save.child) {
+		return out_err(conn, ERR_BUSY, k_busy[g_save.kind]);
+	}
+	uint8_t* buf = (uint8_t*)malloc(k_snapshot_mem);
+	uint64_t start = get_monotonic_us();
+	pid_t pid = fork();
+	if (pid == 0) {
+		uint64_t bytes = 0;
+		bool ok = snapshot_save(buf, &bytes);
+		snapshot_report("background save", bytes, get_monotonic_us() - start);
+		_exit(ok ? 0 : 1);
+	}
+	uint64_t pause = get_monotonic_us() - start;
+	free(buf);
+	if (pid < 0) {
+		return out_err(conn, ERR_IO, "fork failed");
+	}
+	g_save.kind = CHILD_SAVE;
+	g_save.child = pid;
+	fprintf(stderr, "background save started by pid %d, fork took %llu us\n",
+		(int)pid, (unsigned long long)pause);
+	out_status(conn, "Background saving started");
+}
+
+// group commit, run by every worker at the end of each loop iteration,
+// before the replies of the iteration are sent: writes every command
+// appended so far with one write(), and with fsync always syncs it too.
+// write_lock is held throughout, so a worker whose commands another
+// worker is already writing waits for that write instead of returning
+static void aof_flush () {
+	bool always = g_aof.fsync == AOF_FSYNC_ALWAYS;
+	std::atomic<uint64_t> &done = always ? g_aof.synced : g_aof.written;
+	uint64_t target = g_aof.appended;
+	if (done >= target) {
+		return;
+	}
+	std::lock_guard<std::mutex> wguard(g_aof.write_lock);
+	if (done >= target) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> guard(g_data.lock);
+		if (!buf_size(&g_aof.out)) {
+			std::swap(g_aof.buf, g_aof.out);
+		} else {
+			//what a failed write left comes first
+			buf_append(&g_aof.out, buf_head(&g_aof.buf), buf_size(&g_aof.buf));
+			buf_consume(&g_aof.buf, buf_size(&g_aof.buf));
+		}
+	}
+	size_t size = buf_size(&g_aof.out);
+	bool ok = aof_write(g_aof.fd, &g_aof.out);
+	g_aof.written += size - buf_size(&g_aof.out);
+	if (ok && always) {
+		ok = fdatasync(g_aof.fd) == 0;
+		if (ok) {
+			g_aof.synced = g_aof.written.load();
+		}
+	}
+	if (!ok && always) {
+		//the replies waiting for this would claim it is on disk
+		errmsg("AOF write failed");
+	}
+	if (!ok && !g_aof.write_failed) {
+		msg("AOF write failed, retrying");
+	}
+	g_aof.write_failed = !ok;
+}
+
+// fsync everysec: syncs whatever was written during the last second on
+// its own thread, so no worker ever waits for the disk
+static void aof_syncer () {
+	while (1) {
+		sleep(1);
+		uint64_t written = g_aof.written;
+		if (g_aof.synced >= written) {
+			continue;
+		}
+		std::lock_guard<std::mutex> guard(g_aof.sync_lock);
+		if (fdatasync(g_aof.fd) != 0) {
+			msg("AOF fsync failed");
+			continue;
+		}
+		g_aof.synced = written;
+	}
+}
+
+// bgrewriteaof, compacts the log. a forked child writes the keyspace as a
+// snapshot, the base the new log starts from, while the commands applied
+// since the fork are kept in memory as well as being logged as usual.
+// once the child is done aof_rewrite_done() swaps both files in
+static void do_bgrewriteaof (Conn* conn) {
+	if (!g_aof.on) {
+		return out_err(conn, ERR_UNKNOWN, "the AOF is off");
+	}
+	ShardLocks shards(k_all_shards);
+	std::lock_guard<std::mutex> guard(g_data.lock);
+	if (g_save.child) {
+		return out_err(conn, ERR_BUSY, k_busy[g_save.kind]);
+	}
+	uint8_t* buf = (uint8_t*)malloc(k_snapshot_mem);
+	uint64_t start = get_monotonic_us();
+	pid_t pid = fork();
+	if (pid == 0) {
+		uint64_t bytes = 0;
+		bool ok = snapshot_write(g_aof.base_tmp.c_str(), buf, &bytes);
+		snapshot_report("AOF rewrite", bytes, get_monotonic_us() - start);
+		_exit(ok ? 0 : 1);
+	}
+	uint64_t pause = get_monotonic_us() - start;
+	free(buf);
+	if (pid < 0) {
+		return out_err(conn, ERR_IO, "fork failed");
+	}
+	g_aof.rewriting = true;
+	g_save.kind = CHILD_REWRITE;
+	g_save.child = pid;
+	fprintf(stderr, "AOF rewrite started by pid %d, fork took %llu us\n",
+		(int)pid, (unsigned long long)pause);
+	out_status(conn, "Background append only file rewriting started");
+}
+
+// run by the worker that reaped the rewrite child. the commands since
+// the fork go to a new log, then the new base and the new log are renamed
+// over the old ones, in that order. a crash in between leaves the new
+// base with the old log, which holds everything since the old base: the
+// logged commands set values rather than adjust them, so replaying the
+// ones the new base already contains changes nothing
+static void aof_rewrite_done (bool ok) {
+	std::lock_guard<std::mutex> wguard(g_aof.write_lock);
+	Buffer diff;
+	{
+		std::lock_guard<std::mutex> guard(g_data.lock);
+		diff = g_aof.rewrite;
+		buf_init(&g_aof.rewrite);
+		g_aof.rewriting = false;
+		//the old log is kept complete until it is replaced. these
+		//commands are in diff too
+		buf_append(&g_aof.out, buf_head(&g_aof.buf), buf_size(&g_aof.buf));
+		buf_consume(&g_aof.buf, buf_size(&g_aof.buf));
+	}
+	size_t size = buf_size(&g_aof.out);
+	bool written = aof_write(g_aof.fd, &g_aof.out);
+	g_aof.written += size - buf_size(&g_aof.out);
+	g_aof.write_failed = !written;
+
+	int fd = -1;
+	if (ok && written) {
+		fd = open(g_aof.tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+		ok = fd >= 0 && aof_write(fd, &diff) && fdatasync(fd) == 0
+			&& rename(g_aof.base_tmp.c_str(), g_aof.base.c_str()) == 0
+			&& rename(g_aof.tmp.c_str(), g_aof.path.c_str()) == 0;
+	} else {
+		ok = false;
+	}
+	buf_release(&diff);
+	if (!ok) {
+		msg("AOF rewrite failed");
+		if (fd >= 0) {
+			close(fd);
+		}
+		(void)unlink(g_aof.tmp.c_str());
+		(void)unlink(g_aof.base_tmp.c_str());
+		return;
+	}
+	{
+		//the new log holds everything written so far, and is synced
+		std::lock_guard<std::mutex> guard(g_aof.sync_lock);
+		close(g_aof.fd);
+		g_aof.fd = fd;
+		g_aof.synced = g_aof.written.load();
+	}
+	msg("AOF rewrite done");
+}
+
+// on a replica whose keyspace a full resync replaced: the log starts over
+// from the new keyspace, written as the base on the spot. the commands
+// not written yet are dropped, the keyspace they changed is gone. the
+// caller holds g_aof.write_lock, every shard lock and g_data.lock, and
+// no rewrite runs
+static bool aof_reset () {
+	uint64_t dropped = buf_size(&g_aof.buf) + buf_size(&g_aof.out);
+	buf_consume(&g_aof.buf, buf_size(&g_aof.buf));
+	buf_consume(&g_aof.out, buf_size(&g_aof.out));
+	uint8_t* buf = (uint8_t*)malloc(k_snapshot_mem);
+	uint64_t bytes = 0;
+	int fd = -1;
+	bool ok = snapshot_write(g_aof.base_tmp.c_str(), buf, &bytes)
+		&& (fd = open(g_aof.tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) >= 0
+		&& rename(g_aof.base_tmp.c_str(), g_aof.base.c_str()) == 0
+		&& rename(g_aof.tmp.c_str(), g_aof.path.c_str()) == 0;
+	free(buf);
+	if (!ok) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		(void)unlink(g_aof.tmp.c_str());
+		(void)unlink(g_aof.base_tmp.c_str());
+		return false;
+	}
+	//the dropped commands count as written, for the replies waiting on them
+	g_aof.written += dropped;
+	g_aof.write_failed = false;
+	std::lock_guard<std::mutex> guard(g_aof.sync_lock);
+	close(g_aof.fd);
+	g_aof.fd = fd;
+	g_aof.synced = g_aof.written.load();
+	return true;
+}
+
+// make the worker run a loop iteration, which feeds its replicas. at most
+// one wakeup is pending per worker
+static void worker_wake (Worker* w) {
+	if (!w->woken.exchange(true)) {
+		(void)!write(w->wake_fd[1], "w", 1);
+	}
+}
+
+static void repl_wake_all () {
+	for (Worker* w: g_workers) {
+		if (w->nreplicas) {
+			worker_wake(w);
+		}
+	}
+}
+
+// the caller holds g_data.lock. the file goes once no replica needs it
+static void repl_sync_unref (ReplSync* sync) {
+	if (--sync->refs > 0 || sync->state == SYNC_WRITING) {
+		return;
+	}
+	if (sync->fd >= 0) {
+		close(sync->fd);
+	}
+	delete sync;
+}
+
+// the caller holds every shard lock and g_data.lock. forks a child that
+// writes the keyspace for a full resync, like BGSAVE but to a file of its
+// own. the stream
+// continues from the offset at the fork. NULL if the fork failed
+static ReplSync* repl_sync_start () {
+	uint8_t* buf = (uint8_t*)malloc(k_snapshot_mem);
+	uint64_t start = get_monotonic_us();
+	pid_t pid = fork();
+	if (pid == 0) {
+		uint64_t bytes = 0;
+		bool ok = snapshot_write(g_repl.sync_path.c_str(), buf, &bytes);
+		snapshot_report("full resync snapshot", bytes, get_monotonic_us() - start);
+		_exit(ok ? 0 : 1);
+	}
+	uint64_t pause = get_monotonic_us() - start;
+	free(buf);
+	if (pid < 0) {
+		return NULL;
+	}
+	ReplSync* sync = new ReplSync();
+	sync->offset = g_repl.offset;
+	g_repl.sync = sync;
+	g_save.kind = CHILD_SYNC;
+	g_save.child = pid;
+	fprintf(stderr, "full resync snapshot started by pid %d, fork took %llu us\n",
+		(int)pid, (unsigned long long)pause);
+	return sync;
+}
+
+// run by the worker that reaped the full resync child. the file is
+// unlinked at once, the replicas read it through the open fd
+static void repl_sync_done (bool ok) {
+	int fd = ok ? open(g_repl.sync_path.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+	struct stat st;
+	if (fd >= 0 && fstat(fd, &st) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	(void)unlink(g_repl.sync_path.c_str());
+	if (fd < 0) {
+		msg("full resync snapshot failed");
+	}
+	{
+		std::lock_guard<std::mutex> guard(g_data.lock);
+		ReplSync* sync = g_repl.sync;
+		g_repl.sync = NULL;
+		sync->fd = fd;
+		sync->size = fd >= 0 ? (uint64_t)st.st_size : 0;
+		sync->state = fd >= 0 ? SYNC_READY : SYNC_FAILED;
+		//every replica waiting for it may have gone meanwhile
+		sync->refs++;
+		repl_sync_unref(sync);
+	}
+	repl_wake_all();
+}
+
+// reaps a finished BGSAVE, BGREWRITEAOF or full resync child, run by every
+// worker once per loop iteration, so the worker that started it polls
+// while the others may be blocked. only the one whose waitpid() returns
+// the child handles it. returns the loop timeout in ms, -1 if no child is
+// running
+static int snapshot_poll () {
+	pid_t pid = g_save.child;
+	if (!pid) {
+		return -1;
+	}
+	int status = 0;
+	pid_t rv = waitpid(pid, &status, WNOHANG);
+	if (rv != pid) {
+		return rv == 0 ? 100 : -1;
+	}
+	bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	if (g_save.kind == CHILD_REWRITE) {
+		aof_rewrite_done(ok);
+	} else if (g_save.kind == CHILD_SYNC) {
+		repl_sync_done(ok);
+	} else if (ok) {
+		g_save.lastsave = time(NULL);
+	} else {
+		msg("background save failed");
+	}
+	g_save.child = 0;
+	return -1;
+}
+
+// what one loader thread has decoded: keys with an expiry are added to the
+// wheel by the main thread afterwards, the wheel is not thread-safe
+struct SnapLoad {
+	std::vector<std::pair<Entry*, uint64_t>> expiring;
+	const char* err = NULL;
+	std::mutex* locks = NULL; //one per shard, shared by the threads
+};
+
+// one record of a snapshot. keys that expired while the server was down
+// are skipped. a key cannot appear twice in a file written from the db,
+// so nothing is looked up
+static bool snapshot_record (SnapReader* r, uint64_t now, int64_t wall, SnapLoad* load) {
+	uint8_t type = 0;
+	uint8_t flags = 0;
+	uint64_t expire = 0;
+	uint32_t klen = 0;
+	const uint8_t* key = NULL;
+	if (!snap_get_u8(r, &type) || !snap_get_u8(r, &flags)
+		|| ((flags & SNAP_EXPIRE) && !snap_get_u64(r, &expire))
+		|| !snap_get_u32(r, &klen) || !(key = snap_get(r, klen)))
+	{
+		return false;
+	}
+	std::string_view name((const char*)key, klen);
+	int64_t ttl_ms = (int64_t)expire - wall;
+	bool live = !(flags & SNAP_EXPIRE) || ttl_ms > 0;
+	Entry* ent = NULL;
+	uint32_t n = 0;
+	if (type == T_STR) {
+		const uint8_t* val = NULL;
+		if (!snap_get_u32(r, &n) || !(val = snap_get(r, n))) {
+			return false;
+		}
+		if (live) {
+			ent = entry_make(name, T_STR);
+			ent->val = blob_new(val, n);
+		}
+	} else if (type == T_ZSET) {
+		if (!snap_get_u32(r, &n) || n == 0) {
+			return false;
+		}
+		if (live) {
+			ent = entry_make(name, T_ZSET);
+			ent->zset = zset_new();
+		}
+		for (uint32_t i = 0; i < n; ++i) {
+			uint32_t mlen = 0;
+			const uint8_t* member = NULL;
+			uint64_t bits = 0;
+			if (!snap_get_u32(r, &mlen) || !(member = snap_get(r, mlen)) || !snap_get_u64(r, &bits)) {
+				return false;
+			}
+			double score = 0;
+			memcpy(&score, &bits, 8);
+			if (ent) {
+				zset_add(ent->zset, (const char*)member, mlen, score);
+			}
+		}
+	} else if (type == T_LIST) {
+		if (!snap_get_u32(r, &n) || n == 0) {
+			return false;
+		}
+		if (live) {
+			ent = entry_make(name, T_LIST);
+			ent->list = new std::deque<Blob*>();
+		}
+		for (uint32_t i = 0; i < n; ++i) {
+			uint32_t vlen = 0;
+			const uint8_t* val = NULL;
+			if (!snap_get_u32(r, &vlen) || !(val = snap_get(r, vlen))) {
+				return false;
+			}
+			if (ent) {
+				ent->list->push_back(blob_new(val, vlen));
+			}
+		}
+	} else {
+		return false;
+	}
+	if (ent) {
+		Shard* sh = entry_shard(ent);
+		std::lock_guard<std::mutex> guard(load->locks[sh - g_data.shards]);
+		hm_insert(&sh->db, &ent->node);
+		if (flags & SNAP_EXPIRE) {
+			load->expiring.push_back({ent, now + (uint64_t)ttl_ms});
+		}
+	}
+	return r->pos == r->len;
+}
+
+// checks one chunk, then decodes it. nothing of a damaged chunk is loaded
+static bool snapshot_chunk (const uint8_t* data, const SnapChunk* c, uint64_t now, int64_t wall,
+	SnapLoad* load)
+{
+	if (!snap_chunk_valid(data, c)) {
+		load->err = "checksum mismatch";
+		return false;
+	}
+	SnapReader r = {data + c->offset, c->len, 0};
+	uint32_t n = 0;
+	while (r.pos < r.len) {
+		uint32_t len = 0;
+		const uint8_t* body = NULL;
+		if (!snap_get_u32(&r, &len) || !(body = snap_get(&r, len)) || n == c->n) {
+			load->err = "damaged record";
+			return false;
+		}
+		SnapReader rec = {body, len, 0};
+		if (!snapshot_record(&rec, now, wall, load)) {
+			load->err = "damaged record";
+			return false;
+		}
+		n++;
+	}
+	if (n != c->n) {
+		load->err = "damaged chunk";
+		return false;
+	}
+	//decoded, the kernel may drop these pages of the file
+	snap_chunk_advise(data, c, MADV_DONTNEED);
+	return true;
+}
+
+static bool entry_drop (HNode* node, void*) {
+	entry_free(container_of(node, Entry, node));
+	return true;
+}
+
+// the caller holds every shard lock
+static void db_clear () {
+	for (Shard &sh: g_data.shards) {
+		hm_foreach(&sh.db, &entry_drop, NULL);
+		hm_clear(&sh.db);
+		sh.expire_next = UINT64_MAX;
+	}
+}
+
+static bool entry_index_one (HNode* node, void*) {
+	entry_index(container_of(node, Entry, node));
+	return true;
+}
+
+// lists every key under its slot, after a load that inserted them
+// directly. the caller holds every shard lock
+static void db_index () {
+	if (!g_cluster.on) {
+		return;
+	}
+	for (Shard &sh: g_data.shards) {
+		hm_foreach(&sh.db, &entry_index_one, NULL);
+	}
+}
+
+// loads a snapshot into an empty keyspace, at startup before the
+// listeners are opened, or on a replica in place of its keyspace after a
+// full resync. the caller holds every shard lock. a missing file is an
+// empty keyspace, a damaged one returns false.
+// the file is mapped, each shard's table is sized for its share of the
+// record counts in the chunk headers, and g_load_threads threads take
+// chunks off a shared counter and insert side by side, under a lock per
+// shard of their own
+static bool snapshot_load (const std::string &path) {
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0 && errno == ENOENT) {
+		return true;
+	}
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
+	uint64_t start = get_monotonic_us();
+	//mapped rather than read, so the file is in the page cache only and
+	//the kernel can drop what has been loaded
+	size_t size = (size_t)st.st_size;
+	uint8_t* data = NULL;
+	if (size) {
+		data = (uint8_t*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			errmsg("mmap snapshot");
+		}
+	}
+	close(fd);
+
+	std::vector<SnapChunk> chunks;
+	const char* err = NULL;
+	bool ok = snap_index(data, size, &chunks, &err) >= 0;
+	size_t nthreads = 0;
+	if (ok) {
+		size_t records = 0;
+		for (const SnapChunk &c: chunks) {
+			records += c.n;
+		}
+		for (Shard &sh: g_data.shards) {
+			assert(hm_size(&sh.db) == 0);
+			hm_reserve(&sh.db, records / k_shards);
+		}
+
+		uint64_t now = get_monotonic_ms();
+		int64_t wall = get_wall_ms();
+		nthreads = (size_t)g_load_threads < chunks.size() ? (size_t)g_load_threads : chunks.size();
+		std::vector<SnapLoad> loads(nthreads);
+		std::vector<std::mutex> locks(k_shards);
+		for (SnapLoad &load: loads) {
+			load.locks = locks.data();
+		}
+		std::atomic<size_t> next{0};
+		std::atomic<bool> failed{false};
+		auto run = [&](SnapLoad* load) {
+			size_t i = 0;
+			while (!failed && (i = next++) < chunks.size()) {
+				//start reading the chunks taken next, so the disk works
+				//while this one is decoded
+				size_t ahead = i + nthreads * k_snapshot_readahead;
+				if (ahead < chunks.size()) {
+					snap_chunk_advise(data, &chunks[ahead], MADV_WILLNEED);
+				}
+				if (!snapshot_chunk(data, &chunks[i], now, wall, load)) {
+					failed = true;
+				}
+			}
+		};
+		for (size_t i = 0; i < chunks.size() && i < nthreads * k_snapshot_readahead; ++i) {
+			snap_chunk_advise(data, &chunks[i], MADV_WILLNEED);
+		}
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < nthreads; ++i) {
+			threads.emplace_back(run, &loads[i]);
+		}
+		if (nthreads) {
+			run(&loads[0]);
+		}
+		for (std::thread &t: threads) {
+			t.join();
+		}
+		for (SnapLoad &load: loads) {
+			if (load.err) {
+				ok = false;
+				err = load.err;
+			}
+			for (auto &[ent, expire]: load.expiring) {
+				entry_ttl_add(ent, expire);
+			}
+		}
+	}
+	if (size) {
+		munmap(data, size);
+	}
+	if (!ok) {
+		fprintf(stderr, "%s: %s\n", path.c_str(), err);
+		//whatever the other chunks held
+		db_clear();
+		return false;
+	}
+	db_index();
+	double secs = (double)(get_monotonic_us() - start) / 1e6;
+	printf("Loaded %zu keys from %s (%zu bytes, %zu chunks, %zu threads) in %.3f s, %.2f GB/s\n",
+		db_size(), path.c_str(), size, chunks.size(), nthreads, secs,
+		secs > 0 ? (double)size / secs / 1e9 : 0.0);
+	return true;
+}
+
+// at startup, a snapshot that cannot be loaded stops the server
+static void snapshot_load_or_exit (const std::string &path) {
+	ShardLocks shards(k_all_shards);
+	if (!snapshot_load(path)) {
+		exit(1);
+	}
+}
+
+// hello [protover], switches a RESP connection between RESP2 and RESP3
+static void do_hello (Conn* conn, std::vector<std::string_view> &cmd) {
+	if (conn->proto == PROTO_BIN) {
+		return out_err(conn, ERR_UNKNOWN, "HELLO needs a RESP connection");
+	}
+	if (cmd.size() >= 2) {
+		if (cmd[1] == "2") {
+			conn->proto = PROTO_RESP2;
+		} else if (cmd[1] == "3") {
+			conn->proto = PROTO_RESP3;
+		} else {
+			return out_err(conn, ERR_BAD_ARG, "unsupported protocol version");
+		}
+	}
+	out_map(conn, 3);
+	out_str(conn, "server", 6);
+	out_str(conn, "redis-from-scratch", 18);
+	out_str(conn, "proto", 5);
+	out_int(conn, conn->proto == PROTO_RESP3 ? 3 : 2);
+	out_str(conn, "mode", 4);
+	if (g_cluster.on) {
+		out_str(conn, "cluster", 7);
+	} else {
+		out_str(conn, "standalone", 10);
+	}
+}
+
+// memory stats, slab allocator usage per size class that has any slabs:
+// object size, objects in use and objects carved in total
+static void do_memory_stats (Conn* conn) {
+	std::vector<SlabClassStats> stats = slab_stats();
+	uint32_t n = 0;
+	for (const SlabClassStats &st: stats) {
+		n += st.total ? 1 : 0;
+	}
+	out_arr(conn, n);
+	for (const SlabClassStats &st: stats) {
+		if (!st.total) {
+			continue;
+		}
+		out_map(conn, 3);
+		out_str(conn, "size", 4);
+		out_int(conn, (int64_t)st.size);
+		out_str(conn, "used", 4);
+		out_int(conn, (int64_t)st.used);
+		out_str(conn, "total", 5);
+		out_int(conn, (int64_t)st.total);
+	}
+}
+
+// the caller holds g_data.lock. a new replication id, which tells
+// replicas that this stream is not the one they were following
+static void repl_new_id () {
+	static const char* const k_hex = "0123456789abcdef";
+	uint64_t x = get_monotonic_us() ^ (uint64_t)get_wall_ms() << 20 ^ (uint64_t)getpid() << 40;
+	for (int i = 0; i < 40; ++i) {
+		//splitmix64, a fresh word every 16 digits
+		if (i % 16 == 0) {
+			x += 0x9e3779b97f4a7c15ull;
+			x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+			x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+			x ^= x >> 31;
+		}
+		g_repl.replid[i] = k_hex[(x >> (4 * (i % 16))) & 15];
+	}
+	g_repl.replid[40] = 0;
+}
+
+// psync replid offset, sent by a replica. if the stream it followed is
+// this one and its offset is still in the backlog, it continues from
+// there. otherwise it gets a full resync: a forked child writes the
+// keyspace, the replica loads it and the stream follows from the offset
+// at the fork. replicas asking while the child runs share its snapshot.
+// from now on the connection carries the stream, see repl_feed()
+static void do_psync (Conn* conn, std::vector<std::string_view> &cmd) {
+	if (conn->proto == PROTO_BIN) {
+		return out_err(conn, ERR_UNKNOWN, "PSYNC needs a RESP connection");
+	}
+	if (g_repl.replica) {
+		return out_err(conn, ERR_BAD_ARG, "a replica has no replicas of its own");
+	}
+	int64_t off = -1;
+	if (!str2int(cmd[2], &off)) {
+		off = -1;
+	}
+	//the backlog starting and the fork both need every command either
+	//done or not started
+	ShardLocks shards(k_all_shards);
+	std::lock_guard<std::mutex> guard(g_data.lock);
+	Backlog* b = &g_repl.backlog;
+	if (!b->data) {
+		backlog_init(b, g_repl_backlog_size, g_repl.offset);
+	}
+	if (cmd[1] == g_repl.replid && off >= 0 && (uint64_t)off >= b->start && (uint64_t)off <= b->end) {
+		out_status(conn, "CONTINUE");
+		conn->repl = REPL_ONLINE;
+		conn->repl_off = (uint64_t)off;
+		g_repl.partial_syncs++;
+	} else {
+		if (cmd[1] != "?") {
+			g_repl.partial_fails++;
+		}
+		ReplSync* sync = g_repl.sync;
+		if (!sync && g_save.child) {
+			return out_err(conn, ERR_BUSY, k_busy[g_save.kind]);
+		}
+		if (!sync && !(sync = repl_sync_start())) {
+			return out_err(conn, ERR_IO, "fork failed");
+		}
+		sync->refs++;
+		char line[80];
+		snprintf(line, sizeof(line), "FULLRESYNC %s %llu", g_repl.replid,
+			(unsigned long long)sync->offset);
+		out_status(conn, line);
+		conn->repl = REPL_WAIT_SYNC;
+		conn->repl_sync = sync;
+		conn->repl_off = sync->offset;
+		g_repl.full_syncs++;
+	}
+	conn->repl_ack = conn->repl_off;
+	conn->repl_ack_ms = get_monotonic_ms();
+	dlist_push_back(&g_repl.replicas, &conn->repl_all);
+}
+
+// a replica's connection is closed
+static void repl_conn_gone (Conn* conn) {
+	std::lock_guard<std::mutex> guard(g_data.lock);
+	dlist_detach(&conn->repl_all);
+	if (conn->repl_sync) {
+		repl_sync_unref(conn->repl_sync);
+		conn->repl_sync = NULL;
+	}
+}
+
+// replconf ack offset, how far a replica has applied the stream. the only
+// request a replica sends once it follows the stream, and it gets no
+// reply, the connection's output is the stream. anything else replicas
+// send before PSYNC is accepted and ignored
+static void do_replconf (Conn* conn, std::vector<std::string_view> &cmd) {
+	int64_t off = 0;
+	if (conn->repl && cmd.size() == 3 && cmd_is(cmd[1], "ack") && str2int(cmd[2], &off)) {
+		std::lock_guard<std::mutex> guard(g_data.lock);
+		conn->repl_ack = (uint64_t)off;
+		conn->repl_ack_ms = get_monotonic_ms();
+	}
+	if (!conn->repl) {
+		out_ok(conn);
+	}
+}
+
+static void replica_run ();
+
+// replicaof host port, makes this server a replica of another one: the
+// keyspace is replaced by the primary's and follows its stream, and
+// clients can no longer write. issued again it reconnects, from the
+// offset reached. replicaof no one makes it a primary again, with the
+// keyspace it has
+static void do_replicaof (Conn* conn, std::vector<std::string_view> &cmd) {
+	if (cmd_is(cmd[1], "no") && cmd_is(cmd[2], "one")) {
+		{
+			std::lock_guard<std::mutex> guard(g_repl.cfg_lock);
+			g_repl.host.clear();
+			g_repl.port = 0;
+			g_repl.primary_replid.clear();
+			g_repl.cfg_gen++;
+		}
+		std::lock_guard<std::mutex> guard(g_data.lock);
+		if (g_repl.replica) {
+			repl_new_id();
+			g_repl.replica = false;
+			msg("promoted to primary");
+		}
+		return out_ok(conn);
+	}
+	int64_t port = 0;
+	if (!str2int(cmd[2], &port) || port <= 0 || port > 65535) {
+		return out_err(conn, ERR_BAD_ARG, "invalid port");
+	}
+	{
+		//replicas of this server are dropped, the stream they followed
+		//ends here
+		ShardLocks shards(k_all_shards);
+		std::lock_guard<std::mutex> guard(g_data.lock);
+		backlog_free(&g_repl.backlog);
+		g_repl.replica = true;
+	}
+	{
+		std::lock_guard<std::mutex> guard(g_repl.cfg_lock);
+		g_repl.host.assign(cmd[1].data(), cmd[1].size());
+		g_repl.port = (int)port;
+		g_repl.cfg_gen++;
+		if (!g_repl.thread_started) {
+			g_repl.thread_started = true;
+			std::thread(replica_run).detach();
+		}
+	}
+	repl_wake_all();
+	out_ok(conn);
+}
+
+static const char* const k_repl_states[] = {"none", "wait_bgsave", "send_bulk", "online"};
+
+// info [replication], the replication state as "field:value" lines
+static void do_info (Conn* conn) {
+	std::string s = "# Replication\r\n";
+	char line[256];
+	uint64_t now = get_monotonic_ms();
+	if (g_repl.replica) {
+		std::lock_guard<std::mutex> guard(g_repl.cfg_lock);
+		snprintf(line, sizeof(line), "role:slave\r\nmaster_host:%s\r\nmaster_port:%d\r\n"
+			"master_link_status:%s\r\nslave_repl_offset:%llu\r\nmaster_replid:%s\r\n",
+			g_repl.host.c_str(), g_repl.port, g_repl.link_up ? "up" : "down",
+			(unsigned long long)g_repl.offset.load(), g_repl.primary_replid.c_str());
+		s += line;
+		return out_str(conn, s.data(), s.size());
+	}
+	std::lock_guard<std::mutex> guard(g_data.lock);
+	size_t n = 0;
+	for (DList* node = g_repl.replicas.next; node != &g_repl.replicas; node = node->next) {
+		n++;
+	}
+	snprintf(line, sizeof(line), "role:master\r\nconnected_slaves:%zu\r\n", n);
+	s += line;
+	n = 0;
+	for (DList* node = g_repl.replicas.next; node != &g_repl.replicas; node = node->next) {
+		Conn* r = container_of(node, Conn, repl_all);
+		struct sockaddr_in addr = {};
+		socklen_t len = sizeof(addr);
+		char ip[INET_ADDRSTRLEN] = "?";
+		if (getpeername(r->fd, (struct sockaddr*)&addr, &len) == 0) {
+			inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+		}
+		snprintf(line, sizeof(line), "slave%zu:ip=%s,port=%d,state=%s,offset=%llu,lag=%llu\r\n",
+			n++, ip, ntohs(addr.sin_port), k_repl_states[r->repl], (unsigned long long)r->repl_ack,
+			(unsigned long long)((now - r->repl_ack_ms) / 1000));
+		s += line;
+	}
+	snprintf(line, sizeof(line), "master_replid:%s\r\nmaster_repl_offset:%llu\r\n"
+		"repl_backlog_active:%d\r\nrepl_backlog_size:%zu\r\nrepl_backlog_first_byte_offset:%llu\r\n"
+		"sync_full:%llu\r\nsync_partial_ok:%llu\r\nsync_partial_err:%llu\r\n",
+		g_repl.replid, (unsigned long long)g_repl.offset.load(), g_repl.backlog.data ? 1 : 0,
+		g_repl.backlog.size, (unsigned long long)g_repl.backlog.start,
+		(unsigned long long)g_repl.full_syncs, (unsigned long long)g_repl.partial_syncs,
+		(unsigned long long)g_repl.partial_fails);
+	s += line;
+	out_str(conn, s.data(), s.size());
+}
+
+// commands that change the keyspace, which a replica takes only from its
+// primary
+static bool cmd_writes (std::string_view name) {
+	static const char* const k_writes[] = {"set", "del", "mset", "expire", "pexpire",
+		"expireat", "pexpireat", "persist", "zadd", "zrem", "lpush", "rpush", "lpop", "rpop",
+		"blpop", "brpop"};
+	for (const char* w: k_writes) {
+		if (cmd_is(name, w)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// where the keys of a command are: cmd[1], then every step-th argument
+// after it up to the end, or only cmd[1] if step is 0. the last tail
+// arguments are not keys. false for commands without keys
+static bool cmd_keys (std::string_view name, size_t* step, size_t* tail) {
+	static const struct {
+		const char* name;
+		size_t step;
+		size_t tail;
+	} k_keys[] = {{"get", 0, 0}, {"set", 0, 0}, {"del", 1, 0}, {"mget", 1, 0}, {"mset", 2, 0},
+		{"expire", 0, 0}, {"pexpire", 0, 0}, {"expireat", 0, 0}, {"pexpireat", 0, 0}, {"ttl", 0, 0},
+		{"pttl", 0, 0}, {"persist", 0, 0}, {"zadd", 0, 0}, {"zrem", 0, 0}, {"zscore", 0, 0},
+		{"zcard", 0, 0}, {"zrank", 0, 0}, {"zrange", 0, 0}, {"lpush", 0, 0}, {"rpush", 0, 0},
+		{"lpop", 0, 0}, {"rpop", 0, 0}, {"llen", 0, 0}, {"lrange", 0, 0}, {"blpop", 1, 1},
+		{"brpop", 1, 1}};
+	for (const auto &k: k_keys) {
+		if (cmd_is(name, k.name)) {
+			*step = k.step;
+			*tail = k.tail;
+			return true;
+		}
+	}
+	return false;
+}
+
+// "MOVED slot host:port" or "ASK slot host:port"
+static void cluster_redirect (Conn* conn, int32_t code, uint32_t slot, uint16_t node) {
+	char text[300];
+	std::lock_guard<std::mutex> guard(g_data.lock);
+	snprintf(text, sizeof(text), "%u %s:%d", slot, g_cluster.nodes[node].host.c_str(),
+		g_cluster.nodes[node].port);
+	out_err(conn, code, text);
+}
+
+// in a cluster a command runs where its keys' slot is served, so its keys
+// must share a slot, and a node answers MOVED for a slot it does not
+// serve. the client updates its slot map and sends the command there.
+// while a slot moves, its source serves the keys it still has and answers
+// ASK for the rest, which the client sends once to the target, preceded by
+// ASKING. hold keeps the migration from moving the keys before the
+// command has run
+static bool cluster_check (Conn* conn, std::vector<std::string_view> &cmd, bool asking,
+	std::unique_lock<std::mutex>* hold)
+{
+	size_t step = 0;
+	size_t tail = 0;
+	if (cmd.size() < 2 || !cmd_keys(cmd[0], &step, &tail) || cmd.size() < 2 + tail) {
+		return true;
+	}
+	size_t end = cmd.size() - tail;
+	uint32_t slot = key_slot(cmd[1].data(), cmd[1].size());
+	for (size_t i = 1 + step; step && i < end; i += step) {
+		if (key_slot(cmd[i].data(), cmd[i].size()) != slot) {
+			out_err(conn, ERR_CROSSSLOT, "Keys in request don't hash to the same slot");
+			return false;
+		}
+	}
+	uint16_t owner = g_cluster.owner[slot];
+	if (owner == g_cluster.self && g_cluster.migrating[slot] == k_no_node) {
+		return true;
+	}
+	if (owner != g_cluster.self) {
+		if (asking && g_cluster.importing[slot] != k_no_node) {
+			return true;
+		}
+		if (owner == k_no_node) {
+			out_err(conn, ERR_CLUSTERDOWN, "Hash slot not served");
+			return false;
+		}
+		cluster_redirect(conn, ERR_MOVED, slot, owner);
+		return false;
+	}
+	*hold = std::unique_lock<std::mutex>(g_migrate.lock);
+	//the slot may have been handed over while this waited for the lock
+	owner = g_cluster.owner[slot];
+	uint16_t target = g_cluster.migrating[slot];
+	if (owner != g_cluster.self) {
+		cluster_redirect(conn, ERR_MOVED, slot, owner);
+		return false;
+	}
+	if (target == k_no_node) {
+		return true;
+	}
+	size_t n = 0;
+	size_t here = 0;
+	bool moving = false;
+	{
+		//the keys share the slot, and so its shard
+		std::lock_guard<std::mutex> guard(slot_shard(slot)->lock);
+		for (size_t i = 1; i < end; i += step ? step : end) {
+			Entry* ent = entry_lookup(cmd[i]);
+			n++;
+			here += ent ? 1 : 0;
+			moving = moving || (ent && ent->moving);
+		}
+	}
+	if (moving || (here && here < n)) {
+		out_err(conn, ERR_TRYAGAIN, "the keys are being migrated, try again later");
+		return false;
+	}
+	if (here == n) {
+		return true;
+	}
+	cluster_redirect(conn, ERR_ASK, slot, target);
+	return false;
+}
+
+// the node at host:port, added if it is new. the caller holds g_data.lock
+static uint16_t cluster_node (const std::string &host, int port) {
+	for (size_t i = 0; i < g_cluster.nodes.size(); ++i) {
+		if (g_cluster.nodes[i].host == host && g_cluster.nodes[i].port == port) {
+			return (uint16_t)i;
+		}
+	}
+	g_cluster.nodes.push_back(ClusterNode{host, port});
+	return (uint16_t)(g_cluster.nodes.size() - 1);
+}
+
+static bool parse_addr (std::string_view s, std::string* host, int* port) {
+	size_t colon = s.rfind(':');
+	if (colon == std::string_view::npos || colon == 0) {
+		return false;
+	}
+	int64_t p = 0;
+	if (!str2int(s.substr(colon + 1), &p) || p <= 0 || p > 65535) {
+		return false;
+	}
+	host->assign(s.data(), colon);
+	*port = (int)p;
+	return true;
+}
+
+static bool parse_slots (std::string_view s, uint32_t* first, uint32_t* last) {
+	std::string text(s);
+	return slot_range_parse(text.c_str(), first, last);
+}
+
+// cluster slots: for every run of slots one node serves,
+// [first, last, [host, port]]
+static void do_cluster_slots (Conn* conn) {
+	std::vector<uint32_t> runs; //start of each run, and k_slots at the end
+	std::vector<uint16_t> owner(k_slots);
+	uint32_t n = 0;
+	for (uint32_t s = 0; s < k_slots; ++s) {
+		owner[s] = g_cluster.owner[s];
+		if (s == 0 || owner[s] != owner[s - 1]) {
+			runs.push_back(s);
+			n += owner[s] != k_no_node ? 1 : 0;
+		}
+	}
+	runs.push_back(k_slots);
+	std::lock_guard<std::mutex> guard(g_data.lock);
+	out_arr(conn, n);
+	for (size_t i = 0; i + 1 < runs.size(); ++i) {
+		if (owner[runs[i]] == k_no_node) {
+			continue;
+		}
+		const ClusterNode &node = g_cluster.nodes[owner[runs[i]]];
+		out_arr(conn, 3);
+		out_int(conn, runs[i]);
+		out_int(conn, runs[i + 1] - 1);
+		out_arr(conn, 2);
+		out_str(conn, node.host.data(), node.host.size());
+		out_int(conn, node.port);
+	}
+}
+
+// cluster info: the layout as this node sees it, and the last migration
+static void do_cluster_info (Conn* conn) {
+	uint32_t assigned = 0;
+	uint32_t mine = 0;
+	for (uint32_t s = 0; s < k_slots; ++s) {
+		uint16_t owner = g_cluster.owner[s];
+		assigned += owner != k_no_node ? 1 : 0;
+		mine += owner == g_cluster.self ? 1 : 0;
+	}
+	std::lock_guard<std::mutex> guard(g_migrate.lock);
+	std::lock_guard<std::mutex> data_guard(g_data.lock);
+	std::string target = "-";
+	if (g_migrate.target != k_no_node) {
+		const ClusterNode &node = g_cluster.nodes[g_migrate.target];
+		target = node.host + ":" + std::to_string(node.port);
+	}
+	uint64_t end = g_migrate.end_us ? g_migrate.end_us : get_monotonic_us();
+	char line[512];
+	snprintf(line, sizeof(line), "cluster_enabled:1\r\ncluster_state:%s\r\ncluster_slots_assigned:%u\r\n"
+		"cluster_slots_served:%u\r\ncluster_known_nodes:%zu\r\n"
+		"migrate_state:%s\r\nmigrate_target:%s\r\nmigrate_slots:%zu\r\nmigrate_slots_done:%zu\r\n"
+		"migrate_keys_moved:%llu\r\nmigrate_ms:%llu\r\nmigrate_error:%s\r\n",
+		assigned == k_slots ? "ok" : "fail", assigned, mine, g_cluster.nodes.size(),
+		k_mig_states[g_migrate.state], target.c_str(), g_migrate.slots.size(), g_migrate.handed,
+		(unsigned long long)g_migrate.keys_moved,
+		(unsigned long long)(g_migrate.start_us ? (end - g_migrate.start_us) / 1000 : 0),
+		g_migrate.err.empty() ? "-" : g_migrate.err.c_str());
+	out_str(conn, line, strlen(line));
+}
+
+// cluster setslot range importing host:port | node host:port | stable.
+// a migration sends IMPORTING to its target before the first keys and
+// NODE after the last key of each slot
+static void do_cluster_setslot (Conn* conn, std::vector<std::string_view> &cmd) {
+	uint32_t first = 0;
+	uint32_t last = 0;
+	std::string host;
+	int port = 0;
+	bool stable = cmd.size() == 4 && cmd_is(cmd[3], "stable");
+	bool importing = cmd.size() == 5 && cmd_is(cmd[3], "importing");
+	bool handover = cmd.size() == 5 && cmd_is(cmd[3], "node");
+	if (!parse_slots(cmd[2], &first, &last) || (!stable && (!(importing || handover) || !parse_addr(cmd[4], &host, &port)))) {
+		return out_err(conn, ERR_BAD_ARG, "syntax error");
+	}
+	std::lock_guard<std::mutex> guard(g_migrate.lock);
+	ShardLocks shards(k_all_shards);
+	std::lock_guard<std::mutex> block_guard(g_block.lock);
+	std::lock_guard<std::mutex> data_guard(g_data.lock);
+	if (stable) {
+		if (g_migrate.active) {
+			return out_err(conn, ERR_BUSY, "a slot migration is running");
+		}
+		for (uint32_t s = first; s <= last; ++s) {
+			g_cluster.migrating[s] = k_no_node;
+			g_cluster.importing[s] = k_no_node;
+		}
+		return out_status(conn, "OK");
+	}
+	//every slot is checked before the node is looked up, which adds it
+	//to the nodes for good
+	const ClusterNode &me = g_cluster.nodes[g_cluster.self];
+	bool to_self = me.host == host && me.port == port;
+	for (uint32_t s = first; s <= last; ++s) {
+		if (importing && g_cluster.owner[s] == g_cluster.self) {
+			return out_err(conn, ERR_BAD_ARG, "the slot is already served here");
+		}
+		if (handover && !to_self && g_cluster.nkeys[s]) {
+			return out_err(conn, ERR_BAD_ARG, "the slot still has keys here");
+		}
+	}
+	uint16_t node = cluster_node(host, port);
+	for (uint32_t s = first; s <= last; ++s) {
+		if (importing) {
+			g_cluster.importing[s] = node;
+		} else {
+			g_cluster.owner[s] = node;
+			g_cluster.migrating[s] = k_no_node;
+			g_cluster.importing[s] = k_no_node;
+			if (node != g_cluster.self) {
+				block_slot_moved(s);
+			}
+		}
+	}
+	out_status(conn, "OK");
+}
+
+// cluster migrate host:port range..., moves slots this node serves to
+// another node. replies once the migration is set up, worker 0 moves the
+// keys in the background, see migrate_tick(). running it again after a
+// failure carries on where it stopped
+static void do_cluster_migrate (Conn* conn, std::vector<std::string_view> &cmd) {
+	std::string host;
+	int port = 0;
+	if (!parse_addr(cmd[2], &host, &port)) {
+		return out_err(conn, ERR_BAD_ARG, "syntax error");
+	}
+	std::vector<uint32_t> slots;
+	for (size_t i = 3; i < cmd.size(); ++i) {
+		uint32_t first = 0;
+		uint32_t last = 0;
+		if (!parse_slots(cmd[i], &first, &last)) {
+			return out_err(conn, ERR_BAD_ARG, "invalid slot range");
+		}
+		for (uint32_t s = first; s <= last; ++s) {
+			slots.push_back(s);
+		}
+	}
+	std::lock_guard<std::mutex> guard(g_migrate.lock);
+	if (g_migrate.active) {
+		return out_err(conn, ERR_BUSY, "a slot migration is running");
+	}
+	{
+		std::lock_guard<std::mutex> data_guard(g_data.lock);
+		uint16_t target = cluster_node(host, port);
+		if (target == g_cluster.self) {
+			return out_err(conn, ERR_BAD_ARG, "the target is this node");
+		}
+		for (uint32_t s: slots) {
+			uint16_t to = g_cluster.migrating[s];
+			if (g_cluster.owner[s] != g_cluster.self || (to != k_no_node && to != target)) {
+				return out_err(conn, ERR_BAD_ARG, "a slot is not served here, or moving elsewhere");
+			}
+		}
+		for (uint32_t s: slots) {
+			g_cluster.migrating[s] = target;
+		}
+		g_migrate.target = target;
+		g_migrate.target_addr = host + ":" + std::to_string(port);
+	}
+	g_migrate.state = MIG_QUIESCE;
+	g_migrate.slots.swap(slots);
+	g_migrate.next = 0;
+	g_migrate.handed = 0;
+	g_migrate.keys_moved = 0;
+	g_migrate.start_us = get_monotonic_us();
+	g_migrate.end_us = 0;
+	g_migrate.err.clear();
+	g_migrate.ticks.clear();
+	for (Worker* w: g_workers) {
+		g_migrate.ticks.push_back(w->ticks);
+	}
+	g_migrate.active = true;
+	for (Worker* w: g_workers) {
+		worker_wake(w);
+	}
+	out_status(conn, "OK");
+}
+
+static void do_cluster (Conn* conn, std::vector<std::string_view> &cmd) {
+	size_t n = cmd.size();
+	if (n == 3 && cmd_is(cmd[1], "keyslot")) {
+		return out_int(conn, key_slot(cmd[2].data(), cmd[2].size()));
+	}
+	if (!g_cluster.on) {
+		return out_err(conn, ERR_UNKNOWN, "This instance has cluster support disabled");
+	}
+	if (n == 2 && cmd_is(cmd[1], "slots")) {
+		do_cluster_slots(conn);
+	} else if (n == 2 && cmd_is(cmd[1], "info")) {
+		do_cluster_info(conn);
+	} else if (n == 3 && cmd_is(cmd[1], "countkeysinslot")) {
+		uint32_t first = 0;
+		uint32_t last = 0;
+		if (!parse_slots(cmd[2], &first, &last) || first != last) {
+			return out_err(conn, ERR_BAD_ARG, "invalid slot");
+		}
+		std::lock_guard<std::mutex> guard(slot_shard(first)->lock);
+		out_int(conn, g_cluster.nkeys[first]);
+	} else if ((n == 4 || n == 5) && cmd_is(cmd[1], "setslot")) {
+		do_cluster_setslot(conn, cmd);
+	} else if (n >= 4 && cmd_is(cmd[1], "migrate")) {
+		do_cluster_migrate(conn, cmd);
+	} else {
+		out_err(conn, ERR_BAD_ARG, "unknown CLUSTER subcommand");
+	}
+}
+
+static bool pubchan_eq (HNode* lhs, HNode* rhs) {
+	return container_of(lhs, PubChan, node)->name == container_of(rhs, KeyProbe, node)->key;
+}
+
+// the caller holds g_pubsub.lock
+static PubChan* pubchan_lookup (std::string_view name, bool pattern) {
+	KeyProbe probe = key_probe(name);
+	HNode* node = hm_lookup(pattern ? &g_pubsub.patterns : &g_pubsub.channels, &probe.node, &pubchan_eq);
+	return node ? container_of(node, PubChan, node) : NULL;
+}
+
+// one pattern token against byte c: ?, a [set] with ranges and ^ for
+// negation, a \ quoted byte, or a literal. moves *pp past the token
+static bool glob_one (const char** pp, const char* pend, char c) {
+	const char* p = *pp;
+	bool hit = false;
+	if (*p == '?') {
+		hit = true;
+		p++;
+	} else if (*p == '[') {
+		p++;
+		bool negate = p < pend && *p == '^';
+		p += negate ? 1 : 0;
+		while (p < pend && *p != ']') {
+			if (*p == '\\' && p + 1 < pend) {
+				hit |= p[1] == c;
+				p += 2;
+			} else if (p + 2 < pend && p[1] == '-' && p[2] != ']') {
+				char lo = p[0] < p[2] ? p[0] : p[2];
+				char hi = p[0] < p[2] ? p[2] : p[0];
+				hit |= c >= lo && c <= hi;
+				p += 3;
+			} else {
+				hit |= *p == c;
+				p++;
+			}
+		}
+		p += p < pend ? 1 : 0;
+		hit = hit != negate;
+	} else {
+		if (*p == '\\' && p + 1 < pend) {
+			p++;
+		}
+		hit = *p == c;
+		p++;
+	}
+	*pp = p;
+	return hit;
+}
+
+// glob-style match of PSUBSCRIBE patterns, where * matches any run of
+// bytes. a mismatch only backtracks to the last *, so it is O(n*m)
+static bool glob_match (std::string_view pat, std::string_view str) {
+	const char* p = pat.data();
+	const char* pend = p + pat.size();
+	const char* s = str.data();
+	const char* send = s + str.size();
+	const char* star = NULL; //the pattern after the last *
+	const char* mark = NULL; //where the text that * matched ends
+	while (s < send) {
+		if (p < pend && *p == '*') {
+			star = ++p;
+			mark = s;
+			continue;
+		}
+		const char* next = p;
+		if (p < pend && glob_one(&next, pend, *s)) {
+			p = next;
+			s++;
+			continue;
+		}
+		if (!star) {
+			return false;
+		}
+		p = star;
+		s = ++mark;
+	}
+	while (p < pend && *p == '*') {
+		p++;
+	}
+	return p == pend;
+}
+
+// the caller holds g_pubsub.lock
+static Sub* sub_find (Conn* conn, std::string_view name, bool pattern) {
+	for (DList* node = conn->subs.next; node != &conn->subs; node = node->next) {
+		Sub* sub = container_of(node, Sub, conn_link);
+		if (sub->chan->pattern == pattern && sub->chan->name == name) {
+			return sub;
+		}
+	}
+	return NULL;
+}
+
+// the caller holds g_pubsub.lock and has checked the connection is not
+// subscribed yet
+static void sub_add (Conn* conn, std::string_view name, bool pattern) {
+	PubChan* chan = pubchan_lookup(name, pattern);
+	if (!chan) {
+		chan = new PubChan();
+		chan->name.assign(name.data(), name.size());
+		chan->node.hcode = str_hash((const uint8_t*)name.data(), name.size());
+		chan->pattern = pattern;
+		chan->subs.resize(g_workers.size());
+		chan->nsubs.assign(g_workers.size(), 0);
+		hm_insert(pattern ? &g_pubsub.patterns : &g_pubsub.channels, &chan->node);
+		if (pattern) {
+			dlist_push_back(&g_pubsub.patterns_all, &chan->pattern_link);
+		}
+	}
+	Sub* sub = new Sub();
+	sub->chan = chan;
+	sub->conn = conn;
+	dlist_push_back(&chan->subs[conn->worker], &sub->chan_link);
+	dlist_push_back(&conn->subs, &sub->conn_link);
+	chan->nsubs[conn->worker]++;
+	chan->total++;
+	conn->nsubs++;
+}
+
+// the caller holds g_pubsub.lock
+static void sub_del (Sub* sub) {
+	PubChan* chan = sub->chan;
+	Conn* conn = sub->conn;
+	dlist_detach(&sub->chan_link);
+	dlist_detach(&sub->conn_link);
+	chan->nsubs[conn->worker]--;
+	chan->total--;
+	conn->nsubs--;
+	delete sub;
+	if (chan->total == 0) {
+		KeyProbe probe = key_probe(chan->name, &chan->node);
+		hm_delete(chan->pattern ? &g_pubsub.patterns : &g_pubsub.channels, &probe.node, &pubchan_eq);
+		dlist_detach(&chan->pattern_link);
+		delete chan;
+	}
+}
+
+static void pubsub_conn_gone (Conn* conn) {
+	std::lock_guard<std::mutex> guard(g_pubsub.lock);
+	while (!dlist_empty(&conn->subs)) {
+		sub_del(container_of(conn->subs.next, Sub, conn_link));
+	}
+}
+
+// header of a message to a subscriber, or of a SUBSCRIBE reply. RESP3
+// has a push type for it
+static void out_push (Conn* conn, uint32_t n) {
+	if (conn->proto == PROTO_RESP3) {
+		return out_resp_num(conn, '>', n);
+	}
+	out_arr(conn, n);
+}
+
+// [kind, channel, subscriptions left], once per channel. the binary
+// protocol has one reply per request, an array of them
+static void out_sub_reply (Conn* conn, const char* kind, std::string_view name) {
+	out_push(conn, 3);
+	out_str(conn, kind, strlen(kind));
+	out_str(conn, name.data(), name.size());
+	out_int(conn, conn->nsubs);
+}
+
+static void do_subscribe (Conn* conn, std::vector<std::string_view> &cmd, bool pattern) {
+	if (conn->proto == PROTO_BIN) {
+		out_arr(conn, (uint32_t)(cmd.size() - 1));
+	}
+	std::lock_guard<std::mutex> guard(g_pubsub.lock);
+	for (size_t i = 1; i < cmd.size(); ++i) {
+		if (!sub_find(conn, cmd[i], pattern)) {
+			sub_add(conn, cmd[i], pattern);
+		}
+		out_sub_reply(conn, pattern ? "psubscribe" : "subscribe", cmd[i]);
+	}
+}
+
+// the given channels or patterns, or all of them
+static void do_unsubscribe (Conn* conn, std::vector<std::string_view> &cmd, bool pattern) {
+	const char* kind = pattern ? "punsubscribe" : "unsubscribe";
+	std::lock_guard<std::mutex> guard(g_pubsub.lock);
+	std::vector<Sub*> all;
+	if (cmd.size() == 1) {
+		for (DList* node = conn->subs.next; node != &conn->subs; node = node->next) {
+			Sub* sub = container_of(node, Sub, conn_link);
+			if (sub->chan->pattern == pattern) {
+				all.push_back(sub);
+			}
+		}
+		if (all.empty()) {
+			out_push(conn, 3);
+			out_str(conn, kind, strlen(kind));
+			out_nil(conn);
+			return out_int(conn, conn->nsubs);
+		}
+	}
+	if (conn->proto == PROTO_BIN) {
+		out_arr(conn, (uint32_t)(all.empty() ? cmd.size() - 1 : all.size()));
+	}
+	for (Sub* sub: all) {
+		std::string name = sub->chan->name;
+		sub_del(sub);
+		out_sub_reply(conn, kind, name);
+	}
+	for (size_t i = 1; i < cmd.size(); ++i) {
+		if (Sub* sub = sub_find(conn, cmd[i], pattern)) {
+			sub_del(sub);
+		}
+		out_sub_reply(conn, kind, cmd[i]);
+	}
+}
+
+// queues the message in the inbox of every worker with a subscriber for
+// it. the reply counts the subscribers, delivery follows at the end of the
+// loop iteration of each worker
+static void do_publish (Conn* conn, std::vector<std::string_view> &cmd) {
+	thread_local std::vector<uint8_t> to;
+	to.assign(g_workers.size(), 0);
+	int64_t count = 0;
+	{
+		std::lock_guard<std::mutex> guard(g_pubsub.lock);
+		if (PubChan* chan = pubchan_lookup(cmd[1], false)) {
+			count += chan->total;
+			for (size_t i = 0; i < to.size(); ++i) {
+				to[i] |= chan->nsubs[i] ? 1 : 0;
+			}
+		}
+		for (DList* node = g_pubsub.patterns_all.next; node != &g_pubsub.patterns_all; node = node->next) {
+			PubChan* pat = container_of(node, PubChan, pattern_link);
+			if (glob_match(pat->name, cmd[1])) {
+				count += pat->total;
+				for (size_t i = 0; i < to.size(); ++i) {
+					to[i] |= pat->nsubs[i] ? 1 : 0;
+				}
+			}
+		}
+	}
+	if (count) {
+		PubMsg* m = new PubMsg();
+		m->channel.assign(cmd[1].data(), cmd[1].size());
+		m->payload.assign(cmd[2].data(), cmd[2].size());
+		for (uint8_t t: to) {
+			m->refs += t;
+		}
+		for (size_t i = 0; i < to.size(); ++i) {
+			if (!to[i]) {
+				continue;
+			}
+			Worker* w = g_workers[i];
+			{
+				std::lock_guard<std::mutex> guard(w->inbox_lock);
+				w->inbox.push_back(m);
+			}
+			//this worker delivers at the end of the current iteration
+			if ((int)i != conn->worker) {
+				worker_wake(w);
+			}
+		}
+	}
+	out_int(conn, count);
+}
+
+struct PubList {
+	std::vector<std::string> names;
+	std::string_view pattern;
+	bool all = true;
+};
+
+static bool pubsub_list_one (HNode* node, void* arg) {
+	PubList* list = (PubList*)arg;
+	PubChan* chan = container_of(node, PubChan, node);
+	if (list->all || glob_match(list->pattern, chan->name)) {
+		list->names.push_back(chan->name);
+	}
+	return true;
+}
+
+// PUBSUB CHANNELS [pattern], NUMSUB [channel...] and NUMPAT
+static void do_pubsub (Conn* conn, std::vector<std::string_view> &cmd) {
+	std::lock_guard<std::mutex> guard(g_pubsub.lock);
+	if (cmd.size() <= 3 && cmd_is(cmd[1], "channels")) {
+		PubList list;
+		if (cmd.size() == 3) {
+			list.pattern = cmd[2];
+			list.all = false;
+		}
+		hm_foreach(&g_pubsub.channels, &pubsub_list_one, &list);
+		out_arr(conn, (uint32_t)list.names.size());
+		for (const std::string &name: list.names) {
+			out_str(conn, name.data(), name.size());
+		}
+	} else if (cmd_is(cmd[1], "numsub")) {
+		out_map(conn, (uint32_t)(cmd.size() - 2));
+		for (size_t i = 2; i < cmd.size(); ++i) {
+			PubChan* chan = pubchan_lookup(cmd[i], false);
+			out_str(conn, cmd[i].data(), cmd[i].size());
+			out_int(conn, chan ? chan->total : 0);
+		}
+	} else if (cmd.size() == 2 && cmd_is(cmd[1], "numpat")) {
+		out_int(conn, (int64_t)hm_size(&g_pubsub.patterns));
+	} else {
+		out_err(conn, ERR_BAD_ARG, "unknown PUBSUB subcommand or wrong number of arguments");
+	}
+}
+
+// what a RESP2 or binary connection may send while it has subscriptions,
+// everything else would be mistaken for a message
+static bool cmd_pubsub_ok (std::string_view name) {
+	return cmd_is(name, "subscribe") || cmd_is(name, "unsubscribe") || cmd_is(name, "psubscribe")
+		|| cmd_is(name, "punsubscribe") || cmd_is(name, "ping");
+}
+
+static void do_request (Conn* conn, std::vector<std::string_view> &cmd) {
+	size_t n = cmd.size();
+	if (conn->repl) {
+		//a replica's connection, any reply would end up in the stream
+		if (n >= 1 && cmd_is(cmd[0], "replconf")) {
+			do_replconf(conn, cmd);
+		}
+		return;
+	}
+	if (n && g_repl.replica && !conn->primary && cmd_writes(cmd[0])) {
+		return out_err(conn, ERR_READONLY, "You can't write against a read only replica.");
+	}
+	if (n && conn->nsubs && conn->proto != PROTO_RESP3 && !cmd_pubsub_ok(cmd[0])) {
+		return out_err(conn, ERR_BAD_ARG, "only (P)SUBSCRIBE / (P)UNSUBSCRIBE / PING are allowed in this context");
+	}
+	//ASKING covers the one command after it
+	bool asking = conn->asking;
+	conn->asking = false;
+	std::unique_lock<std::mutex> hold;
+	if (g_cluster.on && !conn->primary && !cluster_check(conn, cmd, asking, &hold)) {
+		return;
+	}
+	if (n == 0) {
+		out_err(conn, ERR_BAD_ARG, "empty command");
+	} else if (n == 2 && cmd_is(cmd[0], "get")) {
+		do_get(conn, cmd);
+	} else if ((n == 3 || n == 5) && cmd_is(cmd[0], "set")) {
+		do_set(conn, cmd);
+	} else if (n >= 2 && cmd_is(cmd[0], "del")) {
+		do_del(conn, cmd);
+	} else if (n >= 2 && cmd_is(cmd[0], "mget")) {
+		do_mget(conn, cmd);
+	} else if (n >= 3 && n % 2 == 1 && cmd_is(cmd[0], "mset")) {
+		do_mset(conn, cmd);
+	} else if (n == 3 && cmd_is(cmd[0], "expire")) {
+		do_expire(conn, cmd, false);
+	} else if (n == 3 && cmd_is(cmd[0], "pexpire")) {
+		do_expire(conn, cmd, true);
+	} else if (n == 3 && cmd_is(cmd[0], "expireat")) {
+		do_expireat(conn, cmd, false);
+	} else if (n == 3 && cmd_is(cmd[0], "pexpireat")) {
+		do_expireat(conn, cmd, true);
+	} else if (n == 2 && cmd_is(cmd[0], "ttl")) {
+		do_ttl(conn, cmd, false);
+	} else if (n == 2 && cmd_is(cmd[0], "pttl")) {
+		do_ttl(conn, cmd, true);
+	} else if (n == 2 && cmd_is(cmd[0], "persist")) {
+		do_persist(conn, cmd);
+	} else if (n >= 4 && n % 2 == 0 && cmd_is(cmd[0], "zadd")) {
+		do_zadd(conn, cmd);
+	} else if (n >= 3 && cmd_is(cmd[0], "zrem")) {
+		do_zrem(conn, cmd);
+	} else if (n == 3 && cmd_is(cmd[0], "zscore")) {
+		do_zscore(conn, cmd);
+	} else if (n == 2 && cmd_is(cmd[0], "zcard")) {
+		do_zcard(conn, cmd);
+	} else if (n == 3 && cmd_is(cmd[0], "zrank")) {
+		do_zrank(conn, cmd);
+	} else if (n >= 4 && cmd_is(cmd[0], "zrange")) {
+		do_zrange(conn, cmd);
+	} else if (n >= 3 && cmd_is(cmd[0], "lpush")) {
+		do_push(conn, cmd, true);
+	} else if (n >= 3 && cmd_is(cmd[0], "rpush")) {
+		do_push(conn, cmd, false);
+	} else if ((n == 2 || n == 3) && cmd_is(cmd[0], "lpop")) {
+		do_pop(conn, cmd, true);
+	} else if ((n == 2 || n == 3) && cmd_is(cmd[0], "rpop")) {
+		do_pop(conn, cmd, false);
+	} else if (n == 2 && cmd_is(cmd[0], "llen")) {
+		do_llen(conn, cmd);
+	} else if (n == 4 && cmd_is(cmd[0], "lrange")) {
+		do_lrange(conn, cmd);
+	} else if (n >= 3 && cmd_is(cmd[0], "blpop")) {
+		do_bpop(conn, cmd, true);
+	} else if (n >= 3 && cmd_is(cmd[0], "brpop")) {
+		do_bpop(conn, cmd, false);
+	} else if (n == 1 && cmd_is(cmd[0], "save")) {
+		do_save(conn);
+	} else if (n == 1 && cmd_is(cmd[0], "bgsave")) {
+		do_bgsave(conn);
+	} else if (n == 1 && cmd_is(cmd[0], "bgrewriteaof")) {
+		do_bgrewriteaof(conn);
+	} else if (n == 1 && cmd_is(cmd[0], "lastsave")) {
+		out_int(conn, g_save.lastsave);
+	} else if (n == 2 && cmd_is(cmd[0], "echo")) {
+		out_str(conn, cmd[1].data(), cmd[1].size());
+	} else if (n == 1 && cmd_is(cmd[0], "ping") && conn->nsubs && conn->proto != PROTO_RESP3) {
+		//a subscriber tells the reply from messages by its shape
+		out_push(conn, 2);
+		out_str(conn, "pong", 4);
+		out_str(conn, "", 0);
+	} else if (n == 1 && cmd_is(cmd[0], "ping")) {
+		out_status(conn, "PONG");
+	} else if (n <= 2 && cmd_is(cmd[0], "hello")) {
+		do_hello(conn, cmd);
+	} else if (n == 2 && cmd_is(cmd[0], "memory") && cmd_is(cmd[1], "stats")) {
+		do_memory_stats(conn);
+	} else if (n == 3 && cmd_is(cmd[0], "psync")) {
+		do_psync(conn, cmd);
+	} else if (n >= 1 && cmd_is(cmd[0], "replconf")) {
+		do_replconf(conn, cmd);
+	} else if (n == 3 && (cmd_is(cmd[0], "replicaof") || cmd_is(cmd[0], "slaveof"))) {
+		do_replicaof(conn, cmd);
+	} else if (n <= 2 && cmd_is(cmd[0], "info")) {
+		do_info(conn);
+	} else if (n >= 2 && cmd_is(cmd[0], "cluster")) {
+		do_cluster(conn, cmd);
+	} else if (n >= 2 && cmd_is(cmd[0], "subscribe")) {
+		do_subscribe(conn, cmd, false);
+	} else if (n >= 2 && cmd_is(cmd[0], "psubscribe")) {
+		do_subscribe(conn, cmd, true);
+	} else if (cmd_is(cmd[0], "unsubscribe")) {
+		do_unsubscribe(conn, cmd, false);
+	} else if (cmd_is(cmd[0], "punsubscribe")) {
+		do_unsubscribe(conn, cmd, true);
+	} else if (n == 3 && cmd_is(cmd[0], "publish")) {
+		do_publish(conn, cmd);
+	} else if (n >= 2 && cmd_is(cmd[0], "pubsub")) {
+		do_pubsub(conn, cmd);
+	} else if (n == 1 && cmd_is(cmd[0], "asking")) {
+		conn->asking = g_cluster.on;
+		out_status(conn, "OK");
+	} else if (cmd_is(cmd[0], "command") || cmd_is(cmd[0], "config")) {
+		//probed by redis-cli and redis-benchmark on connect
+		out_arr(conn, 0);
+	} else {
+		out_err(conn, ERR_UNKNOWN, "unknown command");
+	}
+}
+
+// binary frames start with a little-endian length of at most k_max_msg, so
+// their 4th byte is 0..2, while RESP and inline requests are printable text
+static bool sniff_proto (Conn* conn) {
+	if (buf_size(&conn->rbuf) < 4) {
+		return false;
+	}
+	conn->proto = (buf_head(&conn->rbuf)[3] <= 2) ? PROTO_BIN : PROTO_RESP2;
+	return true;
+}
+
+// a complete binary frame, sets *consumed to its size. returns false if
+// more bytes are needed or the frame is bad (then the state is STATE_END)
+static bool parse_bin (Conn* conn, std::vector<std::string_view> &cmd, size_t* consumed) {
+	size_t size = buf_size(&conn->rbuf);
+	if (size < 4) {
+		return false;
+	}
+	uint8_t* req = buf_head(&conn->rbuf);
+	uint32_t len = 0;
+	memcpy(&len, req, 4);
+	if (len > k_max_msg) {
+		msg("too long");
+		conn->state = STATE_END;
+		return false;
+	}
+
+	if (4 + (size_t)len > size) {
+		return false;
+	}
+
+	if (parse_req(req + 4, len, cmd) != 0) {
+		msg("bad request");
+		conn->state = STATE_END;
+		return false;
+	}
+	*consumed = 4 + len;
+	return true;
+}
+
+// a complete RESP request. the parser keeps its progress in conn->resp, so
+// a request split over many reads is scanned only once
+static bool parse_resp (Conn* conn, std::vector<std::string_view> &cmd, size_t* consumed) {
+	uint8_t* req = buf_head(&conn->rbuf);
+	int64_t rv = resp_parse(&conn->resp, req, buf_size(&conn->rbuf), k_max_msg, k_max_args);
+	if (rv == 0) {
+		return false;
+	}
+	if (rv < 0) {
+		//reply like upstream, then close once it is sent
+		out_err(conn, ERR_BAD_ARG, "Protocol error");
+		state_res(conn);
+		conn->state = STATE_END;
+		return false;
+	}
+	for (const RespArg &arg: conn->resp.args) {
+		cmd.emplace_back((const char*)req + arg.off, arg.len);
+	}
+	*consumed = (size_t)rv;
+	return true;
+}
+
+static bool try_one_request (Conn* conn) {
+	//back-pressure, leave the rest in rbuf until the queue drains
+	if (conn_queued(conn) >= g_output_hwm) {
+		return false;
+	}
+	if (conn->proto == PROTO_UNKNOWN && !sniff_proto(conn)) {
+		return false;
+	}
+
+	//argument views are reused across requests, so parsing does not
+	//allocate once the worker has seen its widest command
+	thread_local std::vector<std::string_view> cmd;
+	cmd.clear();
+	size_t consumed = 0;
+	bool bin = (conn->proto == PROTO_BIN);
+	if (!(bin ? parse_bin(conn, cmd, &consumed) : parse_resp(conn, cmd, &consumed))) {
+		return false;
+	}
+	if (g_verbose && !cmd.empty()) {
+		printf("Client says %.*s (%zu args)\n", (int)cmd[0].size(), cmd[0].data(), cmd.size());
+	}
+
+	//the reply is appended after the previous replies so the whole batch
+	//goes out in one write(). a binary reply is framed, its length is
+	//patched in once it is known
+	size_t header = buf_size(&conn->wbuf);
+	size_t ref_bytes = conn->ref_bytes;
+	uint32_t wlen = 0;
+	if (bin) {
+		buf_append(&conn->wbuf, &wlen, 4);
+	}
+	if (!cmd.empty()) {
+		do_request(conn, cmd);
+	}
+	if (bin && conn->state == STATE_BLOCKED) {
+		//no reply until the wait ends, see block_finish()
+		buf_truncate(&conn->wbuf, header);
+	} else if (bin) {
+		wlen = (uint32_t)(buf_size(&conn->wbuf) - header - 4 + conn->ref_bytes - ref_bytes);
+		memcpy(buf_head(&conn->wbuf) + header, &wlen, 4);
+	}
+
+	//consume the request by advancing the read offset, no copying
+	buf_consume(&conn->rbuf, consumed);
+	if (!bin) {
+		resp_reset(&conn->resp);
+	}
+
+	return (conn->state == STATE_REQ);
+}
+
+// mark n bytes of the output queue as sent, wbuf bytes and queued values
+// in the order they were appended
+static void out_consume (Conn* conn, size_t n) {
+	while (n > 0) {
+		size_t at = buf_size(&conn->wbuf);
+		if (conn->ref_head < conn->refs.size()) {
+			at = (size_t)(conn->refs[conn->ref_head].pos - conn->wbuf_sent);
+		}
+		if (at > 0) {
+			size_t k = at < n ? at : n;
+			buf_consume(&conn->wbuf, k);
+			conn->wbuf_sent += k;
+			n -= k;
+			continue;
+		}
+		OutRef* ref = &conn->refs[conn->ref_head];
+		size_t k = ref->val->len - ref->sent;
+		k = k < n ? k : n;
+		ref->sent += k;
+		conn->ref_bytes -= k;
+		n -= k;
+		if (ref->sent == ref->val->len) {
+			blob_unref(ref->val);
+			conn->ref_head++;
+		}
+	}
+}
+
+static bool try_flush_buffer (Conn* conn) {
+	//gather the queue: wbuf bytes up to the next value, the value, ...
+	struct iovec iov[k_max_iov];
+	int n = 0;
+	uint8_t* head = buf_head(&conn->wbuf);
+	size_t off = 0;
+	size_t end = buf_size(&conn->wbuf);
+	for (size_t i = conn->ref_head; i < conn->refs.size(); ++i) {
+		OutRef* ref = &conn->refs[i];
+		size_t at = (size_t)(ref->pos - conn->wbuf_sent);
+		if (n + 2 > k_max_iov) {
+			end = at; //the rest goes out with the next call
+			break;
+		}
+		if (at > off) {
+			iov[n++] = iovec{head + off, at - off};
+			off = at;
+		}
+		iov[n++] = iovec{ref->val->data + ref->sent, ref->val->len - ref->sent};
+	}
+	if (end > off) {
+		iov[n++] = iovec{head + off, end - off};
+	}
+
+	ssize_t rv = 0;
+	do {
+		rv = writev(conn->fd, iov, n);
+	} while (rv < 0 && errno == EINTR);
+
+	if (rv < 0 && errno == EAGAIN) {
+		//got EAGAIN, stop
+	    return false;
+	}
+
+	if (rv < 0) {
+		msg("write() error");
+		conn->state = STATE_END;
+		return false;
+	}
+
+	out_consume(conn, (size_t)rv);
+
+	//still got data queued, could try to write again
+	return conn_queued(conn) > 0;
+}
+
+// send as much of the output queue as the socket takes, then pick the state
+// from what is left: reading resumes once the queue is below g_output_hwm
+static void state_res (Conn* conn) {
+	//io_uring sends are submitted once per loop tick instead
+	if (!g_io_uring && !conn->aof_wait) {
+		while (conn_queued(conn) && try_flush_buffer(conn)) {}
+	}
+	if (conn->state == STATE_END || conn->state == STATE_BLOCKED) {
+		return;
+	}
+	conn->state = (conn_queued(conn) >= g_output_hwm) ? STATE_RES : STATE_REQ;
+}
+
+// parse every complete request in rbuf and send the replies with a single
+// writev() per batch. a blocked write leaves the replies queued and parsing
+// carries on until the queue reaches g_output_hwm
+static void migrate_replies (Conn* conn);
+
+static void process_requests (Conn* conn) {
+	if (conn->migrate) {
+		//the target's replies to the keys sent over
+		return migrate_replies(conn);
+	}
+	while (conn->state == STATE_REQ) {
+		while(try_one_request(conn)) {}
+		if (conn->state == STATE_END || !conn_queued(conn)) {
+			return;
+		}
+		size_t queued = conn_queued(conn);
+		//the replies go out once the worker has written the AOF
+		conn->aof_wait = g_aof.on;
+		state_res(conn);
+		//nothing was sent, wait for the socket to become writable
+		if (conn_queued(conn) == queued) {
+			return;
+		}
+	}
+}
+
+static bool try_fill_buffer (Conn* conn) {
+	//read a pending large request in as few calls as possible
+	size_t want = k_read_chunk;
+	size_t size = buf_size(&conn->rbuf);
+	if (conn->proto != PROTO_BIN) {
+		size_t missing = resp_want(&conn->resp, size);
+		if (missing > want) {
+			want = missing;
+		}
+	} else if (size >= 4) {
+		uint32_t len = 0;
+		memcpy(&len, buf_head(&conn->rbuf), 4);
+		if (len <= k_max_msg && 4 + (size_t)len > size + want) {
+			want = 4 + (size_t)len - size;
+		}
+	}
+	buf_reserve(&conn->rbuf, want);
+
+	ssize_t rv = 0;
+	do {
+		rv = read(conn->fd, buf_tail(&conn->rbuf), buf_avail(&conn->rbuf));
+	} while (rv < 0 && errno == EINTR);
+
+	if (rv < 0 && errno == EAGAIN) {
+		// got EAGAIN, stop.
+		return false;
+	}
+
+	if (rv < 0) {
+		msg("read() error");
+		conn->state = STATE_END;
+		return false;
+	}
+	
+	if (rv == 0) {
+		if (buf_size(&conn->rbuf) > 0) {
+			msg("unexpected EOF");
+		} else {
+			msg("EOF");
+		}
+		conn->state = STATE_END;
+		return false;
+	}
+
+	buf_commit(&conn->rbuf, (size_t)rv);
+	process_requests(conn);
+	//a blocked connection only buffers what it is sent, up to one request
+	//of the largest size, but reads on to notice a client that goes away
+	return conn->state == STATE_REQ || (conn->state == STATE_BLOCKED && buf_size(&conn->rbuf) < k_max_msg);
+}
+
+static void state_req (Conn* conn) {
+	while(try_fill_buffer(conn)) {}
+}
+
+static void connection_io (Conn* conn) {
+	assert(conn->state == STATE_REQ || conn->state == STATE_RES || conn->state == STATE_BLOCKED);
+	if (conn_queued(conn)) {
+		state_res(conn);
+	}
+	if (conn->state == STATE_REQ) {
+		//requests left in rbuf while the queue was full come first, then
+		//the socket is drained since readiness is edge-triggered
+		process_requests(conn);
+	}
+	if (conn->state == STATE_REQ || (conn->state == STATE_BLOCKED && buf_size(&conn->rbuf) < k_max_msg)) {
+		state_req(conn);
+	}
+
+	//the socket is drained and nothing is pending, give back the memory
+	//a large request or reply left behind
+	if (conn->state != STATE_RES) {
+		buf_trim(&conn->rbuf, k_conn_buf_keep);
+	}
+	buf_trim(&conn->wbuf, k_conn_buf_keep);
+	if (conn->ref_head == conn->refs.size() && conn->refs.capacity() > k_conn_refs_keep) {
+		std::vector<OutRef>().swap(conn->refs);
+		conn->ref_head = 0;
+	}
+}
+
+//no active expiry by this worker before this time, us
+static thread_local uint64_t t_expire_rest_until = 0;
+
+// active expiry, run by every worker once per loop iteration: deletes
+// keys whose ttl has passed for at most k_expire_budget_us. a larger
+// backlog is worked off in slices with k_expire_rest_us between them, so
+// millions of keys expiring at once cannot take over the workers. a shard
+// is only locked once its wheel has work, and skipped while another
+// worker holds it. returns the loop timeout in ms, -1 if no key has a ttl
+static int expire_tick () {
+	uint64_t start = get_monotonic_us();
+	uint64_t now = start / 1000;
+	if (start < t_expire_rest_until) {
+		return (int)((t_expire_rest_until - start + 999) / 1000);
+	}
+	uint64_t next = UINT64_MAX;
+	for (Shard &sh: g_data.shards) {
+		uint64_t at = sh.expire_next;
+		if (at <= now && !sh.lock.try_lock()) {
+			//busy, look again in a moment
+			at = now + 1;
+		} else if (at <= now) {
+			std::lock_guard<std::mutex> guard(sh.lock, std::adopt_lock);
+			while (1) {
+				bool caught_up = tw_advance(&sh.ttl, now, k_expire_batch);
+				size_t n = 0;
+				TNode* node = NULL;
+				while (n < k_expire_batch && (node = tw_pop_due(&sh.ttl))) {
+					Entry* ent = container_of(node, Entry, ttl);
+					entry_remove(ent);
+					n++;
+				}
+				if (caught_up && n < k_expire_batch) {
+					break;
+				}
+				uint64_t end = get_monotonic_us();
+				if (end - start >= k_expire_budget_us) {
+					sh.expire_next = tw_next(&sh.ttl);
+					t_expire_rest_until = end + k_expire_rest_us;
+					return (int)((k_expire_rest_us + 999) / 1000);
+				}
+			}
+			at = tw_next(&sh.ttl);
+			sh.expire_next = at;
+		}
+		next = at < next ? at : next;
+	}
+	return deadline_to_timeout(next, now);
+}
+
+// with SO_REUSEPORT every worker binds its own socket to the same port and
+// the kernel spreads incoming connections across them
+static int open_listener (uint16_t port) {
+	// Get an fd for stream socket in the internet domain
+	// fd = file descriptor, refers to something in an unix kernel (e.g., TCP connection, file, listening port)
+	int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (server_fd == -1) {
+		errmsg("Socket creation failed");
+		return -1;
+	}
+
+	// Since the tester restarts your program quite often, setting REUSE_PORT
+	// ensures that we don't run into 'Address already in use' errors
+	int reuse = 1;
+	if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+		errmsg("SO_REUSEPORT failed");
+		return -1;
+	}
+	
+	// Property of our server address
+	struct sockaddr_in serv_addr = {};
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_port = htons(port);
+	serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	
+	//bind
+	if (bind(server_fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) != 0) {
+		errmsg("Bind failed");
+		return -1;
+	}
+
+    //listen
+	if (listen(server_fd, SOMAXCONN) != 0) {
+		errmsg("Listen failed");
+		return -1;
+	}
+	fd_set_nb(server_fd);
+	return server_fd;
+}
+
+// the shorter of two loop timeouts, where -1 means none
+static int min_timeout (int a, int b) {
+	if (a < 0) {
+		return b;
+	}
+	if (b < 0) {
+		return a;
+	}
+	return a < b ? a : b;
+}
+
+// remember a connection whose replies wait for the AOF write
+static void conn_aof_wait (Worker* w, Conn* conn) {
+	if (conn->aof_wait && dlist_empty(&conn->aof_waiting)) {
+		dlist_push_back(&w->aof_waiting, &conn->aof_waiting);
+	}
+}
+
+// a replica connection that PSYNC just turned into one joins the
+// worker's replicas
+static void conn_repl_attach (Worker* w, Conn* conn) {
+	if (conn->repl && dlist_empty(&conn->repl_link) && conn->state != STATE_END) {
+		dlist_push_back(&w->replicas, &conn->repl_link);
+		w->nreplicas++;
+	}
+}
+
+// the registration and timeout updates after I/O on a connection, prev
+// is the interest set it is registered with
+static void worker_conn_done (Worker* w, Conn* conn, uint32_t prev, uint64_t now) {
+	if (conn->state == STATE_END) {
+		(void)reactor_del(w->reactor, conn->fd, prev);
+		conn_destroy(w, conn);
+		return;
+	}
+
+	//only touch the registration when the state flipped
+	//between STATE_REQ and STATE_RES
+	if (reactor_mod(w->reactor, conn->fd, prev, conn_events(conn)) < 0) {
+		errmsg("reactor_mod()");
+	}
+	conn_touch(w, conn, now);
+	conn_aof_wait(w, conn);
+	conn_repl_attach(w, conn);
+}
+
+// I/O on a ready connection
+static void worker_conn_io (Worker* w, Conn* conn, uint64_t now) {
+	uint32_t prev = conn_events(conn);
+	connection_io(conn);
+	worker_conn_done(w, conn, prev, now);
+}
+
+// the connections waiting at the start, in order. a connection that
+// parses more requests in the meantime waits again, for the next flush
+static Conn* aof_next_waiting (Worker* w, DList** last) {
+	if (dlist_empty(&w->aof_waiting) || !*last) {
+		return NULL;
+	}
+	DList* node = w->aof_waiting.next;
+	*last = (node == *last) ? NULL : *last;
+	dlist_detach(node);
+	Conn* conn = container_of(node, Conn, aof_waiting);
+	conn->aof_wait = false;
+	return conn;
+}
+
+// queues what a replica is missing: the snapshot of its full resync, then
+// the stream from the backlog. at most half of g_output_hwm is queued, the
+// rest waits in the file or the backlog until the replica catches up, so a
+// slow replica costs no memory beyond its queue. a replica so far behind
+// that the backlog has dropped its offset is disconnected, it comes back
+// for a full resync. returns true if anything was queued
+static bool repl_feed (Conn* conn) {
+	if (conn->state == STATE_END) {
+		return false;
+	}
+	if (g_repl.replica) {
+		//REPLICAOF, this server no longer has a stream of its own
+		conn->state = STATE_END;
+		return false;
+	}
+	size_t cap = g_output_hwm / 2;
+	size_t queued = conn_queued(conn);
+	bool fed = false;
+	if (conn->repl == REPL_WAIT_SYNC) {
+		ReplSync* sync = conn->repl_sync;
+		if (sync->state == SYNC_WRITING) {
+			return false;
+		}
+		if (sync->state == SYNC_FAILED) {
+			conn->state = STATE_END;
+			return false;
+		}
+		std::lock_guard<std::mutex> guard(g_data.lock);
+		out_resp_num(conn, '$', (int64_t)sync->size);
+		conn->repl = REPL_SEND_SYNC;
+		conn->sync_pos = 0;
+		fed = true;
+	}
+	if (conn->repl == REPL_SEND_SYNC) {
+		ReplSync* sync = conn->repl_sync;
+		while (queued < cap && conn->sync_pos < sync->size) {
+			uint64_t left = sync->size - conn->sync_pos;
+			size_t n = cap - queued < left ? cap - queued : (size_t)left;
+			buf_reserve(&conn->wbuf, n);
+			ssize_t rv = pread(sync->fd, buf_tail(&conn->wbuf), n, (off_t)conn->sync_pos);
+			if (rv <= 0) {
+				msg("full resync snapshot read error");
+				conn->state = STATE_END;
+				return false;
+			}
+			buf_commit(&conn->wbuf, (size_t)rv);
+			conn->sync_pos += (uint64_t)rv;
+			queued += (size_t)rv;
+			fed = true;
+		}
+		if (conn->sync_pos < sync->size) {
+			return fed;
+		}
+		std::lock_guard<std::mutex> guard(g_data.lock);
+		conn->repl = REPL_ONLINE;
+		conn->repl_sync = NULL;
+		repl_sync_unref(sync);
+	}
+	if (conn->repl_off == g_repl.offset || queued >= cap) {
+		return fed;
+	}
+	std::lock_guard<std::mutex> guard(g_data.lock);
+	Backlog* b = &g_repl.backlog;
+	if (!b->data || conn->repl_off < b->start) {
+		msg("replica fell behind the backlog");
+		conn->state = STATE_END;
+		return false;
+	}
+	uint64_t left = b->end - conn->repl_off;
+	size_t n = cap - queued < left ? cap - queued : (size_t)left;
+	buf_reserve(&conn->wbuf, n);
+	n = backlog_read(b, conn->repl_off, buf_tail(&conn->wbuf), n);
+	buf_commit(&conn->wbuf, n);
+	conn->repl_off += n;
+	return true;
+}
+
+// at the end of a loop iteration that added to the stream, wake the other
+// workers whose replicas are waiting for it. before is the offset at the
+// start of the iteration
+static void repl_wake_others (Worker* w, uint64_t before) {
+	if (g_repl.offset == before) {
+		return;
+	}
+	for (Worker* other: g_workers) {
+		if (other != w && other->nreplicas) {
+			worker_wake(other);
+		}
+	}
+}
+
+// the worker's wake socket became readable, see worker_wake()
+static void worker_woken (Worker* w) {
+	w->woken = false;
+	char buf[64];
+	while (read(w->wake_fd[0], buf, sizeof(buf)) > 0) {}
+}
+
+// a message as one complete push in a protocol: a RESP3 push, a RESP2
+// array, or a binary frame holding an array
+static Blob* push_encode (uint32_t proto, const std::string_view* parts, size_t n) {
+	std::string out;
+	size_t size = 16;
+	for (size_t i = 0; i < n; ++i) {
+		size += 16 + parts[i].size();
+	}
+	out.reserve(size);
+	if (proto == PROTO_BIN) {
+		uint32_t len = 5;
+		for (size_t i = 0; i < n; ++i) {
+			len += 5 + (uint32_t)parts[i].size();
+		}
+		uint32_t count = (uint32_t)n;
+		out.append((const char*)&len, 4);
+		out.push_back((char)SER_ARR);
+		out.append((const char*)&count, 4);
+		for (size_t i = 0; i < n; ++i) {
+			uint32_t sz = (uint32_t)parts[i].size();
+			out.push_back((char)SER_STR);
+			out.append((const char*)&sz, 4);
+			out.append(parts[i].data(), parts[i].size());
+		}
+	} else {
+		char head[32];
+		out.append(head, (size_t)snprintf(head, sizeof(head), "%c%zu\r\n", proto == PROTO_RESP3 ? '>' : '*', n));
+		for (size_t i = 0; i < n; ++i) {
+			out.append(head, (size_t)snprintf(head, sizeof(head), "$%zu\r\n", parts[i].size()));
+			out.append(parts[i].data(), parts[i].size());
+			out.append("\r\n", 2);
+		}
+	}
+	return blob_new(out.data(), out.size());
+}
+
+static Blob* pubmsg_frame (PubMsg* m, uint32_t proto) {
+	std::lock_guard<std::mutex> guard(m->lock);
+	if (!m->frames[proto]) {
+		std::string_view parts[3] = {"message", m->channel, m->payload};
+		m->frames[proto] = push_encode(proto, parts, 3);
+	}
+	return m->frames[proto];
+}
+
+static void pubmsg_unref (PubMsg* m) {
+	if (--m->refs > 0) {
+		return;
+	}
+	for (Blob* frame: m->frames) {
+		if (frame) {
+			blob_unref(frame);
+		}
+	}
+	delete m;
+}
+
+// queues a message on a subscriber by reference to the shared frame. a
+// subscriber that does not keep up is disconnected once its queue is over
+// g_pubsub_hard, or over g_pubsub_soft for g_pubsub_soft_sec
+static void pub_queue (Worker* w, Conn* conn, Blob* frame, uint64_t now) {
+	if (conn->state == STATE_END) {
+		return;
+	}
+	if (!conn->pub_touched) {
+		conn->pub_touched = true;
+		conn->pub_events = conn_events(conn);
+		w->pub_touched.push_back(conn);
+	}
+	if (g_io_uring) {
+		//sent from one contiguous buffer, see out_val()
+		buf_append(&conn->wbuf, frame->data, frame->len);
+	} else {
+		out_ref(conn, frame);
+	}
+	size_t queued = conn_queued(conn);
+	bool soft = g_pubsub_soft && queued > g_pubsub_soft;
+	if (!soft) {
+		conn->pub_soft_ms = 0;
+	} else if (!conn->pub_soft_ms) {
+		conn->pub_soft_ms = now;
+	}
+	if ((g_pubsub_hard && queued > g_pubsub_hard) || (soft && now - conn->pub_soft_ms >= g_pubsub_soft_sec * 1000)) {
+		msg("subscriber over its output limit");
+		conn->state = STATE_END;
+	}
+}
+
+// queues the messages in the worker's inbox on its subscribers, each
+// frame encoded once and shared. the connections are left in
+// w->pub_touched for the caller to send to
+static void pubsub_deliver (Worker* w, uint64_t now) {
+	thread_local std::vector<PubMsg*> msgs;
+	thread_local std::vector<PubChan*> patterns;
+	{
+		std::lock_guard<std::mutex> guard(w->inbox_lock);
+		msgs.swap(w->inbox);
+	}
+	for (PubMsg* m: msgs) {
+		PubChan* chan = NULL;
+		patterns.clear();
+		{
+			std::lock_guard<std::mutex> guard(g_pubsub.lock);
+			chan = pubchan_lookup(m->channel, false);
+			chan = (chan && chan->nsubs[w->id]) ? chan : NULL;
+			for (DList* node = g_pubsub.patterns_all.next; node != &g_pubsub.patterns_all; node = node->next) {
+				PubChan* pat = container_of(node, PubChan, pattern_link);
+				if (pat->nsubs[w->id] && glob_match(pat->name, m->channel)) {
+					patterns.push_back(pat);
+				}
+			}
+		}
+		//the lists are this worker's, see PubChan
+		if (chan) {
+			Blob* frames[PROTO_RESP3 + 1] = {};
+			DList* head = &chan->subs[w->id];
+			for (DList* node = head->next; node != head; node = node->next) {
+				Conn* conn = container_of(node, Sub, chan_link)->conn;
+				if (!frames[conn->proto]) {
+					frames[conn->proto] = pubmsg_frame(m, conn->proto);
+				}
+				pub_queue(w, conn, frames[conn->proto], now);
+			}
+		}
+		for (PubChan* pat: patterns) {
+			std::string_view parts[4] = {"pmessage", pat->name, m->channel, m->payload};
+			Blob* frames[PROTO_RESP3 + 1] = {};
+			DList* head = &pat->subs[w->id];
+			for (DList* node = head->next; node != head; node = node->next) {
+				Conn* conn = container_of(node, Sub, chan_link)->conn;
+				if (!frames[conn->proto]) {
+					frames[conn->proto] = push_encode(conn->proto, parts, 4);
+				}
+				pub_queue(w, conn, frames[conn->proto], now);
+			}
+			for (Blob* frame: frames) {
+				if (frame) {
+					blob_unref(frame);
+				}
+			}
+		}
+		pubmsg_unref(m);
+	}
+	msgs.clear();
+}
+
+// the next blocked connection of the worker to reply to: one a push woke,
+// or one whose timeout has passed. the wheel is only advanced here, a
+// connection blocked without a timeout is never looked at
+static Conn* block_next (Worker* w, uint64_t now) {
+	{
+		std::lock_guard<std::mutex> guard(w->inbox_lock);
+		if (!dlist_empty(&w->unblocked)) {
+			return container_of(w->unblocked.next, Conn, unblock_link);
+		}
+	}
+	bool caught_up = false;
+	while (1) {
+		TNode* node = tw_pop_due(&w->block_timers);
+		if (node) {
+			return container_of(node, Conn, block_timer);
+		}
+		if (caught_up) {
+			return NULL;
+		}
+		caught_up = tw_advance(&w->block_timers, now, k_expire_batch);
+	}
+}
+
+// loop timeout in ms until the next blocked connection times out, 0 if a
+// push has woken one already, -1 if none is waiting for either
+static int block_timeout (Worker* w, uint64_t now) {
+	{
+		std::lock_guard<std::mutex> guard(w->inbox_lock);
+		if (!dlist_empty(&w->unblocked)) {
+			return 0;
+		}
+	}
+	return deadline_to_timeout(tw_next(&w->block_timers), now);
+}
+
+// the reply that ends a wait: the key and the value a push popped for the
+// connection, MOVED if the slot went elsewhere, or a nil array once the
+// timeout has passed. the requests the client sent meanwhile run next.
+// the pop is in the AOF buffer already, the reply waits for it like any
+// other
+static void block_finish (Worker* w, Conn* conn) {
+	Blob* val = NULL;
+	uint32_t result = block_end(w, conn, &val);
+	//framed like try_one_request() does
+	bool bin = conn->proto == PROTO_BIN;
+	size_t header = buf_size(&conn->wbuf);
+	size_t ref_bytes = conn->ref_bytes;
+	uint32_t wlen = 0;
+	if (bin) {
+		buf_append(&conn->wbuf, &wlen, 4);
+	}
+	if (result == BLOCK_SERVED) {
+		out_arr(conn, 2);
+		out_str(conn, conn->block_key.data(), conn->block_key.size());
+		out_val(conn, val);
+		blob_unref(val);
+	} else if (result == BLOCK_MOVED) {
+		uint32_t slot = key_slot(conn->block_key.data(), conn->block_key.size());
+		cluster_redirect(conn, ERR_MOVED, slot, g_cluster.owner[slot]);
+	} else {
+		out_nil_arr(conn);
+	}
+	if (bin) {
+		wlen = (uint32_t)(buf_size(&conn->wbuf) - header - 4 + conn->ref_bytes - ref_bytes);
+		memcpy(buf_head(&conn->wbuf) + header, &wlen, 4);
+	}
+	std::string().swap(conn->block_key);
+	conn->state = STATE_REQ;
+	conn->aof_wait = g_aof.on;
+}
+
+//batches a migration has in flight at most, and the size of one
+const size_t k_migrate_window = 4;
+const uint32_t k_migrate_batch_keys = 256;
+const size_t k_migrate_batch_bytes = 64 << 10;
+//members per ZADD or values per RPUSH when a set or a list is moved
+const size_t k_migrate_chunk = 512;
+
+static const char k_asking[] = "*1\r\n$6\r\nASKING\r\n";
+
+// queues the commands that recreate a key on the target, each after an
+// ASKING, and returns the number of replies they get. a set goes in
+// several ZADDs and a list in several RPUSHes, the key stays here until
+// the target has answered all of them
+static uint32_t migrate_encode (Buffer* b, Entry* ent, uint64_t now) {
+	std::string ttl = tw_linked(&ent->ttl) ? std::to_string(ent->ttl.expire - now) : "";
+	std::string_view key = ent->key;
+	if (ent->type == T_STR) {
+		std::string_view args[5] = {"SET", key, std::string_view(ent->val->data, ent->val->len), "PX", ttl};
+		buf_append(b, k_asking, sizeof(k_asking) - 1);
+		aof_encode(b, args, ttl.empty() ? 3 : 5);
+		return 2;
+	}
+	std::string_view del[2] = {"DEL", key};
+	buf_append(b, k_asking, sizeof(k_asking) - 1);
+	aof_encode(b, del, 2);
+	uint32_t n = 2;
+	std::vector<std::string> scores;
+	std::vector<std::string_view> args;
+	if (ent->type == T_LIST) {
+		const std::deque<Blob*> &list = *ent->list;
+		for (size_t i = 0; i < list.size();) {
+			args.assign({"RPUSH", key});
+			for (size_t k = 0; k < k_migrate_chunk && i < list.size(); ++k, ++i) {
+				args.emplace_back(list[i]->data, list[i]->len);
+			}
+			buf_append(b, k_asking, sizeof(k_asking) - 1);
+			aof_encode(b, args.data(), args.size());
+			n += 2;
+		}
+	}
+	ZIter it;
+	bool more = ent->type == T_ZSET && zset_seek_rank(ent->zset, 0, &it);
+	while (more) {
+		scores.clear();
+		scores.reserve(k_migrate_chunk); //args point into it
+		args.assign({"ZADD", key});
+		for (size_t i = 0; i < k_migrate_chunk && zset_iter_valid(&it); ++i) {
+			const char* name = NULL;
+			size_t len = 0;
+			double score = 0;
+			zset_iter_get(&it, &name, &len, &score);
+			char num[32];
+			snprintf(num, sizeof(num), "%.17g", score);
+			scores.emplace_back(num);
+			args.push_back(scores.back());
+			args.emplace_back(name, len);
+			zset_iter_next(&it);
+		}
+		buf_append(b, k_asking, sizeof(k_asking) - 1);
+		aof_encode(b, args.data(), args.size());
+		n += 2;
+		more = zset_iter_valid(&it);
+	}
+	if (!ttl.empty()) {
+		std::string_view expire[3] = {"PEXPIRE", key, ttl};
+		buf_append(b, k_asking, sizeof(k_asking) - 1);
+		aof_encode(b, expire, 3);
+		n += 2;
+	}
+	return n;
+}
+
+// the next keys of the slot being drained, marked as moving and queued
+// for the target, or once the slot is empty the command that hands it
+// over. the caller holds g_migrate.lock
+static void migrate_batch (Conn* conn) {
+	uint32_t slot = g_migrate.slots[g_migrate.next];
+	MigBatch* b = new MigBatch();
+	b->slot = slot;
+	std::lock_guard<std::mutex> guard(slot_shard(slot)->lock);
+	DList* keys = &g_cluster.keys[slot];
+	uint64_t now = get_monotonic_ms();
+	size_t before = buf_size(&conn->wbuf);
+	while (!dlist_empty(keys) && b->replies < 2 * k_migrate_batch_keys
+		&& buf_size(&conn->wbuf) - before < k_migrate_batch_bytes)
+	{
+		Entry* ent = container_of(keys->next, Entry, slot_link);
+		if (tw_linked(&ent->ttl) && ent->ttl.expire <= now) {
+			entry_remove(ent);
+			continue;
+		}
+		dlist_detach(&ent->slot_link);
+		dlist_push_back(&b->keys, &ent->slot_link);
+		ent->moving = true;
+		b->replies += migrate_encode(&conn->wbuf, ent, now);
+	}
+	if (!b->replies) {
+		std::string num = std::to_string(slot);
+		std::string_view args[5] = {"CLUSTER", "SETSLOT", num, "NODE", g_migrate.target_addr};
+		aof_encode(&conn->wbuf, args, 5);
+		b->replies = 1;
+		b->handover = true;
+		g_migrate.next++;
+	}
+	g_migrate.inflight.push_back(b);
+}
+
+// the target has answered for a whole batch: its keys are deleted here,
+// or the slot it handed over is the target's now. false if the deadline
+// (us) passed first, the rest of the keys are left for the next call.
+// the caller holds g_migrate.lock
+static bool migrate_batch_done (MigBatch* b, uint64_t deadline) {
+	std::lock_guard<std::mutex> guard(slot_shard(b->slot)->lock);
+	if (b->handover) {
+		std::lock_guard<std::mutex> block_guard(g_block.lock);
+		g_cluster.owner[b->slot] = g_migrate.target;
+		g_cluster.migrating[b->slot] = k_no_node;
+		block_slot_moved(b->slot);
+		g_migrate.handed++;
+		return true;
+	}
+	for (uint32_t n = 0; !dlist_empty(&b->keys); ++n) {
+		if (n % 32 == 31 && get_monotonic_us() >= deadline) {
+			return false;
+		}
+		Entry* ent = container_of(b->keys.next, Entry, slot_link);
+		std::string_view args[2] = {"DEL", ent->key};
+		propagate(args, 2);
+		entry_remove(ent);
+		g_migrate.keys_moved++;
+	}
+	return true;
+}
+
+// the keys of unanswered batches stay here and stop moving. the slots
+// keep migrating, keys already moved are found through ASK until the
+// migration is run again. the caller holds g_migrate.lock
+static void migrate_fail (const std::string &err) {
+	//answered batches are on the target, their keys can go
+	while (!g_migrate.answered.empty()) {
+		migrate_batch_done(g_migrate.answered.front(), UINT64_MAX);
+		delete g_migrate.answered.front();
+		g_migrate.answered.pop_front();
+	}
+	for (MigBatch* b: g_migrate.inflight) {
+		std::lock_guard<std::mutex> guard(slot_shard(b->slot)->lock);
+		while (!dlist_empty(&b->keys)) {
+			Entry* ent = container_of(b->keys.next, Entry, slot_link);
+			dlist_detach(&ent->slot_link);
+			dlist_push_back(&g_cluster.keys[ent->slot], &ent->slot_link);
+			ent->moving = false;
+		}
+		delete b;
+	}
+	g_migrate.inflight.clear();
+	g_migrate.state = MIG_FAILED;
+	g_migrate.err = err;
+	g_migrate.end_us = get_monotonic_us();
+	g_migrate.active = false;
+	fprintf(stderr, "slot migration failed: %s\n", err.c_str());
+}
+
+// the target's replies, one line each, answer the batches in order.
+// answered batches wait for migrate_tick(), which has a time budget
+static void migrate_replies (Conn* conn) {
+	std::lock_guard<std::mutex> guard(g_migrate.lock);
+	while (conn->state != STATE_END && buf_size(&conn->rbuf)) {
+		const uint8_t* p = buf_head(&conn->rbuf);
+		const uint8_t* lf = (const uint8_t*)memchr(p, '\n', buf_size(&conn->rbuf));
+		if (!lf) {
+			break;
+		}
+		size_t len = (size_t)(lf - p) + 1;
+		if (p[0] == '-' || g_migrate.inflight.empty()) {
+			migrate_fail("the target answered " + std::string((const char*)p, len > 2 ? len - 2 : 0));
+			conn->state = STATE_END;
+			break;
+		}
+		buf_consume(&conn->rbuf, len);
+		MigBatch* b = g_migrate.inflight.front();
+		if (--b->replies == 0) {
+			g_migrate.inflight.pop_front();
+			g_migrate.answered.push_back(b);
+		}
+	}
+}
+
+static void migrate_conn_gone (Conn* conn) {
+	std::lock_guard<std::mutex> guard(g_migrate.lock);
+	if (g_migrate.conn != conn) {
+		return;
+	}
+	g_migrate.conn = NULL;
+	if (g_migrate.state == MIG_MOVING) {
+		migrate_fail("lost the connection to the target");
+	}
+}
+
+// a non-blocking connection to the target, which is told first that the
+// slots come from here. the caller holds g_migrate.lock
+static bool migrate_connect (Worker* w) {
+	std::string host;
+	int port = 0;
+	std::string self;
+	{
+		std::lock_guard<std::mutex> guard(g_data.lock);
+		host = g_cluster.nodes[g_migrate.target].host;
+		port = g_cluster.nodes[g_migrate.target].port;
+		self = g_cluster.nodes[g_cluster.self].host + ":" + std::to_string(g_cluster.nodes[g_cluster.self].port);
+	}
+	struct addrinfo hints = {};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo* res = NULL;
+	if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0) {
+		return false;
+	}
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd >= 0) {
+		fd_set_nb(fd);
+		fd_set_cloexec(fd);
+		if (connect(fd, res->ai_addr, res->ai_addrlen) < 0 && errno != EINPROGRESS) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		return false;
+	}
+	Conn* conn = conn_new(w, fd);
+	conn->proto = PROTO_RESP2;
+	MigBatch* b = new MigBatch();
+	const std::vector<uint32_t> &slots = g_migrate.slots;
+	for (size_t i = g_migrate.next; i < slots.size(); ) {
+		size_t j = i + 1;
+		while (j < slots.size() && slots[j] == slots[j - 1] + 1) {
+			j++;
+		}
+		std::string range = std::to_string(slots[i]) + "-" + std::to_string(slots[j - 1]);
+		std::string_view args[5] = {"CLUSTER", "SETSLOT", range, "IMPORTING", self};
+		aof_encode(&conn->wbuf, args, 5);
+		b->replies++;
+		i = j;
+	}
+	if (!g_io_uring && reactor_add(w->reactor, fd, conn_events(conn)) < 0) {
+		delete b;
+		conn_destroy(w, conn);
+		return false;
+	}
+	conn->migrate = true;
+	g_migrate.conn = conn;
+	g_migrate.inflight.push_back(b);
+	return true;
+}
+
+// a slot migration, run by worker 0 once per loop iteration. the slots
+// are marked migrating first, and no key moves until every worker has
+// begun an iteration since, so no command that found them not migrating
+// is still running. then batches of keys go out, at most
+// k_migrate_window unanswered, for at most g_migrate_budget_us per
+// iteration, so the clients of worker 0 wait no longer than that for the
+// migration. returns the loop timeout
+static int migrate_tick (Worker* w) {
+	if (w->id != 0 || !g_migrate.active) {
+		return -1;
+	}
+	std::unique_lock<std::mutex> guard(g_migrate.lock);
+	if (g_migrate.state == MIG_QUIESCE) {
+		for (size_t i = 0; i < g_workers.size(); ++i) {
+			if (g_workers[i]->ticks == g_migrate.ticks[i]) {
+				return 1;
+			}
+		}
+		if (!migrate_connect(w)) {
+			migrate_fail("cannot connect to the target");
+			return -1;
+		}
+		g_migrate.state = MIG_MOVING;
+	}
+	Conn* conn = g_migrate.conn;
+	if (g_migrate.state != MIG_MOVING || !conn) {
+		return -1;
+	}
+	uint32_t prev = conn_events(conn);
+	uint64_t deadline = get_monotonic_us() + g_migrate_budget_us;
+	int timeout = -1;
+	while (!g_migrate.answered.empty()) {
+		if (!migrate_batch_done(g_migrate.answered.front(), deadline)) {
+			return 0;
+		}
+		delete g_migrate.answered.front();
+		g_migrate.answered.pop_front();
+	}
+	while (g_migrate.inflight.size() < k_migrate_window && conn_queued(conn) < g_output_hwm / 2
+		&& g_migrate.next < g_migrate.slots.size())
+	{
+		if (get_monotonic_us() >= deadline) {
+			timeout = 0;
+			break;
+		}
+		migrate_batch(conn);
+	}
+	if (g_migrate.next == g_migrate.slots.size() && g_migrate.inflight.empty()) {
+		g_migrate.state = MIG_DONE;
+		g_migrate.end_us = get_monotonic_us();
+		g_migrate.active = false;
+		conn->state = STATE_END;
+		printf("Slot migration done: %zu slot(s), %llu keys in %.3f s\n", g_migrate.slots.size(),
+			(unsigned long long)g_migrate.keys_moved, (double)(g_migrate.end_us - g_migrate.start_us) / 1e6);
+	}
+	guard.unlock();
+	//io_uring submits the sends with the loop's next io_uring_enter()
+	if (!g_io_uring) {
+		state_res(conn);
+		if (conn->state == STATE_END) {
+			(void)reactor_del(w->reactor, conn->fd, prev);
+			conn_destroy(w, conn);
+			return -1;
+		}
+		if (reactor_mod(w->reactor, conn->fd, prev, conn_events(conn)) < 0) {
+			errmsg("reactor_mod()");
+		}
+	}
+	return timeout;
+}
+
+static void worker_run (Worker* w) {
+	//only ready fds are returned, so a loop iteration costs O(ready)
+	//instead of O(connections)
+	const int k_max_events = 256;
+	ReactorEvent events[k_max_events];
+	t_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	while (1) {
+		w->ticks++;
+		uint64_t now = get_monotonic_ms();
+		while (Conn* conn = conn_expired(w, now)) {
+			(void)reactor_del(w->reactor, conn->fd, conn_events(conn));
+			conn_destroy(w, conn);
+		}
+		int timeout = min_timeout(expire_tick(), conn_timeout(w, now));
+		timeout = min_timeout(timeout, t_accept_retry ? k_accept_retry_ms : -1);
+		timeout = min_timeout(timeout, snapshot_poll());
+		timeout = min_timeout(timeout, migrate_tick(w));
+		timeout = min_timeout(timeout, block_timeout(w, now));
+		if (!dlist_empty(&w->aof_waiting)) {
+			timeout = 0;
+		}
+		int rv = reactor_wait(w->reactor, events, k_max_events, timeout);
+		if (rv < 0) {
+			errmsg("reactor_wait");
+		}
+		if (t_accept_retry) {
+			//no readiness event comes for what is already in the backlog
+			t_accept_retry = false;
+			while (accept_new_conn(w) == 0) {}
+		}
+
+		now = get_monotonic_ms();
+		uint64_t offset = g_repl.offset;
+		for (int i = 0; i < rv; ++i) {
+			int fd = events[i].fd;
+			if (fd == w->listen_fd) {
+				//edge-triggered, accept until the backlog is empty
+				while (accept_new_conn(w) == 0) {}
+				continue;
+			}
+			if (fd == w->wake_fd[0]) {
+				worker_woken(w);
+				continue;
+			}
+
+			//kqueue reports read and write separately, so the fd may
+			//already be gone by its second event
+			Conn* conn = ((size_t)fd < w->fd2conn.size()) ? w->fd2conn[fd] : NULL;
+			if (!conn) {
+				continue;
+			}
+			worker_conn_io(w, conn, now);
+		}
+
+		//waits a push or the timeout ended, before the AOF write
+		while (Conn* conn = block_next(w, now)) {
+			uint32_t prev = conn_events(conn);
+			block_finish(w, conn);
+			connection_io(conn);
+			worker_conn_done(w, conn, prev, now);
+		}
+
+		if (g_aof.on) {
+			aof_flush();
+			DList* last = w->aof_waiting.prev;
+			while (Conn* conn = aof_next_waiting(w, &last)) {
+				worker_conn_io(w, conn, now);
+			}
+		}
+
+		//replicas get the stream once it is in the AOF, like replies.
+		//a queue the socket took whole is refilled right away, no
+		//writable event would come for it
+		DList* node = w->replicas.next;
+		while (node != &w->replicas) {
+			Conn* conn = container_of(node, Conn, repl_link);
+			node = node->next;
+			uint32_t prev = conn_events(conn);
+			bool fed = false;
+			while (repl_feed(conn)) {
+				fed = true;
+				state_res(conn);
+				if (conn->state == STATE_END || conn_queued(conn)) {
+					break;
+				}
+			}
+			if (conn->state == STATE_END) {
+				(void)reactor_del(w->reactor, conn->fd, prev);
+				conn_destroy(w, conn);
+				continue;
+			}
+			if (reactor_mod(w->reactor, conn->fd, prev, conn_events(conn)) < 0) {
+				errmsg("reactor_mod()");
+			}
+			if (fed) {
+				conn_touch(w, conn, now);
+			}
+		}
+		repl_wake_others(w, offset);
+
+		//messages go out with one writev() per subscriber for all of them
+		pubsub_deliver(w, now);
+		for (Conn* conn: w->pub_touched) {
+			conn->pub_touched = false;
+			if (conn->state != STATE_END) {
+				bool paused = conn->state == STATE_RES;
+				state_res(conn);
+				if (paused && conn->state == STATE_REQ) {
+					process_requests(conn);
+				}
+			}
+			if (conn->state == STATE_END) {
+				(void)reactor_del(w->reactor, conn->fd, conn->pub_events);
+				conn_destroy(w, conn);
+				continue;
+			}
+			if (reactor_mod(w->reactor, conn->fd, conn->pub_events, conn_events(conn)) < 0) {
+				errmsg("reactor_mod()");
+			}
+			conn_aof_wait(w, conn);
+		}
+		w->pub_touched.clear();
+	}
+}
+
+enum { //operation a completion belongs to, in the low byte of user_data
+	URING_ACCEPT = 1,
+	URING_RECV = 2,
+	URING_SEND = 3,
+	URING_CANCEL = 4,
+	URING_WAKE = 5, //the worker's wake socket
+};
+
+static uint64_t uring_tag (int fd, uint32_t op) {
+	return ((uint64_t)fd << 8) | op;
+}
+
+// submit what the connection needs next: a send of the queued replies, a
+// fresh recv, or a cancel of the recv under back-pressure. the fd is only
+// closed once no operation on it is left, so a reused fd number never
+// receives a completion meant for the old connection
+static void uring_conn_update (Worker* w, Uring* ring, Conn* conn) {
+	if (!conn->sending && !conn->aof_wait) {
+		if (!buf_size(&conn->sbuf) && buf_size(&conn->wbuf)) {
+			//double buffering, the drained send buffer takes new replies
+			std::swap(conn->sbuf, conn->wbuf);
+		}
+		if (buf_size(&conn->sbuf)) {
+			uring_send(ring, conn->fd, buf_head(&conn->sbuf), buf_size(&conn->sbuf),
+				uring_tag(conn->fd, URING_SEND));
+			conn->sending = true;
+		}
+	}
+
+	//a blocked connection reads on, see try_fill_buffer()
+	bool recv = conn->state == STATE_REQ || (conn->state == STATE_BLOCKED && buf_size(&conn->rbuf) < k_max_msg);
+	if (recv && !conn->recv_armed) {
+		uring_recv(ring, conn->fd, uring_tag(conn->fd, URING_RECV));
+		conn->recv_armed = true;
+		conn->recv_stopping = false;
+	} else if (!recv && conn->recv_armed && !conn->recv_stopping) {
+		uring_cancel(ring, uring_tag(conn->fd, URING_RECV), uring_tag(conn->fd, URING_CANCEL));
+		conn->recv_stopping = true;
+	}
+
+	if (conn->state == STATE_END) {
+		//nothing is served to it while its operations finish
+		block_conn_gone(w, conn);
+	}
+	if (conn->state == STATE_END && !conn->sending && !conn->recv_armed) {
+		conn_destroy(w, conn);
+		return;
+	}
+	conn_aof_wait(w, conn);
+	conn_repl_attach(w, conn);
+	if (conn->state != STATE_RES) {
+		buf_trim(&conn->rbuf, k_conn_buf_keep);
+	}
+	buf_trim(&conn->wbuf, k_conn_buf_keep);
+	if (!conn->sending) {
+		buf_trim(&conn->sbuf, k_conn_buf_keep);
+	}
+}
+
+static void uring_on_recv (Uring* ring, Conn* conn, const UringCqe* cqe) {
+	if (uring_has_buf(cqe->flags)) {
+		if (cqe->res > 0 && conn->state != STATE_END) {
+			buf_append(&conn->rbuf, uring_buf(ring, cqe->flags), (size_t)cqe->res);
+		}
+		uring_buf_return(ring, cqe->flags);
+	}
+	if (!uring_more(cqe->flags)) {
+		conn->recv_armed = false;
+	}
+	if (cqe->res == 0) {
+		msg(buf_size(&conn->rbuf) ? "unexpected EOF" : "EOF");
+		conn->state = STATE_END;
+	} else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+		msg("recv() error");
+		conn->state = STATE_END;
+	} else if (cqe->res > 0) {
+		process_requests(conn);
+	}
+	//-ENOBUFS: every provided buffer is taken, the recv is re-armed once
+	//the others have been handed back
+}
+
+static void uring_on_send (Conn* conn, const UringCqe* cqe) {
+	conn->sending = false;
+	if (cqe->res < 0) {
+		msg("send() error");
+		conn->state = STATE_END;
+		//nothing more can be sent
+		buf_release(&conn->wbuf);
+		buf_release(&conn->sbuf);
+		return;
+	}
+	buf_consume(&conn->sbuf, (size_t)cqe->res);
+	if (conn->state == STATE_RES && conn_queued(conn) < g_output_hwm) {
+		//requests left in rbuf while the queue was full
+		conn->state = STATE_REQ;
+		process_requests(conn);
+	}
+}
+
+// the io_uring event loop: one multishot accept and one multishot recv per
+// connection stay armed, receives land in kernel-provided buffers, and all
+// sends prepared during a tick are submitted by one io_uring_enter()
+static void worker_run_uring (Worker* w) {
+	//single issuer, so the ring must be created by the thread using it
+	Uring* ring = uring_new(k_uring_entries);
+	if (!ring || uring_setup_bufs(ring, k_uring_bufs, k_read_chunk) < 0) {
+		errmsg("io_uring setup");
+	}
+	uring_accept(ring, w->listen_fd, uring_tag(w->listen_fd, URING_ACCEPT));
+	uring_recv(ring, w->wake_fd[0], uring_tag(w->wake_fd[0], URING_WAKE));
+	t_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	const int k_max_cqes = 256;
+	UringCqe cqes[k_max_cqes];
+	while (1) {
+		w->ticks++;
+		uint64_t now = get_monotonic_ms();
+		while (Conn* conn = conn_expired(w, now)) {
+			//fails the operations in flight, the connection goes once
+			//they have completed
+			(void)shutdown(conn->fd, SHUT_RDWR);
+			conn->state = STATE_END;
+			uring_conn_update(w, ring, conn);
+		}
+		int timeout = min_timeout(expire_tick(), conn_timeout(w, now));
+		timeout = min_timeout(timeout, t_accept_retry ? k_accept_retry_ms : -1);
+		timeout = min_timeout(timeout, snapshot_poll());
+		timeout = min_timeout(timeout, migrate_tick(w));
+		timeout = min_timeout(timeout, block_timeout(w, now));
+		if (w->id == 0 && g_migrate.conn) {
+			uring_conn_update(w, ring, g_migrate.conn);
+		}
+		if (uring_wait(ring, timeout) < 0) {
+			errmsg("io_uring_enter");
+		}
+		if (t_accept_retry) {
+			t_accept_retry = false;
+			uring_accept(ring, w->listen_fd, uring_tag(w->listen_fd, URING_ACCEPT));
+		}
+		now = get_monotonic_ms();
+		uint64_t offset = g_repl.offset;
+		int n = uring_peek(ring, cqes, k_max_cqes);
+		for (int i = 0; i < n; ++i) {
+			const UringCqe* cqe = &cqes[i];
+			int fd = (int)(cqe->user_data >> 8);
+			uint32_t op = (uint32_t)(cqe->user_data & 0xff);
+			if (op == URING_CANCEL) {
+				continue;
+			}
+			if (op == URING_ACCEPT) {
+				if (cqe->res >= 0) {
+					Conn* conn = conn_new(w, cqe->res);
+					uring_conn_update(w, ring, conn);
+				} else if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+					(void)accept_shed(w->listen_fd);
+				}
+				//an error ends the multishot accept. it is armed again
+				//right away, or once the retry is due
+				if (!uring_more(cqe->flags) && !t_accept_retry) {
+					uring_accept(ring, w->listen_fd, uring_tag(w->listen_fd, URING_ACCEPT));
+				}
+				continue;
+			}
+			if (op == URING_WAKE) {
+				if (uring_has_buf(cqe->flags)) {
+					uring_buf_return(ring, cqe->flags);
+				}
+				if (!uring_more(cqe->flags)) {
+					uring_recv(ring, w->wake_fd[0], uring_tag(w->wake_fd[0], URING_WAKE));
+				}
+				w->woken = false;
+				continue;
+			}
+
+			Conn* conn = ((size_t)fd < w->fd2conn.size()) ? w->fd2conn[fd] : NULL;
+			if (!conn) {
+				continue;
+			}
+			if (op == URING_RECV) {
+				uring_on_recv(ring, conn, cqe);
+			} else if (op == URING_SEND) {
+				uring_on_send(conn, cqe);
+			}
+			if (cqe->res > 0) {
+				conn_touch(w, conn, now);
+			}
+			uring_conn_update(w, ring, conn);
+		}
+
+		while (Conn* conn = block_next(w, now)) {
+			block_finish(w, conn);
+			process_requests(conn);
+			conn_touch(w, conn, now);
+			uring_conn_update(w, ring, conn);
+		}
+
+		//the sends of waiting replies are prepared after the AOF write,
+		//and submitted with the next io_uring_enter()
+		if (g_aof.on) {
+			aof_flush();
+			DList* last = w->aof_waiting.prev;
+			while (Conn* conn = aof_next_waiting(w, &last)) {
+				uring_conn_update(w, ring, conn);
+			}
+		}
+
+		//replicas are refilled as their sends complete
+		DList* node = w->replicas.next;
+		while (node != &w->replicas) {
+			Conn* conn = container_of(node, Conn, repl_link);
+			node = node->next;
+			if (repl_feed(conn) || conn->state == STATE_END) {
+				uring_conn_update(w, ring, conn);
+			}
+		}
+		repl_wake_others(w, offset);
+
+		pubsub_deliver(w, now);
+		for (Conn* conn: w->pub_touched) {
+			conn->pub_touched = false;
+			if (conn->state == STATE_END) {
+				//the send in flight may never complete
+				(void)shutdown(conn->fd, SHUT_RDWR);
+			}
+			uring_conn_update(w, ring, conn);
+		}
+		w->pub_touched.clear();
+	}
+}
+
+// runs every command of the log at startup, the replies go nowhere. a
+// log that ends in the middle of a command, from a crash during a write,
+// is cut back to the last complete one. a damaged log stops the server
+static void aof_replay () {
+	int fd = open(g_aof.path.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		errmsg("open AOF");
+	}
+	uint64_t start = get_monotonic_us();
+	size_t size = (size_t)st.st_size;
+	uint8_t* data = NULL;
+	if (size) {
+		data = (uint8_t*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			errmsg("mmap AOF");
+		}
+	}
+	close(fd);
+
+	Conn conn;
+	conn.proto = PROTO_RESP2;
+	buf_init(&conn.rbuf);
+	buf_init(&conn.wbuf);
+	buf_init(&conn.sbuf);
+	std::vector<std::string_view> cmd;
+	size_t pos = 0;
+	size_t n = 0;
+	int64_t rv = 0;
+	while (pos < size) {
+		//only multibulk arrays are ever logged
+		if (data[pos] != '*') {
+			rv = -1;
+			break;
+		}
+		resp_reset(&conn.resp);
+		rv = resp_parse(&conn.resp, data + pos, size - pos, k_max_msg, k_max_args);
+		if (rv <= 0) {
+			break;
+		}
+		cmd.clear();
+		for (const RespArg &arg: conn.resp.args) {
+			cmd.emplace_back((const char*)data + pos + arg.off, arg.len);
+		}
+		if (!cmd.empty()) {
+			do_request(&conn, cmd);
+			out_consume(&conn, conn_queued(&conn));
+			n++;
+		}
+		pos += (size_t)rv;
+	}
+	buf_release(&conn.wbuf);
+	if (size) {
+		munmap(data, size);
+	}
+	if (rv < 0) {
+		fprintf(stderr, "%s: damaged command at offset %zu\n", g_aof.path.c_str(), pos);
+		exit(1);
+	}
+	if (pos < size) {
+		fprintf(stderr, "%s: the last command is incomplete, dropping its %zu bytes\n",
+			g_aof.path.c_str(), size - pos);
+		if (truncate(g_aof.path.c_str(), (off_t)pos) < 0) {
+			errmsg("truncate AOF");
+		}
+	}
+	double secs = (double)(get_monotonic_us() - start) / 1e6;
+	printf("Replayed %zu commands from %s (%zu bytes) in %.3f s\n", n, g_aof.path.c_str(), pos, secs);
+}
+
+//how long the link to the primary may stay silent during the handshake
+const uint64_t k_link_timeout_ms = 60 * 1000;
+
+// reads more from the primary into in. false once the link is gone. a
+// read that timed out returns true with nothing read, so the caller gets
+// to check for a REPLICAOF meanwhile
+static bool link_read (int fd, Buffer* in) {
+	buf_reserve(in, 64 << 10);
+	ssize_t rv = read(fd, buf_tail(in), buf_avail(in));
+	if (rv < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return true;
+	}
+	if (rv <= 0) {
+		return false;
+	}
+	buf_commit(in, (size_t)rv);
+	return true;
+}
+
+static bool write_all (int fd, const void* data, size_t len) {
+	size_t pos = 0;
+	while (pos < len) {
+		ssize_t rv = write(fd, (const uint8_t*)data + pos, len - pos);
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rv <= 0) {
+			return false;
+		}
+		pos += (size_t)rv;
+	}
+	return true;
+}
+
+// the next line from the primary, without its CRLF
+static bool link_line (int fd, Buffer* in, uint64_t gen, std::string* line) {
+	uint64_t deadline = get_monotonic_ms() + k_link_timeout_ms;
+	while (1) {
+		const uint8_t* p = buf_head(in);
+		const uint8_t* lf = (const uint8_t*)memchr(p, '\n', buf_size(in));
+		if (lf) {
+			size_t len = (size_t)(lf - p);
+			line->assign((const char*)p, len && lf[-1] == '\r' ? len - 1 : len);
+			buf_consume(in, len + 1);
+			return true;
+		}
+		if (g_repl.cfg_gen != gen || get_monotonic_ms() > deadline || !link_read(fd, in)) {
+			return false;
+		}
+	}
+}
+
+// a blocking TCP connection to the primary, reads time out every 100 ms
+static int link_connect (const std::string &host, int port) {
+	struct addrinfo hints = {};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo* res = NULL;
+	std::string service = std::to_string(port);
+	if (getaddrinfo(host.c_str(), service.c_str(), &hints, &res) != 0) {
+		return -1;
+	}
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd >= 0) {
+		fd_set_cloexec(fd);
+	}
+	if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		return -1;
+	}
+	int on = 1;
+	(void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	(void)setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	struct timeval tv = {0, 100 * 1000};
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return fd;
+}
+
+// a full resync: the snapshot that follows FULLRESYNC, as "$size\r\n"
+// and the file's bytes, goes to a file, then replaces the keyspace. with
+// the AOF on, the log starts over from the new keyspace
+static bool replica_full_sync (int fd, Buffer* in, uint64_t gen) {
+	std::string line;
+	int64_t size = 0;
+	//waits for the primary's child to write the snapshot
+	do {
+		if (!link_line(fd, in, gen, &line)) {
+			return false;
+		}
+	} while (line.empty());
+	if (line[0] != '$' || !str2int(std::string_view(line).substr(1), &size) || size < 0) {
+		msg("replica: bad full resync header");
+		return false;
+	}
+	std::string path = g_snapshot_path + ".recv";
+	int out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out < 0) {
+		msg("replica: cannot write the full resync snapshot");
+		return false;
+	}
+	uint64_t start = get_monotonic_us();
+	uint64_t left = (uint64_t)size;
+	uint64_t deadline = get_monotonic_ms() + k_link_timeout_ms;
+	bool ok = true;
+	while (ok && left) {
+		if (!buf_size(in)) {
+			ok = g_repl.cfg_gen == gen && get_monotonic_ms() < deadline && link_read(fd, in);
+			continue;
+		}
+		size_t n = buf_size(in) < left ? buf_size(in) : (size_t)left;
+		ok = write_all(out, buf_head(in), n);
+		buf_consume(in, n);
+		left -= n;
+		deadline = get_monotonic_ms() + k_link_timeout_ms;
+	}
+	ok = close(out) == 0 && ok;
+	if (ok) {
+		uint64_t recv_us = get_monotonic_us() - start;
+		snapshot_report("replica: full resync snapshot received", (uint64_t)size, recv_us);
+		//a rewrite running now would rename the old keyspace's base
+		//over the new one, so the load waits for it
+		while (1) {
+			{
+				std::lock_guard<std::mutex> wguard(g_aof.write_lock);
+				ShardLocks shards(k_all_shards);
+				std::lock_guard<std::mutex> guard(g_data.lock);
+				if (!g_save.child || g_save.kind != CHILD_REWRITE) {
+					db_clear();
+					ok = snapshot_load(path);
+					if (ok && g_aof.on && !aof_reset()) {
+						errmsg("AOF reset after a full resync");
+					}
+					break;
+				}
+			}
+			usleep(10 * 1000);
+		}
+	}
+	(void)unlink(path.c_str());
+	return ok;
+}
+
+// applies the stream from the primary, until the link fails or REPLICAOF
+// changes. every command goes through do_request() like a client's, the
+// replies go nowhere. the offset reached is acknowledged once a second
+static void replica_stream (int fd, Buffer* in, uint64_t gen) {
+	Conn conn;
+	conn.proto = PROTO_RESP2;
+	conn.primary = true;
+	buf_init(&conn.rbuf);
+	buf_init(&conn.wbuf);
+	buf_init(&conn.sbuf);
+	std::vector<std::string_view> cmd;
+	uint64_t acked_ms = 0;
+	while (g_repl.cfg_gen == gen) {
+		while (buf_size(in)) {
+			const uint8_t* data = buf_head(in);
+			int64_t rv = resp_parse(&conn.resp, data, buf_size(in), k_max_msg, k_max_args);
+			if (rv < 0) {
+				msg("replica: protocol error in the stream");
+				buf_release(&conn.wbuf);
+				return;
+			}
+			if (rv == 0) {
+				break;
+			}
+			cmd.clear();
+			for (const RespArg &arg: conn.resp.args) {
+				cmd.emplace_back((const char*)data + arg.off, arg.len);
+			}
+			if (!cmd.empty()) {
+				do_request(&conn, cmd);
+				out_consume(&conn, conn_queued(&conn));
+			}
+			buf_consume(in, (size_t)rv);
+			resp_reset(&conn.resp);
+			g_repl.offset += (uint64_t)rv;
+		}
+		if (g_aof.on) {
+			aof_flush();
+		}
+		uint64_t now = get_monotonic_ms();
+		if (now - acked_ms >= 1000) {
+			std::string off = std::to_string(g_repl.offset.load());
+			std::string ack = "*3\r\n$8\r\nREPLCONF\r\n$3\r\nACK\r\n$"
+				+ std::to_string(off.size()) + "\r\n" + off + "\r\n";
+			if (!write_all(fd, ack.data(), ack.size())) {
+				break;
+			}
+			acked_ms = now;
+		}
+		if (!link_read(fd, in)) {
+			break;
+		}
+	}
+	buf_release(&conn.wbuf);
+}
+
+// one connection to the primary: PSYNC from the stream and offset this
+// replica has, a full resync if the primary cannot continue those, then
+// the stream
+static void replica_link (const std::string &host, int port, uint64_t gen) {
+	int fd = link_connect(host, port);
+	if (fd < 0) {
+		msg("replica: cannot connect to the primary");
+		return;
+	}
+	std::string replid;
+	{
+		std::lock_guard<std::mutex> guard(g_repl.cfg_lock);
+		replid = g_repl.primary_replid;
+	}
+	std::string off = replid.empty() ? "-1" : std::to_string(g_repl.offset.load());
+	if (replid.empty()) {
+		replid = "?";
+	}
+	std::string psync = "*3\r\n$5\r\nPSYNC\r\n$" + std::to_string(replid.size()) + "\r\n" + replid
+		+ "\r\n$" + std::to_string(off.size()) + "\r\n" + off + "\r\n";
+	Buffer in;
+	buf_init(&in);
+	std::string line;
+	bool ok = write_all(fd, psync.data(), psync.size()) && link_line(fd, &in, gen, &line);
+	if (ok && line == "+CONTINUE") {
+		fprintf(stderr, "replica: partial resync from offset %s\n", off.c_str());
+	} else if (ok && !strncmp(line.c_str(), "+FULLRESYNC ", 12)) {
+		char id[41] = {};
+		unsigned long long at = 0;
+		ok = sscanf(line.c_str() + 12, "%40s %llu", id, &at) == 2 && replica_full_sync(fd, &in, gen);
+		if (ok) {
+			g_repl.offset = at;
+			std::lock_guard<std::mutex> guard(g_repl.cfg_lock);
+			g_repl.primary_replid = id;
+		}
+	} else {
+		if (ok) {
+			fprintf(stderr, "replica: PSYNC refused: %s\n", line.c_str());
+		}
+		ok = false;
+	}
+	if (ok) {
+		g_repl.link_up = true;
+		replica_stream(fd, &in, gen);
+		g_repl.link_up = false;
+		msg("replica: lost the link to the primary");
+	}
+	buf_release(&in);
+	close(fd);
+}
+
+// on a replica, the thread that keeps the link to the primary. blocking
+// I/O on a thread of its own, the workers only see the keyspace change.
+// after losing the link it reconnects a second later, and at once after a
+// REPLICAOF
+static void replica_run () {
+	while (1) {
+		std::string host;
+		int port = 0;
+		uint64_t gen = 0;
+		{
+			std::lock_guard<std::mutex> guard(g_repl.cfg_lock);
+			host = g_repl.host;
+			port = g_repl.port;
+			gen = g_repl.cfg_gen;
+		}
+		if (port) {
+			replica_link(host, port, gen);
+		}
+		for (int i = 0; i < 10 && g_repl.cfg_gen == gen; ++i) {
+			usleep(100 * 1000);
+		}
+	}
+}
+
+// loads the keyspace from the base snapshot and the log at startup, then
+// opens the log for appending. on the first start with the AOF on there
+// is no log yet: the keyspace comes from the snapshot, and becomes the
+// base so that nothing already saved is lost
+static void aof_load () {
+	struct stat st;
+	if (stat(g_aof.path.c_str(), &st) == 0) {
+		snapshot_load_or_exit(g_aof.base);
+		aof_replay();
+	} else {
+		snapshot_load_or_exit(g_snapshot_path);
+		ShardLocks shards(k_all_shards);
+		uint8_t* buf = (uint8_t*)malloc(k_snapshot_mem);
+		uint64_t bytes = 0;
+		bool ok = snapshot_write(g_aof.base_tmp.c_str(), buf, &bytes)
+			&& rename(g_aof.base_tmp.c_str(), g_aof.base.c_str()) == 0;
+		free(buf);
+		if (!ok) {
+			errmsg("write AOF base");
+		}
+	}
+	g_aof.fd = open(g_aof.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (g_aof.fd < 0) {
+		errmsg("open AOF");
+	}
+	g_aof.on = true;
+	if (g_aof.fsync == AOF_FSYNC_EVERYSEC) {
+		std::thread(aof_syncer).detach();
+	}
+}
+
+// reads the cluster layout and finds this node in it, by its port, and by
+// announce too if that is set
+static void cluster_load (const char* path, int port, const std::string &announce) {
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	std::string text;
+	char chunk[4096];
+	size_t got = 0;
+	while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+		text.append(chunk, got);
+	}
+	fclose(f);
+	std::string err;
+	SlotMap map;
+	if (!slot_map_parse(text, &map, &err)) {
+		fprintf(stderr, "%s: %s\n", path, err.c_str());
+		exit(1);
+	}
+	g_cluster.nodes = map.nodes;
+	for (uint32_t s = 0; s < k_slots; ++s) {
+		g_cluster.owner[s] = map.owner[s];
+		g_cluster.migrating[s] = k_no_node;
+		g_cluster.importing[s] = k_no_node;
+	}
+	for (size_t i = 0; i < g_cluster.nodes.size(); ++i) {
+		const ClusterNode &node = g_cluster.nodes[i];
+		if (node.port != port || (!announce.empty() && node.host != announce)) {
+			continue;
+		}
+		if (g_cluster.self != k_no_node) {
+			fprintf(stderr, "%s: more than one node uses port %d, pick one with --cluster-announce\n", path, port);
+			exit(1);
+		}
+		g_cluster.self = (uint16_t)i;
+	}
+	if (g_cluster.self == k_no_node) {
+		fprintf(stderr, "%s: no node for port %d\n", path, port);
+		exit(1);
+	}
+	uint32_t mine = 0;
+	for (uint32_t s = 0; s < k_slots; ++s) {
+		mine += g_cluster.owner[s] == g_cluster.self ? 1 : 0;
+	}
+	printf("Cluster: node %u of %zu, serving %u slot(s)\n", g_cluster.self,
+		g_cluster.nodes.size(), mine);
+}
+
+static void usage (const char* prog) {
+	fprintf(stderr, "usage: %s [--port N] [--threads N] [--output-hwm BYTES] [--idle-timeout SEC] [--read-timeout SEC]\n"
+		"       [--snapshot PATH] [--load-threads N] [--aof PATH] [--appendfsync always|everysec|no]\n"
+		"       [--replicaof HOST PORT] [--repl-backlog-size BYTES] [--cluster FILE] [--cluster-announce HOST]\n"
+		"       [--migrate-budget-us N] [--pubsub-limit HARD_BYTES SOFT_BYTES SOFT_SEC]\n"
+		"       [--zset-max-listpack-entries N] [--zset-max-listpack-value BYTES]\n"
+		"       [--resp-kernel scalar|sse2|avx2] [--io-uring] [--slab] [--verbose]\n", prog);
+	exit(1);
+}
+
+int main (int argc, char *argv[]) {
+	// Disable output buffering
+	setbuf(stdout, NULL);
+	//a client gone while its replies are queued is an EPIPE from writev(),
+	//not a reason to exit
+	signal(SIGPIPE, SIG_IGN);
+	g_hash_seed = (get_monotonic_us() ^ (uint64_t)getpid() << 32) * 0x9e3779b97f4a7c15ull;
+
+	uint16_t port = 6379;
+	int threads = 1;
+	const char* kernel = "scalar";
+	bool aof = false;
+	std::string primary_host;
+	int primary_port = 0;
+	const char* cluster = NULL;
+	std::string announce;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--port") && i + 1 < argc) {
+			port = (uint16_t)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			threads = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--output-hwm") && i + 1 < argc) {
+			g_output_hwm = (size_t)atol(argv[++i]);
+		} else if (!strcmp(argv[i], "--idle-timeout") && i + 1 < argc) {
+			g_idle_timeout_ms = (uint64_t)atol(argv[++i]) * 1000;
+		} else if (!strcmp(argv[i], "--read-timeout") && i + 1 < argc) {
+			g_read_timeout_ms = (uint64_t)atol(argv[++i]) * 1000;
+		} else if (!strcmp(argv[i], "--resp-kernel") && i + 1 < argc) {
+			kernel = argv[++i];
+		} else if (!strcmp(argv[i], "--snapshot") && i + 1 < argc) {
+			g_snapshot_path = argv[++i];
+		} else if (!strcmp(argv[i], "--load-threads") && i + 1 < argc) {
+			g_load_threads = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--aof") && i + 1 < argc) {
+			g_aof.path = argv[++i];
+			aof = true;
+		} else if (!strcmp(argv[i], "--appendfsync") && i + 1 < argc) {
+			g_aof.fsync = aof_fsync_policy(argv[++i]);
+		} else if (!strcmp(argv[i], "--replicaof") && i + 2 < argc) {
+			primary_host = argv[++i];
+			primary_port = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--repl-backlog-size") && i + 1 < argc) {
+			g_repl_backlog_size = (size_t)atol(argv[++i]);
+		} else if (!strcmp(argv[i], "--cluster") && i + 1 < argc) {
+			cluster = argv[++i];
+		} else if (!strcmp(argv[i], "--cluster-announce") && i + 1 < argc) {
+			announce = argv[++i];
+		} else if (!strcmp(argv[i], "--migrate-budget-us") && i + 1 < argc) {
+			g_migrate_budget_us = (uint64_t)atol(argv[++i]);
+		} else if (!strcmp(argv[i], "--pubsub-limit") && i + 3 < argc) {
+			g_pubsub_hard = (size_t)atol(argv[++i]);
+			g_pubsub_soft = (size_t)atol(argv[++i]);
+			g_pubsub_soft_sec = (uint64_t)atol(argv[++i]);
+		} else if (!strcmp(argv[i], "--zset-max-listpack-entries") && i + 1 < argc) {
+			g_zset_max_listpack_entries = (size_t)atol(argv[++i]);
+		} else if (!strcmp(argv[i], "--zset-max-listpack-value") && i + 1 < argc) {
+			g_zset_max_listpack_value = (size_t)atol(argv[++i]);
+		} else if (!strcmp(argv[i], "--io-uring")) {
+			g_io_uring = true;
+		} else if (!strcmp(argv[i], "--slab")) {
+			slab_enable();
+		} else if (!strcmp(argv[i], "--verbose")) {
+			g_verbose = true;
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (threads < 1 || g_output_hwm == 0 || g_load_threads < 0 || g_aof.fsync < 0
+		|| g_repl_backlog_size == 0 || (!primary_host.empty() && (primary_port <= 0 || primary_port > 65535)))
+	{
+		usage(argv[0]);
+	}
+	resp_init();
+	if (!resp_set_kernel(kernel)) {
+		msg("--resp-kernel: unknown, or not supported by this cpu");
+		usage(argv[0]);
+	}
+	if (g_io_uring) {
+		//multishot recv and provided buffer rings need linux 6.0
+		Uring* probe = uring_new(8);
+		if (!probe || uring_setup_bufs(probe, 8, k_read_chunk) < 0) {
+			msg("io_uring is not available, falling back to the reactor");
+			g_io_uring = false;
+		}
+		if (probe) {
+			uring_free(probe);
+		}
+	}
+
+	for (Shard &sh: g_data.shards) {
+		tw_init(&sh.ttl, get_monotonic_ms());
+	}
+	g_snapshot_tmp = g_snapshot_path + ".tmp";
+	g_repl.sync_path = g_snapshot_path + ".sync";
+	repl_new_id();
+	g_save.lastsave = time(NULL);
+	if (g_load_threads == 0) {
+		int cpus = (int)std::thread::hardware_concurrency();
+		g_load_threads = cpus > 0 ? cpus : 1;
+	}
+	//clients can only connect once the keyspace is complete
+	if (aof) {
+		g_aof.tmp = g_aof.path + ".tmp";
+		g_aof.base = g_aof.path + ".base";
+		g_aof.base_tmp = g_aof.base + ".tmp";
+		aof_load();
+	} else {
+		snapshot_load_or_exit(g_snapshot_path);
+	}
+	//after the load, which replays commands for any slot
+	if (cluster) {
+		cluster_load(cluster, port, announce);
+		g_cluster.on = true;
+		db_index();
+	}
+	for (int i = 0; i < threads; ++i) {
+		Worker* w = new Worker();
+		w->id = i;
+		tw_init(&w->block_timers, get_monotonic_ms());
+		w->listen_fd = open_listener(port);
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, w->wake_fd) < 0) {
+			errmsg("socketpair()");
+		}
+		for (int fd : w->wake_fd) {
+			fd_set_nb(fd);
+			fd_set_cloexec(fd);
+		}
+		if (!g_io_uring) {
+			w->reactor = reactor_new();
+			if (!w->reactor) {
+				errmsg("reactor_new()");
+			}
+			if (reactor_add(w->reactor, w->listen_fd, REACTOR_READ) < 0) {
+				errmsg("reactor_add() listen_fd");
+			}
+			if (reactor_add(w->reactor, w->wake_fd[0], REACTOR_READ) < 0) {
+				errmsg("reactor_add() wake_fd");
+			}
+		}
+		g_workers.push_back(w);
+	}
+	const char* backend = g_io_uring ? "io_uring" : reactor_backend();
+	printf("Event loop backend: %s, %d worker(s), RESP scan kernel: %s\n", backend, threads, resp_kernel());
+	printf("Waiting for a client to connect...\n");
+
+	//worker 0 runs on the main thread
+	void (*run)(Worker*) = g_io_uring ? worker_run_uring : worker_run;
+	for (int i = 1; i < threads; ++i) {
+		g_workers[i]->thread = std::thread(run, g_workers[i]);
+	}
+	if (!primary_host.empty()) {
+		g_repl.replica = true;
+		g_repl.host = primary_host;
+		g_repl.port = primary_port;
+		g_repl.thread_started = true;
+		std::thread(replica_run).detach();
+	}
+	run(g_workers[0]);
 	return 0;
 }
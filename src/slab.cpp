@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <atomic>
+#include <mutex>
+#include "slab.h"
+
+const size_t k_slab_bytes = 64 << 10;
+//free objects a thread keeps per class, and how many move at once
+//between a thread and the shared pool
+const size_t k_cache_max = 64;
+const size_t k_batch = 32;
+
+//sizes a multiple of 16, spaced ~1.5x apart so at most a third is wasted
+static const uint32_t k_class_size[] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096,
+};
+const size_t k_nclass = sizeof(k_class_size) / sizeof(k_class_size[0]);
+
+// class of every size, in steps of 16 bytes
+struct ClassTable {
+	uint8_t idx[k_slab_max / 16 + 1];
+	constexpr ClassTable () : idx() {
+		size_t c = 0;
+		for (size_t i = 0; i <= k_slab_max / 16; ++i) {
+			while (k_class_size[c] < i * 16) {
+				c++;
+			}
+			idx[i] = (uint8_t)c;
+		}
+	}
+};
+static constexpr ClassTable g_table;
+
+struct FreeObj {
+	FreeObj* next;
+};
+
+struct SlabClass {
+	std::mutex lock;
+	FreeObj* free = NULL;
+	size_t nfree = 0;
+	size_t total = 0;
+	int64_t used_exited = 0; //left behind by threads that have exited
+};
+
+static SlabClass g_classes[k_nclass];
+
+struct ThreadCache {
+	FreeObj* free[k_nclass] = {};
+	size_t nfree[k_nclass] = {};
+	//only written by the owner, read by slab_stats()
+	std::atomic<int64_t> used[k_nclass] = {};
+
+	ThreadCache ();
+	~ThreadCache ();
+};
+
+static std::mutex g_caches_lock;
+static std::vector<ThreadCache*> g_caches;
+static thread_local ThreadCache t_cache;
+static bool g_enabled = false;
+
+ThreadCache::ThreadCache () {
+	std::lock_guard<std::mutex> guard(g_caches_lock);
+	g_caches.push_back(this);
+}
+
+// hand the cached objects back so other threads can use them
+ThreadCache::~ThreadCache () {
+	std::lock_guard<std::mutex> guard(g_caches_lock);
+	for (size_t c = 0; c < k_nclass; ++c) {
+		SlabClass* sc = &g_classes[c];
+		std::lock_guard<std::mutex> class_guard(sc->lock);
+		while (free[c]) {
+			FreeObj* obj = free[c];
+			free[c] = obj->next;
+			obj->next = sc->free;
+			sc->free = obj;
+			sc->nfree++;
+		}
+		sc->used_exited += used[c].load(std::memory_order_relaxed);
+	}
+	for (size_t i = 0; i < g_caches.size(); ++i) {
+		if (g_caches[i] == this) {
+			g_caches[i] = g_caches.back();
+			g_caches.pop_back();
+			break;
+		}
+	}
+}
+
+// the caller holds sc->lock
+static void carve_slab (SlabClass* sc, size_t size) {
+	char* slab = (char*)malloc(k_slab_bytes);
+	if (!slab) {
+		abort();
+	}
+	size_t n = k_slab_bytes / size;
+	for (size_t i = n; i-- > 0;) {
+		FreeObj* obj = (FreeObj*)(slab + i * size);
+		obj->next = sc->free;
+		sc->free = obj;
+	}
+	sc->nfree += n;
+	sc->total += n;
+}
+
+static void refill (ThreadCache* tc, size_t c) {
+	SlabClass* sc = &g_classes[c];
+	std::lock_guard<std::mutex> guard(sc->lock);
+	//a slab holds fewer than k_batch objects of the largest classes
+	while (sc->nfree < k_batch) {
+		carve_slab(sc, k_class_size[c]);
+	}
+	for (size_t i = 0; i < k_batch; ++i) {
+		FreeObj* obj = sc->free;
+		sc->free = obj->next;
+		obj->next = tc->free[c];
+		tc->free[c] = obj;
+	}
+	sc->nfree -= k_batch;
+	tc->nfree[c] += k_batch;
+}
+
+static void spill (ThreadCache* tc, size_t c) {
+	SlabClass* sc = &g_classes[c];
+	std::lock_guard<std::mutex> guard(sc->lock);
+	for (size_t i = 0; i < k_batch; ++i) {
+		FreeObj* obj = tc->free[c];
+		tc->free[c] = obj->next;
+		obj->next = sc->free;
+		sc->free = obj;
+	}
+	sc->nfree += k_batch;
+	tc->nfree[c] -= k_batch;
+}
+
+static void count_used (ThreadCache* tc, size_t c, int64_t delta) {
+	tc->used[c].store(tc->used[c].load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+void slab_enable () {
+	g_enabled = true;
+}
+
+void* slab_alloc (size_t size) {
+	if (size > k_slab_max || !g_enabled) {
+		void* p = malloc(size);
+		if (!p) {
+			abort();
+		}
+		return p;
+	}
+	size_t c = g_table.idx[(size + 15) / 16];
+	ThreadCache* tc = &t_cache;
+	if (!tc->free[c]) {
+		refill(tc, c);
+	}
+	FreeObj* obj = tc->free[c];
+	tc->free[c] = obj->next;
+	tc->nfree[c]--;
+	count_used(tc, c, 1);
+	return obj;
+}
+
+void slab_free (void* p, size_t size) {
+	if (!p) {
+		return;
+	}
+	if (size > k_slab_max || !g_enabled) {
+		free(p);
+		return;
+	}
+	//objects may be freed by another thread than the one that allocated
+	//them, they simply join this thread's cache
+	size_t c = g_table.idx[(size + 15) / 16];
+	ThreadCache* tc = &t_cache;
+	FreeObj* obj = (FreeObj*)p;
+	obj->next = tc->free[c];
+	tc->free[c] = obj;
+	tc->nfree[c]++;
+	count_used(tc, c, -1);
+	if (tc->nfree[c] > k_cache_max) {
+		spill(tc, c);
+	}
+}
+
+std::vector<SlabClassStats> slab_stats () {
+	std::vector<SlabClassStats> out(k_nclass);
+	std::lock_guard<std::mutex> guard(g_caches_lock);
+	for (size_t c = 0; c < k_nclass; ++c) {
+		SlabClass* sc = &g_classes[c];
+		int64_t used = 0;
+		{
+			std::lock_guard<std::mutex> class_guard(sc->lock);
+			used = sc->used_exited;
+			out[c].total = sc->total;
+		}
+		for (ThreadCache* tc: g_caches) {
+			used += tc->used[c].load(std::memory_order_relaxed);
+		}
+		out[c].size = k_class_size[c];
+		out[c].used = used > 0 ? (size_t)used : 0;
+	}
+	return out;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// size-class slab allocator for the server's small objects: connections,
+// hash entries and short values. objects of a class are carved out of
+// 64 KiB slabs and recycled through free lists, so connection churn keeps
+// reusing the same memory instead of fragmenting the heap. every thread
+// caches a few free objects per class and trades them with a shared pool
+// in batches, so the common path takes no lock. slabs are never returned
+// to the system. sizes above k_slab_max go to malloc.
+
+const size_t k_slab_max = 4096;
+
+// the slabs are only used after slab_enable(), otherwise every size goes
+// to malloc. call it once at startup, before the first slab_alloc(), so
+// no object is freed through a different path than it was allocated by
+void slab_enable ();
+void* slab_alloc (size_t size);
+// size must be the one passed to slab_alloc
+void slab_free (void* p, size_t size);
+
+struct SlabClassStats {
+	size_t size; //object size of the class
+	size_t used; //objects handed out
+	size_t total; //objects carved from slabs, used or free
+};
+
+// one entry per size class, smallest first
+std::vector<SlabClassStats> slab_stats ();
@@ -0,0 +1,177 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "snapshot.h"
+#include "crc32c.h"
+
+static const char k_magic[8] = {'R', 'F', 'S', 'N', 'A', 'P', '0', '2'};
+static const char k_end_magic[4] = {'R', 'F', 'S', 'E'};
+const size_t k_header = sizeof(k_magic) + 8;
+const size_t k_footer = 8 + 4 + sizeof(k_end_magic);
+
+static bool write_all (int fd, const void* data, size_t len) {
+	const uint8_t* p = (const uint8_t*)data;
+	while (len > 0) {
+		ssize_t rv = write(fd, p, len);
+		if (rv < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rv <= 0) {
+			return false;
+		}
+		p += rv;
+		len -= (size_t)rv;
+	}
+	return true;
+}
+
+static void flush (SnapWriter* w) {
+	w->chunk.crc = crc32c(w->chunk.crc, w->buf, w->len);
+	if (!w->failed && !write_all(w->fd, w->buf, w->len)) {
+		w->failed = true;
+	}
+	w->len = 0;
+}
+
+// the chunk's checksum is taken as the buffer is flushed, so a chunk ends
+// with a flush
+static void chunk_close (SnapWriter* w) {
+	flush(w);
+	w->chunk.len = w->bytes - w->chunk.offset;
+	w->index[w->nchunks++] = w->chunk;
+	w->chunk = SnapChunk{w->bytes, 0, 0, 0};
+}
+
+bool snap_open (SnapWriter* w, const char* path, uint8_t* buf, size_t cap,
+	SnapChunk* index, size_t index_cap, uint64_t nkeys)
+{
+	*w = SnapWriter{};
+	w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (w->fd < 0) {
+		return false;
+	}
+	w->buf = buf;
+	w->cap = cap;
+	w->index = index;
+	w->index_cap = index_cap;
+	snap_put(w, k_magic, sizeof(k_magic));
+	snap_put_u64(w, nkeys);
+	flush(w);
+	w->chunk = SnapChunk{w->bytes, 0, 0, 0};
+	return true;
+}
+
+void snap_put (SnapWriter* w, const void* data, size_t len) {
+	const uint8_t* p = (const uint8_t*)data;
+	w->bytes += len;
+	while (len > 0) {
+		if (w->len == w->cap) {
+			flush(w);
+		}
+		size_t n = w->cap - w->len < len ? w->cap - w->len : len;
+		memcpy(w->buf + w->len, p, n);
+		w->len += n;
+		p += n;
+		len -= n;
+	}
+}
+
+void snap_next (SnapWriter* w) {
+	w->chunk.n++;
+	//one index slot is kept for the last chunk
+	if (w->bytes - w->chunk.offset >= k_snap_chunk && w->nchunks + 1 < w->index_cap) {
+		chunk_close(w);
+	}
+}
+
+bool snap_close (SnapWriter* w) {
+	if (w->chunk.n) {
+		chunk_close(w);
+	}
+	flush(w);
+	size_t index_len = w->nchunks * sizeof(SnapChunk);
+	uint8_t footer[k_footer];
+	uint64_t nchunks = w->nchunks;
+	uint32_t crc = crc32c(0, w->index, index_len);
+	memcpy(footer, &nchunks, 8);
+	memcpy(footer + 8, &crc, 4);
+	memcpy(footer + 12, k_end_magic, sizeof(k_end_magic));
+	if (!write_all(w->fd, w->index, index_len) || !write_all(w->fd, footer, sizeof(footer))) {
+		w->failed = true;
+	}
+	w->bytes += index_len + sizeof(footer);
+	if (fsync(w->fd) < 0) {
+		w->failed = true;
+	}
+	if (close(w->fd) < 0) {
+		w->failed = true;
+	}
+	w->fd = -1;
+	return !w->failed;
+}
+
+int64_t snap_index (const uint8_t* data, size_t len, std::vector<SnapChunk>* out, const char** err) {
+	if (len < k_header + k_footer || memcmp(data, k_magic, sizeof(k_magic))) {
+		*err = "not a snapshot file";
+		return -1;
+	}
+	const uint8_t* footer = data + len - k_footer;
+	uint64_t nchunks = 0;
+	uint32_t crc = 0;
+	memcpy(&nchunks, footer, 8);
+	memcpy(&crc, footer + 8, 4);
+	if (memcmp(footer + 12, k_end_magic, sizeof(k_end_magic))
+		|| nchunks > (len - k_header - k_footer) / sizeof(SnapChunk))
+	{
+		*err = "truncated file";
+		return -1;
+	}
+	size_t index_len = nchunks * sizeof(SnapChunk);
+	const uint8_t* index = footer - index_len;
+	if (crc32c(0, index, index_len) != crc) {
+		*err = "checksum mismatch";
+		return -1;
+	}
+	//the chunks must tile everything between the header and the index
+	out->resize(nchunks);
+	memcpy(out->data(), index, index_len);
+	uint64_t at = k_header;
+	for (const SnapChunk &c: *out) {
+		if (c.offset != at || c.len > (uint64_t)(index - data) - at) {
+			*err = "damaged index";
+			return -1;
+		}
+		at += c.len;
+	}
+	if (at != (uint64_t)(index - data)) {
+		*err = "damaged index";
+		return -1;
+	}
+	uint64_t nkeys = 0;
+	memcpy(&nkeys, data + sizeof(k_magic), 8);
+	return (int64_t)nkeys;
+}
+
+bool snap_chunk_valid (const uint8_t* data, const SnapChunk* c) {
+	return crc32c(0, data + c->offset, c->len) == c->crc;
+}
+
+void snap_chunk_advise (const uint8_t* data, const SnapChunk* c, int advice) {
+	uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t start = ((uintptr_t)(data + c->offset) + page - 1) & ~(page - 1);
+	uintptr_t end = (uintptr_t)(data + c->offset + c->len) & ~(page - 1);
+	if (start < end) {
+		(void)madvise((void*)start, end - start, advice);
+	}
+}
+
+const uint8_t* snap_get (SnapReader* r, size_t n) {
+	if (r->len - r->pos < n) {
+		return NULL;
+	}
+	const uint8_t* p = r->data + r->pos;
+	r->pos += n;
+	return p;
+}
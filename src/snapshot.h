@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+// point-in-time snapshot file, laid out to be mapped and decoded by
+// several threads at once. all integers are little-endian:
+//   header: "RFSNAP02", nkeys(8), at least the keys that follow
+//   chunks of records, back to back
+//     record: rlen(4), then rlen bytes of
+//       type(1), flags(1), [expire(8) if flags & SNAP_EXPIRE], klen(4), key,
+//       string: vlen(4), value
+//       sorted set: n(4), n x (mlen(4), member, score(8))
+//       list: n(4), n x (vlen(4), value), head first
+//   index: nchunks x SnapChunk
+//   footer: nchunks(8), crc32c(4) of the index, "RFSE"
+// records never straddle chunks, and the index at the end holds each
+// chunk's place, record count and checksum, so a reader finds every chunk
+// from the last few bytes and checks and decodes each one on its own.
+// the writer buffers in memory handed in by the caller, so it can run in
+// a forked child without allocating
+
+const uint8_t SNAP_EXPIRE = 1; //record has an expiry, unix time in ms
+
+//chunks are cut at the first record boundary past this size. small
+//enough to stay in cache between checking a chunk and decoding it
+const uint64_t k_snap_chunk = 1 << 20;
+
+struct SnapChunk {
+	uint64_t offset;
+	uint64_t len;
+	uint32_t n; //records
+	uint32_t crc; //crc32c of the len bytes
+};
+
+struct SnapWriter {
+	int fd = -1;
+	uint8_t* buf = NULL;
+	size_t cap = 0;
+	size_t len = 0;
+	uint64_t bytes = 0; //file size so far, including len
+	//chunks written so far. once the index is full the last chunk takes
+	//the rest of the records
+	SnapChunk* index = NULL;
+	size_t index_cap = 0;
+	size_t nchunks = 0;
+	SnapChunk chunk = {}; //being written
+	bool failed = false;
+};
+
+// creates path and writes the header. false on error
+bool snap_open (SnapWriter* w, const char* path, uint8_t* buf, size_t cap,
+	SnapChunk* index, size_t index_cap, uint64_t nkeys);
+void snap_put (SnapWriter* w, const void* data, size_t len);
+// after each record, may start a new chunk
+void snap_next (SnapWriter* w);
+// writes the index, flushes and syncs. false if anything failed since
+// snap_open
+bool snap_close (SnapWriter* w);
+
+inline void snap_put_u8 (SnapWriter* w, uint8_t v) {
+	snap_put(w, &v, 1);
+}
+inline void snap_put_u32 (SnapWriter* w, uint32_t v) {
+	snap_put(w, &v, 4);
+}
+inline void snap_put_u64 (SnapWriter* w, uint64_t v) {
+	snap_put(w, &v, 8);
+}
+
+// checks the header and the index of a mapped snapshot and copies out
+// the chunks. returns the key count, or -1 with a reason
+int64_t snap_index (const uint8_t* data, size_t len, std::vector<SnapChunk>* out, const char** err);
+bool snap_chunk_valid (const uint8_t* data, const SnapChunk* c);
+// madvise() on the pages that lie entirely inside the chunk, so releasing
+// one never touches a neighbour another thread is decoding
+void snap_chunk_advise (const uint8_t* data, const SnapChunk* c, int advice);
+
+// bounds-checked reads from a chunk
+struct SnapReader {
+	const uint8_t* data = NULL;
+	size_t len = 0;
+	size_t pos = 0;
+};
+
+// NULL if fewer than n bytes are left
+const uint8_t* snap_get (SnapReader* r, size_t n);
+
+inline bool snap_get_u8 (SnapReader* r, uint8_t* v) {
+	const uint8_t* p = snap_get(r, 1);
+	return p ? (*v = *p, true) : false;
+}
+inline bool snap_get_u32 (SnapReader* r, uint32_t* v) {
+	const uint8_t* p = snap_get(r, 4);
+	return p ? (memcpy(v, p, 4), true) : false;
+}
+inline bool snap_get_u64 (SnapReader* r, uint64_t* v) {
+	const uint8_t* p = snap_get(r, 8);
+	return p ? (memcpy(v, p, 8), true) : false;
+}
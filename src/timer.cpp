@@ -0,0 +1,170 @@
+#include "timer.h"
+
+static void list_init (TNode* head) {
+	head->prev = head;
+	head->next = head;
+}
+
+static bool list_empty (const TNode* head) {
+	return head->next == head;
+}
+
+static void list_push (TNode* head, TNode* node) {
+	node->prev = head->prev;
+	node->next = head;
+	head->prev->next = node;
+	head->prev = node;
+}
+
+static void list_unlink (TNode* node) {
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->prev = NULL;
+	node->next = NULL;
+}
+
+static uint64_t slot_range (size_t level) {
+	return 1ull << (6 * level);
+}
+
+void tw_init (TWheel* w, uint64_t now) {
+	w->now = now;
+	w->size = 0;
+	for (size_t level = 0; level < k_tw_levels; ++level) {
+		w->occupied[level] = 0;
+		for (size_t slot = 0; slot < k_tw_slots; ++slot) {
+			list_init(&w->slots[level][slot]);
+		}
+	}
+	list_init(&w->due);
+}
+
+// the level is the highest 6-bit group in which the expiry differs from
+// now, so a slot never holds timers from two rotations of its level
+static void place (TWheel* w, TNode* node) {
+	uint64_t when = node->expire;
+	if (when <= w->now) {
+		node->where = k_tw_due;
+		list_push(&w->due, node);
+		return;
+	}
+	//past the reach of the top level the timer is parked in its farthest
+	//slot, and placed again from there when that slot comes up
+	uint64_t max = w->now + (k_tw_slots - 1) * slot_range(k_tw_levels - 1);
+	if (when > max) {
+		when = max;
+	}
+	size_t level = (size_t)(63 - __builtin_clzll((w->now ^ when) | 63)) / 6;
+	if (level >= k_tw_levels) {
+		level = k_tw_levels - 1;
+	}
+	size_t slot = (size_t)(when >> (6 * level)) & (k_tw_slots - 1);
+	node->where = (uint16_t)(level * k_tw_slots + slot);
+	list_push(&w->slots[level][slot], node);
+	w->occupied[level] |= 1ull << slot;
+}
+
+void tw_add (TWheel* w, TNode* node, uint64_t expire) {
+	tw_del(w, node);
+	node->expire = expire;
+	place(w, node);
+	w->size++;
+}
+
+void tw_del (TWheel* w, TNode* node) {
+	if (!tw_linked(node)) {
+		return;
+	}
+	list_unlink(node);
+	w->size--;
+	if (node->where == k_tw_due) {
+		return;
+	}
+	size_t level = node->where / k_tw_slots;
+	size_t slot = node->where % k_tw_slots;
+	if (list_empty(&w->slots[level][slot])) {
+		w->occupied[level] &= ~(1ull << slot);
+	}
+}
+
+// the first occupied slot at or after now on any level, and the time it
+// comes up. a slot that started before now is due now
+static uint64_t next_slot (TWheel* w, size_t* out_level, size_t* out_slot) {
+	uint64_t best = UINT64_MAX;
+	for (size_t level = 0; level < k_tw_levels; ++level) {
+		uint64_t occupied = w->occupied[level];
+		if (!occupied) {
+			continue;
+		}
+		uint64_t range = slot_range(level);
+		uint64_t level_range = range * k_tw_slots;
+		size_t now_slot = (size_t)(w->now >> (6 * level)) & (k_tw_slots - 1);
+		uint64_t rot = (occupied >> now_slot) | (now_slot ? occupied << (64 - now_slot) : 0);
+		size_t zeros = (size_t)__builtin_ctzll(rot);
+		size_t slot = (now_slot + zeros) & (k_tw_slots - 1);
+		uint64_t at = (w->now & ~(level_range - 1)) + slot * range;
+		if (now_slot + zeros >= k_tw_slots) {
+			at += level_range; //only the top level wraps around
+		}
+		if (at < w->now) {
+			at = w->now;
+		}
+		if (at < best) {
+			best = at;
+			*out_level = level;
+			*out_slot = slot;
+		}
+	}
+	return best;
+}
+
+bool tw_advance (TWheel* w, uint64_t now, size_t work) {
+	size_t done = 0;
+	while (1) {
+		size_t level = 0;
+		size_t slot = 0;
+		uint64_t at = next_slot(w, &level, &slot);
+		if (at > now) {
+			break;
+		}
+		if (at > w->now) {
+			w->now = at;
+		}
+		//timers on level 0 expire now, the others move down a level
+		TNode* head = &w->slots[level][slot];
+		while (!list_empty(head)) {
+			if (done >= work) {
+				return false;
+			}
+			TNode* node = head->next;
+			list_unlink(node);
+			place(w, node);
+			done++;
+		}
+		w->occupied[level] &= ~(1ull << slot);
+	}
+	//no timer is due before now, so skipping ahead leaves every slot valid
+	if (now > w->now) {
+		w->now = now;
+	}
+	return true;
+}
+
+TNode* tw_pop_due (TWheel* w) {
+	if (list_empty(&w->due)) {
+		return NULL;
+	}
+	TNode* node = w->due.next;
+	list_unlink(node);
+	w->size--;
+	return node;
+}
+
+uint64_t tw_next (TWheel* w) {
+	if (!list_empty(&w->due)) {
+		return w->now;
+	}
+	size_t level = 0;
+	size_t slot = 0;
+	return next_slot(w, &level, &slot);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// hierarchical timing wheel with 1 ms ticks: 6 levels of 64 slots, level L
+// holding timers due within 64^(L+1) ms. adding or removing a timer is
+// O(1). a timer only moves when time reaches its slot on a higher level
+// and it cascades one level down, so each timer moves at most 6 times.
+// advancing time does a bounded amount of work per call, so a slot holding
+// millions of timers is drained over several calls instead of in one stall.
+
+struct TNode {
+	TNode* prev = NULL; //NULL when not linked
+	TNode* next = NULL;
+	uint64_t expire = 0; //ms, same clock as the wheel
+	uint16_t where = 0; //level * 64 + slot, or k_tw_due
+};
+
+const size_t k_tw_levels = 6;
+const size_t k_tw_slots = 64;
+const uint16_t k_tw_due = 0xffff;
+
+struct TWheel {
+	uint64_t now = 0;
+	size_t size = 0; //timers linked, including the due list
+	uint64_t occupied[k_tw_levels] = {};
+	//circular lists with sentinel heads
+	TNode slots[k_tw_levels][k_tw_slots];
+	//timers that expired and wait for the caller
+	TNode due;
+};
+
+void tw_init (TWheel* w, uint64_t now);
+
+inline bool tw_linked (const TNode* node) {
+	return node->prev != NULL;
+}
+
+// a time at or before now fires on the next advance
+void tw_add (TWheel* w, TNode* node, uint64_t expire);
+void tw_del (TWheel* w, TNode* node);
+
+// move time forward to now, cascading and collecting expired timers into
+// the due list. stops after about work node moves and returns false if
+// there is more to do for this time
+bool tw_advance (TWheel* w, uint64_t now, size_t work);
+
+// next expired timer, removed from the wheel, or NULL
+TNode* tw_pop_due (TWheel* w);
+
+// earliest time the wheel has work at: now if expired timers are waiting,
+// UINT64_MAX when it is empty
+uint64_t tw_next (TWheel* w);
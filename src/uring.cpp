@@ -0,0 +1,320 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "uring.h"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct Uring {
+	int fd = -1;
+	uint32_t to_submit = 0;
+	//submission queue, the tail is published when an sqe is ready
+	uint32_t* sq_head = NULL;
+	uint32_t* sq_tail = NULL;
+	uint32_t sq_mask = 0;
+	uint32_t sq_entries = 0;
+	struct io_uring_sqe* sqes = NULL;
+	//completion queue
+	uint32_t* cq_head = NULL;
+	uint32_t* cq_tail = NULL;
+	uint32_t cq_mask = 0;
+	struct io_uring_cqe* cqes = NULL;
+	void* ring_ptr = NULL;
+	size_t ring_len = 0;
+	size_t sqes_len = 0;
+	//provided receive buffers, group 0. the ring is indexed as a plain
+	//array: in c++ the header's flex array member lands at offset 8. the
+	//tail lives in the resv field of entry 0
+	struct io_uring_buf* br = NULL;
+	size_t br_len = 0;
+	uint32_t br_mask = 0;
+	uint16_t br_tail = 0;
+	uint8_t* bufs = NULL;
+	uint32_t buf_size = 0;
+};
+
+static int sys_setup (uint32_t entries, struct io_uring_params* p) {
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter (int fd, uint32_t to_submit, uint32_t min_complete,
+	uint32_t flags, void* arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_register (int fd, uint32_t op, void* arg, uint32_t nargs) {
+	return (int)syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+Uring* uring_new (uint32_t entries) {
+	//completions from multishot receives outnumber submissions, so the
+	//completion queue is made larger than the default 2x
+	struct io_uring_params p = {};
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	p.cq_entries = entries * 8;
+	int fd = sys_setup(entries, &p);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+		close(fd);
+		return NULL;
+	}
+
+	Uring* r = new Uring();
+	r->fd = fd;
+	size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->ring_len = sq_len > cq_len ? sq_len : cq_len;
+	r->ring_ptr = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	void* sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (r->ring_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+		if (r->ring_ptr != MAP_FAILED) {
+			munmap(r->ring_ptr, r->ring_len);
+		}
+		close(fd);
+		delete r;
+		return NULL;
+	}
+	uint8_t* ring = (uint8_t*)r->ring_ptr;
+	r->sq_head = (uint32_t*)(ring + p.sq_off.head);
+	r->sq_tail = (uint32_t*)(ring + p.sq_off.tail);
+	r->sq_mask = *(uint32_t*)(ring + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->sqes = (struct io_uring_sqe*)sqes;
+	r->cq_head = (uint32_t*)(ring + p.cq_off.head);
+	r->cq_tail = (uint32_t*)(ring + p.cq_off.tail);
+	r->cq_mask = *(uint32_t*)(ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)(ring + p.cq_off.cqes);
+	//sqe i always sits in slot i, so the indirection array is fixed
+	uint32_t* array = (uint32_t*)(ring + p.sq_off.array);
+	for (uint32_t i = 0; i < p.sq_entries; ++i) {
+		array[i] = i;
+	}
+	return r;
+}
+
+void uring_free (Uring* r) {
+	close(r->fd);
+	munmap(r->sqes, r->sqes_len);
+	munmap(r->ring_ptr, r->ring_len);
+	if (r->br) {
+		munmap(r->br, r->br_len);
+	}
+	free(r->bufs);
+	delete r;
+}
+
+static void buf_publish (Uring* r, uint16_t bid) {
+	struct io_uring_buf* buf = &r->br[r->br_tail & r->br_mask];
+	buf->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)bid * r->buf_size);
+	buf->len = r->buf_size;
+	buf->bid = bid;
+	r->br_tail++;
+	__atomic_store_n(&r->br[0].resv, r->br_tail, __ATOMIC_RELEASE);
+}
+
+int32_t uring_setup_bufs (Uring* r, uint32_t n, uint32_t size) {
+	if (n == 0 || (n & (n - 1)) || n > 32768) {
+		return -1;
+	}
+	r->br_len = n * sizeof(struct io_uring_buf);
+	void* br = mmap(NULL, r->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (br == MAP_FAILED) {
+		return -1;
+	}
+	r->br = (struct io_uring_buf*)br;
+	r->br_mask = n - 1;
+	r->buf_size = size;
+	r->bufs = (uint8_t*)malloc((size_t)n * size);
+	if (!r->bufs) {
+		abort();
+	}
+
+	struct io_uring_buf_reg reg = {};
+	reg.ring_addr = (uint64_t)(uintptr_t)br;
+	reg.ring_entries = n;
+	reg.bgid = 0;
+	if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		return -1;
+	}
+	for (uint32_t i = 0; i < n; ++i) {
+		buf_publish(r, (uint16_t)i);
+	}
+	return 0;
+}
+
+uint8_t* uring_buf (Uring* r, uint32_t flags) {
+	uint32_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+	return r->bufs + (size_t)bid * r->buf_size;
+}
+
+void uring_buf_return (Uring* r, uint32_t flags) {
+	buf_publish(r, (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT));
+}
+
+bool uring_more (uint32_t flags) {
+	return flags & IORING_CQE_F_MORE;
+}
+
+bool uring_has_buf (uint32_t flags) {
+	return flags & IORING_CQE_F_BUFFER;
+}
+
+static int32_t submit (Uring* r, uint32_t min_complete, int timeout_ms) {
+	struct __kernel_timespec ts = {};
+	struct io_uring_getevents_arg arg = {};
+	uint32_t flags = 0;
+	if (min_complete) {
+		flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		if (timeout_ms >= 0) {
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+		}
+	}
+	int rv = sys_enter(r->fd, r->to_submit, min_complete, flags,
+		min_complete ? &arg : NULL, min_complete ? sizeof(arg) : 0);
+	if (rv < 0) {
+		return (errno == EINTR || errno == ETIME || errno == EBUSY) ? 0 : -1;
+	}
+	r->to_submit -= (uint32_t)rv;
+	return 0;
+}
+
+static struct io_uring_sqe* get_sqe (Uring* r) {
+	uint32_t tail = *r->sq_tail;
+	if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+		//full, hand the queue to the kernel early
+		if (submit(r, 0, 0) < 0) {
+			abort();
+		}
+	}
+	struct io_uring_sqe* sqe = &r->sqes[tail & r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static void push_sqe (Uring* r) {
+	__atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+	r->to_submit++;
+}
+
+void uring_accept (Uring* r, int fd, uint64_t user_data) {
+	struct io_uring_sqe* sqe = get_sqe(r);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = user_data;
+	push_sqe(r);
+}
+
+void uring_recv (Uring* r, int fd, uint64_t user_data) {
+	struct io_uring_sqe* sqe = get_sqe(r);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = user_data;
+	push_sqe(r);
+}
+
+void uring_send (Uring* r, int fd, const void* data, size_t len, uint64_t user_data) {
+	struct io_uring_sqe* sqe = get_sqe(r);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)data;
+	sqe->len = (uint32_t)len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = user_data;
+	push_sqe(r);
+}
+
+void uring_cancel (Uring* r, uint64_t target, uint64_t user_data) {
+	struct io_uring_sqe* sqe = get_sqe(r);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = user_data;
+	push_sqe(r);
+}
+
+int32_t uring_wait (Uring* r, int timeout_ms) {
+	//completions already queued, only submit
+	bool ready = *r->cq_head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	if (ready && !r->to_submit) {
+		return 0;
+	}
+	return submit(r, ready ? 0 : 1, timeout_ms);
+}
+
+int uring_peek (Uring* r, UringCqe* out, int max) {
+	uint32_t head = *r->cq_head;
+	uint32_t tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	int n = 0;
+	while (head != tail && n < max) {
+		struct io_uring_cqe* cqe = &r->cqes[head & r->cq_mask];
+		out[n].user_data = cqe->user_data;
+		out[n].res = cqe->res;
+		out[n].flags = cqe->flags;
+		n++;
+		head++;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+#else
+
+struct Uring {};
+
+Uring* uring_new (uint32_t entries) {
+	(void)entries;
+	return NULL;
+}
+
+void uring_free (Uring* r) {
+	delete r;
+}
+
+int32_t uring_setup_bufs (Uring*, uint32_t, uint32_t) {
+	return -1;
+}
+
+uint8_t* uring_buf (Uring*, uint32_t) {
+	return NULL;
+}
+
+void uring_buf_return (Uring*, uint32_t) {}
+void uring_accept (Uring*, int, uint64_t) {}
+void uring_recv (Uring*, int, uint64_t) {}
+void uring_send (Uring*, int, const void*, size_t, uint64_t) {}
+void uring_cancel (Uring*, uint64_t, uint64_t) {}
+
+bool uring_more (uint32_t) {
+	return false;
+}
+
+bool uring_has_buf (uint32_t) {
+	return false;
+}
+
+int32_t uring_wait (Uring*, int) {
+	return -1;
+}
+
+int uring_peek (Uring*, UringCqe*, int) {
+	return 0;
+}
+
+#endif
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// minimal io_uring wrapper on the raw syscalls (linux 6.0+), for the
+// completion-based event loop. prepared operations are only handed to the
+// kernel by the next uring_wait(), so everything queued during one loop
+// tick goes out in a single io_uring_enter(). elsewhere uring_new() fails
+// and the server stays on the reactor.
+
+struct UringCqe {
+	uint64_t user_data;
+	int32_t res;
+	uint32_t flags;
+};
+
+struct Uring;
+
+// NULL when the kernel lacks io_uring or one of the features used here
+Uring* uring_new (uint32_t entries);
+void uring_free (Uring* r);
+
+// a ring of n (power of two) kernel-provided receive buffers of size bytes
+int32_t uring_setup_bufs (Uring* r, uint32_t n, uint32_t size);
+// the data of a buffer picked by the kernel, from a completion's flags
+uint8_t* uring_buf (Uring* r, uint32_t flags);
+// hand a buffer back to the kernel once its data was consumed
+void uring_buf_return (Uring* r, uint32_t flags);
+
+// multishot operations stay armed until a completion arrives without
+// uring_more() set on it
+void uring_accept (Uring* r, int fd, uint64_t user_data);
+void uring_recv (Uring* r, int fd, uint64_t user_data);
+void uring_send (Uring* r, int fd, const void* data, size_t len, uint64_t user_data);
+void uring_cancel (Uring* r, uint64_t target, uint64_t user_data);
+
+bool uring_more (uint32_t flags);
+bool uring_has_buf (uint32_t flags);
+
+// submit everything prepared so far and wait for a completion.
+// returns 0 or -1 on error. timeout_ms < 0 blocks forever
+int32_t uring_wait (Uring* r, int timeout_ms);
+// pop up to max completions without blocking
+int uring_peek (Uring* r, UringCqe* out, int max);
@@ -0,0 +1,541 @@
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "common.h"
+#include "slab.h"
+#include "zset.h"
+
+size_t g_zset_max_listpack_entries = 128;
+size_t g_zset_max_listpack_value = 64;
+
+//longest member the 2-byte listpack length can hold
+const size_t k_lp_len_max = 0x7fff;
+
+// (score, member) order
+static bool zless (double score, const char* name, size_t len, double score2, const char* name2, size_t len2) {
+	if (score != score2) {
+		return score < score2;
+	}
+	int rv = memcmp(name, name2, len < len2 ? len : len2);
+	return rv ? rv < 0 : len < len2;
+}
+
+// listpack
+
+// an entry decoded in place
+struct LpEntry {
+	const char* name;
+	size_t len;
+	double score;
+	size_t size; //bytes the entry takes
+};
+
+static void lp_read (const uint8_t* lp, size_t pos, LpEntry* e) {
+	size_t len = lp[pos];
+	size_t hdr = 1;
+	if (len & 0x80) {
+		len = (len & 0x7f) | ((size_t)lp[pos + 1] << 7);
+		hdr = 2;
+	}
+	e->name = (const char*)lp + pos + hdr;
+	e->len = len;
+	memcpy(&e->score, lp + pos + hdr + len, 8);
+	e->size = hdr + len + 8;
+}
+
+static size_t lp_entry_size (size_t len) {
+	return (len < 0x80 ? 1 : 2) + len + 8;
+}
+
+static void lp_write (uint8_t* p, const char* name, size_t len, double score) {
+	if (len < 0x80) {
+		*p++ = (uint8_t)len;
+	} else {
+		*p++ = (uint8_t)(0x80 | (len & 0x7f));
+		*p++ = (uint8_t)(len >> 7);
+	}
+	memcpy(p, name, len);
+	memcpy(p + len, &score, 8);
+}
+
+// linear scan for a member, its offset and rank
+static bool lp_find (ZSet* z, const char* name, size_t len, size_t* pos, size_t* rank) {
+	size_t off = 0;
+	for (size_t i = 0; i < z->len; ++i) {
+		LpEntry e;
+		lp_read(z->lp, off, &e);
+		if (e.len == len && !memcmp(e.name, name, len)) {
+			*pos = off;
+			*rank = i;
+			return true;
+		}
+		off += e.size;
+	}
+	return false;
+}
+
+// replace cut bytes at offset at with room for insert bytes. the buffer is
+// reallocated to fit on every change, the sets are small and the slab
+// allocator keeps that cheap
+static void lp_resize (ZSet* z, size_t at, size_t cut, size_t insert) {
+	size_t bytes = z->lp_bytes - cut + insert;
+	uint8_t* lp = bytes ? (uint8_t*)slab_alloc(bytes) : NULL;
+	if (at) {
+		memcpy(lp, z->lp, at);
+	}
+	size_t tail = z->lp_bytes - at - cut;
+	if (tail) {
+		memcpy(lp + at + insert, z->lp + at + cut, tail);
+	}
+	slab_free(z->lp, z->lp_bytes);
+	z->lp = lp;
+	z->lp_bytes = bytes;
+}
+
+static void lp_insert (ZSet* z, const char* name, size_t len, double score) {
+	size_t off = 0;
+	for (size_t i = 0; i < z->len; ++i) {
+		LpEntry e;
+		lp_read(z->lp, off, &e);
+		if (zless(score, name, len, e.score, e.name, e.len)) {
+			break;
+		}
+		off += e.size;
+	}
+	lp_resize(z, off, 0, lp_entry_size(len));
+	lp_write(z->lp + off, name, len, score);
+	z->len++;
+}
+
+static void lp_remove (ZSet* z, size_t pos) {
+	LpEntry e;
+	lp_read(z->lp, pos, &e);
+	lp_resize(z, pos, e.size, 0);
+	z->len--;
+}
+
+// skiplist
+
+static size_t zn_size (int level, size_t len) {
+	return sizeof(ZNode) + (size_t)level * sizeof(ZLink) + len;
+}
+
+static ZNode* zn_new (const char* name, size_t len, double score, int level) {
+	ZNode* node = (ZNode*)slab_alloc(zn_size(level, len));
+	node->hnode.hcode = str_hash((const uint8_t*)name, len);
+	node->score = score;
+	node->len = (uint32_t)len;
+	node->level = (uint8_t)level;
+	for (int i = 0; i < level; ++i) {
+		node->links[i].next = NULL;
+		node->links[i].span = 0;
+	}
+	memcpy((char*)zn_member(node), name, len);
+	return node;
+}
+
+static void zn_free (ZNode* node) {
+	slab_free(node, zn_size(node->level, node->len));
+}
+
+// 1 with probability 3/4, 2 with 3/16 and so on
+static int random_level () {
+	static thread_local uint64_t x = 0x9e3779b97f4a7c15ull;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	uint64_t r = x;
+	int level = 1;
+	while ((r & 3) == 0 && level < k_zset_max_level) {
+		level++;
+		r >>= 2;
+	}
+	return level;
+}
+
+static bool node_less (const ZNode* a, const ZNode* b) {
+	return zless(a->score, zn_member(a), a->len, b->score, zn_member(b), b->len);
+}
+
+// probe for the index, the member to look for
+struct ZKey {
+	HNode hnode;
+	const char* name;
+	size_t len;
+};
+
+static void zkey_init (ZKey* key, const char* name, size_t len) {
+	key->hnode.hcode = str_hash((const uint8_t*)name, len);
+	key->name = name;
+	key->len = len;
+}
+
+// lhs is the node in the index, rhs the probe
+static bool zkey_eq (HNode* lhs, HNode* rhs) {
+	ZNode* node = container_of(lhs, ZNode, hnode);
+	ZKey* key = container_of(rhs, ZKey, hnode);
+	return node->len == key->len && !memcmp(zn_member(node), key->name, key->len);
+}
+
+static ZNode* sl_lookup (ZSkip* s, const char* name, size_t len) {
+	ZKey key;
+	zkey_init(&key, name, len);
+	HNode* found = hm_lookup(&s->index, &key.hnode, &zkey_eq);
+	return found ? container_of(found, ZNode, hnode) : NULL;
+}
+
+// link a node into the skiplist at its level
+static void sl_insert (ZSet* z, ZNode* node) {
+	ZSkip* s = z->skip;
+	ZNode* update[k_zset_max_level];
+	size_t rank[k_zset_max_level];
+	ZNode* x = s->head;
+	for (int i = s->level - 1; i >= 0; --i) {
+		rank[i] = (i == s->level - 1) ? 0 : rank[i + 1];
+		while (x->links[i].next && node_less(x->links[i].next, node)) {
+			rank[i] += x->links[i].span;
+			x = x->links[i].next;
+		}
+		update[i] = x;
+	}
+	int level = node->level;
+	if (level > s->level) {
+		for (int i = s->level; i < level; ++i) {
+			rank[i] = 0;
+			update[i] = s->head;
+			update[i]->links[i].span = z->len;
+		}
+		s->level = level;
+	}
+	for (int i = 0; i < level; ++i) {
+		node->links[i].next = update[i]->links[i].next;
+		update[i]->links[i].next = node;
+		node->links[i].span = update[i]->links[i].span - (rank[0] - rank[i]);
+		update[i]->links[i].span = (rank[0] - rank[i]) + 1;
+	}
+	//links passing over the new node skip one more
+	for (int i = level; i < s->level; ++i) {
+		update[i]->links[i].span++;
+	}
+	z->len++;
+}
+
+static void sl_unlink (ZSet* z, ZNode* node) {
+	ZSkip* s = z->skip;
+	ZNode* update[k_zset_max_level];
+	ZNode* x = s->head;
+	for (int i = s->level - 1; i >= 0; --i) {
+		while (x->links[i].next && node_less(x->links[i].next, node)) {
+			x = x->links[i].next;
+		}
+		update[i] = x;
+	}
+	for (int i = 0; i < s->level; ++i) {
+		if (update[i]->links[i].next == node) {
+			update[i]->links[i].span += node->links[i].span - 1;
+			update[i]->links[i].next = node->links[i].next;
+		} else {
+			update[i]->links[i].span--;
+		}
+	}
+	while (s->level > 1 && !s->head->links[s->level - 1].next) {
+		s->level--;
+	}
+	z->len--;
+}
+
+static void sl_add (ZSet* z, const char* name, size_t len, double score) {
+	int level = random_level();
+	ZNode* node = zn_new(name, len, score, level);
+	z->skip->node_bytes += zn_size(level, len);
+	hm_insert(&z->skip->index, &node->hnode);
+	sl_insert(z, node);
+}
+
+static size_t sl_rank (ZSkip* s, ZNode* node) {
+	size_t rank = 0;
+	ZNode* x = s->head;
+	for (int i = s->level - 1; i >= 0; --i) {
+		while (x->links[i].next && !node_less(node, x->links[i].next)) {
+			rank += x->links[i].span;
+			x = x->links[i].next;
+		}
+		if (x == node) {
+			break;
+		}
+	}
+	return rank - 1;
+}
+
+// move every listpack entry into a new skiplist
+static void zset_promote (ZSet* z) {
+	ZSkip* s = new ZSkip();
+	s->head = (ZNode*)malloc(zn_size(k_zset_max_level, 0));
+	if (!s->head) {
+		abort();
+	}
+	memset((void*)s->head, 0, zn_size(k_zset_max_level, 0));
+	s->head->level = (uint8_t)k_zset_max_level;
+
+	uint8_t* lp = z->lp;
+	size_t lp_bytes = z->lp_bytes;
+	size_t n = z->len;
+	z->skip = s;
+	z->len = 0;
+	size_t off = 0;
+	for (size_t i = 0; i < n; ++i) {
+		LpEntry e;
+		lp_read(lp, off, &e);
+		sl_add(z, e.name, e.len, e.score);
+		off += e.size;
+	}
+	slab_free(lp, lp_bytes);
+	z->lp = NULL;
+	z->lp_bytes = 0;
+}
+
+ZSet* zset_new () {
+	return new (slab_alloc(sizeof(ZSet))) ZSet();
+}
+
+void zset_free (ZSet* z) {
+	if (z->skip) {
+		ZNode* node = z->skip->head->links[0].next;
+		while (node) {
+			ZNode* next = node->links[0].next;
+			zn_free(node);
+			node = next;
+		}
+		hm_clear(&z->skip->index);
+		free(z->skip->head);
+		delete z->skip;
+	}
+	slab_free(z->lp, z->lp_bytes);
+	z->~ZSet();
+	slab_free(z, sizeof(ZSet));
+}
+
+bool zset_add (ZSet* z, const char* name, size_t len, double score) {
+	if (!z->skip) {
+		size_t pos = 0;
+		size_t rank = 0;
+		if (lp_find(z, name, len, &pos, &rank)) {
+			LpEntry e;
+			lp_read(z->lp, pos, &e);
+			if (e.score != score) {
+				lp_remove(z, pos);
+				lp_insert(z, name, len, score);
+			}
+			return false;
+		}
+		size_t max_value = g_zset_max_listpack_value < k_lp_len_max ? g_zset_max_listpack_value : k_lp_len_max;
+		if (z->len < g_zset_max_listpack_entries && len <= max_value) {
+			lp_insert(z, name, len, score);
+			return true;
+		}
+		zset_promote(z);
+	}
+	ZNode* node = sl_lookup(z->skip, name, len);
+	if (node) {
+		if (node->score != score) {
+			//the node keeps its level and allocation, only its place moves
+			sl_unlink(z, node);
+			node->score = score;
+			sl_insert(z, node);
+		}
+		return false;
+	}
+	sl_add(z, name, len, score);
+	return true;
+}
+
+bool zset_del (ZSet* z, const char* name, size_t len) {
+	if (!z->skip) {
+		size_t pos = 0;
+		size_t rank = 0;
+		if (!lp_find(z, name, len, &pos, &rank)) {
+			return false;
+		}
+		lp_remove(z, pos);
+		return true;
+	}
+	ZKey key;
+	zkey_init(&key, name, len);
+	HNode* found = hm_delete(&z->skip->index, &key.hnode, &zkey_eq);
+	if (!found) {
+		return false;
+	}
+	ZNode* node = container_of(found, ZNode, hnode);
+	sl_unlink(z, node);
+	z->skip->node_bytes -= zn_size(node->level, node->len);
+	zn_free(node);
+	return true;
+}
+
+bool zset_score (ZSet* z, const char* name, size_t len, double* score) {
+	if (!z->skip) {
+		size_t pos = 0;
+		size_t rank = 0;
+		if (!lp_find(z, name, len, &pos, &rank)) {
+			return false;
+		}
+		LpEntry e;
+		lp_read(z->lp, pos, &e);
+		*score = e.score;
+		return true;
+	}
+	ZNode* node = sl_lookup(z->skip, name, len);
+	if (!node) {
+		return false;
+	}
+	*score = node->score;
+	return true;
+}
+
+bool zset_rank (ZSet* z, const char* name, size_t len, size_t* rank) {
+	if (!z->skip) {
+		size_t pos = 0;
+		return lp_find(z, name, len, &pos, rank);
+	}
+	ZNode* node = sl_lookup(z->skip, name, len);
+	if (!node) {
+		return false;
+	}
+	*rank = sl_rank(z->skip, node);
+	return true;
+}
+
+bool zset_seek_rank (ZSet* z, size_t rank, ZIter* it) {
+	it->z = z;
+	it->rank = rank;
+	it->pos = 0;
+	it->node = NULL;
+	if (rank >= z->len) {
+		return false;
+	}
+	if (!z->skip) {
+		for (size_t i = 0; i < rank; ++i) {
+			LpEntry e;
+			lp_read(z->lp, it->pos, &e);
+			it->pos += e.size;
+		}
+		return true;
+	}
+	size_t target = rank + 1;
+	size_t traversed = 0;
+	ZNode* x = z->skip->head;
+	for (int i = z->skip->level - 1; i >= 0; --i) {
+		while (x->links[i].next && traversed + x->links[i].span <= target) {
+			traversed += x->links[i].span;
+			x = x->links[i].next;
+		}
+		if (traversed == target) {
+			break;
+		}
+	}
+	it->node = x;
+	return true;
+}
+
+// score before the start of a range
+static bool below_min (double score, double min, bool exclusive) {
+	return exclusive ? score <= min : score < min;
+}
+
+// score within the end of a range
+static bool upto_max (double score, double max, bool exclusive) {
+	return exclusive ? score < max : score <= max;
+}
+
+bool zset_seek_score (ZSet* z, double min, bool exclusive, ZIter* it) {
+	it->z = z;
+	it->rank = 0;
+	it->pos = 0;
+	it->node = NULL;
+	if (!z->skip) {
+		for (; it->rank < z->len; it->rank++) {
+			LpEntry e;
+			lp_read(z->lp, it->pos, &e);
+			if (!below_min(e.score, min, exclusive)) {
+				break;
+			}
+			it->pos += e.size;
+		}
+		return zset_iter_valid(it);
+	}
+	//the rank is summed up on the way down
+	ZNode* x = z->skip->head;
+	for (int i = z->skip->level - 1; i >= 0; --i) {
+		while (x->links[i].next && below_min(x->links[i].next->score, min, exclusive)) {
+			it->rank += x->links[i].span;
+			x = x->links[i].next;
+		}
+	}
+	it->node = x->links[0].next;
+	return it->node != NULL;
+}
+
+size_t zset_count_to (ZSet* z, double max, bool exclusive) {
+	size_t n = 0;
+	if (!z->skip) {
+		size_t off = 0;
+		for (; n < z->len; ++n) {
+			LpEntry e;
+			lp_read(z->lp, off, &e);
+			if (!upto_max(e.score, max, exclusive)) {
+				break;
+			}
+			off += e.size;
+		}
+		return n;
+	}
+	ZNode* x = z->skip->head;
+	for (int i = z->skip->level - 1; i >= 0; --i) {
+		while (x->links[i].next && upto_max(x->links[i].next->score, max, exclusive)) {
+			n += x->links[i].span;
+			x = x->links[i].next;
+		}
+	}
+	return n;
+}
+
+void zset_iter_get (const ZIter* it, const char** name, size_t* len, double* score) {
+	if (!it->z->skip) {
+		LpEntry e;
+		lp_read(it->z->lp, it->pos, &e);
+		*name = e.name;
+		*len = e.len;
+		*score = e.score;
+		return;
+	}
+	*name = zn_member(it->node);
+	*len = it->node->len;
+	*score = it->node->score;
+}
+
+void zset_iter_next (ZIter* it) {
+	if (!it->z->skip) {
+		LpEntry e;
+		lp_read(it->z->lp, it->pos, &e);
+		it->pos += e.size;
+	} else {
+		it->node = it->node->links[0].next;
+	}
+	it->rank++;
+}
+
+size_t zset_mem (ZSet* z) {
+	size_t bytes = sizeof(ZSet) + z->lp_bytes;
+	ZSkip* s = z->skip;
+	if (s) {
+		size_t slots = 0;
+		if (s->index.newer.slots) {
+			slots += s->index.newer.mask + 1;
+		}
+		if (s->index.older.slots) {
+			slots += s->index.older.mask + 1;
+		}
+		bytes += sizeof(ZSkip) + zn_size(k_zset_max_level, 0) + s->node_bytes + slots * sizeof(HSlot);
+	}
+	return bytes;
+}
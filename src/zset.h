@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hashtable.h"
+
+// sorted set, members ordered by (score, member).
+// small sets are a listpack: one contiguous buffer of (member, score)
+// entries in order, scanned linearly, a few bytes of overhead per member.
+// a set is promoted to the full form once it has more than
+// g_zset_max_listpack_entries members or a member longer than
+// g_zset_max_listpack_value bytes, and stays there.
+// the full form is a skiplist whose links carry spans, so ranks and range
+// scans by rank or by score cost O(log n), plus a hash index of
+// member -> node for O(1) score lookups. a member is a single allocation
+// holding its hash node, score, skiplist links and the member bytes
+// inline. levels are drawn with p = 1/4, so a node carries 1.33 links on
+// average.
+
+extern size_t g_zset_max_listpack_entries;
+extern size_t g_zset_max_listpack_value;
+
+const int k_zset_max_level = 32;
+
+struct ZNode;
+
+struct ZLink {
+	ZNode* next;
+	size_t span; //ranks skipped by following next, to the end if NULL
+};
+
+struct ZNode {
+	HNode hnode;
+	double score;
+	uint32_t len;
+	uint8_t level;
+	ZLink links[]; //then len bytes of member
+};
+
+inline const char* zn_member (const ZNode* node) {
+	return (const char*)(node->links + node->level);
+}
+
+// the full form
+struct ZSkip {
+	HMap index;
+	ZNode* head = NULL; //sentinel with k_zset_max_level links
+	int level = 1;
+	size_t node_bytes = 0;
+};
+
+struct ZSet {
+	size_t len = 0;
+	//listpack entries: varint member length, member bytes, double score
+	uint8_t* lp = NULL;
+	size_t lp_bytes = 0;
+	ZSkip* skip = NULL; //set once promoted, lp is unused then
+};
+
+// a position in a set, walked in order
+struct ZIter {
+	ZSet* z;
+	size_t rank;
+	size_t pos; //listpack offset
+	ZNode* node; //skiplist node
+};
+
+ZSet* zset_new ();
+void zset_free (ZSet* z);
+
+// insert or update the score. returns true if the member is new
+bool zset_add (ZSet* z, const char* name, size_t len, double score);
+// returns false if there was no such member
+bool zset_del (ZSet* z, const char* name, size_t len);
+// false if there is no such member
+bool zset_score (ZSet* z, const char* name, size_t len, double* score);
+// 0-based position of a member, false if there is no such member
+bool zset_rank (ZSet* z, const char* name, size_t len, size_t* rank);
+
+// position the iterator at a rank, false if the set is shorter
+bool zset_seek_rank (ZSet* z, size_t rank, ZIter* it);
+// position the iterator at the first member with a score above min, or at
+// min unless exclusive. false if there is none
+bool zset_seek_score (ZSet* z, double min, bool exclusive, ZIter* it);
+// members with a score below max, or at max unless exclusive
+size_t zset_count_to (ZSet* z, double max, bool exclusive);
+
+inline bool zset_iter_valid (const ZIter* it) {
+	return it->rank < it->z->len;
+}
+void zset_iter_get (const ZIter* it, const char** name, size_t* len, double* score);
+void zset_iter_next (ZIter* it);
+
+// bytes held by the set: the listpack, or the nodes and the hash index
+size_t zset_mem (ZSet* z);